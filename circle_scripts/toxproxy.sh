@@ -254,7 +254,30 @@ ls -hal ToxProxy
 file ToxProxy
 ldd ToxProxy
 
+# microbenchmarks (ToxProxy_bench.c includes ToxProxy.c), with zstd to get the compression numbers too
+clang-10 $CFLAGS \
+$C_FLAGS $CXX_FLAGS $LD_FLAGS \
+-DHAVE_ZSTD \
+ToxProxy_bench.c \
+$_INST_/lib/libtoxcore.a \
+$_INST_/lib/libtoxav.a \
+$_INST_/lib/libtoxencryptsave.a \
+$_INST_/lib/libopus.a \
+$_INST_/lib/libvpx.a \
+$_INST_/lib/libx264.a \
+$_INST_/lib/libavcodec.a \
+$_INST_/lib/libavutil.a \
+$_INST_/lib/libsodium.a \
+-lzstd \
+-lm \
+-ldl \
+-lpthread \
+-o ToxProxy_bench
+
+ls -hal ToxProxy_bench
+
 mkdir -p ~/work/artefacts/
 cp -av ToxProxy ~/work/artefacts/
+cp -av ToxProxy_bench ~/work/artefacts/
 
 # -------------- now compile toxproxy ----------------------
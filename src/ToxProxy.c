@@ -49,7 +49,10 @@ Zoff sagt: wichtig: erste relay message am 20.08.2019 um 20:31 gesendet und rich
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
 #include <unistd.h>
+#include <spawn.h>
 #include <getopt.h>
 #include <fcntl.h>
 #include <assert.h>
@@ -57,6 +60,7 @@ Zoff sagt: wichtig: erste relay message am 20.08.2019 um 20:31 gesendet und rich
 #include <limits.h>
 #include <stdbool.h>
 #include <netdb.h>
+#include <poll.h>
 #include <netinet/in.h>
 
 
@@ -66,8 +70,21 @@ Zoff sagt: wichtig: erste relay message am 20.08.2019 um 20:31 gesendet und rich
 #include <signal.h>
 #include <linux/sched.h>
 
-// gives bin2hex & hex2bin functions for Tox-ID / public-key conversions
-#include <sodium/utils.h>
+// vector paths of the hex codec
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+// optional compression of stored messages and bulk sync packets, build with -DHAVE_ZSTD ... -lzstd
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+// at-rest encryption of the spool and savedata
+#include <sodium.h>
 
 // tox core
 #include <tox/tox.h>
@@ -88,8 +105,7 @@ Zoff sagt: wichtig: erste relay message am 20.08.2019 um 20:31 gesendet und rich
 // mkdir -> https://linux.die.net/man/2/mkdir
 #include <sys/stat.h>
 #include <sys/types.h>
-
-static char *NOTIFICATION__device_token = NULL;
+#include <sys/mman.h>
 
 typedef struct DHT_node {
     const char *ip;
@@ -108,9 +124,106 @@ typedef enum CONTROL_PROXY_MESSAGE_TYPE {
     CONTROL_PROXY_MESSAGE_TYPE_PROXY_PUBKEY_FOR_FRIEND = 176,
     CONTROL_PROXY_MESSAGE_TYPE_ALL_MESSAGES_SENT = 177,
     CONTROL_PROXY_MESSAGE_TYPE_PROXY_KILL_SWITCH = 178,
-    CONTROL_PROXY_MESSAGE_TYPE_NOTIFICATION_TOKEN = 179
+    CONTROL_PROXY_MESSAGE_TYPE_NOTIFICATION_TOKEN = 179,
+    CONTROL_PROXY_MESSAGE_TYPE_PROXY_STATUS = 180,
+    CONTROL_PROXY_MESSAGE_TYPE_BULK_SYNC = 181,
+    CONTROL_PROXY_MESSAGE_TYPE_BULK_SYNC_ACK = 182,
+    CONTROL_PROXY_MESSAGE_TYPE_NOTIFICATION_TOKENS = 183,
+    CONTROL_PROXY_MESSAGE_TYPE_MASTER_DEVICES = 184,
+    CONTROL_PROXY_MESSAGE_TYPE_FILE_SENDER = 185,
+    CONTROL_PROXY_MESSAGE_TYPE_FRIEND_PUBKEYS_FOR_PROXY = 186
 } CONTROL_PROXY_MESSAGE_TYPE;
 
+// friends of the master in bulk: [186][batch_id u32][flags u8][count u8][count * friend pubkey 32] (big endian).
+// the savedata is written once, after the packet with FRIEND_PROVISION_FLAG_LAST (or FRIEND_PROVISION_COMMIT_SECS
+// after the last packet). the proxy answers every packet with a PROXY_STATUS_TYPE_PROVISION status.
+typedef enum FRIEND_PROVISION_FLAG {
+    FRIEND_PROVISION_FLAG_LAST = 1
+} FRIEND_PROVISION_FLAG;
+
+// a stored file transfer of a friend is sent on to a master device with the file id it came with. right before
+// it the device gets [185][file id 32][sender pubkey 32][receive time u32] (big endian)
+
+// second byte of a CONTROL_PROXY_MESSAGE_TYPE_NOTIFICATION_TOKENS packet:
+// ADD [gateway u8][token], REMOVE [token], CLEAR
+typedef enum PUSH_TOKENS_OP {
+    PUSH_TOKENS_OP_ADD = 0,
+    PUSH_TOKENS_OP_REMOVE = 1,
+    PUSH_TOKENS_OP_CLEAR = 2
+} PUSH_TOKENS_OP;
+
+// second byte of a CONTROL_PROXY_MESSAGE_TYPE_MASTER_DEVICES packet from a master device:
+// ADD [device pubkey 32], REMOVE [device pubkey 32] (the first master can't be removed)
+typedef enum MASTER_DEVICES_OP {
+    MASTER_DEVICES_OP_ADD = 0,
+    MASTER_DEVICES_OP_REMOVE = 1
+} MASTER_DEVICES_OP;
+
+// first payload byte of a CONTROL_PROXY_MESSAGE_TYPE_PROXY_STATUS packet.
+// the master sends [180] or [180][type] to ask, the proxy answers with [180][type][data...]
+// all numbers in status data are big endian.
+typedef enum PROXY_STATUS_TYPE {
+    PROXY_STATUS_TYPE_ALL = 0,
+    PROXY_STATUS_TYPE_QUOTA = 1,
+    PROXY_STATUS_TYPE_RECOVERY = 2,
+    PROXY_STATUS_TYPE_INGRESS = 3,
+    PROXY_STATUS_TYPE_EXPIRY = 4,
+    PROXY_STATUS_TYPE_HOOKS = 5,
+    PROXY_STATUS_TYPE_PROVISION = 6
+} PROXY_STATUS_TYPE;
+
+// bulk sync, stored messages go to the master in batches of lossless packets (big endian numbers):
+// proxy -> master [181][version][flags][batch_id u32][first_seq u16][count u8] followed by count records
+//     record      [record flags][sender pubkey 32, only with BULK_SYNC_RECORD_NEW_SENDER]
+//                 [seq u64][receive time u32][receive ms u16, all 3 only with BULK_SYNC_FEATURE_RECEIVE_TIME
+//                 and not for BULK_SYNC_RECORD_SKIPPED][length u16][data]
+//     data is the stored messageV2 (what the proxy would wrap with tox_messagev2_sync_wrap()),
+//     the sender pubkey is the one of the last record that had one. records of a sender come in the order
+//     the proxy stored them, seq and receive time both go up (seq is 0 for messages stored by older
+//     versions, they come first).
+//     records of a batch are numbered from 0, first_seq is the number of the first record in the packet.
+//     a record too big for one packet (only with BULK_SYNC_FEATURE_FRAGMENT) goes in parts, each with
+//     BULK_SYNC_RECORD_FRAGMENT. a part that does not end the record is the last record of its packet,
+//     the next packet starts with the next part (its first_seq is that record again).
+// master -> proxy [182][batch_id u32][next_seq u16]
+//     the master has stored all records of the batch with seq < next_seq. it answers after the packet
+//     with BULK_SYNC_FLAG_END_OF_BATCH, records it already has (seen on a resend) are just skipped.
+// a probe is an empty batch with BULK_SYNC_FLAG_PROBE followed by [features u8] of the proxy. the master
+// answers with [182][batch_id u32][0 u16][features u8] (the features both sides have).
+// masters that don't answer it get the per message sync.
+typedef enum BULK_SYNC_FLAG {
+    BULK_SYNC_FLAG_END_OF_BATCH = 1,
+    BULK_SYNC_FLAG_PROBE = 2,
+    // everything after the packet header is one zstd frame (no dictionary) with the records
+    BULK_SYNC_FLAG_ZSTD = 4
+} BULK_SYNC_FLAG;
+
+typedef enum BULK_SYNC_FEATURE {
+    BULK_SYNC_FEATURE_ZSTD = 1,
+    BULK_SYNC_FEATURE_CONFERENCE_RECORD = 2,
+    BULK_SYNC_FEATURE_RECEIVE_TIME = 4,
+    BULK_SYNC_FEATURE_RECEIPT_RECORD = 8,
+    BULK_SYNC_FEATURE_FRAGMENT = 16
+} BULK_SYNC_FEATURE;
+
+typedef enum BULK_SYNC_RECORD_FLAG {
+    // TOX_FILE_KIND_MESSAGEV2_ANSWER, otherwise TOX_FILE_KIND_MESSAGEV2_SEND
+    BULK_SYNC_RECORD_ANSWER = 1,
+    BULK_SYNC_RECORD_NEW_SENDER = 2,
+    // no data, the message is gone or is too big for a packet and was sent with the per message sync
+    BULK_SYNC_RECORD_SKIPPED = 4,
+    // data is [peer pubkey 32][messageV2 of the line] of a conference line (the sender is the conference),
+    // with the per message sync the proxy sends "<peer pubkey hex><line>" instead
+    BULK_SYNC_RECORD_CONFERENCE = 8,
+    // data is [count u16][count * ([msg id 32][ts sec u32])], read receipts of the sender (with
+    // BULK_SYNC_RECORD_ANSWER). masters without BULK_SYNC_FEATURE_RECEIPT_RECORD get one ANSWER messageV2
+    // per receipt from the per message sync instead
+    BULK_SYNC_RECORD_RECEIPTS = 16,
+    // [total length u32][offset u32] follow the receive time, data is that part of the record's data.
+    // the master keeps the parts until the one that ends at total length is there
+    BULK_SYNC_RECORD_FRAGMENT = 32
+} BULK_SYNC_RECORD_FLAG;
+
 FILE *logfile = NULL;
 #ifndef UNIQLOGFILE
 const char *log_filename = "toxblinkenwall.log";
@@ -123,26 +236,229 @@ const char *savedata_tmp_filename = "./db/savedata.tox.tmp";
 
 const char *empty_log_message = "empty log message received!";
 const char *msgsDir = "./messages";
+const char *msgsDamagedDir = "./messages_damaged";
+const char *msgsWipeDir = "./messages.wipe";
+const char *kill_switch_marker_filename = "./kill_switch.wipe";
+const char *filesDir = "./files";
 const char *masterFile = "./db/toxproxymasterpubkey.txt";
+const char *masterDevicesFile = "./db/toxproxymasterdevices.txt";
+const char *masterDevicesTmpFile = "./db/toxproxymasterdevices.txt.tmp";
+const char *spool_dict_filename = "./db/spool_dict.zstd";
+const char *spool_dict_tmp_filename = "./db/spool_dict.zstd.tmp";
+const char *spool_key_filename = "./db/spool_key";
+const char *spool_plain_filename = "./db/spool_plain_left";
+const char *spool_index_filename = "./db/spool_index";
+const char *spool_index_tmp_filename = "./db/spool_index.tmp";
+const char *spool_seq_filename = "./db/spool_seq";
+const char *spool_seq_tmp_filename = "./db/spool_seq.tmp";
+const char *sync_cursors_filename = "./db/sync_cursors";
+const char *sync_cursors_tmp_filename = "./db/sync_cursors.tmp";
+const char *msgid_index_filename = "./db/msgid_index";
+const char *msgid_index_tmp_filename = "./db/msgid_index.tmp";
+const char *push_token_filename = "./db/push_token";
+const char *push_token_tmp_filename = "./db/push_token.tmp";
 
 #ifdef WRITE_MY_TOXID_TO_FILE
 const char *my_toxid_filename_txt = "toxid.txt";
 const char *my_toxid_filename_txt2 = "./db/toxid.txt";
 #endif
 
-const char *shell_cmd__onstart = "./scripts/on_start.sh 2> /dev/null";
-const char *shell_cmd__ononline = "./scripts/on_online.sh 2> /dev/null";
-const char *shell_cmd__onoffline = "./scripts/on_offline.sh 2> /dev/null";
+const char *hook_script__onstart = "./scripts/on_start.sh";
+const char *hook_script__ononline = "./scripts/on_online.sh";
+const char *hook_script__onoffline = "./scripts/on_offline.sh";
+// hook scripts are killed when they run longer than this (SIGTERM, SIGKILL HOOK_KILL_GRACE_SECS later)
+#define HOOK_START_TIMEOUT_SECS 60
+#define HOOK_LINK_TIMEOUT_SECS 10
+#define HOOK_KILL_GRACE_SECS 2
+// friends added in bulk are written to the savedata this long after the last packet without FRIEND_PROVISION_FLAG_LAST
+#define FRIEND_PROVISION_COMMIT_SECS 10
 uint32_t my_last_online_ts = 0;
 #define BOOTSTRAP_AFTER_OFFLINE_SECS 30
+
+// conference lines are buffered for one main loop pass and written to the spool in one batch
+#define CONFERENCE_MAX_BUFFERED_LINES 200
+// optional cap for the stored messages of one conference
+// max bytes: 0 = same quota as any other sender (the max age is SPOOL_TTL_CONFERENCE_SECS)
+#define CONFERENCE_SPOOL_MAX_BYTES 0
+
+// read receipts of friends are collected for RECEIPT_COALESCE_SECS (or until RECEIPT_COALESCE_MAX wait),
+// then looked up in the spool in one pass. the ones that are stored go into records of up to
+// RECEIPT_RECORD_MAX_RECEIPTS receipts: one spool file, synced as one record and no push ping
+#define RECEIPT_COALESCE_SECS 2
+#define RECEIPT_COALESCE_MAX 256
+#define RECEIPT_RECORD_MAX_RECEIPTS 32
+
+// incoming messages per friend and lines per conference are limited by token buckets (a steady rate
+// per minute plus a burst), what is over the limit is dropped before anything is stored
+#define INGRESS_FRIEND_MSGS_PER_MIN 60
+#define INGRESS_FRIEND_BURST 30
+#define INGRESS_CONFERENCE_LINES_PER_MIN 600
+#define INGRESS_CONFERENCE_BURST 200
+
+// ids of stored messages are remembered this long, a resend of one of them is not stored again
+#define MSGID_INDEX_RETENTION_SECS (7 * 24 * 3600)
+// the in memory table starts with this many slots (20 bytes each), a power of 2, and doubles when 3/4 full.
+// (1 << 16) takes 1.25 MiB and holds about 49000 ids before it grows
+#define MSGID_INDEX_SLOTS (1 << 16)
+// expired ids are removed from the file this often
+#define MSGID_INDEX_COMPACT_SECS 3600
+
+// spool quotas, per sender (friend or conference) and for the whole spool
+typedef enum SPOOL_QUOTA_POLICY {
+    // evict the oldest stored messages to make room for the new one
+    SPOOL_QUOTA_POLICY_OLDEST_FIRST = 0,
+    // keep what is stored and drop the new message
+    SPOOL_QUOTA_POLICY_REJECT_NEW = 1
+} SPOOL_QUOTA_POLICY;
+
+#define SPOOL_QUOTA_POLICY_DEFAULT SPOOL_QUOTA_POLICY_OLDEST_FIRST
+#define SPOOL_QUOTA_SENDER_MAX_BYTES (64ULL * 1024ULL * 1024ULL)
+#define SPOOL_QUOTA_SENDER_MAX_MESSAGES 100000
+#define SPOOL_QUOTA_GLOBAL_MAX_BYTES (1024ULL * 1024ULL * 1024ULL)
+#define SPOOL_QUOTA_GLOBAL_MAX_MESSAGES 1000000
+// evictions free a bit more than needed, so not every new message evicts again
+#define SPOOL_QUOTA_EVICT_TO_PERCENT 90
+// the oldest names of a sender that are kept in memory for evictions, the dir is read again when they are used up
+#define SPOOL_QUOTA_EVICT_CACHE_NAMES 1024
+// min. seconds between unsolicited quota status messages to the master
+#define SPOOL_QUOTA_STATUS_INTERVAL_SECS 60
+
+// stored messages the master devices did not get within this time (after they were received) are deleted,
+// for friends and for conferences. 0 = keep them until they are synced
+#define SPOOL_TTL_DIRECT_SECS (30 * 24 * 3600)
+#define SPOOL_TTL_CONFERENCE_SECS (7 * 24 * 3600)
+// files deleted per main loop iteration at most, the rest follows in the next seconds
+#define SPOOL_TTL_EXPIRE_PER_TICK 512
+// the oldest names of a sender that are kept in memory while its files expire
+#define SPOOL_TTL_CACHE_NAMES 256
+// min. seconds between unsolicited expiry status messages to the master
+#define SPOOL_TTL_STATUS_INTERVAL_SECS 3600
+
+// devices of the master (the first one included) that get the stored messages
+#define MASTER_MAX_DEVICES 8
+// how far each device has synced is saved at most this often (and when the proxy stops)
+#define SYNC_CURSORS_SAVE_SECS 10
+
+#define BULK_SYNC_VERSION 1
+// raw records put into one compressed packet at most
+#define BULK_SYNC_ZSTD_MAX_RAW_BYTES (32 * 1024)
+// one spool scan queues at most this many messages, batches are taken from that queue
+#define BULK_SYNC_QUEUE_MAX_RECORDS 16384
+#define BULK_SYNC_BATCH_MAX_RECORDS 1024
+// lossless packets sent per main loop iteration at most (a full send queue stops earlier)
+#define BULK_SYNC_PACKETS_PER_ITERATION 64
+#define BULK_SYNC_PROBE_TIMEOUT_SECS 10
+// resend the not acknowledged part of a batch after this time
+#define BULK_SYNC_ACK_TIMEOUT_SECS 30
+// scan the spool again after this time once everything queued has been synced
+#define BULK_SYNC_RESCAN_SECS 20
+// stored messages are synced in priority classes (direct messages, receipts, conference backlog), within a
+// class the senders take turns with up to this many messages each
+#define SYNC_ROUND_ROBIN_QUANTUM 8
+// a new direct message waits at most this long behind older queued direct messages before the spool is
+// scanned again (a batch of lower classes is ended right away)
+#define BULK_SYNC_DIRECT_LATENCY_SECS 2
+// a record that needs more than one packet starts in the packet before when at least this much of it
+// fits in there, otherwise it starts in a new packet
+#define BULK_SYNC_FRAGMENT_MIN_BYTES 256
+
+// file transfers of friends are stored in filesDir and sent on to the master devices
+#define FILE_TRANSFER_MAX_BYTES (256ULL * 1024ULL * 1024ULL)
+#define FILE_SPOOL_MAX_BYTES (2ULL * 1024ULL * 1024ULL * 1024ULL)
+// incoming and outgoing transfers at the same time
+#define FILE_TRANSFERS_MAX 32
+// the state of an incoming transfer is written after this many bytes, a resumed transfer starts there
+#define FILE_STATE_SAVE_BYTES (256 * 1024)
+// files that are not complete after this time are deleted, at startup and every FILE_PARTIAL_CHECK_SECS
+#define FILE_PARTIAL_MAX_AGE_SECS (7 * 24 * 3600)
+#define FILE_PARTIAL_CHECK_SECS 3600
+// look for stored files the master devices do not have yet after this time
+#define FILE_FORWARD_RESCAN_SECS 30
+// largest chunk asked for by file_chunk_request
+#define FILE_CHUNK_MAX_BYTES (64 * 1024)
+
+// compression (only with HAVE_ZSTD), ToxProxy_bench prints sizes and speed for other levels
+#define SPOOL_ZSTD_LEVEL 3
+#define BULK_SYNC_ZSTD_LEVEL 1
+// smaller messages are stored as they are
+#define SPOOL_COMPRESS_MIN_BYTES 64
+// a dictionary is trained once from the stored messages, when there are enough of them
+#define SPOOL_ZSTD_DICT_SIZE (16 * 1024)
+#define SPOOL_ZSTD_DICT_MIN_SAMPLES 500
+#define SPOOL_ZSTD_DICT_MAX_SAMPLES 10000
+#define SPOOL_ZSTD_DICT_MAX_SAMPLE_BYTES (4 * 1024 * 1024)
+#define SPOOL_ZSTD_TRAIN_CHECK_SECS 600
+// the samples are read in slices of this many microseconds between tox_iterate() calls
+#define SPOOL_ZSTD_TRAIN_SLICE_USEC 10000
+
+// the spool is checked at startup by this many threads, the main thread takes their results over
+// in slices of SPOOL_RECOVERY_SLICE_USEC microseconds between tox_iterate() calls
+#define SPOOL_INDEX_THREADS 4
+#define SPOOL_RECOVERY_SLICE_USEC 10000
+// the quota accounts are saved at most this often (and when the proxy stops), see spool index
+#define SPOOL_INDEX_CHECKPOINT_SECS 300
+
+// sequence numbers of stored messages are reserved in blocks of this many (one small write per block)
+#define SPOOL_SEQ_RESERVE 4096
+
+// the passphrase for the at-rest encryption is taken from this environment variable, without one
+// nothing is encrypted
+#define SPOOL_CRYPT_PASSPHRASE_ENV "TOXPROXY_PASSPHRASE"
+
+// push pings: devices (tokens) and gateways, connections per gateway (pings in flight plus the warm one)
+#define PUSH_MAX_TOKENS 8
+#define PUSH_MAX_GATEWAYS 4
+#define PUSH_POOL_SIZE 4
+#define PUSH_TOKEN_MAX_LENGTH 300
+#define PUSH_GATEWAYS_ENV "TOXPROXY_PUSH_GATEWAYS"
+// a device is woken at most once in this time, however many messages arrive
+#define PUSH_MIN_INTERVAL_SECS 10
+// gateway hosts are looked up again after this time, no new connections for a while after one failed
+#define PUSH_RESOLVE_REFRESH_SECS 600
+#define PUSH_RETRY_SECS 30
+#define PUSH_WARM_REOPEN_SECS 5
+#define PUSH_CONNECT_TIMEOUT_MS 2000
+#define PUSH_RECV_TIMEOUT_SECS 5
+
+// threads that remove the spool when the kill switch is used (ToxProxy_bench shows what helps)
+#define KILL_SWITCH_WIPE_THREADS 8
 TOX_CONNECTION my_connection_status = TOX_CONNECTION_NONE;
 
 uint32_t tox_public_key_hex_size = 0; //initialized in main
 uint32_t tox_address_hex_size = 0; //initialized in main
 int tox_loop_running = 1;
 bool masterIsOnline = false;
+// see spool_crypt_init()
+bool spool_crypt_enabled = false;
+bool spool_crypt_plain_left = false;
+uint8_t spool_crypt_key[crypto_secretstream_xchacha20poly1305_KEYBYTES];
 
 int ping_push_service();
+void push_tokens_handle_packet(const uint8_t *data, size_t length);
+void push_tokens_wipe(void);
+void spool_recovery_stop(void);
+void spool_zstd_train_stop(void);
+void friend_provision_add_one(Tox *tox, uint32_t friend_number, const uint8_t *public_key);
+void add_master(const char *public_key_hex);
+bool is_master(const char *public_key_hex);
+bool is_master_friendnumber(Tox *tox, uint32_t friend_number);
+uint32_t get_master_friendnumber(Tox *tox);
+int master_device_index_by_friend(Tox *tox, uint32_t friend_number);
+struct spool_account;
+bool master_device_got_message(struct spool_account *acc, int dir_fd, const char *name, int device);
+void master_devices_connection_change(Tox *tox, uint32_t friend_number, TOX_CONNECTION connection_status);
+void master_devices_handle_packet(Tox *tox, int device, const uint8_t *data, size_t length);
+void send_proxy_status(Tox *tox, uint32_t friend_number, uint8_t status_type);
+void file_transfers_connection_change(uint32_t friend_number, TOX_CONNECTION connection_status);
+void bulk_sync_reset_device(int device);
+void bulk_sync_direct_stored(void);
+void bulk_sync_handle_ack(int device, const uint8_t *data, size_t length);
+bool spool_is_encrypted(const uint8_t *data, size_t length);
+size_t spool_encrypt(const uint8_t *data, size_t length, uint8_t **out);
+uint8_t *spool_decrypt(const uint8_t *data, size_t length, size_t *out_length);
+uint8_t *spool_crypt_read_file(const char *path, size_t max_size, size_t *length, bool *was_encrypted);
+bool spool_name_is_compressed(const char *name);
+bool spool_crypt_write_file(const char *tmp_path, const char *path, const uint8_t *data, size_t length);
 
 void openLogFile()
 {
@@ -239,6 +555,13 @@ time_t get_unix_time(void)
     return time(NULL);
 }
 
+uint64_t get_monotonic_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)(ts.tv_nsec / 1000);
+}
+
 void usleep_usec(uint64_t usec)
 {
     struct timespec ts;
@@ -247,72 +570,508 @@ void usleep_usec(uint64_t usec)
     nanosleep(&ts, NULL);
 }
 
+// ----------- hex codec -----------
+// all hex conversions of public keys, tox ids and message ids go through
+// bin2upHex() and hex_string_to_bin(). output is always upper case, input
+// may be upper or lower case and is validated (no silent garbage bytes).
+
+#define HEX_INVALID 0x10
+
+static const char hex_upper_digits[16] = {
+    '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
+};
+
+// nibble value of every character, HEX_INVALID for non hex characters
+static const uint8_t hex_decode_table[256] = {
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+       0,    1,    2,    3,    4,    5,    6,    7,    8,    9, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10,   10,   11,   12,   13,   14,   15, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10,   10,   11,   12,   13,   14,   15, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+};
+
+#if defined(__SSE2__)
+// 16 bytes -> 32 upper case hex chars
+void hex_encode16_simd(const uint8_t *bin, char *hex)
+{
+    const __m128i v = _mm_loadu_si128((const __m128i *)bin);
+    const __m128i low_mask = _mm_set1_epi8(0x0F);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i ascii_zero = _mm_set1_epi8('0');
+    const __m128i ascii_gap = _mm_set1_epi8('A' - '0' - 10);
+
+    const __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), low_mask);
+    const __m128i lo = _mm_and_si128(v, low_mask);
+    __m128i first = _mm_unpacklo_epi8(hi, lo);
+    __m128i second = _mm_unpackhi_epi8(hi, lo);
+
+    first = _mm_add_epi8(_mm_add_epi8(first, ascii_zero), _mm_and_si128(_mm_cmpgt_epi8(first, nine), ascii_gap));
+    second = _mm_add_epi8(_mm_add_epi8(second, ascii_zero), _mm_and_si128(_mm_cmpgt_epi8(second, nine), ascii_gap));
+
+    _mm_storeu_si128((__m128i *)hex, first);
+    _mm_storeu_si128((__m128i *)(hex + 16), second);
+}
+
+// 16 hex chars -> 8 bytes (in the low byte of each 16 bit lane), sets 0xFF in *valid for every good char
+__m128i hex_decode_chars_simd(__m128i c, __m128i *valid)
+{
+    const __m128i minus_one = _mm_set1_epi8(-1);
+    const __m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    const __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(d, minus_one), _mm_cmplt_epi8(d, _mm_set1_epi8(10)));
+    const __m128i l = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    const __m128i is_alpha = _mm_and_si128(_mm_cmpgt_epi8(l, minus_one), _mm_cmplt_epi8(l, _mm_set1_epi8(6)));
+    const __m128i value = _mm_or_si128(_mm_and_si128(is_digit, d),
+                                       _mm_and_si128(is_alpha, _mm_add_epi8(l, _mm_set1_epi8(10))));
+
+    *valid = _mm_or_si128(is_digit, is_alpha);
+
+    // first char of each pair is the high nibble (little endian lanes)
+    return _mm_or_si128(_mm_and_si128(_mm_slli_epi16(value, 4), _mm_set1_epi16(0x00F0)), _mm_srli_epi16(value, 8));
+}
+
+// 32 hex chars -> 16 bytes, returns false on any non hex char
+bool hex_decode16_simd(const char *hex, uint8_t *bin)
+{
+    __m128i valid_first;
+    __m128i valid_second;
+    const __m128i first = hex_decode_chars_simd(_mm_loadu_si128((const __m128i *)hex), &valid_first);
+    const __m128i second = hex_decode_chars_simd(_mm_loadu_si128((const __m128i *)(hex + 16)), &valid_second);
+
+    _mm_storeu_si128((__m128i *)bin, _mm_packus_epi16(first, second));
+
+    return _mm_movemask_epi8(_mm_and_si128(valid_first, valid_second)) == 0xFFFF;
+}
+#define HAVE_HEX_SIMD 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+// 16 bytes -> 32 upper case hex chars
+void hex_encode16_simd(const uint8_t *bin, char *hex)
+{
+    const uint8x16_t v = vld1q_u8(bin);
+    const uint8x16_t nine = vdupq_n_u8(9);
+    const uint8x16_t ascii_zero = vdupq_n_u8('0');
+    const uint8x16_t ascii_gap = vdupq_n_u8('A' - '0' - 10);
+
+    uint8x16_t hi = vshrq_n_u8(v, 4);
+    uint8x16_t lo = vandq_u8(v, vdupq_n_u8(0x0F));
+
+    uint8x16x2_t out;
+    out.val[0] = vaddq_u8(vaddq_u8(hi, ascii_zero), vandq_u8(vcgtq_u8(hi, nine), ascii_gap));
+    out.val[1] = vaddq_u8(vaddq_u8(lo, ascii_zero), vandq_u8(vcgtq_u8(lo, nine), ascii_gap));
+
+    // interleaving store: hi0 lo0 hi1 lo1 ...
+    vst2q_u8((uint8_t *)hex, out);
+}
+
+// 16 hex chars -> 16 nibbles, sets 0xFF in *valid for every good char
+uint8x16_t hex_decode_chars_simd(uint8x16_t c, uint8x16_t *valid)
+{
+    const uint8x16_t d = vsubq_u8(c, vdupq_n_u8('0'));
+    const uint8x16_t is_digit = vcltq_u8(d, vdupq_n_u8(10));
+    const uint8x16_t l = vsubq_u8(vorrq_u8(c, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+    const uint8x16_t is_alpha = vcltq_u8(l, vdupq_n_u8(6));
+
+    *valid = vorrq_u8(is_digit, is_alpha);
+
+    return vorrq_u8(vandq_u8(is_digit, d), vandq_u8(is_alpha, vaddq_u8(l, vdupq_n_u8(10))));
+}
+
+// 32 hex chars -> 16 bytes, returns false on any non hex char
+bool hex_decode16_simd(const char *hex, uint8_t *bin)
+{
+    // de-interleaving load: val[0] = high nibble chars, val[1] = low nibble chars
+    const uint8x16x2_t c = vld2q_u8((const uint8_t *)hex);
+    uint8x16_t valid_hi;
+    uint8x16_t valid_lo;
+    const uint8x16_t hi = hex_decode_chars_simd(c.val[0], &valid_hi);
+    const uint8x16_t lo = hex_decode_chars_simd(c.val[1], &valid_lo);
+
+    vst1q_u8(bin, vorrq_u8(vshlq_n_u8(hi, 4), lo));
+
+    const uint8x16_t valid = vandq_u8(valid_hi, valid_lo);
+    const uint8x8_t folded = vand_u8(vget_low_u8(valid), vget_high_u8(valid));
+    return vget_lane_u64(vreinterpret_u64_u8(folded), 0) == UINT64_MAX;
+}
+#define HAVE_HEX_SIMD 1
+#endif
+
+// hex_size includes the terminating \0, output is cut to what fits into hex_size
 void bin2upHex(const uint8_t *bin, uint32_t bin_size, char *hex, uint32_t hex_size)
 {
-    sodium_bin2hex(hex, hex_size, bin, bin_size);
+    if (hex_size == 0) {
+        return;
+    }
+
+    if (bin_size > (hex_size - 1) / 2) {
+        bin_size = (hex_size - 1) / 2;
+    }
 
-    for (size_t i = 0; i < hex_size - 1; i++) {
-        hex[i] = toupper(hex[i]);
+    uint32_t i = 0;
+
+#ifdef HAVE_HEX_SIMD
+    // public keys (32) and tox ids (38) are mostly handled here
+    for (; i + 16 <= bin_size; i += 16) {
+        hex_encode16_simd(bin + i, hex + (2 * i));
+    }
+
+#endif
+
+    for (; i < bin_size; i++) {
+        hex[2 * i] = hex_upper_digits[bin[i] >> 4];
+        hex[2 * i + 1] = hex_upper_digits[bin[i] & 0x0F];
     }
+
+    hex[2 * bin_size] = '\0';
 }
 
-unsigned int char_to_int(char c)
+// returns 0 on success, -1 if hex_len != 2 * output_size or the input contains a non hex char
+int hex_string_to_bin(const char *hex_string, size_t hex_len, char *output, size_t output_size)
 {
-    if (c >= '0' && c <= '9') {
-        return c - '0';
+    if (output_size == 0 || hex_len != output_size * 2) {
+        return -1;
     }
 
-    if (c >= 'A' && c <= 'F') {
-        return 10 + c - 'A';
+    uint8_t *out = (uint8_t *)output;
+    const uint8_t *in = (const uint8_t *)hex_string;
+    uint8_t invalid = 0;
+    size_t i = 0;
+
+#ifdef HAVE_HEX_SIMD
+
+    for (; i + 16 <= output_size; i += 16) {
+        if (!hex_decode16_simd(hex_string + (2 * i), out + i)) {
+            return -1;
+        }
     }
 
-    if (c >= 'a' && c <= 'f') {
-        return 10 + c - 'a';
+#endif
+
+    for (; i < output_size; i++) {
+        const uint8_t hi = hex_decode_table[in[2 * i]];
+        const uint8_t lo = hex_decode_table[in[2 * i + 1]];
+        invalid |= (uint8_t)(hi | lo);
+        out[i] = (uint8_t)((hi << 4) | (lo & 0x0F));
     }
 
-    return -1;
+    return (invalid & HEX_INVALID) ? -1 : 0;
 }
 
+// decodes a hex public key into a new buffer (caller frees it), NULL if it's not valid hex
 uint8_t *hex_string_to_bin2(const char *hex_string)
 {
-    size_t len = TOX_ADDRESS_SIZE;
+    const size_t len = TOX_PUBLIC_KEY_SIZE;
+
+    if (strlen(hex_string) < len * 2) {
+        return NULL;
+    }
+
     uint8_t *val = calloc(1, len);
 
-    for (size_t i = 0; i != len; ++i) {
-        val[i] = (16 * char_to_int(hex_string[2 * i])) + (char_to_int(hex_string[2 * i + 1]));
+    if (val == NULL) {
+        return NULL;
+    }
+
+    if (hex_string_to_bin(hex_string, len * 2, (char *)val, len) != 0) {
+        free(val);
+        return NULL;
     }
 
     return val;
 }
+// ----------- hex codec -----------
 
-void on_start()
+// big endian helpers for packets and file headers
+uint8_t *put_u16_be(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+    return p + 2;
+}
+
+uint8_t *put_u32_be(uint8_t *p, uint32_t v)
 {
-    char *cmd_str = calloc(1, 1000);
-    snprintf(cmd_str, 999, "%s", shell_cmd__onstart);
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+    return p + 4;
+}
 
-    if (system(cmd_str)) {}
+uint8_t *put_u64_be(uint8_t *p, uint64_t v)
+{
+    p = put_u32_be(p, (uint32_t)(v >> 32));
+    return put_u32_be(p, (uint32_t)v);
+}
 
-    free(cmd_str);
+uint16_t get_u16_be(const uint8_t *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
 }
 
-void on_online()
+uint32_t get_u32_be(const uint8_t *p)
 {
-    char *cmd_str = calloc(1, 1000);
-    snprintf(cmd_str, 999, "%s", shell_cmd__ononline);
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
 
-    if (system(cmd_str)) {}
+uint64_t get_u64_be(const uint8_t *p)
+{
+    return ((uint64_t)get_u32_be(p) << 32) | get_u32_be(p + 4);
+}
 
-    free(cmd_str);
+// ----------- hooks -----------
+// the scripts in ./scripts run without a shell and without blocking the tox thread. the main loop reaps them
+// (SIGCHLD comes through a signalfd) and kills the ones that run too long. online/offline changes while a link
+// script runs are coalesced: when it ends, only the latest state runs, and only if it differs from the state
+// the last link script ran for.
+typedef enum HOOK {
+    HOOK_START = 0,
+    HOOK_ONLINE = 1,
+    HOOK_OFFLINE = 2,
+    HOOKS = 3
+} HOOK;
+
+typedef struct hook_stats {
+    uint32_t runs;
+    // could not be started or exited with an error (a missing script is not counted)
+    uint32_t failed;
+    uint32_t timed_out;
+    // requests that did not run because a later one replaced them
+    uint32_t coalesced;
+    // from the event to the end of its script
+    uint32_t last_latency_ms;
+    uint32_t max_latency_ms;
+    uint64_t total_latency_ms;
+} hook_stats;
+
+// one script at a time per slot: on_start, and on_online/on_offline
+typedef struct hook_slot {
+    pid_t pid;
+    HOOK running;
+    uint64_t started_usec;
+    uint64_t requested_usec;
+    // SIGTERM went out, SIGKILL follows
+    bool terminated;
+    // waits for the running script, HOOKS = nothing waits
+    HOOK pending;
+    uint64_t pending_usec;
+    // the hook the last script of the slot ran for, HOOKS = none yet
+    HOOK last;
+} hook_slot;
+
+#define HOOK_SLOTS 2
+
+hook_slot hook_slots[HOOK_SLOTS];
+hook_stats hook_totals[HOOKS];
+int hook_signal_fd = -1;
+extern char **environ;
+
+const char *hook_script(HOOK hook)
+{
+    return (hook == HOOK_START) ? hook_script__onstart : (hook == HOOK_ONLINE) ? hook_script__ononline
+           : hook_script__onoffline;
 }
 
-void on_offline()
+// block SIGCHLD (before any thread is started, they all inherit it) and get it through hook_signal_fd.
+// without a signalfd the main loop asks waitpid() every time a script runs.
+void hooks_init(void)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) == 0) {
+        hook_signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+        if (hook_signal_fd < 0) {
+            toxProxyLog(1, "hooks: no signalfd (%s), polling for exited scripts", strerror(errno));
+            pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+        }
+    }
+
+    for (int i = 0; i < HOOK_SLOTS; i++) {
+        CLEAR(hook_slots[i]);
+        hook_slots[i].pending = HOOKS;
+        hook_slots[i].last = HOOKS;
+    }
+}
+
+void hook_spawn(hook_slot *slot, HOOK hook, uint64_t requested_usec)
+{
+    const char *script = hook_script(hook);
+    char *argv[] = {(char *)script, NULL};
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t mask;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawnattr_init(&attr);
+    // SIGCHLD is not blocked in the script, and what it starts is in its process group (killed with it)
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+
+    pid_t pid = 0;
+    const int res = posix_spawn(&pid, script, &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    slot->last = hook;
+
+    if (res != 0) {
+        if (res != ENOENT) {
+            hook_totals[hook].failed++;
+            toxProxyLog(1, "hooks: can not start %s: %s", script, strerror(res));
+        } else {
+            toxProxyLog(9, "hooks: no %s", script);
+        }
+
+        return;
+    }
+
+    slot->pid = pid;
+    slot->running = hook;
+    slot->started_usec = get_monotonic_usec();
+    slot->requested_usec = requested_usec;
+    slot->terminated = false;
+    toxProxyLog(9, "hooks: started %s pid=%d", script, (int)pid);
+}
+
+void hook_request(HOOK hook)
+{
+    hook_slot *slot = &hook_slots[(hook == HOOK_START) ? 0 : 1];
+    const uint64_t now = get_monotonic_usec();
+
+    if (slot->pid != 0) {
+        if (slot->pending != HOOKS) {
+            hook_totals[slot->pending].coalesced++;
+        }
+
+        slot->pending = hook;
+        slot->pending_usec = now;
+        return;
+    }
+
+    if (hook != HOOK_START && hook == slot->last) {
+        // (online via TCP and then via UDP)
+        hook_totals[hook].coalesced++;
+        return;
+    }
+
+    hook_spawn(slot, hook, now);
+}
+
+// the kill switch: end the running scripts and what they started (their process groups), and reap them
+void hooks_kill_all(void)
+{
+    for (int i = 0; i < HOOK_SLOTS; i++) {
+        if (hook_slots[i].pid != 0) {
+            kill(-hook_slots[i].pid, SIGKILL);
+            waitpid(hook_slots[i].pid, NULL, 0);
+            hook_slots[i].pid = 0;
+        }
+
+        hook_slots[i].pending = HOOKS;
+    }
+}
+
+void hook_finished(hook_slot *slot, int status)
+{
+    const HOOK hook = slot->running;
+    hook_stats *st = &hook_totals[hook];
+    const uint64_t now = get_monotonic_usec();
+    const uint32_t latency_ms = (uint32_t)((now - slot->requested_usec) / 1000);
+
+    st->runs++;
+    st->last_latency_ms = latency_ms;
+    st->total_latency_ms += latency_ms;
+
+    if (latency_ms > st->max_latency_ms) {
+        st->max_latency_ms = latency_ms;
+    }
+
+    if (!slot->terminated && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+        st->failed++;
+    }
+
+    toxProxyLog(WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 9 : 1, "hooks: %s ended (status %d) after %u ms",
+                hook_script(hook), status, latency_ms);
+    slot->pid = 0;
+
+    if (slot->pending != HOOKS) {
+        const HOOK next = slot->pending;
+        slot->pending = HOOKS;
+
+        if (next != HOOK_START && next == slot->last) {
+            hook_totals[next].coalesced++;
+        } else {
+            hook_spawn(slot, next, slot->pending_usec);
+        }
+    }
+}
+
+// called from the main loop: reap the scripts that ended, stop the ones that take too long
+void hooks_poll(void)
+{
+    bool check = (hook_signal_fd < 0);
+    struct signalfd_siginfo info;
+
+    while (hook_signal_fd >= 0 && read(hook_signal_fd, &info, sizeof(info)) == (ssize_t)sizeof(info)) {
+        check = true;
+    }
+
+    const uint64_t now = get_monotonic_usec();
+
+    for (int i = 0; i < HOOK_SLOTS; i++) {
+        hook_slot *slot = &hook_slots[i];
+        int status = 0;
+
+        if (slot->pid == 0) {
+            continue;
+        }
+
+        if (check && waitpid(slot->pid, &status, WNOHANG) == slot->pid) {
+            hook_finished(slot, status);
+            continue;
+        }
+
+        const uint64_t timeout_usec = (uint64_t)((slot->running == HOOK_START) ? HOOK_START_TIMEOUT_SECS :
+                                      HOOK_LINK_TIMEOUT_SECS) * 1000000;
+
+        if (!slot->terminated && now - slot->started_usec > timeout_usec) {
+            toxProxyLog(1, "hooks: %s runs too long, stopping it", hook_script(slot->running));
+            hook_totals[slot->running].timed_out++;
+            slot->terminated = true;
+            kill(-slot->pid, SIGTERM);
+        } else if (slot->terminated && now - slot->started_usec > timeout_usec + HOOK_KILL_GRACE_SECS * 1000000ULL) {
+            kill(-slot->pid, SIGKILL);
+        }
+    }
+}
+
+void on_start()
 {
-    char *cmd_str = calloc(1, 1000);
-    snprintf(cmd_str, 999, "%s", shell_cmd__onoffline);
+    hook_request(HOOK_START);
+}
 
-    if (system(cmd_str)) {}
+void on_online()
+{
+    hook_request(HOOK_ONLINE);
+}
 
-    free(cmd_str);
+void on_offline()
+{
+    hook_request(HOOK_OFFLINE);
 
     // if we go offline, immediately bootstrap again. maybe we can go online faster
     // set last online timestamp into the past
@@ -323,20 +1082,7 @@ void on_offline()
         my_last_online_ts = my_last_online_ts_ - ((BOOTSTRAP_AFTER_OFFLINE_SECS - 2) * 1000);
     }
 }
-
-void killSwitch() __attribute__((noreturn));
-
-void killSwitch()
-{
-    toxProxyLog(2, "got killSwitch command, deleting all data");
-#ifdef USE_SEPARATE_SAVEDATA_FILE
-    unlink(savedata_filename);
-#endif
-    unlink(masterFile);
-    toxProxyLog(1, "todo implement deleting messages");
-    tox_loop_running = 0;
-    exit(0);
-}
+// ----------- hooks -----------
 
 void sigint_handler(int signo)
 {
@@ -527,13 +1273,26 @@ void updateToxSavedata(const Tox *tox)
     tox_get_savedata(tox, savedata);
 
 #ifdef USE_SEPARATE_SAVEDATA_FILE
-    FILE *f = fopen(savedata_tmp_filename, "wb");
-    fwrite(savedata, size, 1, f);
-    fclose(f);
 
-    rename(savedata_tmp_filename, savedata_filename);
+    if (!spool_crypt_write_file(savedata_tmp_filename, savedata_filename, savedata, size)) {
+        toxProxyLog(0, "can not write %s", savedata_filename);
+    }
+
 #else
-    dbSavedataAction(true, savedata, size);
+    uint8_t *encrypted = NULL;
+
+    if (spool_crypt_enabled) {
+        const size_t encrypted_size = spool_encrypt(savedata, size, &encrypted);
+
+        if (encrypted) {
+            dbSavedataAction(true, encrypted, encrypted_size);
+        }
+
+        free(encrypted);
+    } else {
+        dbSavedataAction(true, savedata, size);
+    }
+
 #endif
 
     free(savedata);
@@ -559,36 +1318,40 @@ Tox *openTox()
     options.log_callback = tox_log_cb__custom;
 
 #ifdef USE_SEPARATE_SAVEDATA_FILE
-    FILE *f = fopen(savedata_filename, "rb");
-    uint8_t *savedata = NULL;
-
-    if (f) {
-        fseek(f, 0, SEEK_END);
-        size_t savedataSize = ftell(f);
-        fseek(f, 0, SEEK_SET);
-
-        savedata = malloc(savedataSize);
-        size_t ret = fread(savedata, savedataSize, 1, f);
-
-        // TODO: handle ret return vlaue here!
-        if (ret) {
-            // ------
-        }
-
-        fclose(f);
+    size_t savedataSize = 0;
+    uint8_t *savedata = spool_crypt_read_file(savedata_filename, SIZE_MAX, &savedataSize, NULL);
 
+    if (savedata) {
         options.savedata_type = TOX_SAVEDATA_TYPE_TOX_SAVE;
         options.savedata_data = savedata;
         options.savedata_length = savedataSize;
+    } else if (access(savedata_filename, F_OK) == 0) {
+        // starting with a new identity would overwrite it
+        toxProxyLog(0, "can not read %s, exiting", savedata_filename);
+        exit(1);
     }
 
 #else
     SizedSavedata ssd = dbSavedataAction(false, NULL, 0);
+    uint8_t *savedata = NULL;
 
     if (ssd.savedataSize != 0) {
         options.savedata_type = TOX_SAVEDATA_TYPE_TOX_SAVE;
         options.savedata_data = ssd.savedata;
         options.savedata_length = ssd.savedataSize;
+
+        if (spool_is_encrypted(ssd.savedata, ssd.savedataSize)) {
+            size_t savedataSize = 0;
+            savedata = spool_decrypt(ssd.savedata, ssd.savedataSize, &savedataSize);
+
+            if (savedata == NULL) {
+                toxProxyLog(0, "can not decrypt the savedata, exiting");
+                exit(1);
+            }
+
+            options.savedata_data = savedata;
+            options.savedata_length = savedataSize;
+        }
     }
 
 #endif
@@ -599,9 +1362,8 @@ Tox *openTox()
     tox = tox_new(&options, NULL);
 #endif
 
-#ifdef USE_SEPARATE_SAVEDATA_FILE
     free(savedata);
-#else
+#ifndef USE_SEPARATE_SAVEDATA_FILE
     sqlite3_finalize(ssd.stmt);
     sqlite3_close(ssd.db);
 #endif
@@ -640,11 +1402,16 @@ void bootstap_nodes(Tox *tox, DHT_node nodes[], int number_of_nodes, int add_as_
 
     for (size_t j = 0; (int)j < (int)number_of_nodes; j++) {
         size_t i = (size_t)random_order_nodenums[j];
-        bool res = sodium_hex2bin(nodes[i].key_bin, sizeof(nodes[i].key_bin),
-                                  nodes[i].key_hex, sizeof(nodes[i].key_hex) - 1, NULL, NULL, NULL);
-        toxProxyLog(99, "bootstap_nodes - sodium_hex2bin:res=%d", res);
+        int hex_res = hex_string_to_bin(nodes[i].key_hex, sizeof(nodes[i].key_hex) - 1,
+                                        (char *)nodes[i].key_bin, sizeof(nodes[i].key_bin));
+        toxProxyLog(99, "bootstap_nodes - hex_string_to_bin:res=%d", hex_res);
+
+        if (hex_res != 0) {
+            continue;
+        }
+
         TOX_ERR_BOOTSTRAP error;
-        res = tox_bootstrap(tox, nodes[i].ip, nodes[i].port, nodes[i].key_bin, &error);
+        bool res = tox_bootstrap(tox, nodes[i].ip, nodes[i].port, nodes[i].key_bin, &error);
 
         if (res != true) {
             if (error == TOX_ERR_BOOTSTRAP_OK) {
@@ -742,893 +1509,8670 @@ void bootstrap(Tox *tox)
 
 }
 
-void writeConferenceMessage(Tox *tox, const char *sender_key_hex, const uint8_t *message_orig, size_t length_orig,
-                            uint32_t msg_type, char *peer_pubkey_hex)
+// ----------- spool quotas -----------
+// every sender dir (friend pubkey or conference id) has an account with the bytes and number
+// of messages it has stored. the accounts and the global totals are updated on every spool
+// write and delete, so checking a quota never needs to look at the disk.
+// only message files are counted, the small __MSGID__ files are not.
+
+typedef struct spool_account {
+    bool used;
+    bool is_conference;
+    // the startup recovery has counted everything this sender stored before
+    bool counted;
+    // a file went away while the startup recovery was counting, the account may be a bit too big
+    bool inexact;
+    char sender_key_hex[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+    uint64_t bytes;
+    uint32_t messages;
+    uint32_t evicted;
+    uint32_t rejected;
+    // per master_devices[] slot: the device has all stored messages of this sender up to this sequence number
+    uint64_t sync_cursor[MASTER_MAX_DEVICES];
+    // receive time in ms of the newest stored message, the next one gets a later one. taken from the
+    // newest name of the sender dir before the first message of a run is stored (receive_seeded)
+    uint64_t last_receive_ms;
+    bool receive_seeded;
+    // index + 1 of the timer for the oldest file in spool_ttl_timers, 0 = none
+    uint32_t ttl_timer;
+    // messages deleted since the proxy started because they were older than the ttl
+    uint32_t ttl_expired;
+    // the oldest names of the sender dir for spool_evict_oldest(), evict_names_next is the first one not deleted
+    char **evict_names;
+    uint32_t evict_names_count;
+    uint32_t evict_names_next;
+} spool_account;
+
+spool_account *spool_accounts = NULL;
+uint32_t spool_accounts_size = 0; // always a power of 2
+uint32_t spool_accounts_used = 0;
+
+uint64_t spool_total_bytes = 0;
+uint32_t spool_total_messages = 0;
+uint32_t spool_total_evicted = 0;
+uint32_t spool_total_rejected = 0;
+bool spool_quota_status_changed = false;
+// the accounts are only complete once the startup recovery is done, until then nothing is evicted
+bool spool_quota_ready = false;
+// the accounts have changed since the last checkpoint (see spool index)
+bool spool_index_dirty = false;
+// messages written by this run have names >= this (the first sequence number of the run) and are
+// counted when they are written, the startup recovery counts the older ones
+char spool_counted_from_name[32] = {0};
+
+uint32_t spool_account_hash(const char *sender_key_hex)
 {
-    size_t length = length_orig + 64;
-    size_t len_copy = length_orig;
+    // FNV-1a
+    uint32_t h = 2166136261U;
 
-    if (length > TOX_MAX_MESSAGE_LENGTH) {
-        length = TOX_MAX_MESSAGE_LENGTH;
-        len_copy = TOX_MAX_MESSAGE_LENGTH - (TOX_MAX_MESSAGE_LENGTH - (length_orig + 64));
+    for (const char *c = sender_key_hex; *c != '\0'; c++) {
+        h ^= (uint8_t) * c;
+        h *= 16777619U;
     }
 
-    uint8_t *message = calloc(1, length);
-    // put peer pubkey in front of message
-    memcpy(message, peer_pubkey_hex, 64);
-    // put message after peer pubkey
-    memcpy(message + 64, message_orig, len_copy);
+    return h;
+}
 
-    uint32_t raw_message_len = tox_messagev2_size(length, TOX_FILE_KIND_MESSAGEV2_SEND, 0);
+spool_account *spool_account_find_slot(spool_account *table, uint32_t size, const char *sender_key_hex)
+{
+    uint32_t i = spool_account_hash(sender_key_hex) & (size - 1);
 
-    toxProxyLog(0, "writeConferenceMessage:raw_message_len=%d length=%d", raw_message_len, (int)length);
-    uint8_t *raw_message_data = calloc(1, raw_message_len);
+    while (table[i].used && strcmp(table[i].sender_key_hex, sender_key_hex) != 0) {
+        i = (i + 1) & (size - 1);
+    }
 
-    uint32_t ts_sec = (uint32_t) get_unix_time();
+    return &table[i];
+}
 
-    char msgid[TOX_PUBLIC_KEY_SIZE];
-    CLEAR(msgid);
-    bool res = tox_messagev2_wrap(length, TOX_FILE_KIND_MESSAGEV2_SEND,
-                                  0, message, ts_sec, 0,
-                                  raw_message_data, (uint8_t *)msgid);
-    if (res) {}
+// make room for count accounts (the table is kept at most 3/4 full), a rebuild invalidates all
+// spool_account pointers
+bool spool_accounts_reserve(uint32_t count)
+{
+    if (count * 4 <= spool_accounts_size * 3) {
+        return true;
+    }
 
-    char msg_id_hex[tox_public_key_hex_size];
-    CLEAR(msg_id_hex);
-    bin2upHex((const uint8_t *)msgid, tox_public_key_size(), msg_id_hex, tox_public_key_hex_size);
-    toxProxyLog(0, "writeConferenceMessage:msg_id_hex=%s", msg_id_hex);
+    uint32_t new_size = (spool_accounts_size == 0) ? 64 : (spool_accounts_size * 2);
 
-    char userDir[tox_public_key_hex_size + strlen(msgsDir) + 1];
-    CLEAR(userDir);
+    while (count * 4 > new_size * 3) {
+        new_size *= 2;
+    }
 
-    strcpy(userDir, msgsDir);
-    strcat(userDir, "/");
-    strcat(userDir, sender_key_hex);
+    spool_account *n = calloc(new_size, sizeof(spool_account));
 
-    mkdir(msgsDir, S_IRWXU);
-    mkdir(userDir, S_IRWXU);
+    if (n == NULL) {
+        return false;
+    }
 
-    //TODO FIXME use message v2 message id / hash instead of timestamp of receiving / processing message!
+    for (uint32_t i = 0; i < spool_accounts_size; i++) {
+        if (spool_accounts[i].used) {
+            *spool_account_find_slot(n, new_size, spool_accounts[i].sender_key_hex) = spool_accounts[i];
+        }
+    }
 
-    char timestamp[strlen("0000-00-00_0000-00,000000") + 1]; // = "0000-00-00_0000-00,000000";
-    CLEAR(timestamp);
+    free(spool_accounts);
+    spool_accounts = n;
+    spool_accounts_size = new_size;
+    return true;
+}
 
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    struct tm tm = *localtime(&tv.tv_sec);
-    snprintf(timestamp, sizeof(timestamp), "%04d-%02d-%02d_%02d%02d-%02d,%06ld",
-             tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, tv.tv_usec);
+// returns the account of a sender, creates it if needed.
+// creating one can rebuild the table: all spool_account pointers held before are invalid after an insert
+// (a lookup of an existing sender never moves anything)
+spool_account *spool_account_get(const char *sender_key_hex)
+{
+    if (strlen(sender_key_hex) >= (TOX_PUBLIC_KEY_SIZE * 2 + 1)) {
+        return NULL;
+    }
 
-    char *msgPath = calloc(1, sizeof(userDir) + 1 + sizeof(timestamp) + 4 + 1);
-    strcpy(msgPath, userDir);
-    strcat(msgPath, "/");
-    strcat(msgPath, timestamp);
-    strcat(msgPath, ".txtS");
+    spool_account *acc = (spool_accounts_size == 0) ? NULL
+                         : spool_account_find_slot(spool_accounts, spool_accounts_size, sender_key_hex);
 
-    FILE *f = fopen(msgPath, "wb");
+    if (acc != NULL && acc->used) {
+        return acc;
+    }
 
-    if (f) {
-        fwrite(raw_message_data, raw_message_len, 1, f);
-        fclose(f);
+    if (!spool_accounts_reserve(spool_accounts_used + 1)) {
+        return NULL;
     }
 
-    ping_push_service();
+    acc = spool_account_find_slot(spool_accounts, spool_accounts_size, sender_key_hex);
 
-    free(raw_message_data);
-    free(message);
-    free(msgPath);
+    if (!acc->used) {
+        acc->used = true;
+        snprintf(acc->sender_key_hex, sizeof(acc->sender_key_hex), "%s", sender_key_hex);
+        spool_accounts_used++;
+    }
+
+    return acc;
 }
 
-void writeMessage(char *sender_key_hex, const uint8_t *message, size_t length, uint32_t msg_type)
+void spool_account_add_many(spool_account *acc, uint64_t bytes, uint32_t messages)
 {
+    acc->bytes += bytes;
+    acc->messages += messages;
+    spool_total_bytes += bytes;
+    spool_total_messages += messages;
+    spool_index_dirty = true;
+}
 
-    uint8_t *msg_id = calloc(1, tox_public_key_size());
-    tox_messagev2_get_message_id(message, msg_id);
-    toxProxyLog(2, "New message from %s msg_type=%d", sender_key_hex, msg_type);
+void spool_account_add(spool_account *acc, uint64_t bytes)
+{
+    spool_account_add_many(acc, bytes, 1);
+}
 
-    char userDir[tox_public_key_hex_size + strlen(msgsDir) + 1];
-    CLEAR(userDir);
+void spool_account_sub(spool_account *acc, uint64_t bytes)
+{
+    acc->bytes = (acc->bytes > bytes) ? (acc->bytes - bytes) : 0;
+    acc->messages = (acc->messages > 0) ? (acc->messages - 1) : 0;
+    spool_total_bytes = (spool_total_bytes > bytes) ? (spool_total_bytes - bytes) : 0;
+    spool_total_messages = (spool_total_messages > 0) ? (spool_total_messages - 1) : 0;
+    spool_index_dirty = true;
+}
 
-    strcpy(userDir, msgsDir);
-    strcat(userDir, "/");
-    strcat(userDir, sender_key_hex);
+uint64_t spool_account_max_bytes(const spool_account *acc)
+{
+    if (acc->is_conference && CONFERENCE_SPOOL_MAX_BYTES > 0) {
+        return CONFERENCE_SPOOL_MAX_BYTES;
+    }
 
-    mkdir(msgsDir, S_IRWXU);
-    mkdir(userDir, S_IRWXU);
+    return SPOOL_QUOTA_SENDER_MAX_BYTES;
+}
 
-    //TODO FIXME use message v2 message id / hash instead of timestamp of receiving / processing message!
+bool name_has_suffix(const char *name, const char *suffix)
+{
+    const size_t len = strlen(name);
+    const size_t suffix_len = strlen(suffix);
+    return (len >= suffix_len) && (strcmp(name + len - suffix_len, suffix) == 0);
+}
 
-    char timestamp[strlen("0000-00-00_0000-00,000000") + 1]; // = "0000-00-00_0000-00,000000";
-    CLEAR(timestamp);
+// message files are the ones that don't end with "_" (those are the __MSGID__ files)
+bool spool_is_message_file(const char *name)
+{
+    const size_t len = strlen(name);
+    return (len > 2) && (name[0] != '.') && (name[len - 1] != '_');
+}
 
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    struct tm tm = *localtime(&tv.tv_sec);
-    snprintf(timestamp, sizeof(timestamp), "%04d-%02d-%02d_%02d%02d-%02d,%06ld",
-             tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, tv.tv_usec);
+// while the startup recovery runs, a file it has not seen yet is not in the account.
+// a file it counted in the dir it is working on is taken as not counted, the account is
+// a bit too big then until the next start (it is marked inexact and not put into the checkpoint).
+bool spool_file_is_counted(const spool_account *acc, const char *name)
+{
+    return spool_quota_ready || acc->counted || strcmp(name, spool_counted_from_name) >= 0;
+}
 
-    char *msgPath = calloc(1, sizeof(userDir) + 1 + sizeof(timestamp) + 4 + 1);
-    strcpy(msgPath, userDir);
-    strcat(msgPath, "/");
-    strcat(msgPath, timestamp);
+// unlink one file of a sender dir and keep the account right
+void spool_unlink_file(spool_account *acc, int dir_fd, const char *name)
+{
+    struct stat st;
+    const bool is_message = spool_is_message_file(name);
 
-    if (msg_type == TOX_FILE_KIND_MESSAGEV2_ANSWER) {
-        strcat(msgPath, ".txtA");
-    } else if (msg_type == TOX_FILE_KIND_MESSAGEV2_SEND) {
-        strcat(msgPath, ".txtS");
+    if (is_message && fstatat(dir_fd, name, &st, 0) != 0) {
+        return;
     }
 
-    FILE *f = fopen(msgPath, "wb");
-
-    if (f) {
-        fwrite(message, length, 1, f);
-        fclose(f);
+    if (unlinkat(dir_fd, name, 0) != 0 || !is_message || acc == NULL) {
+        return;
     }
 
-    ping_push_service();
-
-    free(msgPath);
+    if (spool_file_is_counted(acc, name)) {
+        spool_account_sub(acc, (uint64_t)st.st_size);
+    } else {
+        // maybe the recovery has counted it already, don't put this account into the checkpoint
+        acc->inexact = true;
+    }
 }
 
-void writeMessageHelper(Tox *tox, uint32_t friend_number, const uint8_t *message, size_t length, uint32_t msg_type)
+// unlink a stored message and all __MSGID__ files that belong to it (they share the file name as prefix)
+void spool_delete_message_files(const char *sender_key_hex, const char *base_name)
 {
-    uint8_t public_key_bin[tox_public_key_size()];
-    CLEAR(public_key_bin);
+    char friendDir[strlen(msgsDir) + 1 + strlen(sender_key_hex) + 1];
+    snprintf(friendDir, sizeof(friendDir), "%s/%s", msgsDir, sender_key_hex);
 
-    tox_friend_get_public_key(tox, friend_number, public_key_bin, NULL);
+    DIR *dfd = opendir(friendDir);
 
-    char public_key_hex[tox_public_key_hex_size];
-    CLEAR(public_key_hex);
+    if (dfd == NULL) {
+        return;
+    }
 
-    bin2upHex(public_key_bin, tox_public_key_size(), public_key_hex, tox_public_key_hex_size);
-    writeMessage(public_key_hex, message, length, msg_type);
-}
+    spool_account *acc = spool_account_get(sender_key_hex);
+    const size_t base_len = strlen(base_name);
+    struct dirent *dp = NULL;
 
-void writeConferenceMessageHelper(Tox *tox, const uint8_t *conference_id, const uint8_t *message, size_t length,
-                                  char *peer_pubkey_hex)
-{
-    char conference_id_hex[TOX_CONFERENCE_ID_SIZE * 2 + 1];
-    CLEAR(conference_id_hex);
+    while ((dp = readdir(dfd)) != NULL) {
+        if (strncmp(dp->d_name, base_name, base_len) == 0) {
+            spool_unlink_file(acc, dirfd(dfd), dp->d_name);
+        }
+    }
 
-    bin2upHex(conference_id, TOX_CONFERENCE_ID_SIZE, conference_id_hex, (TOX_CONFERENCE_ID_SIZE * 2 + 1));
-    writeConferenceMessage(tox, conference_id_hex, message, length, TOX_FILE_KIND_MESSAGEV2_SEND, peer_pubkey_hex);
+    closedir(dfd);
 }
 
-bool file_exists(const char *path)
+int spool_cmp_names(const void *a, const void *b)
 {
-    struct stat s;
-    return stat(path, &s) == 0;
+    return strcmp(*(char *const *)a, *(char *const *)b);
 }
 
-// fill string with toxid in upper case hex.
-// size of toxid_str needs to be: [TOX_ADDRESS_SIZE*2 + 1] !!
-void get_my_toxid(Tox *tox, char *toxid_str)
+// read all file names of a sender dir, sorted.
+// file names start with the sequence number (older ones with the receive time), so sorting them gives the oldest first
+// and puts the __MSGID__ files right behind the message they belong to
+size_t spool_read_sorted_names(DIR *dfd, char ***names_out)
 {
-    uint8_t tox_id_bin[TOX_ADDRESS_SIZE];
-    CLEAR(tox_id_bin);
+    char **names = NULL;
+    size_t names_count = 0;
+    size_t names_size = 0;
+    struct dirent *dp = NULL;
 
-    tox_self_get_address(tox, tox_id_bin);
-    char tox_id_hex_local[TOX_ADDRESS_SIZE * 2 + 1];
-    CLEAR(tox_id_hex_local);
+    while ((dp = readdir(dfd)) != NULL) {
+        if (dp->d_name[0] == '.') {
+            continue;
+        }
+
+        if (names_count == names_size) {
+            names_size = (names_size == 0) ? 256 : (names_size * 2);
+            char **n = realloc(names, names_size * sizeof(char *));
+
+            if (n == NULL) {
+                break;
+            }
+
+            names = n;
+        }
+
+        names[names_count] = strdup(dp->d_name);
 
-    sodium_bin2hex(tox_id_hex_local, sizeof(tox_id_hex_local), tox_id_bin, sizeof(tox_id_bin));
+        if (names[names_count]) {
+            names_count++;
+        }
+    }
 
-    for (size_t i = 0; i < sizeof(tox_id_hex_local) - 1; i ++) {
-        tox_id_hex_local[i] = toupper(tox_id_hex_local[i]);
+    if (names_count > 0) {
+        qsort(names, names_count, sizeof(char *), spool_cmp_names);
     }
 
-    snprintf(toxid_str, (size_t)(TOX_ADDRESS_SIZE * 2 + 1), "%s", (const char *)tox_id_hex_local);
+    *names_out = names;
+    return names_count;
 }
 
-void add_master(const char *public_key_hex)
+void spool_free_names(char **names, size_t names_count)
 {
-
-    if (file_exists(masterFile)) {
-        toxProxyLog(2, "I already have a *MASTER*");
-        return;
+    for (size_t i = 0; i < names_count; i++) {
+        free(names[i]);
     }
 
-    toxProxyLog(2, "added master");
-    FILE *f = fopen(masterFile, "wb");
+    free(names);
+}
 
-    if (f) {
-        fwrite(public_key_hex, tox_public_key_hex_size, 1, f);
-        fclose(f);
+// move the name at i down the max-heap of names until both children are smaller
+void spool_names_heap_down(char **heap, size_t count, size_t i)
+{
+    while (true) {
+        size_t biggest = i;
+        const size_t l = 2 * i + 1;
+        const size_t r = l + 1;
+
+        if (l < count && strcmp(heap[l], heap[biggest]) > 0) {
+            biggest = l;
+        }
+
+        if (r < count && strcmp(heap[r], heap[biggest]) > 0) {
+            biggest = r;
+        }
+
+        if (biggest == i) {
+            return;
+        }
+
+        char *t = heap[i];
+        heap[i] = heap[biggest];
+        heap[biggest] = t;
+        i = biggest;
     }
 }
 
-bool is_master(const char *public_key_hex)
+// like spool_read_sorted_names(), but only the keep oldest names. they are selected with a max-heap of
+// keep names while reading, so a big dir is neither copied nor sorted as a whole
+size_t spool_read_oldest_names(DIR *dfd, size_t keep, char ***names_out)
 {
-    //toxProxyLog(2, "enter:is_master");
+    char **heap = (keep > 0) ? calloc(keep, sizeof(char *)) : NULL;
+    size_t count = 0;
+    struct dirent *dp = NULL;
 
-    if (!file_exists(masterFile)) {
-        toxProxyLog(2, "master file does not exist");
-        return false;
-    }
+    while (heap != NULL && (dp = readdir(dfd)) != NULL) {
+        if (dp->d_name[0] == '.') {
+            continue;
+        }
 
-    FILE *f = fopen(masterFile, "rb");
+        if (count < keep) {
+            heap[count] = strdup(dp->d_name);
 
-    if (! f) {
-        return false;
-    }
+            if (heap[count] == NULL) {
+                break;
+            }
 
-    fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);
+            count++;
 
-    if (fsize < 1) {
-        fclose(f);
-        return false;
-    }
+            // heapify once it is full, until then it is just filled
+            if (count == keep) {
+                for (size_t i = keep / 2; i > 0; i--) {
+                    spool_names_heap_down(heap, count, i - 1);
+                }
+            }
+
+            continue;
+        }
 
-    char *masterPubKeyHexSaved = calloc(1, fsize);
-    size_t res = fread(masterPubKeyHexSaved, fsize, 1, f);
+        if (strcmp(dp->d_name, heap[0]) >= 0) {
+            continue;
+        }
 
-    if (res) {}
+        char *name = strdup(dp->d_name);
 
-    fclose(f);
+        if (name == NULL) {
+            break;
+        }
 
-    if (strncmp(masterPubKeyHexSaved, public_key_hex, tox_public_key_hex_size) == 0) {
-        free(masterPubKeyHexSaved);
-        return true;
-    } else {
-        free(masterPubKeyHexSaved);
-        return false;
+        free(heap[0]);
+        heap[0] = name;
+        spool_names_heap_down(heap, count, 0);
     }
-}
 
-void getPubKeyHex_friendnumber(Tox *tox, uint32_t friend_number, char *pubKeyHex)
-{
-    uint8_t public_key_bin[tox_public_key_size()];
-    CLEAR(public_key_bin);
-    tox_friend_get_public_key(tox, friend_number, public_key_bin, NULL);
-    bin2upHex(public_key_bin, tox_public_key_size(), pubKeyHex, tox_public_key_hex_size);
+    if (count > 0) {
+        qsort(heap, count, sizeof(char *), spool_cmp_names);
+    }
+
+    *names_out = heap;
+    return count;
 }
 
-bool is_master_friendnumber(Tox *tox, uint32_t friend_number)
+void spool_evict_free_names(spool_account *acc)
 {
-    bool ret = false;
-    char *pubKeyHex = calloc(1, tox_public_key_hex_size);
-    getPubKeyHex_friendnumber(tox, friend_number, pubKeyHex);
-    ret = is_master(pubKeyHex);
-    free(pubKeyHex);
-    return ret;
+    spool_free_names(acc->evict_names, acc->evict_names_count);
+    acc->evict_names = NULL;
+    acc->evict_names_count = 0;
+    acc->evict_names_next = 0;
 }
 
-int hex_string_to_bin(const char *hex_string, size_t hex_len, char *output, size_t output_size)
+// read the oldest SPOOL_QUOTA_EVICT_CACHE_NAMES names of the sender dir into acc->evict_names
+void spool_evict_refill(spool_account *acc, int dir_fd)
 {
-    if (output_size == 0 || hex_len != output_size * 2) {
-        return -1;
-    }
+    spool_evict_free_names(acc);
+
+    const int fd = dup(dir_fd);
+    DIR *dfd = (fd >= 0) ? fdopendir(fd) : NULL;
 
-    for (size_t i = 0; i < output_size; ++i) {
-        sscanf(hex_string, "%2hhx", (unsigned char *) &output[i]);
-        hex_string += 2;
+    if (dfd == NULL) {
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        return;
     }
 
-    return 0;
+    rewinddir(dfd);
+    char **names = NULL;
+    acc->evict_names_count = (uint32_t)spool_read_oldest_names(dfd, SPOOL_QUOTA_EVICT_CACHE_NAMES, &names);
+    acc->evict_names = names;
+    closedir(dfd);
 }
 
-void friend_request_cb(Tox *tox, const uint8_t *public_key, const uint8_t *message, size_t length, void *user_data)
+// delete the oldest messages of a sender until it is at or below the given limits.
+// the names come from the cache of the oldest names of the sender (acc->evict_names), the dir is only read
+// again when they are used up: new messages get a bigger sequence number, nothing is ever stored before them.
+// cached names that are gone already (synced or expired) are skipped.
+void spool_evict_oldest(spool_account *acc, uint64_t target_bytes, uint32_t target_messages)
 {
-    char public_key_hex[tox_public_key_hex_size];
-    CLEAR(public_key_hex);
-    bin2upHex(public_key, tox_public_key_size(), public_key_hex, tox_public_key_hex_size);
+    char friendDir[strlen(msgsDir) + 1 + sizeof(acc->sender_key_hex)];
+    snprintf(friendDir, sizeof(friendDir), "%s/%s", msgsDir, acc->sender_key_hex);
 
-    size_t friends = tox_self_get_friend_list_size(tox);
+    const int dir_fd = open(friendDir, O_RDONLY | O_DIRECTORY);
 
-    if (friends == 0) {
-        // add first friend as master for this proxy
-        add_master(public_key_hex);
-        tox_friend_add_norequest(tox, public_key, NULL);
-        updateToxSavedata(tox);
-    } else {
-        // once I have a master, I don't add friend's on request, only by command of my master!
+    if (dir_fd < 0) {
         return;
     }
 
-    toxProxyLog(2, "Got currently %zu friends. New friend request from %s with message: %s",
-                friends, public_key_hex, message);
+    uint32_t evicted = 0;
+    // evicted when the cache was last refilled, a refill that evicts nothing means the account is too big
+    uint32_t evicted_at_refill = UINT32_MAX;
+    // the message just evicted, its __MSGID__ files come right behind it
+    char deleting[NAME_MAX + 1];
+    CLEAR(deleting);
 
-    friends = tox_self_get_friend_list_size(tox);
-    toxProxyLog(2, "Added friend: %s. Number of total friends: %zu", public_key_hex, friends);
-}
+    while (true) {
+        const bool done = (acc->bytes <= target_bytes && acc->messages <= target_messages);
 
-void friend_message_cb(Tox *tox, uint32_t friend_number, TOX_MESSAGE_TYPE type, const uint8_t *message, size_t length,
-                       void *user_data)
-{
-    char *default_msg = "YOU are using the old Message format! this is not supported!";
-    tox_friend_send_message(tox, friend_number, type, (uint8_t *) default_msg, strlen(default_msg), NULL);
+        if (done && deleting[0] == '\0') {
+            break;
+        }
 
-    toxProxyLog(2, "YOU are using the old Message: fnum=%d", friend_number);
+        if (acc->evict_names_next == acc->evict_names_count) {
+            if (evicted_at_refill == evicted) {
+                break;
+            }
+
+            evicted_at_refill = evicted;
+            spool_evict_refill(acc, dir_fd);
+
+            if (acc->evict_names_count == 0) {
+                break;
+            }
+        }
+
+        const char *name = acc->evict_names[acc->evict_names_next];
+
+        if (deleting[0] != '\0' && strncmp(name, deleting, strlen(deleting)) == 0) {
+            spool_unlink_file(acc, dir_fd, name);
+            acc->evict_names_next++;
+            continue;
+        }
+
+        deleting[0] = '\0';
+
+        if (done) {
+            break;
+        }
+
+        acc->evict_names_next++;
+        struct stat st;
+
+        if (spool_is_message_file(name) && fstatat(dir_fd, name, &st, 0) == 0) {
+            spool_unlink_file(acc, dir_fd, name);
+            snprintf(deleting, sizeof(deleting), "%s", name);
+            evicted++;
+        }
+    }
+
+    close(dir_fd);
+
+    if (acc->evict_names_next == acc->evict_names_count) {
+        spool_evict_free_names(acc);
+    }
+
+    if (evicted > 0) {
+        acc->evicted += evicted;
+        spool_total_evicted += evicted;
+        spool_quota_status_changed = true;
+        toxProxyLog(1, "spool quota: evicted %u oldest messages of %s", evicted, acc->sender_key_hex);
+    }
 }
 
-//
-// cut message at 999 chars length !!
-//
-void send_text_message_to_friend(Tox *tox, uint32_t friend_number, const char *fmt, ...)
+spool_account *spool_account_biggest(void)
 {
-    toxProxyLog(9, "sending message to friend %d", friend_number);
-    char msg2[1000];
-    CLEAR(msg2);
-    size_t length = 0;
+    spool_account *biggest = NULL;
 
-    if (fmt == NULL) {
-        toxProxyLog(9, "send_text_message_to_friend:no message to send");
-        return;
+    for (uint32_t i = 0; i < spool_accounts_size; i++) {
+        if (spool_accounts[i].used && (biggest == NULL || spool_accounts[i].bytes > biggest->bytes)) {
+            biggest = &spool_accounts[i];
+        }
     }
 
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(msg2, 999, fmt, ap);
-    va_end(ap);
-    length = (size_t) strlen(msg2);
-#ifdef TOX_HAVE_TOXUTIL
-    uint32_t ts_sec = (uint32_t) get_unix_time();
-    tox_util_friend_send_message_v2(tox, friend_number, TOX_MESSAGE_TYPE_NORMAL, ts_sec, (const uint8_t *) msg2, length,
-                                    NULL, NULL, NULL, NULL);
-#else
-    // old message format, not support by this proxy!
-    tox_friend_send_message(tox, friend_number, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *)msg2, length, NULL);
-#endif
+    return biggest;
 }
 
-void friendlist_onConnectionChange(Tox *tox, uint32_t friend_number, TOX_CONNECTION connection_status, void *user_data)
+// check if a new message of "bytes" size from this sender may be stored, evicting old messages if the
+// policy says so. returns false if the message must be rejected.
+// while the startup recovery runs the accounts are too small, so messages are only rejected then.
+bool spool_quota_admit(spool_account *acc, uint64_t bytes)
 {
+    const uint64_t max_bytes = spool_account_max_bytes(acc);
 
-    toxProxyLog(2, "friendlist_onConnectionChange:*READY*:friendnum=%d %d", (int) friend_number, (int) connection_status);
+    if (acc->bytes + bytes > max_bytes || acc->messages + 1 > SPOOL_QUOTA_SENDER_MAX_MESSAGES) {
+        if (SPOOL_QUOTA_POLICY_DEFAULT == SPOOL_QUOTA_POLICY_OLDEST_FIRST && spool_quota_ready) {
+            spool_evict_oldest(acc, (max_bytes * SPOOL_QUOTA_EVICT_TO_PERCENT) / 100,
+                               (uint32_t)(((uint64_t)SPOOL_QUOTA_SENDER_MAX_MESSAGES * SPOOL_QUOTA_EVICT_TO_PERCENT) / 100));
+        }
 
-    if (is_master_friendnumber(tox, friend_number)) {
-        if (connection_status != TOX_CONNECTION_NONE) {
-            toxProxyLog(2, "master is online, send him all cached unsent messages");
-            masterIsOnline = true;
-        } else {
-            toxProxyLog(2, "master went offline, don't send him any more messages.");
-            masterIsOnline = false;
+        if (acc->bytes + bytes > max_bytes || acc->messages + 1 > SPOOL_QUOTA_SENDER_MAX_MESSAGES) {
+            return false;
         }
     }
-}
 
-void self_connection_status_cb(Tox *tox, TOX_CONNECTION connection_status, void *user_data)
-{
-    switch (connection_status) {
-        case TOX_CONNECTION_NONE:
-            toxProxyLog(2, "Connection Status changed to: Offline");
-            my_connection_status = TOX_CONNECTION_NONE;
-            on_offline();
-            break;
+    if (spool_total_bytes + bytes > SPOOL_QUOTA_GLOBAL_MAX_BYTES
+            || spool_total_messages + 1 > SPOOL_QUOTA_GLOBAL_MAX_MESSAGES) {
+        if (SPOOL_QUOTA_POLICY_DEFAULT == SPOOL_QUOTA_POLICY_OLDEST_FIRST && spool_quota_ready) {
+            // take the space from whoever stores the most
+            const uint64_t target_bytes = (SPOOL_QUOTA_GLOBAL_MAX_BYTES * SPOOL_QUOTA_EVICT_TO_PERCENT) / 100;
+            const uint32_t target_messages = (uint32_t)(((uint64_t)SPOOL_QUOTA_GLOBAL_MAX_MESSAGES *
+                                             SPOOL_QUOTA_EVICT_TO_PERCENT) / 100);
 
-        case TOX_CONNECTION_TCP:
-            toxProxyLog(2, "Connection Status changed to: Online via TCP");
-            my_connection_status = TOX_CONNECTION_TCP;
-            on_online();
-            break;
+            for (int round = 0; round < 16; round++) {
+                if (spool_total_bytes <= target_bytes && spool_total_messages <= target_messages) {
+                    break;
+                }
 
-        case TOX_CONNECTION_UDP:
-            toxProxyLog(2, "Connection Status changed to: Online via UDP");
-            my_connection_status = TOX_CONNECTION_UDP;
-            on_online();
-            break;
+                spool_account *biggest = spool_account_biggest();
+
+                if (biggest == NULL || biggest->messages == 0) {
+                    break;
+                }
+
+                // take what is over the limit, but at most half of what the biggest sender has per round
+                const uint64_t over_bytes = (spool_total_bytes > target_bytes) ? (spool_total_bytes - target_bytes) : 0;
+                const uint32_t over_messages = (spool_total_messages > target_messages) ?
+                                               (spool_total_messages - target_messages) : 0;
+                const uint64_t keep_bytes = (biggest->bytes > over_bytes) ? (biggest->bytes - over_bytes) : 0;
+                const uint32_t keep_messages = (biggest->messages > over_messages) ? (biggest->messages - over_messages) : 0;
+                spool_evict_oldest(biggest, (keep_bytes > biggest->bytes / 2) ? keep_bytes : (biggest->bytes / 2),
+                                   (keep_messages > biggest->messages / 2) ? keep_messages : (biggest->messages / 2));
+            }
+        }
+
+        if (spool_total_bytes + bytes > SPOOL_QUOTA_GLOBAL_MAX_BYTES
+                || spool_total_messages + 1 > SPOOL_QUOTA_GLOBAL_MAX_MESSAGES) {
+            return false;
+        }
     }
+
+    return true;
 }
 
-void conference_invite_cb(Tox *tox, uint32_t friend_number, TOX_CONFERENCE_TYPE type, const uint8_t *cookie,
-                          size_t length, void *user_data)
+// ----------- spool quotas -----------
+
+// ----------- kill switch -----------
+// the kill switch removes everything the proxy knows: the tox identity and the master in ./db,
+// the spool (also ./messages_damaged), the logs and the push token.
+// first the hook scripts are killed and the spool recovery and dictionary training threads are stopped,
+// nothing else writes into what is wiped. then kill_switch_marker_filename is written and synced, on the
+// next start a wipe that got interrupted is finished with all its steps before anything else is loaded.
+// the small files with secrets are overwritten before they are unlinked. the spool is first renamed
+// to msgsWipeDir, so it is gone at once, then removed by KILL_SWITCH_WIPE_THREADS threads, each taking
+// whole sender dirs. the marker is removed last and only when all wiped dirs are gone, the process only
+// exits after syncfs() said everything is on disk.
+
+typedef struct kill_switch_wipe_job {
+    int dir_fd;
+    char **names;
+    size_t names_count;
+    size_t next;
+    pthread_mutex_t lock;
+} kill_switch_wipe_job;
+
+typedef struct kill_switch_wipe_worker {
+    kill_switch_wipe_job *job;
+    uint64_t removed;
+} kill_switch_wipe_worker;
+
+// remove a file or a whole dir tree, returns the number of files removed
+uint64_t kill_switch_remove_tree(int parent_fd, const char *name, unsigned char d_type)
 {
-    if (!is_master_friendnumber(tox, friend_number)) {
-        toxProxyLog(0, "received conference invite from somebody who's not master!");
-        return;
+    if (d_type != DT_DIR && unlinkat(parent_fd, name, 0) == 0) {
+        return 1;
     }
 
-    toxProxyLog(0, "received conference invite from fnum:%d", friend_number);
-    long conference_num = tox_conference_join(tox, friend_number, cookie, length, NULL);
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    DIR *dfd = (fd >= 0) ? fdopendir(fd) : NULL;
+    uint64_t removed = 0;
 
-    toxProxyLog(0, "received conference join: res=%d", (int)conference_num);
+    if (dfd == NULL) {
+        if (fd >= 0) {
+            close(fd);
+        }
 
-    updateToxSavedata(tox);
+        return 0;
+    }
+
+    struct dirent *dp = NULL;
+
+    while ((dp = readdir(dfd)) != NULL) {
+        if (strcmp(dp->d_name, ".") != 0 && strcmp(dp->d_name, "..") != 0) {
+            removed += kill_switch_remove_tree(dirfd(dfd), dp->d_name, dp->d_type);
+        }
+    }
+
+    closedir(dfd);
+    unlinkat(parent_fd, name, AT_REMOVEDIR);
+    return removed;
 }
 
-void conference_message_cb(Tox *tox, uint32_t conference_number, uint32_t peer_number, TOX_MESSAGE_TYPE type,
-                           const uint8_t *message, size_t length, void *user_data)
+void *kill_switch_wipe_thread(void *data)
 {
-    toxProxyLog(0, "received conference text message conf:%d peer:%d", conference_number, peer_number);
+    kill_switch_wipe_worker *worker = (kill_switch_wipe_worker *)data;
+    kill_switch_wipe_job *job = worker->job;
 
-    uint8_t public_key_bin[TOX_PUBLIC_KEY_SIZE];
-    CLEAR(public_key_bin);
-    TOX_ERR_CONFERENCE_PEER_QUERY error;
-    bool res = tox_conference_peer_get_public_key(tox, conference_number, peer_number, public_key_bin, &error);
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        const size_t i = job->next++;
+        pthread_mutex_unlock(&job->lock);
 
-    if (res == false) {
-        toxProxyLog(0, "received conference from peer without pubkey?");
-        return;
-    } else {
-        char public_key_hex[tox_public_key_hex_size];
-        CLEAR(public_key_hex);
-        bin2upHex(public_key_bin, tox_public_key_size(), public_key_hex, tox_public_key_hex_size);
+        if (i >= job->names_count) {
+            break;
+        }
 
-        if (is_master(public_key_hex)) {
-            toxProxyLog(0, "received conference text message from master");
-        } else {
-            uint8_t conference_id_buffer[TOX_CONFERENCE_ID_SIZE + 1];
-            CLEAR(conference_id_buffer);
-            bool res2 = tox_conference_get_id(tox, conference_number, conference_id_buffer);
+        worker->removed += kill_switch_remove_tree(job->dir_fd, job->names[i], DT_UNKNOWN);
+    }
+
+    return NULL;
+}
+
+// remove a dir and everything in it, the entries of the dir are shared out to "threads" threads.
+// returns the number of files removed
+uint64_t kill_switch_wipe_dir(const char *path, int threads)
+{
+    DIR *dfd = opendir(path);
+
+    if (dfd == NULL) {
+        return 0;
+    }
+
+    kill_switch_wipe_job job;
+    CLEAR(job);
+    job.dir_fd = dirfd(dfd);
+    job.names_count = spool_read_sorted_names(dfd, &job.names);
+    pthread_mutex_init(&job.lock, NULL);
+
+    kill_switch_wipe_worker workers[KILL_SWITCH_WIPE_THREADS];
+    pthread_t tids[KILL_SWITCH_WIPE_THREADS];
+    bool started[KILL_SWITCH_WIPE_THREADS];
+    CLEAR(workers);
+    CLEAR(started);
+
+    if (threads > KILL_SWITCH_WIPE_THREADS) {
+        threads = KILL_SWITCH_WIPE_THREADS;
+    }
+
+    for (int t = 1; t < threads && (size_t)t < job.names_count; t++) {
+        workers[t].job = &job;
+        started[t] = (pthread_create(&tids[t], NULL, kill_switch_wipe_thread, &workers[t]) == 0);
+    }
+
+    // this thread helps, and does it all if no thread could be started
+    workers[0].job = &job;
+    kill_switch_wipe_thread(&workers[0]);
+    uint64_t removed = workers[0].removed;
+
+    for (int t = 1; t < threads; t++) {
+        if (started[t]) {
+            pthread_join(tids[t], NULL);
+            removed += workers[t].removed;
+        }
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    spool_free_names(job.names, job.names_count);
+    closedir(dfd);
+    // what the threads did not get (dot files) and the dir itself
+    removed += kill_switch_remove_tree(AT_FDCWD, path, DT_DIR);
+    return removed;
+}
+
+// overwrite a file with zeros, make that durable and unlink it
+void kill_switch_shred_file(int dir_fd, const char *name)
+{
+    int fd = openat(dir_fd, name, O_WRONLY | O_NOFOLLOW);
+    struct stat st;
+
+    if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        static const uint8_t zeros[4096];
+        off_t left = st.st_size;
+
+        while (left > 0) {
+            const ssize_t w = write(fd, zeros, (left < (off_t)sizeof(zeros)) ? (size_t)left : sizeof(zeros));
+
+            if (w <= 0) {
+                break;
+            }
+
+            left -= w;
+        }
+
+        fsync(fd);
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    unlinkat(dir_fd, name, 0);
+}
+
+void kill_switch_shred_dir_files(const char *path)
+{
+    DIR *dfd = opendir(path);
+
+    if (dfd == NULL) {
+        return;
+    }
+
+    struct dirent *dp = NULL;
+
+    while ((dp = readdir(dfd)) != NULL) {
+        if (dp->d_type == DT_REG || dp->d_type == DT_UNKNOWN) {
+            kill_switch_shred_file(dirfd(dfd), dp->d_name);
+        }
+    }
+
+    closedir(dfd);
+}
+
+void kill_switch_remove_logs(void)
+{
+    if (logfile) {
+        fclose(logfile);
+        logfile = NULL;
+    }
+
+#ifdef UNIQLOGFILE
+    DIR *dfd = opendir(".");
+
+    if (dfd == NULL) {
+        return;
+    }
+
+    struct dirent *dp = NULL;
+
+    while ((dp = readdir(dfd)) != NULL) {
+        const size_t len = strlen(dp->d_name);
+
+        if (strncmp(dp->d_name, "ToxProxy_", 9) == 0 && len > 4 && strcmp(dp->d_name + len - 4, ".log") == 0) {
+            unlinkat(dirfd(dfd), dp->d_name, 0);
+        }
+    }
+
+    closedir(dfd);
+#else
+    unlink(log_filename);
+#endif
+}
+
+// wait until everything done so far is on disk
+void kill_switch_sync(void)
+{
+    int fd = open(".", O_RDONLY | O_DIRECTORY);
+
+    if (fd < 0 || syncfs(fd) != 0) {
+        sync();
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool kill_switch_write_marker(void)
+{
+    int fd = open(kill_switch_marker_filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    const bool ok = (fsync(fd) == 0);
+    close(fd);
+    // the new dir entry too
+    kill_switch_sync();
+    return ok;
+}
+
+// the dirs the wipe removes are all gone
+bool kill_switch_all_gone(void)
+{
+    const char *dirs[] = {msgsDir, msgsWipeDir, msgsDamagedDir, filesDir, "./db"};
+    struct stat st;
+
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+        if (lstat(dirs[i], &st) == 0 || errno != ENOENT) {
+            toxProxyLog(0, "kill switch: %s is still there, the wipe is done again on the next start", dirs[i]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// all steps of the wipe, the marker is removed when they are done. returns the number of spool files removed
+uint64_t kill_switch_wipe_data(void)
+{
+    push_tokens_wipe();
+
+    rename(msgsDir, msgsWipeDir);
+
+    // the tox identity (savedata), the master and everything else in ./db
+    kill_switch_shred_dir_files("./db");
+    kill_switch_remove_tree(AT_FDCWD, "./db", DT_DIR);
+#ifndef USE_SEPARATE_SAVEDATA_FILE
+    kill_switch_shred_file(AT_FDCWD, database_filename);
+#endif
+#ifdef WRITE_MY_TOXID_TO_FILE
+    kill_switch_shred_file(AT_FDCWD, my_toxid_filename_txt);
+#endif
+    kill_switch_sync();
+    toxProxyLog(2, "kill switch: identity removed, wiping the spool");
+
+    // msgsDir is still there if the rename failed
+    uint64_t removed = kill_switch_wipe_dir(msgsWipeDir, KILL_SWITCH_WIPE_THREADS);
+    removed += kill_switch_wipe_dir(msgsDir, KILL_SWITCH_WIPE_THREADS);
+    removed += kill_switch_wipe_dir(msgsDamagedDir, KILL_SWITCH_WIPE_THREADS);
+    removed += kill_switch_wipe_dir(filesDir, KILL_SWITCH_WIPE_THREADS);
+
+    kill_switch_remove_logs();
+    kill_switch_sync();
+
+    if (kill_switch_all_gone()) {
+        unlink(kill_switch_marker_filename);
+        kill_switch_sync();
+    }
+
+    return removed;
+}
+
+// finish a kill switch wipe that was interrupted, before the identity or the spool are loaded
+void kill_switch_finish_interrupted(void)
+{
+    struct stat st;
+
+    // msgsWipeDir without the marker is left by a wipe of a version without it
+    if (stat(kill_switch_marker_filename, &st) == 0 || stat(msgsWipeDir, &st) == 0) {
+        const uint64_t removed = kill_switch_wipe_data();
+        // the log was removed too, this is the start of a new one
+        openLogFile();
+        toxProxyLog(1, "kill switch: finished an interrupted wipe, removed %llu files", (unsigned long long)removed);
+    }
+}
+
+void killSwitch() __attribute__((noreturn));
+
+void killSwitch()
+{
+    toxProxyLog(2, "got killSwitch command, deleting all data");
+
+    // nothing else may write into what is wiped, or still use the key
+    hooks_kill_all();
+    spool_recovery_stop();
+    spool_zstd_train_stop();
+
+    sodium_memzero(spool_crypt_key, sizeof(spool_crypt_key));
+    spool_crypt_enabled = false;
+
+    if (!kill_switch_write_marker()) {
+        toxProxyLog(0, "kill switch: can not write %s, an interrupted wipe will not be finished",
+                    kill_switch_marker_filename);
+    }
+
+    kill_switch_wipe_data();
+    tox_loop_running = 0;
+    exit(0);
+}
+// ----------- kill switch -----------
+
+// ----------- spool encryption -----------
+// with a passphrase in SPOOL_CRYPT_PASSPHRASE_ENV the stored messages and files, the savedata and the compression
+// dictionary are encrypted at rest. the key is derived with crypto_pwhash() from the passphrase and the
+// salt in spool_key_filename, which also has a hash of the key to notice a wrong passphrase:
+// [SPOOL_CRYPT_KEY_MAGIC][salt 16][opslimit u32][memlimit u32][check 32]
+// an encrypted file is one crypto_secretstream (xchacha20poly1305) of chunks of SPOOL_CRYPT_CHUNK_SIZE,
+// the last one tagged FINAL, so a cut off file doesn't decrypt:
+// [SPOOL_CRYPT_MAGIC][stream header 24][chunk + 17 bytes tag/mac]...
+// encryption goes around compression. a friend picks the bytes of its messages, so a stored message is
+// not taken for encrypted by its first bytes: with the passphrase all of them are encrypted, except the
+// ones stored before it was set. spool_plain_filename is there until the startup recovery has encrypted
+// those, until then a message that does not decrypt is taken as plain.
+// the files the proxy writes for itself never start with SPOOL_CRYPT_MAGIC when they are plain, they are
+// still read when they are not encrypted.
+#define SPOOL_CRYPT_MAGIC "TPe1"
+#define SPOOL_CRYPT_HEADER_SIZE (4 + crypto_secretstream_xchacha20poly1305_HEADERBYTES)
+#define SPOOL_CRYPT_CHUNK_SIZE 4096
+#define SPOOL_CRYPT_KEY_MAGIC "TPk1"
+#define SPOOL_CRYPT_KEY_FILE_SIZE (4 + crypto_pwhash_SALTBYTES + 4 + 4 + crypto_generichash_BYTES)
+
+bool spool_crypt_key_check(const uint8_t *key, uint8_t *check)
+{
+    const char *context = "ToxProxy spool key check";
+    return crypto_generichash(check, crypto_generichash_BYTES, (const uint8_t *)context, strlen(context),
+                              key, crypto_secretstream_xchacha20poly1305_KEYBYTES) == 0;
+}
+
+// derive the key if there is a passphrase.
+// returns false if the proxy must not start: wrong passphrase, or encrypted data and no passphrase.
+bool spool_crypt_init(void)
+{
+    if (sodium_init() < 0) {
+        toxProxyLog(0, "spool encryption: sodium_init failed");
+        return false;
+    }
+
+    char *passphrase = getenv(SPOOL_CRYPT_PASSPHRASE_ENV);
+    uint8_t key_file[SPOOL_CRYPT_KEY_FILE_SIZE];
+    FILE *f = fopen(spool_key_filename, "rb");
+    const bool have_key_file = f && fread(key_file, sizeof(key_file), 1, f) == 1
+                               && memcmp(key_file, SPOOL_CRYPT_KEY_MAGIC, 4) == 0;
+
+    if (f) {
+        fclose(f);
+    }
+
+    if (passphrase == NULL || passphrase[0] == '\0') {
+        if (have_key_file) {
+            toxProxyLog(0, "spool encryption: the spool is encrypted, %s must have the passphrase", SPOOL_CRYPT_PASSPHRASE_ENV);
+            return false;
+        }
+
+        return true;
+    }
+
+    if (!have_key_file) {
+        memcpy(key_file, SPOOL_CRYPT_KEY_MAGIC, 4);
+        randombytes_buf(key_file + 4, crypto_pwhash_SALTBYTES);
+        put_u32_be(key_file + 4 + crypto_pwhash_SALTBYTES, crypto_pwhash_OPSLIMIT_INTERACTIVE);
+        put_u32_be(key_file + 4 + crypto_pwhash_SALTBYTES + 4, crypto_pwhash_MEMLIMIT_INTERACTIVE);
+    }
+
+    uint8_t *check = key_file + 4 + crypto_pwhash_SALTBYTES + 4 + 4;
+    uint8_t new_check[crypto_generichash_BYTES];
+    sodium_mlock(spool_crypt_key, sizeof(spool_crypt_key));
+    const int res = crypto_pwhash(spool_crypt_key, sizeof(spool_crypt_key), passphrase, strlen(passphrase),
+                                  key_file + 4, get_u32_be(key_file + 4 + crypto_pwhash_SALTBYTES),
+                                  get_u32_be(key_file + 4 + crypto_pwhash_SALTBYTES + 4), crypto_pwhash_ALG_ARGON2ID13);
+    // keep it out of /proc/<pid>/environ
+    sodium_memzero(passphrase, strlen(passphrase));
+    unsetenv(SPOOL_CRYPT_PASSPHRASE_ENV);
+
+    if (res != 0 || !spool_crypt_key_check(spool_crypt_key, new_check)) {
+        toxProxyLog(0, "spool encryption: can not derive the key");
+        return false;
+    }
+
+    if (have_key_file && sodium_memcmp(check, new_check, sizeof(new_check)) != 0) {
+        sodium_memzero(spool_crypt_key, sizeof(spool_crypt_key));
+        toxProxyLog(0, "spool encryption: wrong passphrase");
+        return false;
+    }
+
+    if (!have_key_file) {
+        memcpy(check, new_check, sizeof(new_check));
+        // before the key file, a crash in between must not leave plain messages that are taken as encrypted
+        f = fopen(spool_plain_filename, "wb");
+
+        if (f == NULL || fclose(f) != 0) {
+            toxProxyLog(0, "spool encryption: can not write %s", spool_plain_filename);
+            return false;
+        }
+
+        f = fopen(spool_key_filename, "wb");
+
+        if (f == NULL || fwrite(key_file, sizeof(key_file), 1, f) != 1) {
+            toxProxyLog(0, "spool encryption: can not write %s", spool_key_filename);
+
+            if (f) {
+                fclose(f);
+            }
+
+            return false;
+        }
+
+        fclose(f);
+    }
+
+    spool_crypt_enabled = true;
+    spool_crypt_plain_left = (access(spool_plain_filename, F_OK) == 0);
+    toxProxyLog(2, "spool encryption: on%s", spool_crypt_plain_left ? ", plain stored messages are left" : "");
+    return true;
+}
+
+size_t spool_crypt_size(size_t length)
+{
+    const size_t chunks = (length == 0) ? 1 : ((length + SPOOL_CRYPT_CHUNK_SIZE - 1) / SPOOL_CRYPT_CHUNK_SIZE);
+    return SPOOL_CRYPT_HEADER_SIZE + length + chunks * crypto_secretstream_xchacha20poly1305_ABYTES;
+}
+
+bool spool_is_encrypted(const uint8_t *data, size_t length)
+{
+    return length >= spool_crypt_size(0) && memcmp(data, SPOOL_CRYPT_MAGIC, 4) == 0;
+}
+
+// encrypt data with the spool key. returns the size of *out (the caller frees it), or 0 if that failed
+size_t spool_encrypt(const uint8_t *data, size_t length, uint8_t **out)
+{
+    const size_t out_length = spool_crypt_size(length);
+    uint8_t *buf = calloc(1, out_length);
+
+    if (buf == NULL) {
+        return 0;
+    }
+
+    crypto_secretstream_xchacha20poly1305_state st;
+    memcpy(buf, SPOOL_CRYPT_MAGIC, 4);
+    crypto_secretstream_xchacha20poly1305_init_push(&st, buf + 4, spool_crypt_key);
+    uint8_t *c = buf + SPOOL_CRYPT_HEADER_SIZE;
+    size_t done = 0;
+
+    do {
+        const size_t chunk = (length - done > SPOOL_CRYPT_CHUNK_SIZE) ? SPOOL_CRYPT_CHUNK_SIZE : (length - done);
+        const bool last = (done + chunk == length);
+        unsigned long long clen = 0;
+        crypto_secretstream_xchacha20poly1305_push(&st, c, &clen, data + done, chunk, NULL, 0,
+                last ? crypto_secretstream_xchacha20poly1305_TAG_FINAL : crypto_secretstream_xchacha20poly1305_TAG_MESSAGE);
+        c += clen;
+        done += chunk;
+    } while (done < length);
+
+    sodium_memzero(&st, sizeof(st));
+    *out = buf;
+    return out_length;
+}
+
+// decrypt what spool_encrypt() made, chunk by chunk straight into the returned buffer (the caller frees it).
+// returns NULL if it is damaged, cut off or was encrypted with another key
+uint8_t *spool_decrypt(const uint8_t *data, size_t length, size_t *out_length)
+{
+    if (!spool_crypt_enabled || !spool_is_encrypted(data, length)) {
+        return NULL;
+    }
+
+    const size_t stream_length = length - SPOOL_CRYPT_HEADER_SIZE;
+    const size_t chunk_size = SPOOL_CRYPT_CHUNK_SIZE + crypto_secretstream_xchacha20poly1305_ABYTES;
+    const size_t chunks = (stream_length + chunk_size - 1) / chunk_size;
+
+    if (stream_length - (chunks - 1) * chunk_size < crypto_secretstream_xchacha20poly1305_ABYTES) {
+        return NULL;
+    }
+
+    const size_t plain_length = stream_length - chunks * crypto_secretstream_xchacha20poly1305_ABYTES;
+    // +1 so there is something to allocate for an empty message
+    uint8_t *plain = calloc(1, plain_length + 1);
+
+    if (plain == NULL) {
+        return NULL;
+    }
+
+    crypto_secretstream_xchacha20poly1305_state st;
+    bool ok = (crypto_secretstream_xchacha20poly1305_init_pull(&st, data + 4, spool_crypt_key) == 0);
+    const uint8_t *c = data + SPOOL_CRYPT_HEADER_SIZE;
+    size_t done = 0;
+
+    for (size_t i = 0; ok && i < chunks; i++) {
+        const size_t clen = (i + 1 < chunks) ? chunk_size : (stream_length - i * chunk_size);
+        unsigned long long mlen = 0;
+        uint8_t tag = 0;
+        ok = (crypto_secretstream_xchacha20poly1305_pull(&st, plain + done, &mlen, &tag, c, clen, NULL, 0) == 0)
+             && ((tag == crypto_secretstream_xchacha20poly1305_TAG_FINAL) == (i + 1 == chunks));
+        c += clen;
+        done += (size_t)mlen;
+    }
+
+    sodium_memzero(&st, sizeof(st));
+
+    if (!ok) {
+        free(plain);
+        return NULL;
+    }
+
+    *out_length = plain_length;
+    return plain;
+}
+
+// read a whole file of at most max_size bytes as it is.
+// returns NULL if it can't be read, otherwise the data (the caller frees it) and its size in *length
+uint8_t *spool_read_file(const char *path, size_t max_size, size_t *length)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || st.st_size < 1 || (size_t)st.st_size > max_size) {
+        close(fd);
+        return NULL;
+    }
+
+    const size_t file_size = (size_t)st.st_size;
+    uint8_t *data = calloc(1, file_size);
+
+    if (data == NULL || read(fd, data, file_size) != (ssize_t)file_size) {
+        close(fd);
+        free(data);
+        return NULL;
+    }
+
+    close(fd);
+    *length = file_size;
+    return data;
+}
+
+// read a whole file the proxy writes for itself of at most max_size bytes and decrypt it if it is encrypted.
+// returns NULL if it can't be read or decrypted, otherwise the data (the caller frees it) and its size in *length.
+// *was_encrypted (if not NULL) tells if the file was encrypted
+uint8_t *spool_crypt_read_file(const char *path, size_t max_size, size_t *length, bool *was_encrypted)
+{
+    size_t file_size = 0;
+    uint8_t *data = spool_read_file(path, max_size, &file_size);
+
+    if (data == NULL) {
+        return NULL;
+    }
+
+    const bool encrypted = spool_is_encrypted(data, file_size);
+
+    if (was_encrypted) {
+        *was_encrypted = encrypted;
+    }
+
+    if (!encrypted) {
+        *length = file_size;
+        return data;
+    }
+
+    uint8_t *plain = spool_decrypt(data, file_size, length);
+
+    if (plain == NULL) {
+        toxProxyLog(0, "spool encryption: can not decrypt %s%s", path, spool_crypt_enabled ? "" : " (no passphrase)");
+    }
+
+    free(data);
+    return plain;
+}
+
+// write a file through tmp_path, encrypted if encryption is on
+bool spool_crypt_write_file(const char *tmp_path, const char *path, const uint8_t *data, size_t length)
+{
+    uint8_t *encrypted = NULL;
+
+    if (spool_crypt_enabled) {
+        length = spool_encrypt(data, length, &encrypted);
+        data = encrypted;
+
+        if (encrypted == NULL) {
+            return false;
+        }
+    }
+
+    FILE *f = fopen(tmp_path, "wb");
+    bool ok = false;
+
+    if (f) {
+        ok = (fwrite(data, length, 1, f) == 1);
+        ok = (fclose(f) == 0) && ok;
+    }
+
+    free(encrypted);
+
+    if (!ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return false;
+    }
+
+    return true;
+}
+// ----------- spool encryption -----------
+
+// ----------- spool compression -----------
+// a compressed stored message is [SPOOL_ZSTD_MAGIC][raw length u32][zstd frame], its name has
+// SPOOL_ZSTD_NAME_MARK right after the receive time (a friend picks the bytes of its messages, so they
+// don't tell). every other file is the raw messageV2 data like before.
+#define SPOOL_ZSTD_MAGIC "TPz1"
+#define SPOOL_ZSTD_HEADER_SIZE 8
+#define SPOOL_ZSTD_NAME_MARK "z"
+// sanity limit for the raw length in the header
+#define SPOOL_MAX_MESSAGE_SIZE (64 * 1024)
+
+#ifdef HAVE_ZSTD
+ZSTD_CCtx *spool_zstd_cctx = NULL;
+ZSTD_DCtx *spool_zstd_dctx = NULL;
+ZSTD_CDict *spool_zstd_cdict = NULL;
+ZSTD_DDict *spool_zstd_ddict = NULL;
+uint32_t spool_zstd_dict_id = 0;
+time_t spool_zstd_train_check_ts = 0;
+
+typedef struct spool_zstd_training {
+    // reading samples, see spool_zstd_maybe_train()
+    bool reading;
+    DIR *dfd_m;
+    DIR *dfd;
+    char dir_name[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+    uint8_t *samples;
+    size_t *sample_sizes;
+    size_t samples_used;
+    uint32_t samples_count;
+    // the thread is training, it sets done (under lock) when dict_size is there
+    bool training;
+    pthread_t tid;
+    pthread_mutex_t lock;
+    bool done;
+    uint8_t *dict;
+    size_t dict_size;
+} spool_zstd_training;
+
+spool_zstd_training spool_zstd_train = {0};
+
+void spool_zstd_load_dict(void)
+{
+    size_t dict_size = 0;
+    bool was_encrypted = false;
+    uint8_t *dict = spool_crypt_read_file(spool_dict_filename, spool_crypt_size(SPOOL_ZSTD_DICT_SIZE), &dict_size,
+                                          &was_encrypted);
+
+    if (dict == NULL) {
+        return;
+    }
+
+    // it is made from stored messages
+    if (spool_crypt_enabled && !was_encrypted) {
+        spool_crypt_write_file(spool_dict_tmp_filename, spool_dict_filename, dict, dict_size);
+    }
+
+    if (dict_size > 0) {
+        spool_zstd_cdict = ZSTD_createCDict(dict, dict_size, SPOOL_ZSTD_LEVEL);
+        spool_zstd_ddict = ZSTD_createDDict(dict, dict_size);
+        spool_zstd_dict_id = (uint32_t)ZDICT_getDictID(dict, dict_size);
+    }
+
+    free(dict);
+
+    if (spool_zstd_cdict == NULL || spool_zstd_ddict == NULL || spool_zstd_dict_id == 0) {
+        toxProxyLog(0, "spool compression: can not use dictionary %s", spool_dict_filename);
+        ZSTD_freeCDict(spool_zstd_cdict);
+        ZSTD_freeDDict(spool_zstd_ddict);
+        spool_zstd_cdict = NULL;
+        spool_zstd_ddict = NULL;
+        spool_zstd_dict_id = 0;
+        return;
+    }
+
+    toxProxyLog(2, "spool compression: using dictionary %u (%d bytes)", spool_zstd_dict_id, (int)dict_size);
+}
+
+bool spool_zstd_init(void)
+{
+    if (spool_zstd_cctx == NULL) {
+        spool_zstd_cctx = ZSTD_createCCtx();
+        spool_zstd_dctx = ZSTD_createDCtx();
+        spool_zstd_load_dict();
+    }
+
+    return (spool_zstd_cctx != NULL) && (spool_zstd_dctx != NULL);
+}
+#endif
+
+// compress a message for the spool, if that makes it smaller.
+// returns the size of *out (the caller frees it), or 0 if the message should be stored as it is.
+size_t spool_compress(const uint8_t *data, size_t length, uint8_t **out)
+{
+#ifdef HAVE_ZSTD
+
+    if (length < SPOOL_COMPRESS_MIN_BYTES || length > SPOOL_MAX_MESSAGE_SIZE || !spool_zstd_init()) {
+        return 0;
+    }
+
+    const size_t bound = SPOOL_ZSTD_HEADER_SIZE + ZSTD_compressBound(length);
+    uint8_t *buf = calloc(1, bound);
+
+    if (buf == NULL) {
+        return 0;
+    }
+
+    size_t res;
+
+    if (spool_zstd_cdict) {
+        res = ZSTD_compress_usingCDict(spool_zstd_cctx, buf + SPOOL_ZSTD_HEADER_SIZE, bound - SPOOL_ZSTD_HEADER_SIZE,
+                                       data, length, spool_zstd_cdict);
+    } else {
+        res = ZSTD_compressCCtx(spool_zstd_cctx, buf + SPOOL_ZSTD_HEADER_SIZE, bound - SPOOL_ZSTD_HEADER_SIZE,
+                                data, length, SPOOL_ZSTD_LEVEL);
+    }
+
+    if (ZSTD_isError(res) || (SPOOL_ZSTD_HEADER_SIZE + res) >= length) {
+        free(buf);
+        return 0;
+    }
+
+    memcpy(buf, SPOOL_ZSTD_MAGIC, 4);
+    put_u32_be(buf + 4, (uint32_t)length);
+    *out = buf;
+    return SPOOL_ZSTD_HEADER_SIZE + res;
+#else
+    return 0;
+#endif
+}
+
+// read a stored message (decrypted and decompressed if needed).
+// returns NULL if it can't be read, otherwise the data (the caller frees it) and its size in *length
+uint8_t *spool_read_message(const char *path, size_t *length)
+{
+    size_t file_size = 0;
+    uint8_t *data = spool_read_file(path, spool_crypt_size(SPOOL_ZSTD_HEADER_SIZE + SPOOL_MAX_MESSAGE_SIZE),
+                                    &file_size);
+
+    if (data == NULL) {
+        return NULL;
+    }
+
+    if (spool_crypt_enabled) {
+        size_t plain_size = 0;
+        uint8_t *plain = spool_decrypt(data, file_size, &plain_size);
+
+        if (plain != NULL) {
+            free(data);
+            data = plain;
+            file_size = plain_size;
+        } else if (!spool_crypt_plain_left) {
+            toxProxyLog(0, "spool encryption: can not decrypt %s", path);
+            free(data);
+            return NULL;
+        }
+
+        // otherwise stored before there was a passphrase, the startup recovery encrypts it
+    }
+
+    const char *name = strrchr(path, '/');
+
+    if (!spool_name_is_compressed((name != NULL) ? (name + 1) : path)) {
+        *length = file_size;
+        return data;
+    }
+
+#ifdef HAVE_ZSTD
+    const uint32_t raw_length = get_u32_be(data + 4);
+    const uint8_t *frame = data + SPOOL_ZSTD_HEADER_SIZE;
+    const size_t frame_size = file_size - SPOOL_ZSTD_HEADER_SIZE;
+    uint8_t *raw = (file_size > SPOOL_ZSTD_HEADER_SIZE && memcmp(data, SPOOL_ZSTD_MAGIC, 4) == 0 && raw_length > 0
+                    && raw_length <= SPOOL_MAX_MESSAGE_SIZE) ? calloc(1, raw_length) : NULL;
+
+    if (raw && spool_zstd_init()) {
+        const unsigned frame_dict_id = ZSTD_getDictID_fromFrame(frame, frame_size);
+        size_t res;
+
+        if (frame_dict_id == 0) {
+            res = ZSTD_decompressDCtx(spool_zstd_dctx, raw, raw_length, frame, frame_size);
+        } else if (frame_dict_id == spool_zstd_dict_id) {
+            res = ZSTD_decompress_usingDDict(spool_zstd_dctx, raw, raw_length, frame, frame_size, spool_zstd_ddict);
+        } else {
+            toxProxyLog(0, "spool compression: %s needs dictionary %u, we have %u", path, frame_dict_id, spool_zstd_dict_id);
+            res = (size_t) -1;
+        }
+
+        if (!ZSTD_isError(res) && res == raw_length) {
+            free(data);
+            *length = raw_length;
+            return raw;
+        }
+    }
+
+    free(raw);
+    toxProxyLog(0, "spool compression: can not decompress %s", path);
+#else
+    toxProxyLog(0, "spool: %s is compressed, but this ToxProxy is built without zstd", path);
+#endif
+    free(data);
+    return NULL;
+}
+
+#ifdef HAVE_ZSTD
+void *spool_zstd_train_thread(void *data)
+{
+    spool_zstd_training *t = (spool_zstd_training *)data;
+    const size_t dict_size = ZDICT_trainFromBuffer(t->dict, SPOOL_ZSTD_DICT_SIZE, t->samples, t->sample_sizes,
+                             t->samples_count);
+
+    pthread_mutex_lock(&t->lock);
+    t->dict_size = dict_size;
+    t->done = true;
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+void spool_zstd_train_free(spool_zstd_training *t)
+{
+    if (t->dfd != NULL) {
+        closedir(t->dfd);
+    }
+
+    if (t->dfd_m != NULL) {
+        closedir(t->dfd_m);
+    }
+
+    free(t->samples);
+    free(t->sample_sizes);
+    free(t->dict);
+    CLEAR(*t);
+}
+
+// read samples until deadline. returns true when there are no more to read
+bool spool_zstd_train_read(spool_zstd_training *t, uint64_t deadline)
+{
+    while (t->samples_count < SPOOL_ZSTD_DICT_MAX_SAMPLES) {
+        if (get_monotonic_usec() >= deadline) {
+            return false;
+        }
+
+        struct dirent *dp = NULL;
+
+        if (t->dfd == NULL || (dp = readdir(t->dfd)) == NULL) {
+            if (t->dfd != NULL) {
+                closedir(t->dfd);
+                t->dfd = NULL;
+            }
+
+            struct dirent *dp_m = readdir(t->dfd_m);
+
+            if (dp_m == NULL) {
+                return true;
+            }
+
+            if (dp_m->d_name[0] != '.' && strlen(dp_m->d_name) < sizeof(t->dir_name)) {
+                snprintf(t->dir_name, sizeof(t->dir_name), "%s", dp_m->d_name);
+                const int fd = openat(dirfd(t->dfd_m), t->dir_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                t->dfd = (fd >= 0) ? fdopendir(fd) : NULL;
+
+                if (t->dfd == NULL && fd >= 0) {
+                    close(fd);
+                }
+            }
+
+            continue;
+        }
+
+        if (!spool_is_message_file(dp->d_name)) {
+            continue;
+        }
+
+        char msgPath[strlen(msgsDir) + 1 + sizeof(t->dir_name) + 1 + strlen(dp->d_name) + 1];
+        snprintf(msgPath, sizeof(msgPath), "%s/%s/%s", msgsDir, t->dir_name, dp->d_name);
+        size_t length = 0;
+        uint8_t *data = spool_read_message(msgPath, &length);
+
+        if (data && (t->samples_used + length) <= SPOOL_ZSTD_DICT_MAX_SAMPLE_BYTES) {
+            memcpy(t->samples + t->samples_used, data, length);
+            t->samples_used += length;
+            t->sample_sizes[t->samples_count] = length;
+            t->samples_count++;
+        }
+
+        free(data);
+    }
+
+    return true;
+}
+#endif
+
+// the kill switch: wait for a training that runs, and forget the samples
+void spool_zstd_train_stop(void)
+{
+#ifdef HAVE_ZSTD
+    spool_zstd_training *t = &spool_zstd_train;
+
+    if (t->training) {
+        pthread_join(t->tid, NULL);
+        pthread_mutex_destroy(&t->lock);
+    }
+
+    if (t->samples != NULL) {
+        sodium_memzero(t->samples, t->samples_used);
+    }
+
+    spool_zstd_train_free(t);
+#endif
+}
+
+// train the dictionary for stored messages once the spool has enough of them. short and repetitive chat
+// lines (conference lines all start with a hex pubkey) compress a lot better with a dictionary of the same
+// kind of data. the dictionary is never replaced, files compressed with it need it to be read.
+// the samples are read in slices of SPOOL_ZSTD_TRAIN_SLICE_USEC, the training runs on a thread.
+void spool_zstd_maybe_train(void)
+{
+#ifdef HAVE_ZSTD
+    spool_zstd_training *t = &spool_zstd_train;
+
+    if (t->training) {
+        pthread_mutex_lock(&t->lock);
+        const bool done = t->done;
+        pthread_mutex_unlock(&t->lock);
+
+        if (!done) {
+            return;
+        }
+
+        pthread_join(t->tid, NULL);
+        pthread_mutex_destroy(&t->lock);
+
+        if (ZDICT_isError(t->dict_size)) {
+            toxProxyLog(1, "spool compression: training the dictionary failed: %s", ZDICT_getErrorName(t->dict_size));
+        } else if (spool_crypt_write_file(spool_dict_tmp_filename, spool_dict_filename, t->dict, t->dict_size)) {
+            toxProxyLog(2, "spool compression: trained dictionary from %u messages", t->samples_count);
+            spool_zstd_load_dict();
+        }
+
+        spool_zstd_train_free(t);
+        return;
+    }
+
+    if (t->reading) {
+        if (!spool_zstd_train_read(t, get_monotonic_usec() + SPOOL_ZSTD_TRAIN_SLICE_USEC)) {
+            return;
+        }
+
+        closedir(t->dfd_m);
+        t->dfd_m = NULL;
+        t->reading = false;
+
+        if (t->samples_count < SPOOL_ZSTD_DICT_MIN_SAMPLES || (t->dict = calloc(1, SPOOL_ZSTD_DICT_SIZE)) == NULL
+                || pthread_mutex_init(&t->lock, NULL) != 0) {
+            spool_zstd_train_free(t);
+            return;
+        }
+
+        if (pthread_create(&t->tid, NULL, spool_zstd_train_thread, t) != 0) {
+            pthread_mutex_destroy(&t->lock);
+            spool_zstd_train_free(t);
+            return;
+        }
+
+        t->training = true;
+        return;
+    }
+
+    const time_t now = get_unix_time();
+
+    if (spool_zstd_cdict != NULL || now < spool_zstd_train_check_ts || !spool_zstd_init()) {
+        return;
+    }
+
+    spool_zstd_train_check_ts = now + SPOOL_ZSTD_TRAIN_CHECK_SECS;
+
+    if (spool_total_messages < SPOOL_ZSTD_DICT_MIN_SAMPLES || access(spool_dict_filename, F_OK) == 0) {
+        return;
+    }
+
+    t->samples = calloc(1, SPOOL_ZSTD_DICT_MAX_SAMPLE_BYTES);
+    t->sample_sizes = calloc(SPOOL_ZSTD_DICT_MAX_SAMPLES, sizeof(size_t));
+    t->dfd_m = (t->samples && t->sample_sizes) ? opendir(msgsDir) : NULL;
+
+    if (t->dfd_m == NULL) {
+        spool_zstd_train_free(t);
+        return;
+    }
+
+    t->reading = true;
+#endif
+}
+
+// ----------- spool sequence -----------
+// every stored message gets a sequence number when it is written, the numbers only go up (for the whole
+// spool, so per sender too) and are never used twice, also not after a restart: blocks of SPOOL_SEQ_RESERVE
+// numbers are taken by writing the end of the block to spool_seq_filename before the first one is used,
+// a new run starts after the last block. the number is the start of the file name, in hex so that
+// sorting the names sorts by it: "s<seq 16 hex>_<receive time><suffix>". older files have no number
+// (seq 0) and sort before all others.
+// the receive time is local time "YYYY-MM-DD_HHMM-SS,uuuuuu" and its offset to UTC "+HHMM" (older names
+// have no offset), compressed files have SPOOL_ZSTD_NAME_MARK right after it.
+#define SPOOL_SEQ_MAGIC "TPq1"
+#define SPOOL_SEQ_PREFIX_LENGTH 18
+#define SPOOL_TIME_NAME_LENGTH 25
+#define SPOOL_TIME_OFFSET_LENGTH 5
+
+uint64_t spool_seq_next_value = 1;
+uint64_t spool_seq_reserved = 0;
+
+bool spool_seq_save(uint64_t reserved)
+{
+    uint8_t buf[4 + 8];
+    memcpy(buf, SPOOL_SEQ_MAGIC, 4);
+    put_u64_be(buf + 4, reserved);
+
+    if (!spool_crypt_write_file(spool_seq_tmp_filename, spool_seq_filename, buf, sizeof(buf))) {
+        toxProxyLog(0, "spool sequence: can not write %s", spool_seq_filename);
+        return false;
+    }
+
+    spool_seq_reserved = reserved;
+    return true;
+}
+
+void spool_seq_init(void)
+{
+    size_t length = 0;
+    bool was_encrypted = false;
+    uint8_t *data = spool_crypt_read_file(spool_seq_filename, 64, &length, &was_encrypted);
+
+    if (data != NULL && length == 12 && memcmp(data, SPOOL_SEQ_MAGIC, 4) == 0) {
+        spool_seq_next_value = get_u64_be(data + 4);
+    }
+
+    free(data);
+    spool_seq_reserved = spool_seq_next_value;
+    toxProxyLog(2, "spool sequence: starting at %llu", (unsigned long long)spool_seq_next_value);
+}
+
+// 0 if the next block could not be reserved
+uint64_t spool_seq_take(void)
+{
+    if (spool_seq_next_value >= spool_seq_reserved && !spool_seq_save(spool_seq_next_value + SPOOL_SEQ_RESERVE)) {
+        return 0;
+    }
+
+    return spool_seq_next_value++;
+}
+
+// "s<seq 16 hex>", what all names of messages with seq or a later one start with (or compare bigger than)
+void spool_seq_name_prefix(uint64_t seq, char *buf, size_t size)
+{
+    snprintf(buf, size, "s%016llx", (unsigned long long)seq);
+}
+
+// the sequence number in a stored message name (or one of its sidecars), 0 for older names without one
+uint64_t spool_name_seq(const char *name)
+{
+    if (name[0] != 's' || strlen(name) < SPOOL_SEQ_PREFIX_LENGTH || name[SPOOL_SEQ_PREFIX_LENGTH - 1] != '_') {
+        return 0;
+    }
+
+    uint64_t seq = 0;
+
+    for (int i = 1; i < SPOOL_SEQ_PREFIX_LENGTH - 1; i++) {
+        const uint8_t v = hex_decode_table[(uint8_t)name[i]];
+
+        if (v & 0xF0) {
+            return 0;
+        }
+
+        seq = (seq << 4) | v;
+    }
+
+    return seq;
+}
+
+// the receive time part of a stored message name
+const char *spool_name_time(const char *name)
+{
+    return (spool_name_seq(name) != 0) ? (name + SPOOL_SEQ_PREFIX_LENGTH) : name;
+}
+
+// the length of the receive time at the start of time_part, with the UTC offset if the name has one
+size_t spool_name_time_length(const char *time_part)
+{
+    const char *o = time_part + SPOOL_TIME_NAME_LENGTH;
+
+    if (strnlen(time_part, SPOOL_TIME_NAME_LENGTH) < SPOOL_TIME_NAME_LENGTH || (o[0] != '+' && o[0] != '-')) {
+        return SPOOL_TIME_NAME_LENGTH;
+    }
+
+    for (int i = 1; i < SPOOL_TIME_OFFSET_LENGTH; i++) {
+        if (o[i] < '0' || o[i] > '9') {
+            return SPOOL_TIME_NAME_LENGTH;
+        }
+    }
+
+    return SPOOL_TIME_NAME_LENGTH + SPOOL_TIME_OFFSET_LENGTH;
+}
+
+bool spool_name_is_compressed(const char *name)
+{
+    const char *time_part = spool_name_time(name);
+
+    if (strnlen(time_part, SPOOL_TIME_NAME_LENGTH) < SPOOL_TIME_NAME_LENGTH) {
+        return false;
+    }
+
+    return time_part[spool_name_time_length(time_part)] == SPOOL_ZSTD_NAME_MARK[0];
+}
+// ----------- spool sequence -----------
+
+// ----------- message id index -----------
+// senders send a messageV2 again when they got no receipt in time, writeMessage() only stores it if its id
+// is not in this index. the index has a hash (BLAKE2b, 16 bytes) of sender pubkey and message id for every
+// message stored in the last MSGID_INDEX_RETENTION_SECS, appended to msgid_index_filename:
+//   "TPm1"[flags u32] then records [stored unix time u32][hash 16]
+// with encryption on the hash is keyed with a key derived from the spool key (MSGID_INDEX_FLAG_KEYED),
+// a file written with the other setting is started new. in memory the same records are in an open addressing
+// hash table (linear probing, the hash is already random so its first 4 bytes pick the slot), a lookup never
+// reads the file. the table doubles when it is 3/4 full. expired records are removed from the file and the
+// table at startup and every MSGID_INDEX_COMPACT_SECS.
+#define MSGID_INDEX_MAGIC "TPm1"
+#define MSGID_INDEX_HEADER_SIZE 8
+#define MSGID_INDEX_HASH_SIZE 16
+#define MSGID_INDEX_RECORD_SIZE (4 + MSGID_INDEX_HASH_SIZE)
+
+typedef enum MSGID_INDEX_FLAG {
+    MSGID_INDEX_FLAG_KEYED = 1
+} MSGID_INDEX_FLAG;
+
+typedef struct msgid_slot {
+    // unix time the message was stored, 0 is an empty slot
+    uint32_t stored;
+    uint8_t hash[MSGID_INDEX_HASH_SIZE];
+} msgid_slot;
+
+msgid_slot *msgid_table = NULL;
+uint32_t msgid_table_size = 0;
+uint32_t msgid_table_count = 0;
+bool msgid_table_full_logged = false;
+FILE *msgid_index_file = NULL;
+uint8_t msgid_index_key[crypto_generichash_KEYBYTES];
+time_t msgid_index_compacted_ts = 0;
+// resends that were not stored again
+uint32_t msgid_index_duplicates = 0;
+
+void msgid_index_hash(const uint8_t *sender_pubkey, const uint8_t *msg_id, uint8_t *hash)
+{
+    uint8_t in[TOX_PUBLIC_KEY_SIZE * 2];
+    memcpy(in, sender_pubkey, TOX_PUBLIC_KEY_SIZE);
+    memcpy(in + TOX_PUBLIC_KEY_SIZE, msg_id, TOX_PUBLIC_KEY_SIZE);
+    crypto_generichash(hash, MSGID_INDEX_HASH_SIZE, in, sizeof(in), spool_crypt_enabled ? msgid_index_key : NULL,
+                       spool_crypt_enabled ? sizeof(msgid_index_key) : 0);
+}
+
+// the slot that has this hash, or the empty slot where it goes
+msgid_slot *msgid_table_slot(msgid_slot *table, uint32_t size, const uint8_t *hash)
+{
+    uint32_t i = get_u32_be(hash) & (size - 1);
+
+    while (table[i].stored != 0 && memcmp(table[i].hash, hash, MSGID_INDEX_HASH_SIZE) != 0) {
+        i = (i + 1) & (size - 1);
+    }
+
+    return &table[i];
+}
+
+bool msgid_table_grow(void)
+{
+    const uint32_t size = msgid_table_size * 2;
+    msgid_slot *table = calloc(size, sizeof(msgid_slot));
+
+    if (table == NULL) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < msgid_table_size; i++) {
+        if (msgid_table[i].stored != 0) {
+            *msgid_table_slot(table, size, msgid_table[i].hash) = msgid_table[i];
+        }
+    }
+
+    free(msgid_table);
+    msgid_table = table;
+    msgid_table_size = size;
+    return true;
+}
+
+void msgid_table_put(const uint8_t *hash, uint32_t stored)
+{
+    if ((msgid_table_count + 1) * 4 > msgid_table_size * 3 && !msgid_table_grow()) {
+        // still one empty slot left, so lookups end. a resend of this message would be stored again
+        if (msgid_table_count + 1 >= msgid_table_size) {
+            if (!msgid_table_full_logged) {
+                msgid_table_full_logged = true;
+                toxProxyLog(1, "message id index: out of memory with %u ids", msgid_table_count);
+            }
+
+            return;
+        }
+    }
+
+    msgid_slot *slot = msgid_table_slot(msgid_table, msgid_table_size, hash);
+
+    if (slot->stored == 0) {
+        memcpy(slot->hash, hash, MSGID_INDEX_HASH_SIZE);
+        msgid_table_count++;
+    }
+
+    if (stored > slot->stored) {
+        slot->stored = stored;
+    }
+}
+
+// reads the records of msgid_index_filename, NULL if there is no usable file
+uint8_t *msgid_index_read(size_t *count)
+{
+    *count = 0;
+    FILE *f = fopen(msgid_index_filename, "rb");
+
+    if (f == NULL) {
+        return NULL;
+    }
+
+    uint8_t header[MSGID_INDEX_HEADER_SIZE];
+    struct stat st;
+    const uint32_t flags = spool_crypt_enabled ? MSGID_INDEX_FLAG_KEYED : 0;
+    uint8_t *records = NULL;
+
+    if (fread(header, sizeof(header), 1, f) == 1 && memcmp(header, MSGID_INDEX_MAGIC, 4) == 0
+            && get_u32_be(header + 4) == flags && fstat(fileno(f), &st) == 0) {
+        const size_t n = ((size_t)st.st_size - MSGID_INDEX_HEADER_SIZE) / MSGID_INDEX_RECORD_SIZE;
+        records = malloc(n * MSGID_INDEX_RECORD_SIZE + 1);
+
+        if (records != NULL) {
+            // a record cut off by a crash is ignored
+            *count = fread(records, MSGID_INDEX_RECORD_SIZE, n, f);
+        }
+    } else {
+        toxProxyLog(1, "message id index: %s is from another setup or damaged, starting a new one",
+                    msgid_index_filename);
+    }
+
+    fclose(f);
+    return records;
+}
+
+// rewrite the file with the records that have not expired and fill the table from them
+void msgid_index_compact(void)
+{
+    if (msgid_index_file != NULL) {
+        fclose(msgid_index_file);
+        msgid_index_file = NULL;
+    }
+
+    memset(msgid_table, 0, sizeof(msgid_slot) * msgid_table_size);
+    msgid_table_count = 0;
+    msgid_table_full_logged = false;
+
+    size_t count = 0;
+    uint8_t *records = msgid_index_read(&count);
+    const uint32_t now = (uint32_t)get_unix_time();
+    size_t kept = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t *r = records + i * MSGID_INDEX_RECORD_SIZE;
+
+        if (get_u32_be(r) != 0 && get_u32_be(r) + MSGID_INDEX_RETENTION_SECS > now) {
+            memmove(records + kept * MSGID_INDEX_RECORD_SIZE, r, MSGID_INDEX_RECORD_SIZE);
+            msgid_table_put(r + 4, get_u32_be(r));
+            kept++;
+        }
+    }
+
+    uint8_t header[MSGID_INDEX_HEADER_SIZE];
+    memcpy(header, MSGID_INDEX_MAGIC, 4);
+    put_u32_be(header + 4, spool_crypt_enabled ? MSGID_INDEX_FLAG_KEYED : 0);
+
+    FILE *f = fopen(msgid_index_tmp_filename, "wb");
+    bool ok = (f != NULL && fwrite(header, sizeof(header), 1, f) == 1
+               && (kept == 0 || fwrite(records, MSGID_INDEX_RECORD_SIZE, kept, f) == kept));
+
+    if (f != NULL && fclose(f) != 0) {
+        ok = false;
+    }
+
+    free(records);
+
+    if (!ok || rename(msgid_index_tmp_filename, msgid_index_filename) != 0) {
+        toxProxyLog(0, "message id index: can not write %s", msgid_index_filename);
+        unlink(msgid_index_tmp_filename);
+    } else {
+        msgid_index_file = fopen(msgid_index_filename, "ab");
+    }
+
+    msgid_index_compacted_ts = get_unix_time();
+    toxProxyLog(2, "message id index: %u of %u ids are still in the window", (uint32_t)kept, (uint32_t)count);
+}
+
+void msgid_index_init(void)
+{
+    if (spool_crypt_enabled) {
+        const char *context = "ToxProxy message id index";
+        crypto_generichash(msgid_index_key, sizeof(msgid_index_key), (const uint8_t *)context, strlen(context),
+                           spool_crypt_key, sizeof(spool_crypt_key));
+    }
+
+    if (msgid_table == NULL) {
+        msgid_table = calloc(MSGID_INDEX_SLOTS, sizeof(msgid_slot));
+
+        if (msgid_table == NULL) {
+            toxProxyLog(0, "message id index: out of memory, resent messages will be stored again");
+            return;
+        }
+
+        msgid_table_size = MSGID_INDEX_SLOTS;
+    }
+
+    msgid_index_compact();
+}
+
+void msgid_index_maybe_compact(void)
+{
+    if (msgid_table != NULL && msgid_index_compacted_ts + MSGID_INDEX_COMPACT_SECS <= get_unix_time()) {
+        msgid_index_compact();
+    }
+}
+
+// true if a message with this id hash was stored in the window
+bool msgid_index_contains(const uint8_t *hash)
+{
+    if (msgid_table == NULL) {
+        return false;
+    }
+
+    const msgid_slot *slot = msgid_table_slot(msgid_table, msgid_table_size, hash);
+    return slot->stored != 0 && slot->stored + MSGID_INDEX_RETENTION_SECS > (uint32_t)get_unix_time();
+}
+
+void msgid_index_add(const uint8_t *hash)
+{
+    if (msgid_table == NULL) {
+        return;
+    }
+
+    const uint32_t now = (uint32_t)get_unix_time();
+    msgid_table_put(hash, now);
+
+    uint8_t record[MSGID_INDEX_RECORD_SIZE];
+    put_u32_be(record, now);
+    memcpy(record + 4, hash, MSGID_INDEX_HASH_SIZE);
+
+    // flushed right away, the file is read back after a restart
+    if (msgid_index_file == NULL || fwrite(record, sizeof(record), 1, msgid_index_file) != 1
+            || fflush(msgid_index_file) != 0) {
+        toxProxyLog(1, "message id index: can not append to %s", msgid_index_filename);
+    }
+}
+// ----------- message id index -----------
+
+// the receive time in stored message names: local time and its offset to UTC
+void spool_timestamp_name(const struct timeval *tv, char *name, size_t name_size)
+{
+    struct tm tm = *localtime(&tv->tv_sec);
+    const long offset_min = tm.tm_gmtoff / 60;
+    const long abs_min = (offset_min < 0) ? -offset_min : offset_min;
+    snprintf(name, name_size, "%04d-%02d-%02d_%02d%02d-%02d,%06ld%c%02ld%02ld",
+             tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, (long)tv->tv_usec,
+             (offset_min < 0) ? '-' : '+', abs_min / 60, abs_min % 60);
+}
+
+// when the stored message msg_path (file name name) was received, read back from its name.
+// names that don't parse fall back to the time the file was written.
+void spool_receive_time(const char *msg_path, const char *name, uint32_t *ts_sec, uint16_t *ts_ms)
+{
+    struct tm tm;
+    CLEAR(tm);
+    long usec = 0;
+    const char *time_part = spool_name_time(name);
+
+    if (sscanf(time_part, "%4d-%2d-%2d_%2d%2d-%2d,%6ld", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &usec) == 7) {
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        time_t t;
+
+        if (spool_name_time_length(time_part) > SPOOL_TIME_NAME_LENGTH) {
+            // the offset to UTC is in the name, also right in the hour that is there twice when DST ends
+            const char *o = time_part + SPOOL_TIME_NAME_LENGTH;
+            const long offset = ((o[1] - '0') * 10 + (o[2] - '0')) * 3600L + ((o[3] - '0') * 10 + (o[4] - '0')) * 60L;
+            t = timegm(&tm) - ((o[0] == '-') ? -offset : offset);
+        } else {
+            // names written without the offset: let mktime() find out about DST, in the hour that is
+            // there twice it may pick the wrong one
+            tm.tm_isdst = -1;
+            t = mktime(&tm);
+        }
+
+        if (t != (time_t) -1) {
+            *ts_sec = (uint32_t)t;
+            *ts_ms = (uint16_t)(usec / 1000);
+            return;
+        }
+    }
+
+    struct stat st;
+    *ts_sec = (stat(msg_path, &st) == 0) ? (uint32_t)st.st_mtime : (uint32_t)get_unix_time();
+    *ts_ms = 0;
+}
+
+// the first message of a run for acc: go on after the receive time of its newest stored message, the
+// order also holds when the clock was set back while the proxy was not running
+void spool_receive_seed(spool_account *acc)
+{
+    acc->receive_seeded = true;
+
+    char friendDir[strlen(msgsDir) + 1 + sizeof(acc->sender_key_hex)];
+    snprintf(friendDir, sizeof(friendDir), "%s/%s", msgsDir, acc->sender_key_hex);
+    DIR *dfd = opendir(friendDir);
+
+    if (dfd == NULL) {
+        return;
+    }
+
+    // names sort by sequence number (older ones by receive time)
+    char newest[NAME_MAX + 1] = {0};
+    struct dirent *dp = NULL;
+
+    while ((dp = readdir(dfd)) != NULL) {
+        if (spool_is_message_file(dp->d_name) && strcmp(dp->d_name, newest) > 0) {
+            snprintf(newest, sizeof(newest), "%s", dp->d_name);
+        }
+    }
+
+    closedir(dfd);
+
+    if (newest[0] != '\0') {
+        char path[sizeof(friendDir) + 1 + sizeof(newest)];
+        snprintf(path, sizeof(path), "%s/%s", friendDir, newest);
+        uint32_t ts_sec = 0;
+        uint16_t ts_ms = 0;
+        spool_receive_time(path, newest, &ts_sec, &ts_ms);
+        const uint64_t newest_ms = (uint64_t)ts_sec * 1000 + ts_ms;
+
+        if (newest_ms > acc->last_receive_ms) {
+            acc->last_receive_ms = newest_ms;
+        }
+    }
+}
+
+void spool_prepare_sender_dir(const char *sender_key_hex)
+{
+    char userDir[tox_public_key_hex_size + strlen(msgsDir) + 1];
+    CLEAR(userDir);
+
+    snprintf(userDir, sizeof(userDir), "%s/%s", msgsDir, sender_key_hex);
+
+    mkdir(msgsDir, S_IRWXU);
+    mkdir(userDir, S_IRWXU);
+}
+
+// ----------- spool ttl -----------
+// stored messages expire SPOOL_TTL_DIRECT_SECS (friends) or SPOOL_TTL_CONFERENCE_SECS (conferences) after they
+// were received. the files of a sender sort by receive time, so every sender with stored messages has one
+// timer, for its oldest file, in a hierarchical timer wheel: SPOOL_TTL_WHEEL_LEVELS levels of
+// SPOOL_TTL_WHEEL_SLOTS slots, a slot of level l is SPOOL_TTL_WHEEL_SLOTS^l seconds. spool_ttl_tick() only
+// touches the timers that are due. a due sender deletes its expired files from a cache of its oldest names
+// (the dir is only read again when the cache is used up) and its timer moves on to the next file.
+#define SPOOL_TTL_WHEEL_BITS 6
+#define SPOOL_TTL_WHEEL_SLOTS (1 << SPOOL_TTL_WHEEL_BITS)
+#define SPOOL_TTL_WHEEL_LEVELS 4
+// timers further out wait in the last level and are put in again when they come down
+#define SPOOL_TTL_WHEEL_RANGE (1ULL << (SPOOL_TTL_WHEEL_BITS * SPOOL_TTL_WHEEL_LEVELS))
+#define SPOOL_TTL_NONE UINT32_MAX
+
+typedef struct spool_ttl_timer {
+    bool used;
+    char sender_key_hex[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+    uint32_t expire_ts;
+    // list of the wheel slot (level * SPOOL_TTL_WHEEL_SLOTS + index), next is also the free list
+    uint32_t slot;
+    uint32_t prev;
+    uint32_t next;
+    // the oldest names of the sender dir and their receive times, names_next is the first one not deleted
+    char **names;
+    uint32_t *names_ts;
+    uint32_t names_count;
+    uint32_t names_next;
+} spool_ttl_timer;
+
+spool_ttl_timer *spool_ttl_timers = NULL;
+uint32_t spool_ttl_timers_size = 0;
+uint32_t spool_ttl_free = SPOOL_TTL_NONE;
+uint32_t spool_ttl_wheel[SPOOL_TTL_WHEEL_LEVELS * SPOOL_TTL_WHEEL_SLOTS];
+// the next second spool_ttl_tick() handles
+uint32_t spool_ttl_now = 0;
+// timers are set once the startup recovery has counted the spool
+bool spool_ttl_started = false;
+uint32_t spool_ttl_expired_direct = 0;
+uint32_t spool_ttl_expired_conference = 0;
+uint64_t spool_ttl_expired_bytes = 0;
+bool spool_ttl_status_changed = false;
+
+uint32_t spool_ttl_secs(const spool_account *acc)
+{
+    return acc->is_conference ? SPOOL_TTL_CONFERENCE_SECS : SPOOL_TTL_DIRECT_SECS;
+}
+
+void spool_ttl_link(uint32_t t)
+{
+    spool_ttl_timer *tm = &spool_ttl_timers[t];
+    uint64_t expire = (tm->expire_ts < spool_ttl_now) ? spool_ttl_now : tm->expire_ts;
+
+    if (expire - spool_ttl_now >= SPOOL_TTL_WHEEL_RANGE) {
+        expire = spool_ttl_now + SPOOL_TTL_WHEEL_RANGE - 1;
+    }
+
+    int level = 0;
+
+    while (level < SPOOL_TTL_WHEEL_LEVELS - 1
+            && (expire - spool_ttl_now) >= (1ULL << (SPOOL_TTL_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    tm->slot = level * SPOOL_TTL_WHEEL_SLOTS
+               + (uint32_t)((expire >> (SPOOL_TTL_WHEEL_BITS * level)) & (SPOOL_TTL_WHEEL_SLOTS - 1));
+    tm->prev = SPOOL_TTL_NONE;
+    tm->next = spool_ttl_wheel[tm->slot];
+
+    if (tm->next != SPOOL_TTL_NONE) {
+        spool_ttl_timers[tm->next].prev = t;
+    }
+
+    spool_ttl_wheel[tm->slot] = t;
+}
+
+void spool_ttl_unlink(uint32_t t)
+{
+    spool_ttl_timer *tm = &spool_ttl_timers[t];
+
+    if (tm->prev != SPOOL_TTL_NONE) {
+        spool_ttl_timers[tm->prev].next = tm->next;
+    } else {
+        spool_ttl_wheel[tm->slot] = tm->next;
+    }
+
+    if (tm->next != SPOOL_TTL_NONE) {
+        spool_ttl_timers[tm->next].prev = tm->prev;
+    }
+}
+
+void spool_ttl_free_names(spool_ttl_timer *tm)
+{
+    spool_free_names(tm->names, tm->names_count);
+    free(tm->names_ts);
+    tm->names = NULL;
+    tm->names_ts = NULL;
+    tm->names_count = 0;
+    tm->names_next = 0;
+}
+
+// a timer that is not linked into the wheel
+void spool_ttl_timer_free(uint32_t t)
+{
+    spool_ttl_timer *tm = &spool_ttl_timers[t];
+    spool_ttl_free_names(tm);
+    tm->used = false;
+    tm->next = spool_ttl_free;
+    spool_ttl_free = t;
+}
+
+// set the timer of acc to expire_ts, or move it there if that is earlier
+void spool_ttl_arm(spool_account *acc, uint32_t expire_ts)
+{
+    if (acc->ttl_timer != 0) {
+        const uint32_t t = acc->ttl_timer - 1;
+
+        if (spool_ttl_timers[t].expire_ts > expire_ts) {
+            spool_ttl_unlink(t);
+            spool_ttl_timers[t].expire_ts = expire_ts;
+            spool_ttl_link(t);
+        }
+
+        return;
+    }
+
+    if (spool_ttl_free == SPOOL_TTL_NONE) {
+        const uint32_t new_size = (spool_ttl_timers_size == 0) ? 64 : (spool_ttl_timers_size * 2);
+        spool_ttl_timer *n = realloc(spool_ttl_timers, new_size * sizeof(spool_ttl_timer));
+
+        if (n == NULL) {
+            return;
+        }
+
+        spool_ttl_timers = n;
+
+        for (uint32_t i = new_size; i > spool_ttl_timers_size; i--) {
+            CLEAR(spool_ttl_timers[i - 1]);
+            spool_ttl_timers[i - 1].next = spool_ttl_free;
+            spool_ttl_free = i - 1;
+        }
+
+        spool_ttl_timers_size = new_size;
+    }
+
+    const uint32_t t = spool_ttl_free;
+    spool_ttl_timer *tm = &spool_ttl_timers[t];
+    spool_ttl_free = tm->next;
+    CLEAR(*tm);
+    tm->used = true;
+    snprintf(tm->sender_key_hex, sizeof(tm->sender_key_hex), "%s", acc->sender_key_hex);
+    tm->expire_ts = expire_ts;
+    spool_ttl_link(t);
+    acc->ttl_timer = t + 1;
+}
+
+// writeSpoolFile() stored a message of acc
+void spool_ttl_stored(spool_account *acc, uint32_t received_ts)
+{
+    const uint32_t ttl = spool_ttl_secs(acc);
+
+    if (spool_ttl_started && ttl > 0) {
+        spool_ttl_arm(acc, received_ts + ttl);
+    }
+}
+
+// read the oldest SPOOL_TTL_CACHE_NAMES names of the sender dir into the cache of its timer
+void spool_ttl_refill(spool_ttl_timer *tm, int dir_fd, const char *friendDir)
+{
+    spool_ttl_free_names(tm);
+
+    const int fd = dup(dir_fd);
+    DIR *dfd = (fd >= 0) ? fdopendir(fd) : NULL;
+
+    if (dfd == NULL) {
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        return;
+    }
+
+    // the dup shares the position with dir_fd, an earlier refill left it at the end
+    rewinddir(dfd);
+    char **names = NULL;
+    const uint32_t keep = (uint32_t)spool_read_oldest_names(dfd, SPOOL_TTL_CACHE_NAMES, &names);
+    closedir(dfd);
+
+    tm->names_ts = calloc(keep + 1, sizeof(uint32_t));
+
+    if (tm->names_ts == NULL) {
+        spool_free_names(names, keep);
+        return;
+    }
+
+    for (uint32_t i = 0; i < keep; i++) {
+        char path[strlen(friendDir) + 1 + strlen(names[i]) + 1];
+        snprintf(path, sizeof(path), "%s/%s", friendDir, names[i]);
+        uint16_t ts_ms = 0;
+        spool_receive_time(path, names[i], &tm->names_ts[i], &ts_ms);
+    }
+
+    tm->names = names;
+    tm->names_count = keep;
+}
+
+// the timer t is due: delete the expired files of its sender (up to *budget) and set it for the next one
+void spool_ttl_fire(uint32_t t, uint32_t now, uint32_t *budget)
+{
+    spool_ttl_timer *tm = &spool_ttl_timers[t];
+
+    if (tm->expire_ts > now) {
+        // came down from the last level
+        spool_ttl_link(t);
+        return;
+    }
+
+    spool_account *acc = spool_account_get(tm->sender_key_hex);
+
+    if (acc == NULL || acc->ttl_timer != t + 1) {
+        spool_ttl_timer_free(t);
+        return;
+    }
+
+    const uint32_t ttl = spool_ttl_secs(acc);
+    char friendDir[strlen(msgsDir) + 1 + sizeof(tm->sender_key_hex)];
+    snprintf(friendDir, sizeof(friendDir), "%s/%s", msgsDir, tm->sender_key_hex);
+    const int dir_fd = open(friendDir, O_RDONLY | O_DIRECTORY);
+    uint32_t expired = 0;
+    uint64_t expired_bytes = 0;
+    uint32_t next_ts = 0;
+
+    while (dir_fd >= 0 && ttl > 0) {
+        if (tm->names_next == tm->names_count) {
+            spool_ttl_refill(tm, dir_fd, friendDir);
+
+            if (tm->names_count == 0) {
+                break;
+            }
+        }
+
+        const uint32_t ts = tm->names_ts[tm->names_next];
+
+        if ((uint64_t)ts + ttl > now) {
+            next_ts = ts + ttl;
+            break;
+        }
+
+        if (*budget == 0) {
+            next_ts = now + 1;
+            break;
+        }
+
+        const char *name = tm->names[tm->names_next];
+        struct stat st;
+
+        // a message that is gone was synced or evicted, its __MSGID__ files are also deleted here
+        if (spool_is_message_file(name) && fstatat(dir_fd, name, &st, 0) == 0) {
+            expired++;
+            expired_bytes += (uint64_t)st.st_size;
+        }
+
+        spool_unlink_file(acc, dir_fd, name);
+        tm->names_next++;
+        (*budget)--;
+    }
+
+    if (dir_fd >= 0) {
+        close(dir_fd);
+    }
+
+    if (expired > 0) {
+        acc->ttl_expired += expired;
+
+        if (acc->is_conference) {
+            spool_ttl_expired_conference += expired;
+        } else {
+            spool_ttl_expired_direct += expired;
+        }
+
+        spool_ttl_expired_bytes += expired_bytes;
+        spool_ttl_status_changed = true;
+        toxProxyLog(2, "spool ttl: deleted %u messages of %s older than %u s", expired, acc->sender_key_hex, ttl);
+    }
+
+    if (next_ts == 0) {
+        // nothing left (or the dir is gone), the next stored message sets a new timer
+        acc->ttl_timer = 0;
+        spool_ttl_timer_free(t);
+        return;
+    }
+
+    tm->expire_ts = next_ts;
+    spool_ttl_link(t);
+}
+
+// a timer for every sender with stored messages, spread over the first minute (they read their dir first)
+void spool_ttl_start(void)
+{
+    spool_ttl_now = (uint32_t)get_unix_time();
+
+    for (int i = 0; i < SPOOL_TTL_WHEEL_LEVELS * SPOOL_TTL_WHEEL_SLOTS; i++) {
+        spool_ttl_wheel[i] = SPOOL_TTL_NONE;
+    }
+
+    uint32_t armed = 0;
+
+    for (uint32_t i = 0; i < spool_accounts_size; i++) {
+        spool_account *acc = &spool_accounts[i];
+
+        if (acc->used && acc->messages > 0 && spool_ttl_secs(acc) > 0) {
+            spool_ttl_arm(acc, spool_ttl_now + 1 + (armed % SPOOL_TTL_WHEEL_SLOTS));
+            armed++;
+        }
+    }
+
+    spool_ttl_started = true;
+    toxProxyLog(2, "spool ttl: direct %u s, conference %u s, %u senders with stored messages",
+                (uint32_t)SPOOL_TTL_DIRECT_SECS, (uint32_t)SPOOL_TTL_CONFERENCE_SECS, armed);
+}
+
+// the clock jumped: take all timers out of the wheel, go on at now and put them in again. the ones that
+// are due go into the slot of now. one pass over the timers instead of one step per second of the jump.
+void spool_ttl_rebase(uint32_t now)
+{
+    uint32_t all = SPOOL_TTL_NONE;
+    uint32_t count = 0;
+
+    for (int i = 0; i < SPOOL_TTL_WHEEL_LEVELS * SPOOL_TTL_WHEEL_SLOTS; i++) {
+        uint32_t t = spool_ttl_wheel[i];
+        spool_ttl_wheel[i] = SPOOL_TTL_NONE;
+
+        while (t != SPOOL_TTL_NONE) {
+            const uint32_t next = spool_ttl_timers[t].next;
+            spool_ttl_timers[t].next = all;
+            all = t;
+            t = next;
+            count++;
+        }
+    }
+
+    toxProxyLog(1, "spool ttl: the clock jumped by %lld s, putting %u timers in again",
+                (long long)now - (long long)spool_ttl_now, count);
+    spool_ttl_now = now;
+
+    while (all != SPOOL_TTL_NONE) {
+        const uint32_t next = spool_ttl_timers[all].next;
+        spool_ttl_link(all);
+        all = next;
+    }
+}
+
+// called from the main loop, handles the seconds that went by since the last call
+void spool_ttl_tick(void)
+{
+    if (!spool_ttl_started) {
+        if (!spool_quota_ready || (SPOOL_TTL_DIRECT_SECS == 0 && SPOOL_TTL_CONFERENCE_SECS == 0)) {
+            return;
+        }
+
+        spool_ttl_start();
+    }
+
+    const uint32_t now = (uint32_t)get_unix_time();
+    uint32_t budget = SPOOL_TTL_EXPIRE_PER_TICK;
+
+    // a stall of the main loop is caught up second by second, a jump of the clock (either way) is not
+    if ((uint64_t)spool_ttl_now + SPOOL_TTL_WHEEL_SLOTS < now || spool_ttl_now > (uint64_t)now + SPOOL_TTL_WHEEL_SLOTS) {
+        spool_ttl_rebase(now);
+    }
+
+    while (spool_ttl_now <= now) {
+        const uint32_t index = spool_ttl_now & (SPOOL_TTL_WHEEL_SLOTS - 1);
+
+        // level 0 went round: the next slot of level 1 comes down (and of level 2 when level 1 went round ...)
+        for (int level = 1; index == 0 && level < SPOOL_TTL_WHEEL_LEVELS; level++) {
+            const uint32_t l_index = (spool_ttl_now >> (SPOOL_TTL_WHEEL_BITS * level)) & (SPOOL_TTL_WHEEL_SLOTS - 1);
+            uint32_t t = spool_ttl_wheel[level * SPOOL_TTL_WHEEL_SLOTS + l_index];
+            spool_ttl_wheel[level * SPOOL_TTL_WHEEL_SLOTS + l_index] = SPOOL_TTL_NONE;
+
+            while (t != SPOOL_TTL_NONE) {
+                const uint32_t next = spool_ttl_timers[t].next;
+                spool_ttl_link(t);
+                t = next;
+            }
+
+            if (l_index != 0) {
+                break;
+            }
+        }
+
+        uint32_t t = spool_ttl_wheel[index];
+        spool_ttl_wheel[index] = SPOOL_TTL_NONE;
+
+        while (t != SPOOL_TTL_NONE) {
+            const uint32_t next = spool_ttl_timers[t].next;
+            spool_ttl_fire(t, now, &budget);
+            t = next;
+        }
+
+        spool_ttl_now++;
+    }
+}
+// ----------- spool ttl -----------
+
+// writes one spool file ./messages/<sender_key_hex>/s<seq>_<timestamp><suffix>, the sender dir must already exist.
+// the receive times of a sender only go up, a message that would get the same ms (or an earlier one, when
+// the clock was set back) is stored 1 ms after the one before it.
+// returns false if the file could not be written or the spool quota does not allow it.
+bool writeSpoolFile(const char *sender_key_hex, const struct timeval *tv, const char *suffix,
+                    const uint8_t *data, size_t length)
+{
+    spool_account *acc = spool_account_get(sender_key_hex);
+
+    if (acc == NULL) {
+        return false;
+    }
+
+    uint8_t *compressed = NULL;
+    const size_t compressed_length = spool_compress(data, length, &compressed);
+
+    if (compressed_length > 0) {
+        data = compressed;
+        length = compressed_length;
+    }
+
+    if (spool_crypt_enabled) {
+        uint8_t *encrypted = NULL;
+        length = spool_encrypt(data, length, &encrypted);
+        free(compressed);
+        // the one buffer to free from here on
+        compressed = encrypted;
+        data = encrypted;
+
+        if (encrypted == NULL) {
+            return false;
+        }
+    }
+
+    if (!spool_quota_admit(acc, length)) {
+        acc->rejected++;
+        spool_total_rejected++;
+        spool_quota_status_changed = true;
+        toxProxyLog(1, "spool quota: rejected message of %s (%llu bytes, %u messages stored)", sender_key_hex,
+                    (unsigned long long)acc->bytes, acc->messages);
+        free(compressed);
+        return false;
+    }
+
+    const uint64_t seq = spool_seq_take();
+
+    if (seq == 0) {
+        free(compressed);
+        return false;
+    }
+
+    if (!acc->receive_seeded) {
+        spool_receive_seed(acc);
+    }
+
+    struct timeval received = *tv;
+    const uint64_t received_ms = (uint64_t)received.tv_sec * 1000 + (uint64_t)(received.tv_usec / 1000);
+
+    if (received_ms <= acc->last_receive_ms) {
+        received.tv_sec = (time_t)((acc->last_receive_ms + 1) / 1000);
+        received.tv_usec = (suseconds_t)(((acc->last_receive_ms + 1) % 1000) * 1000);
+        acc->last_receive_ms++;
+    } else {
+        acc->last_receive_ms = received_ms;
+    }
+
+    char timestamp[SPOOL_TIME_NAME_LENGTH + SPOOL_TIME_OFFSET_LENGTH + 1]; // = "0000-00-00_0000-00,000000+0000";
+    CLEAR(timestamp);
+    spool_timestamp_name(&received, timestamp, sizeof(timestamp));
+
+    const size_t msgPath_len = strlen(msgsDir) + 1 + strlen(sender_key_hex) + 1 + SPOOL_SEQ_PREFIX_LENGTH + sizeof(timestamp)
+                               + strlen(SPOOL_ZSTD_NAME_MARK) + strlen(suffix) + 1;
+    char *msgPath = calloc(1, msgPath_len);
+
+    if (msgPath == NULL) {
+        free(compressed);
+        return false;
+    }
+
+    snprintf(msgPath, msgPath_len, "%s/%s/s%016llx_%s%s%s", msgsDir, sender_key_hex, (unsigned long long)seq, timestamp,
+             (compressed_length > 0) ? SPOOL_ZSTD_NAME_MARK : "", suffix);
+
+    bool ret = false;
+    FILE *f = fopen(msgPath, "wb");
+
+    if (f) {
+        ret = (fwrite(data, length, 1, f) == 1);
+        fclose(f);
+    }
+
+    if (ret) {
+        spool_account_add(acc, length);
+        spool_ttl_stored(acc, (uint32_t)received.tv_sec);
+    } else {
+        unlink(msgPath);
+    }
+
+    free(msgPath);
+    free(compressed);
+    return ret;
+}
+
+void writeMessage(char *sender_key_hex, const uint8_t *message, size_t length, uint32_t msg_type)
+{
+
+    uint8_t *msg_id = calloc(1, tox_public_key_size());
+    tox_messagev2_get_message_id(message, msg_id);
+    toxProxyLog(2, "New message from %s msg_type=%d", sender_key_hex, msg_type);
+
+    // a resend of a message that is already stored (or was, and got synced) is taken like the first one
+    // but not stored again
+    uint8_t sender_pubkey[TOX_PUBLIC_KEY_SIZE];
+    uint8_t id_hash[MSGID_INDEX_HASH_SIZE];
+    const bool have_id = (length >= TOX_PUBLIC_KEY_SIZE
+                          && hex_string_to_bin(sender_key_hex, TOX_PUBLIC_KEY_SIZE * 2, (char *)sender_pubkey,
+                                  TOX_PUBLIC_KEY_SIZE) == 0);
+
+    if (have_id) {
+        msgid_index_hash(sender_pubkey, msg_id, id_hash);
+
+        if (msgid_index_contains(id_hash)) {
+            msgid_index_duplicates++;
+            toxProxyLog(2, "message of %s is already stored, not storing the resend", sender_key_hex);
+            free(msg_id);
+            return;
+        }
+    }
+
+    spool_prepare_sender_dir(sender_key_hex);
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    const char *suffix = "";
+
+    if (msg_type == TOX_FILE_KIND_MESSAGEV2_ANSWER) {
+        suffix = ".txtA";
+    } else if (msg_type == TOX_FILE_KIND_MESSAGEV2_SEND) {
+        suffix = ".txtS";
+    }
+
+    if (writeSpoolFile(sender_key_hex, &tv, suffix, message, length)) {
+        if (have_id) {
+            msgid_index_add(id_hash);
+        }
+
+        if (msg_type == TOX_FILE_KIND_MESSAGEV2_SEND) {
+            bulk_sync_direct_stored();
+        }
+
+        ping_push_service();
+    }
+
+    free(msg_id);
+}
+
+void writeMessageHelper(Tox *tox, uint32_t friend_number, const uint8_t *message, size_t length, uint32_t msg_type)
+{
+    uint8_t public_key_bin[tox_public_key_size()];
+    CLEAR(public_key_bin);
+
+    tox_friend_get_public_key(tox, friend_number, public_key_bin, NULL);
+
+    char public_key_hex[tox_public_key_hex_size];
+    CLEAR(public_key_hex);
+
+    bin2upHex(public_key_bin, tox_public_key_size(), public_key_hex, tox_public_key_hex_size);
+    writeMessage(public_key_hex, message, length, msg_type);
+}
+
+bool file_exists(const char *path)
+{
+    struct stat s;
+    return stat(path, &s) == 0;
+}
+
+// fill string with toxid in upper case hex.
+// size of toxid_str needs to be: [TOX_ADDRESS_SIZE*2 + 1] !!
+void get_my_toxid(Tox *tox, char *toxid_str)
+{
+    uint8_t tox_id_bin[TOX_ADDRESS_SIZE];
+    CLEAR(tox_id_bin);
+
+    tox_self_get_address(tox, tox_id_bin);
+    bin2upHex(tox_id_bin, sizeof(tox_id_bin), toxid_str, (TOX_ADDRESS_SIZE * 2 + 1));
+}
+
+void getPubKeyHex_friendnumber(Tox *tox, uint32_t friend_number, char *pubKeyHex)
+{
+    uint8_t public_key_bin[tox_public_key_size()];
+    CLEAR(public_key_bin);
+    tox_friend_get_public_key(tox, friend_number, public_key_bin, NULL);
+    bin2upHex(public_key_bin, tox_public_key_size(), pubKeyHex, tox_public_key_hex_size);
+}
+
+// ----------- conference ingest -----------
+// conference lines are not written one by one. the lines that come in during one tox_iterate() are
+// buffered per conference and flushed in one batch (one spool dir setup, one wrap buffer, one push ping)
+// right after it in the main loop, or earlier when a buffer gets too big. so a crash loses at most
+// the lines of that one pass.
+// peer public keys (and if the peer is the master) are cached per conference
+// and dropped whenever the peer list of that conference changes. the conference id is cached
+// per conference number, conference_ingest_forget() drops it when the number may stand for
+// another conference (after joining one).
+//
+// a stored conference line is a conference record, a CONFERENCE_RECORD_SUFFIX file:
+// [CONFERENCE_RECORD_MAGIC][peer pubkey 32][messageV2 of the line]
+// only the file name tells a record from a message, a friend picks the bytes of its messages itself.
+// the legacy "<peer pubkey as 64 hex chars><line>" messageV2 the master expects is only
+// built when the line is synced, see conference_record_expand().
+#define CONFERENCE_RECORD_MAGIC "TPc1"
+#define CONFERENCE_RECORD_SUFFIX ".txtC"
+#define CONFERENCE_RECORD_HEADER_SIZE (4 + TOX_PUBLIC_KEY_SIZE)
+
+typedef struct conference_peer_cache_entry {
+    bool valid;
+    bool is_master;
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+} conference_peer_cache_entry;
+
+typedef struct conference_buffered_line {
+    struct timeval received;
+    size_t text_offset;
+    size_t text_length;
+    uint8_t peer_public_key[TOX_PUBLIC_KEY_SIZE];
+} conference_buffered_line;
+
+typedef struct conference_ingest {
+    bool id_valid;
+    char conference_id_hex[TOX_CONFERENCE_ID_SIZE * 2 + 1];
+
+    conference_peer_cache_entry *peers;
+    uint32_t peers_size;
+
+    conference_buffered_line *lines;
+    uint32_t lines_count;
+    uint32_t lines_size;
+    uint8_t *text;
+    size_t text_len;
+    size_t text_size;
+    struct timeval last_received;
+
+    uint32_t dropped_lines;
+} conference_ingest;
+
+conference_ingest *conference_ingests = NULL;
+uint32_t conference_ingests_size = 0;
+
+conference_ingest *conference_ingest_get(Tox *tox, uint32_t conference_number)
+{
+    if (conference_number >= conference_ingests_size) {
+        const uint32_t new_size = conference_number + 1;
+        conference_ingest *n = realloc(conference_ingests, new_size * sizeof(conference_ingest));
+
+        if (n == NULL) {
+            return NULL;
+        }
+
+        memset(n + conference_ingests_size, 0, (new_size - conference_ingests_size) * sizeof(conference_ingest));
+        conference_ingests = n;
+        conference_ingests_size = new_size;
+    }
+
+    conference_ingest *ci = &conference_ingests[conference_number];
+
+    if (!ci->id_valid) {
+        uint8_t conference_id_buffer[TOX_CONFERENCE_ID_SIZE];
+        CLEAR(conference_id_buffer);
+
+        if (!tox_conference_get_id(tox, conference_number, conference_id_buffer)) {
+            toxProxyLog(0, "conference id unknown?");
+            return NULL;
+        }
+
+        bin2upHex(conference_id_buffer, TOX_CONFERENCE_ID_SIZE, ci->conference_id_hex, sizeof(ci->conference_id_hex));
+        ci->id_valid = true;
+    }
+
+    return ci;
+}
+
+const conference_peer_cache_entry *conference_ingest_peer(Tox *tox, conference_ingest *ci, uint32_t conference_number,
+        uint32_t peer_number)
+{
+    if (peer_number >= ci->peers_size) {
+        const uint32_t new_size = peer_number + 1;
+        conference_peer_cache_entry *n = realloc(ci->peers, new_size * sizeof(conference_peer_cache_entry));
+
+        if (n == NULL) {
+            return NULL;
+        }
+
+        memset(n + ci->peers_size, 0, (new_size - ci->peers_size) * sizeof(conference_peer_cache_entry));
+        ci->peers = n;
+        ci->peers_size = new_size;
+    }
+
+    conference_peer_cache_entry *peer = &ci->peers[peer_number];
+
+    if (!peer->valid) {
+        TOX_ERR_CONFERENCE_PEER_QUERY error;
+
+        if (!tox_conference_peer_get_public_key(tox, conference_number, peer_number, peer->public_key, &error)) {
+            return NULL;
+        }
+
+        char public_key_hex[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+        bin2upHex(peer->public_key, TOX_PUBLIC_KEY_SIZE, public_key_hex, sizeof(public_key_hex));
+        peer->is_master = is_master(public_key_hex);
+        peer->valid = true;
+    }
+
+    return peer;
+}
+
+// peer numbers are re-assigned when the peer list changes
+void conference_ingest_invalidate_peers(uint32_t conference_number)
+{
+    if (conference_number < conference_ingests_size) {
+        conference_ingest *ci = &conference_ingests[conference_number];
+
+        if (ci->peers) {
+            memset(ci->peers, 0, ci->peers_size * sizeof(conference_peer_cache_entry));
+        }
+    }
+}
+
+void conference_ingest_buffer_line(conference_ingest *ci, const conference_peer_cache_entry *peer,
+                                   const uint8_t *message, size_t length)
+{
+    if (ci->lines_count == ci->lines_size) {
+        const uint32_t new_size = (ci->lines_size == 0) ? 16 : (ci->lines_size * 2);
+        conference_buffered_line *n = realloc(ci->lines, new_size * sizeof(conference_buffered_line));
+
+        if (n == NULL) {
+            ci->dropped_lines++;
+            return;
+        }
+
+        ci->lines = n;
+        ci->lines_size = new_size;
+    }
+
+    if (ci->text_len + length > ci->text_size) {
+        size_t new_size = (ci->text_size == 0) ? 4096 : ci->text_size;
+
+        while (new_size < ci->text_len + length) {
+            new_size *= 2;
+        }
+
+        uint8_t *n = realloc(ci->text, new_size);
+
+        if (n == NULL) {
+            ci->dropped_lines++;
+            return;
+        }
+
+        ci->text = n;
+        ci->text_size = new_size;
+    }
+
+    conference_buffered_line *line = &ci->lines[ci->lines_count];
+    gettimeofday(&line->received, NULL);
+
+    // the receive time is the file name, keep it unique and increasing within the conference
+    if (timercmp(&line->received, &ci->last_received, <=)) {
+        line->received = ci->last_received;
+        line->received.tv_usec++;
+
+        if (line->received.tv_usec >= 1000000) {
+            line->received.tv_sec++;
+            line->received.tv_usec = 0;
+        }
+    }
+
+    ci->last_received = line->received;
+
+    memcpy(line->peer_public_key, peer->public_key, sizeof(line->peer_public_key));
+    line->text_offset = ci->text_len;
+    line->text_length = length;
+    memcpy(ci->text + ci->text_len, message, length);
+    ci->text_len += length;
+    ci->lines_count++;
+}
+
+// writes all buffered lines of one conference, returns the number of lines written
+uint32_t conference_ingest_flush_one(conference_ingest *ci, uint8_t *record)
+{
+    uint32_t written = 0;
+
+    spool_prepare_sender_dir(ci->conference_id_hex);
+
+    spool_account *acc = spool_account_get(ci->conference_id_hex);
+
+    if (acc) {
+        // conferences can have their own (usually smaller) quota
+        acc->is_conference = true;
+    }
+
+    for (uint32_t i = 0; i < ci->lines_count; i++) {
+        const conference_buffered_line *line = &ci->lines[i];
+        const uint32_t raw_message_len = tox_messagev2_size(line->text_length, TOX_FILE_KIND_MESSAGEV2_SEND, 0);
+
+        memcpy(record, CONFERENCE_RECORD_MAGIC, 4);
+        memcpy(record + 4, line->peer_public_key, TOX_PUBLIC_KEY_SIZE);
+
+        uint8_t msgid[TOX_PUBLIC_KEY_SIZE];
+        CLEAR(msgid);
+        tox_messagev2_wrap(line->text_length, TOX_FILE_KIND_MESSAGEV2_SEND, 0, ci->text + line->text_offset,
+                           (uint32_t)line->received.tv_sec, (uint16_t)(line->received.tv_usec / 1000),
+                           record + CONFERENCE_RECORD_HEADER_SIZE, msgid);
+
+        if (writeSpoolFile(ci->conference_id_hex, &line->received, CONFERENCE_RECORD_SUFFIX, record,
+                           CONFERENCE_RECORD_HEADER_SIZE + raw_message_len)) {
+            written++;
+        } else {
+            ci->dropped_lines++;
+        }
+    }
+
+    if (ci->dropped_lines > 0) {
+        toxProxyLog(1, "conference %s: could not store %u lines", ci->conference_id_hex, ci->dropped_lines);
+        ci->dropped_lines = 0;
+    }
+
+    ci->lines_count = 0;
+    ci->text_len = 0;
+    return written;
+}
+
+// write the buffered lines of all conferences
+void conference_ingest_flush(void)
+{
+    uint8_t *record = NULL;
+    uint32_t written = 0;
+
+    for (uint32_t c = 0; c < conference_ingests_size; c++) {
+        conference_ingest *ci = &conference_ingests[c];
+
+        if (ci->lines_count == 0) {
+            continue;
+        }
+
+        if (record == NULL) {
+            // one buffer for the whole flush, big enough for any line
+            record = calloc(1, CONFERENCE_RECORD_HEADER_SIZE
+                            + tox_messagev2_size(TOX_MAX_MESSAGE_LENGTH, TOX_FILE_KIND_MESSAGEV2_SEND, 0));
+
+            if (record == NULL) {
+                break;
+            }
+        }
+
+        const uint32_t lines = ci->lines_count;
+        const uint32_t w = conference_ingest_flush_one(ci, record);
+        toxProxyLog(9, "conference_ingest_flush: conf %s wrote %u of %u lines", ci->conference_id_hex, w, lines);
+        written += w;
+    }
+
+    free(record);
+
+    if (written > 0) {
+        ping_push_service();
+    }
+}
+
+// conference numbers are re-used for a new conference, what is buffered still goes to the old one
+void conference_ingest_forget(uint32_t conference_number)
+{
+    if (conference_number < conference_ingests_size) {
+        conference_ingest *ci = &conference_ingests[conference_number];
+
+        if (ci->lines_count > 0) {
+            conference_ingest_flush();
+        }
+
+        ci->id_valid = false;
+        CLEAR(ci->conference_id_hex);
+        conference_ingest_invalidate_peers(conference_number);
+    }
+}
+bool conference_record_check(const char *name, const uint8_t *data, size_t length)
+{
+    return name_has_suffix(name, CONFERENCE_RECORD_SUFFIX)
+           && (length >= CONFERENCE_RECORD_HEADER_SIZE + tox_messagev2_size(0, TOX_FILE_KIND_MESSAGEV2_SEND, 0))
+           && (memcmp(data, CONFERENCE_RECORD_MAGIC, 4) == 0);
+}
+
+// turn a stored conference record into the messageV2 the master expects:
+// same message id and timestamps, text is the peer pubkey as 64 hex chars followed by the line.
+// returns NULL if data is not a conference record, otherwise the message (the caller frees it).
+uint8_t *conference_record_expand(const char *name, const uint8_t *data, size_t length, size_t *expanded_length)
+{
+    if (!conference_record_check(name, data, length)) {
+        return NULL;
+    }
+
+    // messageV2 is [msg id][ts sec][ts ms][text], the text starts right after this header
+    const size_t header_size = tox_messagev2_size(0, TOX_FILE_KIND_MESSAGEV2_SEND, 0);
+    const uint8_t *raw = data + CONFERENCE_RECORD_HEADER_SIZE;
+    const size_t raw_length = length - CONFERENCE_RECORD_HEADER_SIZE;
+    uint8_t *out = calloc(1, raw_length + (TOX_PUBLIC_KEY_SIZE * 2) + 1);
+
+    if (out == NULL) {
+        return NULL;
+    }
+
+    memcpy(out, raw, header_size);
+    bin2upHex(data + 4, TOX_PUBLIC_KEY_SIZE, (char *)out + header_size, (TOX_PUBLIC_KEY_SIZE * 2) + 1);
+    memcpy(out + header_size + (TOX_PUBLIC_KEY_SIZE * 2), raw + header_size, raw_length - header_size);
+    *expanded_length = raw_length + (TOX_PUBLIC_KEY_SIZE * 2);
+    return out;
+}
+
+// ----------- conference ingest -----------
+
+// ----------- spool index -----------
+// the quota accounts are saved in spool_index_filename (at most every SPOOL_INDEX_CHECKPOINT_SECS and when
+// the proxy stops), so a restart doesn't have to look at every stored message again. a sender dir is taken
+// from the checkpoint while its mtime is still the one in the checkpoint, every file created, renamed or
+// removed in it changes that. dirs changed less than SPOOL_INDEX_MTIME_SLACK_SECS before the checkpoint
+// was written are left out, FAT (the usb stick) keeps mtimes in 2 second steps.
+// the file is used with mmap(), the records are sorted by sender and searched in place:
+//   "TPi1"[flags u32][written unix time u64][count u32]
+//   count * [sender hex 64][mtime sec u64][mtime nsec u32][messages u32][bytes u64][record flags u32]
+//   [BLAKE2b of everything before it, 16 bytes]
+#define SPOOL_INDEX_MAGIC "TPi1"
+#define SPOOL_INDEX_HEADER_SIZE 20
+#define SPOOL_INDEX_RECORD_SIZE 92
+#define SPOOL_INDEX_HASH_SIZE 16
+#define SPOOL_INDEX_MTIME_SLACK_SECS 2
+
+typedef enum SPOOL_INDEX_FLAG {
+    // written with encryption on, the stored messages were all encrypted
+    SPOOL_INDEX_FLAG_ENCRYPTED = 1
+} SPOOL_INDEX_FLAG;
+
+typedef enum SPOOL_INDEX_RECORD_FLAG {
+    SPOOL_INDEX_RECORD_CONFERENCE = 1
+} SPOOL_INDEX_RECORD_FLAG;
+
+typedef struct spool_index_map {
+    const uint8_t *data;
+    size_t size;
+    uint32_t count;
+    uint64_t written;
+} spool_index_map;
+
+spool_index_map spool_index;
+time_t spool_index_saved_ts = 0;
+
+void spool_index_unload(void)
+{
+    if (spool_index.data != NULL) {
+        munmap((void *)spool_index.data, spool_index.size);
+    }
+
+    CLEAR(spool_index);
+}
+
+void spool_index_load(void)
+{
+    spool_index_unload();
+
+    const int fd = open(spool_index_filename, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || st.st_size < (SPOOL_INDEX_HEADER_SIZE + SPOOL_INDEX_HASH_SIZE)) {
+        close(fd);
+        return;
+    }
+
+    const size_t size = (size_t)st.st_size;
+    void *m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (m == MAP_FAILED) {
+        return;
+    }
+
+    const uint8_t *d = (const uint8_t *)m;
+    const uint32_t count = get_u32_be(d + 16);
+    const uint32_t flags = get_u32_be(d + 4);
+    uint8_t hash[SPOOL_INDEX_HASH_SIZE];
+
+    if (memcmp(d, SPOOL_INDEX_MAGIC, 4) != 0
+            || (uint64_t)size != SPOOL_INDEX_HEADER_SIZE + (uint64_t)count * SPOOL_INDEX_RECORD_SIZE + SPOOL_INDEX_HASH_SIZE
+            || crypto_generichash(hash, sizeof(hash), d, size - SPOOL_INDEX_HASH_SIZE, NULL, 0) != 0
+            || sodium_memcmp(hash, d + size - SPOOL_INDEX_HASH_SIZE, sizeof(hash)) != 0) {
+        toxProxyLog(1, "spool index: %s is damaged, checking the whole spool", spool_index_filename);
+        munmap(m, size);
+        return;
+    }
+
+    // plain messages have to be encrypted by the startup check
+    if (((flags & SPOOL_INDEX_FLAG_ENCRYPTED) != 0) != spool_crypt_enabled || spool_crypt_plain_left) {
+        toxProxyLog(2, "spool index: encryption was switched %s, checking the whole spool", spool_crypt_enabled ? "on" : "off");
+        munmap(m, size);
+        return;
+    }
+
+    spool_index.data = d;
+    spool_index.size = size;
+    spool_index.count = count;
+    spool_index.written = get_u64_be(d + 8);
+    toxProxyLog(2, "spool index: checkpoint with %u senders", count);
+}
+
+// the account of a sender dir from the checkpoint, if the dir has not changed since
+bool spool_index_take(spool_account *acc, const struct stat *dir_st)
+{
+    uint32_t lo = 0;
+    uint32_t hi = spool_index.count;
+
+    while (lo < hi) {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        const uint8_t *rec = spool_index.data + SPOOL_INDEX_HEADER_SIZE + (size_t)mid * SPOOL_INDEX_RECORD_SIZE;
+        const int c = memcmp(rec, acc->sender_key_hex, TOX_PUBLIC_KEY_SIZE * 2);
+
+        if (c < 0) {
+            lo = mid + 1;
+        } else if (c > 0) {
+            hi = mid;
+        } else {
+            const uint64_t mtime_sec = get_u64_be(rec + 64);
+
+            if (mtime_sec != (uint64_t)dir_st->st_mtim.tv_sec || get_u32_be(rec + 72) != (uint32_t)dir_st->st_mtim.tv_nsec
+                    || mtime_sec + SPOOL_INDEX_MTIME_SLACK_SECS > spool_index.written) {
+                return false;
+            }
+
+            spool_account_add_many(acc, get_u64_be(rec + 80), get_u32_be(rec + 76));
+            acc->is_conference = acc->is_conference || (get_u32_be(rec + 88) & SPOOL_INDEX_RECORD_CONFERENCE);
+            acc->counted = true;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int spool_cmp_accounts_by_sender(const void *a, const void *b)
+{
+    return strcmp((*(spool_account *const *)a)->sender_key_hex, (*(spool_account *const *)b)->sender_key_hex);
+}
+
+// write a new checkpoint of the accounts (only once the startup check is done)
+void spool_index_save(void)
+{
+    if (!spool_quota_ready) {
+        return;
+    }
+
+    spool_account **accs = calloc(spool_accounts_used + 1, sizeof(spool_account *));
+    uint8_t *buf = calloc(1, SPOOL_INDEX_HEADER_SIZE + (size_t)spool_accounts_used * SPOOL_INDEX_RECORD_SIZE
+                          + SPOOL_INDEX_HASH_SIZE);
+
+    if (accs == NULL || buf == NULL) {
+        free(accs);
+        free(buf);
+        return;
+    }
+
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < spool_accounts_size; i++) {
+        // an account the startup check could not get exactly right is counted again on the next start
+        if (spool_accounts[i].used && spool_accounts[i].counted && !spool_accounts[i].inexact) {
+            accs[n++] = &spool_accounts[i];
+        }
+    }
+
+    qsort(accs, n, sizeof(spool_account *), spool_cmp_accounts_by_sender);
+
+    const time_t now = get_unix_time();
+    uint8_t *p = buf + SPOOL_INDEX_HEADER_SIZE;
+    uint32_t count = 0;
+    bool skipped_fresh = false;
+
+    for (uint32_t i = 0; i < n; i++) {
+        char dirPath[strlen(msgsDir) + 1 + TOX_PUBLIC_KEY_SIZE * 2 + 1];
+        snprintf(dirPath, sizeof(dirPath), "%s/%s", msgsDir, accs[i]->sender_key_hex);
+        struct stat st;
+
+        if (strlen(accs[i]->sender_key_hex) != TOX_PUBLIC_KEY_SIZE * 2 || stat(dirPath, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            continue;
+        }
+
+        if (st.st_mtim.tv_sec + SPOOL_INDEX_MTIME_SLACK_SECS > now) {
+            skipped_fresh = true;
+            continue;
+        }
+
+        memcpy(p, accs[i]->sender_key_hex, TOX_PUBLIC_KEY_SIZE * 2);
+        p += TOX_PUBLIC_KEY_SIZE * 2;
+        p = put_u64_be(p, (uint64_t)st.st_mtim.tv_sec);
+        p = put_u32_be(p, (uint32_t)st.st_mtim.tv_nsec);
+        p = put_u32_be(p, accs[i]->messages);
+        p = put_u64_be(p, accs[i]->bytes);
+        p = put_u32_be(p, accs[i]->is_conference ? SPOOL_INDEX_RECORD_CONFERENCE : 0);
+        count++;
+    }
+
+    memcpy(buf, SPOOL_INDEX_MAGIC, 4);
+    put_u32_be(buf + 4, spool_crypt_enabled ? SPOOL_INDEX_FLAG_ENCRYPTED : 0);
+    put_u64_be(buf + 8, (uint64_t)now);
+    put_u32_be(buf + 16, count);
+    crypto_generichash(p, SPOOL_INDEX_HASH_SIZE, buf, (unsigned long long)(p - buf), NULL, 0);
+    p += SPOOL_INDEX_HASH_SIZE;
+
+    FILE *f = fopen(spool_index_tmp_filename, "wb");
+    bool ok = false;
+
+    if (f) {
+        ok = (fwrite(buf, (size_t)(p - buf), 1, f) == 1);
+        ok = (fclose(f) == 0) && ok;
+    }
+
+    if (!ok || rename(spool_index_tmp_filename, spool_index_filename) != 0) {
+        toxProxyLog(0, "spool index: can not write %s", spool_index_filename);
+        unlink(spool_index_tmp_filename);
+    } else {
+        toxProxyLog(9, "spool index: saved %u senders", count);
+        // the ones that just changed go into the next one
+        spool_index_dirty = skipped_fresh;
+    }
+
+    spool_index_saved_ts = now;
+    free(accs);
+    free(buf);
+}
+
+// from the main loop
+void spool_index_maybe_save(void)
+{
+    if (spool_index_dirty && spool_index_saved_ts + SPOOL_INDEX_CHECKPOINT_SECS <= get_unix_time()) {
+        spool_index_save();
+    }
+}
+// ----------- spool index -----------
+
+// ----------- spool recovery -----------
+// the spool is checked once at startup, while the proxy goes online. sender dirs that have not
+// changed since the last checkpoint (see spool index) are taken from it, the others are checked by
+// SPOOL_INDEX_THREADS threads, each taking whole sender dirs. spool_recovery_step() takes the
+// results over between tox_iterate() calls.
+// the check counts the stored messages for the quota accounts and repairs what a crash or a full disk
+// can leave behind:
+//   zero byte message files are deleted (with their __MSGID__ files)
+//   __MSGID__ files of messages that are gone are deleted
+//   message files that can't be a stored message are moved to msgsDamagedDir as "<sender>_<name>"
+//   empty sender dirs are removed
+// with encryption on, stored messages that are not encrypted yet are encrypted.
+// sender dirs of friends or conferences we don't have anymore are only reported, their messages
+// still go to the master. everything else in msgsDir is reported and left alone.
+// the threads never delete or replace a message the main thread might be using: they only see
+// messages older than this run, encrypted copies replace the plain ones in spool_recovery_step().
+#define SPOOL_RECOVERY_TMP_SUFFIX ".encrypt.tmp"
+#define SPOOL_RECOVERY_ENCRYPTED_SUFFIX ".encrypted"
+
+typedef struct spool_recovery_report {
+    uint32_t elapsed_ms;
+    uint32_t dirs;
+    uint32_t files;
+    uint32_t zero_byte;
+    uint32_t orphans;
+    uint32_t damaged;
+    uint32_t empty_dirs;
+    uint32_t unknown;
+    uint32_t stale_dirs;
+    uint32_t encrypted;
+    // stored messages that are still plain with encryption on
+    uint32_t plain;
+    uint32_t from_checkpoint;
+} spool_recovery_report;
+
+typedef struct spool_recovery_dir {
+    // the sender key hex, its account is looked up again when the dir is merged (the table can be
+    // rebuilt meanwhile)
+    char name[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+    // set (under spool_recovery.lock) by the thread that checked the dir
+    bool done;
+    bool merged;
+    bool in_use;
+    uint64_t bytes;
+    uint32_t messages;
+    spool_recovery_report report;
+    // plain messages the thread has written encrypted as ".<name>.encrypted"
+    char **encrypted_names;
+    size_t encrypted_count;
+    size_t encrypted_next;
+} spool_recovery_dir;
+
+typedef struct spool_recovery_state {
+    bool running;
+    bool report_pending;
+    // set by the kill switch (under lock), the threads stop after the file they are at
+    bool stop;
+    int msgs_fd;
+    spool_recovery_dir *dirs;
+    size_t dirs_count;
+    // the next dir for a thread, and the done flags
+    size_t next;
+    pthread_mutex_t lock;
+    pthread_t tids[SPOOL_INDEX_THREADS];
+    bool started[SPOOL_INDEX_THREADS];
+    size_t merged;
+    uint64_t start_usec;
+    spool_recovery_report report;
+} spool_recovery_state;
+
+spool_recovery_state spool_recovery = {.msgs_fd = -1};
+
+// time to online and time until the spool is fully indexed, from the start of the process
+uint64_t startup_usec = 0;
+uint32_t startup_online_ms = 0;
+uint32_t startup_indexed_ms = 0;
+
+// unlink a message and its __MSGID__ files in a dir the main thread doesn't know about (no account)
+void spool_recovery_unlink_message(int dir_fd, const char *base_name)
+{
+    const int fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dfd = (fd >= 0) ? fdopendir(fd) : NULL;
+
+    if (dfd == NULL) {
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        return;
+    }
+
+    const size_t base_len = strlen(base_name);
+    struct dirent *dp = NULL;
+
+    while ((dp = readdir(dfd)) != NULL) {
+        if (strncmp(dp->d_name, base_name, base_len) == 0) {
+            unlinkat(dir_fd, dp->d_name, 0);
+        }
+    }
+
+    closedir(dfd);
+}
+
+bool spool_recovery_message_decrypts(int dir_fd, const char *name, uint64_t size)
+{
+    int fd = openat(dir_fd, name, O_RDONLY);
+    uint8_t *data = (fd >= 0) ? calloc(1, (size_t)size) : NULL;
+    bool ok = (data != NULL && read(fd, data, (size_t)size) == (ssize_t)size);
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    size_t plain_size = 0;
+    uint8_t *plain = ok ? spool_decrypt(data, (size_t)size, &plain_size) : NULL;
+    ok = (plain != NULL);
+    free(plain);
+    free(data);
+    return ok;
+}
+
+// a cheap check of a stored message, only the header is read (and while plain messages are left the
+// whole of those that start like an encrypted one)
+bool spool_recovery_message_is_valid(int dir_fd, const char *name, uint64_t size, bool *encrypted)
+{
+    const size_t min_size = tox_messagev2_size(0, TOX_FILE_KIND_MESSAGEV2_SEND, 0);
+    uint8_t head[CONFERENCE_RECORD_HEADER_SIZE];
+
+    *encrypted = false;
+
+    if (size > spool_crypt_size(SPOOL_ZSTD_HEADER_SIZE + SPOOL_MAX_MESSAGE_SIZE)) {
+        return false;
+    }
+
+    int fd = openat(dir_fd, name, O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    const ssize_t got = read(fd, head, sizeof(head));
+    close(fd);
+
+    if (got < SPOOL_ZSTD_HEADER_SIZE) {
+        return false;
+    }
+
+    // while plain messages are left, one that starts like an encrypted one is only encrypted if it decrypts
+    if (spool_crypt_enabled && memcmp(head, SPOOL_CRYPT_MAGIC, 4) == 0
+            && (!spool_crypt_plain_left || spool_recovery_message_decrypts(dir_fd, name, size))) {
+        *encrypted = true;
+        return size >= spool_crypt_size(1);
+    }
+
+    if (size > (SPOOL_ZSTD_HEADER_SIZE + SPOOL_MAX_MESSAGE_SIZE)) {
+        return false;
+    }
+
+    if (spool_name_is_compressed(name)) {
+        const uint32_t raw_length = get_u32_be(head + 4);
+        return size > SPOOL_ZSTD_HEADER_SIZE && memcmp(head, SPOOL_ZSTD_MAGIC, 4) == 0 && raw_length >= min_size
+               && raw_length <= SPOOL_MAX_MESSAGE_SIZE;
+    }
+
+    if (name_has_suffix(name, CONFERENCE_RECORD_SUFFIX)) {
+        return size >= CONFERENCE_RECORD_HEADER_SIZE + min_size && memcmp(head, CONFERENCE_RECORD_MAGIC, 4) == 0;
+    }
+
+    return size >= min_size;
+}
+
+// write an encrypted copy of a stored message that was written before there was a passphrase
+bool spool_recovery_encrypt_file(spool_recovery_dir *d, const char *name, uint64_t size)
+{
+    const size_t path_size = strlen(msgsDir) + 1 + sizeof(d->name) + 2 + strlen(name) + 20;
+    char msgPath[path_size];
+    char tmpPath[path_size];
+    char encryptedPath[path_size];
+    snprintf(msgPath, path_size, "%s/%s/%s", msgsDir, d->name, name);
+    snprintf(tmpPath, path_size, "%s/%s/.%s%s", msgsDir, d->name, name, SPOOL_RECOVERY_TMP_SUFFIX);
+    snprintf(encryptedPath, path_size, "%s/%s/.%s%s", msgsDir, d->name, name, SPOOL_RECOVERY_ENCRYPTED_SUFFIX);
+
+    size_t length = 0;
+    uint8_t *data = spool_read_file(msgPath, (size_t)size, &length);
+    char **names = NULL;
+
+    if (data == NULL || !spool_crypt_write_file(tmpPath, encryptedPath, data, length)
+            || (names = realloc(d->encrypted_names, (d->encrypted_count + 1) * sizeof(char *))) == NULL) {
+        free(data);
+        return false;
+    }
+
+    free(data);
+    d->encrypted_names = names;
+    d->encrypted_names[d->encrypted_count] = strdup(name);
+
+    if (d->encrypted_names[d->encrypted_count] == NULL) {
+        unlink(encryptedPath);
+        return false;
+    }
+
+    d->encrypted_count++;
+    return true;
+}
+
+void spool_recovery_move_damaged(spool_recovery_dir *d, int dir_fd, const char *name)
+{
+    char damagedPath[strlen(msgsDamagedDir) + 1 + sizeof(d->name) + 1 + strlen(name) + 1];
+    snprintf(damagedPath, sizeof(damagedPath), "%s/%s_%s", msgsDamagedDir, d->name, name);
+    mkdir(msgsDamagedDir, S_IRWXU);
+
+    if (renameat(dir_fd, name, AT_FDCWD, damagedPath) == 0) {
+        d->report.damaged++;
+        // its __MSGID__ files
+        spool_recovery_unlink_message(dir_fd, name);
+    }
+}
+
+// runs on a spool recovery thread
+void spool_recovery_check_file(spool_recovery_dir *d, int dir_fd, const char *name)
+{
+    spool_recovery_report *r = &d->report;
+
+    if (name[0] == '.') {
+        if (name_has_suffix(name, SPOOL_RECOVERY_TMP_SUFFIX) || name_has_suffix(name, SPOOL_RECOVERY_ENCRYPTED_SUFFIX)) {
+            unlinkat(dir_fd, name, 0);
+        }
+
+        return;
+    }
+
+    r->files++;
+
+    if (!spool_is_message_file(name)) {
+        // "<message name>__<MSGID>__" belongs to the message
+        const char *sep = strstr(name, "__");
+        char base_name[NAME_MAX + 1];
+        struct stat st;
+        snprintf(base_name, sizeof(base_name), "%.*s", (sep != NULL) ? (int)(sep - name) : 0, name);
+
+        if (base_name[0] != '\0' && fstatat(dir_fd, base_name, &st, 0) == 0) {
+            d->in_use = true;
+        } else if (unlinkat(dir_fd, name, 0) == 0) {
+            r->orphans++;
+        }
+
+        return;
+    }
+
+    d->in_use = true;
+
+    if (strcmp(name, spool_counted_from_name) >= 0) {
+        // written by this run, already counted
+        return;
+    }
+
+    struct stat st;
+    bool encrypted = false;
+
+    if (fstatat(dir_fd, name, &st, 0) != 0 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+
+    if (st.st_size == 0) {
+        spool_recovery_unlink_message(dir_fd, name);
+        r->zero_byte++;
+    } else if (!spool_recovery_message_is_valid(dir_fd, name, (uint64_t)st.st_size, &encrypted)) {
+        spool_recovery_move_damaged(d, dir_fd, name);
+    } else if (!spool_crypt_enabled || encrypted || !spool_recovery_encrypt_file(d, name, (uint64_t)st.st_size)) {
+        if (spool_crypt_enabled && !encrypted) {
+            r->plain++;
+        }
+
+        d->bytes += (uint64_t)st.st_size;
+        d->messages++;
+    }
+}
+
+bool spool_recovery_stopping(void)
+{
+    pthread_mutex_lock(&spool_recovery.lock);
+    const bool stop = spool_recovery.stop;
+    pthread_mutex_unlock(&spool_recovery.lock);
+    return stop;
+}
+
+void spool_recovery_check_dir(spool_recovery_dir *d)
+{
+    const int fd = openat(spool_recovery.msgs_fd, d->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dfd = (fd >= 0) ? fdopendir(fd) : NULL;
+
+    if (dfd == NULL) {
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        // not there anymore, or can't be read: don't remove it
+        d->in_use = true;
+        return;
+    }
+
+    struct dirent *dp = NULL;
+
+    while (!spool_recovery_stopping() && (dp = readdir(dfd)) != NULL) {
+        spool_recovery_check_file(d, dirfd(dfd), dp->d_name);
+    }
+
+    closedir(dfd);
+}
+
+void *spool_recovery_thread(void *data)
+{
+    while (1) {
+        pthread_mutex_lock(&spool_recovery.lock);
+        const size_t i = spool_recovery.next++;
+        const bool stop = spool_recovery.stop;
+        pthread_mutex_unlock(&spool_recovery.lock);
+
+        if (stop || i >= spool_recovery.dirs_count) {
+            break;
+        }
+
+        spool_recovery_check_dir(&spool_recovery.dirs[i]);
+
+        pthread_mutex_lock(&spool_recovery.lock);
+        spool_recovery.dirs[i].done = true;
+        pthread_mutex_unlock(&spool_recovery.lock);
+    }
+
+    return NULL;
+}
+
+// look at the entries of msgsDir, take what the checkpoint knows and start "threads" threads for the rest
+void spool_recovery_start(Tox *tox, int threads)
+{
+    spool_recovery_report *r = &spool_recovery.report;
+
+    CLEAR(spool_recovery);
+    spool_recovery.msgs_fd = -1;
+    spool_recovery.start_usec = get_monotonic_usec();
+
+    spool_seq_name_prefix(spool_seq_next_value, spool_counted_from_name, sizeof(spool_counted_from_name));
+
+    mkdir(msgsDir, S_IRWXU);
+    DIR *dfd_m = opendir(msgsDir);
+    char **names = NULL;
+    const size_t names_count = (dfd_m != NULL) ? spool_read_sorted_names(dfd_m, &names) : 0;
+
+    if (dfd_m == NULL || (names_count > 0 && names == NULL)
+            || (spool_recovery.dirs = calloc(names_count + 1, sizeof(spool_recovery_dir))) == NULL) {
+        toxProxyLog(0, "spool recovery: can not open %s", msgsDir);
+
+        if (dfd_m != NULL) {
+            closedir(dfd_m);
+        }
+
+        spool_free_names(names, names_count);
+        spool_quota_ready = true;
+        return;
+    }
+
+    spool_recovery.msgs_fd = dup(dirfd(dfd_m));
+
+    for (size_t i = 0; i < names_count; i++) {
+        const char *name = names[i];
+        uint8_t key_bin[TOX_PUBLIC_KEY_SIZE];
+        struct stat st;
+
+        if (name[0] == '.' || fstatat(dirfd(dfd_m), name, &st, 0) != 0) {
+            continue;
+        }
+
+        if (!S_ISDIR(st.st_mode) || strlen(name) != (TOX_PUBLIC_KEY_SIZE * 2)
+                || hex_string_to_bin(name, TOX_PUBLIC_KEY_SIZE * 2, (char *)key_bin, sizeof(key_bin)) != 0) {
+            r->unknown++;
+            toxProxyLog(1, "spool recovery: %s/%s is not a sender dir, leaving it alone", msgsDir, name);
+            continue;
+        }
+
+        spool_account *acc = spool_account_get(name);
+
+        if (acc == NULL) {
+            continue;
+        }
+
+        // the accounts don't know which senders are conferences until a line comes in
+        if (tox_conference_by_id(tox, key_bin, NULL) != UINT32_MAX) {
+            acc->is_conference = true;
+        } else if (tox_friend_by_public_key(tox, key_bin, NULL) == UINT32_MAX) {
+            r->stale_dirs++;
+            toxProxyLog(1, "spool recovery: %s is no friend or conference anymore, keeping its messages", name);
+        }
+
+        r->dirs++;
+
+        if (spool_index_take(acc, &st)) {
+            r->from_checkpoint++;
+            continue;
+        }
+
+        spool_recovery_dir *d = &spool_recovery.dirs[spool_recovery.dirs_count++];
+        snprintf(d->name, sizeof(d->name), "%s", name);
+    }
+
+    spool_free_names(names, names_count);
+    closedir(dfd_m);
+    // the mapping is not needed anymore
+    spool_index_unload();
+
+    pthread_mutex_init(&spool_recovery.lock, NULL);
+    spool_recovery.running = true;
+
+    for (int t = 0; t < threads && t < SPOOL_INDEX_THREADS && (size_t)t < spool_recovery.dirs_count; t++) {
+        spool_recovery.started[t] = (pthread_create(&spool_recovery.tids[t], NULL, spool_recovery_thread, NULL) == 0);
+    }
+
+    if (spool_recovery.dirs_count > 0 && !spool_recovery.started[0]) {
+        // no threads, check it all right here
+        spool_recovery_thread(NULL);
+    }
+
+    toxProxyLog(2, "spool recovery: %u sender dirs, %u from the checkpoint, checking %u", r->dirs, r->from_checkpoint,
+                (unsigned)spool_recovery.dirs_count);
+}
+
+// the kill switch: the threads stop after the file they are at and are joined, nothing of the spool is
+// written by them after this
+void spool_recovery_stop(void)
+{
+    if (!spool_recovery.running) {
+        return;
+    }
+
+    pthread_mutex_lock(&spool_recovery.lock);
+    spool_recovery.stop = true;
+    pthread_mutex_unlock(&spool_recovery.lock);
+
+    for (int t = 0; t < SPOOL_INDEX_THREADS; t++) {
+        if (spool_recovery.started[t]) {
+            pthread_join(spool_recovery.tids[t], NULL);
+            spool_recovery.started[t] = false;
+        }
+    }
+}
+
+// take over what a thread found in a dir. returns false if the time was up before everything was done
+bool spool_recovery_merge_dir(spool_recovery_dir *d, uint64_t deadline)
+{
+    spool_recovery_report *r = &spool_recovery.report;
+    const int dir_fd = openat(spool_recovery.msgs_fd, d->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    // the encrypted copies replace the plain messages, unless a receipt has deleted them meanwhile
+    while (d->encrypted_next < d->encrypted_count && dir_fd >= 0) {
+        if (get_monotonic_usec() >= deadline) {
+            close(dir_fd);
+            return false;
+        }
+
+        char *name = d->encrypted_names[d->encrypted_next++];
+        char encrypted_name[strlen(name) + strlen(SPOOL_RECOVERY_ENCRYPTED_SUFFIX) + 2];
+        snprintf(encrypted_name, sizeof(encrypted_name), ".%s%s", name, SPOOL_RECOVERY_ENCRYPTED_SUFFIX);
+        struct stat st;
+
+        if (fstatat(dir_fd, name, &st, 0) == 0 && renameat(dir_fd, encrypted_name, dir_fd, name) == 0) {
+            r->encrypted++;
+        } else {
+            unlinkat(dir_fd, encrypted_name, 0);
+
+            if (fstatat(dir_fd, name, &st, 0) == 0) {
+                r->plain++;
+            }
+        }
+
+        if (fstatat(dir_fd, name, &st, 0) == 0) {
+            d->bytes += (uint64_t)st.st_size;
+            d->messages++;
+        }
+
+        free(name);
+    }
+
+    while (d->encrypted_next < d->encrypted_count) {
+        free(d->encrypted_names[d->encrypted_next++]);
+    }
+
+    free(d->encrypted_names);
+    d->encrypted_names = NULL;
+
+    if (dir_fd >= 0) {
+        close(dir_fd);
+    }
+
+    spool_account *acc = spool_account_get(d->name);
+
+    if (acc != NULL) {
+        spool_account_add_many(acc, d->bytes, d->messages);
+        acc->counted = true;
+    }
+
+    // files written into it since the thread looked make this fail, that's fine
+    if (!d->in_use && unlinkat(spool_recovery.msgs_fd, d->name, AT_REMOVEDIR) == 0) {
+        r->empty_dirs++;
+    }
+
+    r->files += d->report.files;
+    r->zero_byte += d->report.zero_byte;
+    r->orphans += d->report.orphans;
+    r->damaged += d->report.damaged;
+    r->plain += d->report.plain;
+    return true;
+}
+
+void spool_recovery_finish(void)
+{
+    spool_recovery_report *r = &spool_recovery.report;
+
+    for (int t = 0; t < SPOOL_INDEX_THREADS; t++) {
+        if (spool_recovery.started[t]) {
+            pthread_join(spool_recovery.tids[t], NULL);
+        }
+    }
+
+    pthread_mutex_destroy(&spool_recovery.lock);
+    free(spool_recovery.dirs);
+    spool_recovery.dirs = NULL;
+    close(spool_recovery.msgs_fd);
+    spool_recovery.msgs_fd = -1;
+    spool_recovery.running = false;
+    spool_recovery.report_pending = true;
+    spool_quota_ready = true;
+    r->elapsed_ms = (uint32_t)((get_monotonic_usec() - spool_recovery.start_usec) / 1000);
+    startup_indexed_ms = (uint32_t)((get_monotonic_usec() - startup_usec) / 1000);
+
+    toxProxyLog(2, "spool recovery: checked %u files in %u dirs in %u ms (%u dirs from the checkpoint)", r->files,
+                r->dirs, r->elapsed_ms, r->from_checkpoint);
+
+    if (r->zero_byte > 0 || r->orphans > 0 || r->damaged > 0 || r->empty_dirs > 0) {
+        toxProxyLog(1, "spool recovery: removed %u zero byte messages, %u orphaned __MSGID__ files, %u empty dirs,"
+                    " moved %u damaged messages to %s", r->zero_byte, r->orphans, r->empty_dirs, r->damaged, msgsDamagedDir);
+    }
+
+    if (r->encrypted > 0) {
+        toxProxyLog(2, "spool recovery: encrypted %u stored messages", r->encrypted);
+    }
+
+    if (spool_crypt_plain_left && r->plain == 0) {
+        // every stored message is encrypted now, from here on one that does not decrypt is damaged
+        if (unlink(spool_plain_filename) == 0) {
+            spool_crypt_plain_left = false;
+        }
+    } else if (r->plain > 0) {
+        toxProxyLog(1, "spool recovery: %u stored messages could not be encrypted", r->plain);
+    }
+
+    if (r->unknown > 0 || r->stale_dirs > 0) {
+        toxProxyLog(1, "spool recovery: %u unknown entries in %s, %u dirs of removed friends or conferences", r->unknown,
+                    msgsDir, r->stale_dirs);
+    }
+
+    toxProxyLog(2, "spool: %u messages, %llu bytes from %u senders", spool_total_messages,
+                (unsigned long long)spool_total_bytes, spool_accounts_used);
+
+    if (startup_online_ms > 0) {
+        toxProxyLog(2, "startup: online after %u ms, spool fully indexed after %u ms", startup_online_ms,
+                    startup_indexed_ms);
+    } else {
+        toxProxyLog(2, "startup: spool fully indexed after %u ms, not online yet", startup_indexed_ms);
+    }
+
+    spool_index_save();
+}
+
+// take over the results of the threads for about budget_usec. returns true once everything is done.
+bool spool_recovery_step(uint64_t budget_usec)
+{
+    if (!spool_recovery.running) {
+        return true;
+    }
+
+    const uint64_t deadline = get_monotonic_usec() + budget_usec;
+
+    for (size_t i = 0; i < spool_recovery.dirs_count; i++) {
+        spool_recovery_dir *d = &spool_recovery.dirs[i];
+
+        if (d->merged) {
+            continue;
+        }
+
+        pthread_mutex_lock(&spool_recovery.lock);
+        const bool done = d->done;
+        pthread_mutex_unlock(&spool_recovery.lock);
+
+        if (!done) {
+            continue;
+        }
+
+        if (!spool_recovery_merge_dir(d, deadline)) {
+            return false;
+        }
+
+        d->merged = true;
+        spool_recovery.merged++;
+    }
+
+    if (spool_recovery.merged < spool_recovery.dirs_count) {
+        return false;
+    }
+
+    spool_recovery_finish();
+    return true;
+}
+
+// called once tox is online for the first time
+void startup_went_online(void)
+{
+    if (startup_online_ms > 0) {
+        return;
+    }
+
+    startup_online_ms = (uint32_t)((get_monotonic_usec() - startup_usec) / 1000);
+
+    if (startup_online_ms == 0) {
+        startup_online_ms = 1;
+    }
+
+    if (spool_recovery.running) {
+        toxProxyLog(2, "startup: online after %u ms, spool still being indexed", startup_online_ms);
+    } else {
+        toxProxyLog(2, "startup: online after %u ms, spool fully indexed after %u ms", startup_online_ms,
+                    startup_indexed_ms);
+    }
+}
+// ----------- spool recovery -----------
+
+// ----------- ingress limits -----------
+// every message of a friend (not the master) and every conference line takes a token from the bucket of
+// its friend / conference number first, without a token it is dropped. buckets fill up at the rate per minute
+// to the burst size. friend messages then have to pass the duplicate check: a resend of a message that is
+// in the message id index is dropped. both run before the message is copied or written anywhere. ids only
+// go into the index once their message is stored, a message that could not be stored is taken again
+// when the friend resends it.
+#define INGRESS_TOKEN_UNIT 60000000ULL // one token, in 1/60000000 so a rate per minute adds whole units per usec
+
+typedef struct ingress_bucket {
+    uint64_t level;
+    uint64_t last_usec;
+    uint32_t accepted;
+    uint32_t dropped;
+    // dropping right now, logged once when it starts
+    bool limited;
+} ingress_bucket;
+
+typedef struct ingress_stats {
+    uint32_t friend_accepted;
+    uint32_t friend_limited;
+    uint32_t duplicates;
+    uint32_t conference_accepted;
+    uint32_t conference_limited;
+} ingress_stats;
+
+ingress_stats ingress_totals;
+ingress_bucket *ingress_friend_buckets = NULL;
+uint32_t ingress_friend_buckets_size = 0;
+ingress_bucket *ingress_conference_buckets = NULL;
+uint32_t ingress_conference_buckets_size = 0;
+
+ingress_bucket *ingress_bucket_get(ingress_bucket **buckets, uint32_t *size, uint32_t number)
+{
+    if (number >= *size) {
+        uint32_t new_size = (*size == 0) ? 16 : *size;
+
+        while (number >= new_size && new_size < (UINT32_MAX / 2)) {
+            new_size *= 2;
+        }
+
+        if (number >= new_size) {
+            return NULL;
+        }
+
+        ingress_bucket *b = realloc(*buckets, new_size * sizeof(ingress_bucket));
+
+        if (b == NULL) {
+            return NULL;
+        }
+
+        memset(b + *size, 0, (new_size - *size) * sizeof(ingress_bucket));
+        *buckets = b;
+        *size = new_size;
+    }
+
+    return &(*buckets)[number];
+}
+
+bool ingress_bucket_take(ingress_bucket *b, uint32_t per_min, uint32_t burst)
+{
+    const uint64_t now = get_monotonic_usec();
+    const uint64_t full = (uint64_t)burst * INGRESS_TOKEN_UNIT;
+
+    if (b->last_usec == 0 || (now - b->last_usec) >= (full / per_min)) {
+        b->level = full;
+    } else {
+        b->level += (now - b->last_usec) * per_min;
+
+        if (b->level > full) {
+            b->level = full;
+        }
+    }
+
+    b->last_usec = now;
+
+    if (b->level < INGRESS_TOKEN_UNIT) {
+        b->dropped++;
+        return false;
+    }
+
+    b->level -= INGRESS_TOKEN_UNIT;
+    b->accepted++;
+    return true;
+}
+
+// false if the message must be dropped, raw_message is a messageV2 of a friend that is not the master
+bool ingress_friend_admit(Tox *tox, uint32_t friend_number, const uint8_t *raw_message, size_t raw_message_len)
+{
+    ingress_bucket *b = ingress_bucket_get(&ingress_friend_buckets, &ingress_friend_buckets_size, friend_number);
+
+    if (b != NULL && !ingress_bucket_take(b, INGRESS_FRIEND_MSGS_PER_MIN, INGRESS_FRIEND_BURST)) {
+        ingress_totals.friend_limited++;
+
+        if (!b->limited) {
+            b->limited = true;
+            toxProxyLog(1, "ingress: friend %u sends too fast, dropping its messages", friend_number);
+        }
+
+        return false;
+    }
+
+    if (b != NULL) {
+        b->limited = false;
+    }
+
+    uint8_t sender_pubkey[TOX_PUBLIC_KEY_SIZE];
+
+    if (raw_message_len >= TOX_PUBLIC_KEY_SIZE
+            && tox_friend_get_public_key(tox, friend_number, sender_pubkey, NULL)) {
+        uint8_t msg_id[TOX_PUBLIC_KEY_SIZE];
+        uint8_t id_hash[MSGID_INDEX_HASH_SIZE];
+        tox_messagev2_get_message_id(raw_message, msg_id);
+        msgid_index_hash(sender_pubkey, msg_id, id_hash);
+
+        if (msgid_index_contains(id_hash)) {
+            ingress_totals.duplicates++;
+            toxProxyLog(2, "ingress: dropped duplicate message of friend %u", friend_number);
+            return false;
+        }
+    }
+
+    ingress_totals.friend_accepted++;
+    return true;
+}
+
+// false if the conference line must be dropped
+bool ingress_conference_admit(uint32_t conference_number)
+{
+    ingress_bucket *b = ingress_bucket_get(&ingress_conference_buckets, &ingress_conference_buckets_size,
+                                           conference_number);
+
+    if (b != NULL && !ingress_bucket_take(b, INGRESS_CONFERENCE_LINES_PER_MIN, INGRESS_CONFERENCE_BURST)) {
+        ingress_totals.conference_limited++;
+
+        if (!b->limited) {
+            b->limited = true;
+            toxProxyLog(1, "ingress: conference %u is too busy, dropping lines", conference_number);
+        }
+
+        return false;
+    }
+
+    if (b != NULL) {
+        b->limited = false;
+    }
+
+    ingress_totals.conference_accepted++;
+    return true;
+}
+// ----------- ingress limits -----------
+
+void friend_request_cb(Tox *tox, const uint8_t *public_key, const uint8_t *message, size_t length, void *user_data)
+{
+    char public_key_hex[tox_public_key_hex_size];
+    CLEAR(public_key_hex);
+    bin2upHex(public_key, tox_public_key_size(), public_key_hex, tox_public_key_hex_size);
+
+    size_t friends = tox_self_get_friend_list_size(tox);
+
+    if (friends == 0) {
+        // add first friend as master for this proxy
+        add_master(public_key_hex);
+        tox_friend_add_norequest(tox, public_key, NULL);
+        updateToxSavedata(tox);
+    } else {
+        // once I have a master, I don't add friend's on request, only by command of my master!
+        return;
+    }
+
+    toxProxyLog(2, "Got currently %zu friends. New friend request from %s with message: %s",
+                friends, public_key_hex, message);
+
+    friends = tox_self_get_friend_list_size(tox);
+    toxProxyLog(2, "Added friend: %s. Number of total friends: %zu", public_key_hex, friends);
+}
+
+void friend_message_cb(Tox *tox, uint32_t friend_number, TOX_MESSAGE_TYPE type, const uint8_t *message, size_t length,
+                       void *user_data)
+{
+    char *default_msg = "YOU are using the old Message format! this is not supported!";
+    tox_friend_send_message(tox, friend_number, type, (uint8_t *) default_msg, strlen(default_msg), NULL);
+
+    toxProxyLog(2, "YOU are using the old Message: fnum=%d", friend_number);
+}
+
+//
+// cut message at 999 chars length !!
+//
+void send_text_message_to_friend(Tox *tox, uint32_t friend_number, const char *fmt, ...)
+{
+    toxProxyLog(9, "sending message to friend %d", friend_number);
+    char msg2[1000];
+    CLEAR(msg2);
+    size_t length = 0;
+
+    if (fmt == NULL) {
+        toxProxyLog(9, "send_text_message_to_friend:no message to send");
+        return;
+    }
+
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(msg2, 999, fmt, ap);
+    va_end(ap);
+    length = (size_t) strlen(msg2);
+#ifdef TOX_HAVE_TOXUTIL
+    uint32_t ts_sec = (uint32_t) get_unix_time();
+    tox_util_friend_send_message_v2(tox, friend_number, TOX_MESSAGE_TYPE_NORMAL, ts_sec, (const uint8_t *) msg2, length,
+                                    NULL, NULL, NULL, NULL);
+#else
+    // old message format, not support by this proxy!
+    tox_friend_send_message(tox, friend_number, TOX_MESSAGE_TYPE_NORMAL, (uint8_t *)msg2, length, NULL);
+#endif
+}
+
+void friendlist_onConnectionChange(Tox *tox, uint32_t friend_number, TOX_CONNECTION connection_status, void *user_data)
+{
+
+    toxProxyLog(2, "friendlist_onConnectionChange:*READY*:friendnum=%d %d", (int) friend_number, (int) connection_status);
+
+    master_devices_connection_change(tox, friend_number, connection_status);
+    file_transfers_connection_change(friend_number, connection_status);
+}
+
+void self_connection_status_cb(Tox *tox, TOX_CONNECTION connection_status, void *user_data)
+{
+    switch (connection_status) {
+        case TOX_CONNECTION_NONE:
+            toxProxyLog(2, "Connection Status changed to: Offline");
+            my_connection_status = TOX_CONNECTION_NONE;
+            on_offline();
+            break;
+
+        case TOX_CONNECTION_TCP:
+            toxProxyLog(2, "Connection Status changed to: Online via TCP");
+            my_connection_status = TOX_CONNECTION_TCP;
+            startup_went_online();
+            on_online();
+            break;
+
+        case TOX_CONNECTION_UDP:
+            toxProxyLog(2, "Connection Status changed to: Online via UDP");
+            my_connection_status = TOX_CONNECTION_UDP;
+            startup_went_online();
+            on_online();
+            break;
+    }
+}
+
+void conference_invite_cb(Tox *tox, uint32_t friend_number, TOX_CONFERENCE_TYPE type, const uint8_t *cookie,
+                          size_t length, void *user_data)
+{
+    if (!is_master_friendnumber(tox, friend_number)) {
+        toxProxyLog(0, "received conference invite from somebody who's not master!");
+        return;
+    }
+
+    toxProxyLog(0, "received conference invite from fnum:%d", friend_number);
+    long conference_num = tox_conference_join(tox, friend_number, cookie, length, NULL);
+
+    toxProxyLog(0, "received conference join: res=%d", (int)conference_num);
+
+    if (conference_num >= 0 && (uint32_t)conference_num != UINT32_MAX) {
+        conference_ingest_forget((uint32_t)conference_num);
+    }
+
+    updateToxSavedata(tox);
+}
+
+void conference_message_cb(Tox *tox, uint32_t conference_number, uint32_t peer_number, TOX_MESSAGE_TYPE type,
+                           const uint8_t *message, size_t length, void *user_data)
+{
+    toxProxyLog(9, "received conference text message conf:%d peer:%d", conference_number, peer_number);
+
+    if (!ingress_conference_admit(conference_number)) {
+        return;
+    }
+
+    conference_ingest *ci = conference_ingest_get(tox, conference_number);
+
+    if (ci == NULL) {
+        return;
+    }
+
+    const conference_peer_cache_entry *peer = conference_ingest_peer(tox, ci, conference_number, peer_number);
+
+    if (peer == NULL) {
+        toxProxyLog(0, "received conference from peer without pubkey?");
+        return;
+    }
+
+    if (peer->is_master) {
+        toxProxyLog(9, "received conference text message from master");
+        return;
+    }
+
+    conference_ingest_buffer_line(ci, peer, message, length);
+
+    if (ci->lines_count >= CONFERENCE_MAX_BUFFERED_LINES) {
+        conference_ingest_flush();
+    }
+}
+
+void conference_peer_list_changed_cb(Tox *tox, uint32_t conference_number, void *user_data)
+{
+    conference_ingest_invalidate_peers(conference_number);
+    updateToxSavedata(tox);
+}
+
+void friend_sync_message_v2_cb(Tox *tox, uint32_t friend_number, const uint8_t *message, size_t length)
+{
+    toxProxyLog(9, "enter friend_sync_message_v2_cb");
+}
+
+// ----------- receipt aggregator -----------
+// a friend that reads many messages of the master at once sends as many read receipts. they are buffered per
+// friend and handled together every RECEIPT_COALESCE_SECS (or when RECEIPT_COALESCE_MAX are waiting):
+// one pass over the spool finds the receipts for messages that went out with the per message sync (the
+// master devices confirming what they got, see receipts_match_synced()), the rest of the receipts of a friend
+// is stored as receipt records of up to RECEIPT_RECORD_MAX_RECEIPTS, without a push ping.
+// a receipt record is a stored RECEIPT_RECORD_SUFFIX file (the name tells it from an answer of the friend):
+// [RECEIPT_RECORD_MAGIC][count u16][count * ([msg id 32][ts sec u32])]
+// bulk sync sends it as one record to masters with BULK_SYNC_FEATURE_RECEIPT_RECORD, the per message
+// sync sends one ANSWER messageV2 per receipt (like a receipt was stored before) and the record is deleted
+// when the master confirmed all of them. the __MSGID__ file of such an ANSWER is
+// [entry u16][count u16][confirmed u8][master device u8] (older ones without the device are device 0).
+// an entry is sent to a device once: a sync pass only sends the entries that have no __MSGID__ file for
+// that device yet (the file of a send that failed is removed right away).
+#define RECEIPT_RECORD_MAGIC "TPa1"
+#define RECEIPT_RECORD_SUFFIX ".txtR"
+#define RECEIPT_RECORD_HEADER_SIZE (4 + 2)
+#define RECEIPT_RECORD_ENTRY_SIZE (TOX_PUBLIC_KEY_SIZE + 4)
+#define RECEIPT_RECORD_SIDECAR_SIZE (2 + 2 + 1 + 1)
+// "__<msg id as 64 hex chars>__" at the end of the __MSGID__ files
+#define END_PART_GLOB_LEN 68
+
+typedef struct receipt_pending {
+    uint8_t msgid[TOX_PUBLIC_KEY_SIZE];
+    uint32_t ts_sec;
+    uint32_t friend_number;
+    bool matched;
+} receipt_pending;
+
+typedef struct receipt_batch {
+    receipt_pending *receipts;
+    uint32_t count;
+    uint32_t size;
+} receipt_batch;
+
+receipt_batch *receipt_batches = NULL;
+uint32_t receipt_batches_size = 0;
+uint32_t receipt_pending_count = 0;
+time_t receipt_first_pending_ts = 0;
+
+bool receipt_record_check(const char *name, const uint8_t *data, size_t length)
+{
+    return name_has_suffix(name, RECEIPT_RECORD_SUFFIX) && (length >= RECEIPT_RECORD_HEADER_SIZE) && (memcmp(data, RECEIPT_RECORD_MAGIC, 4) == 0)
+           && (length == RECEIPT_RECORD_HEADER_SIZE + (size_t)get_u16_be(data + 4) * RECEIPT_RECORD_ENTRY_SIZE);
+}
+
+int receipt_cmp_msgid(const void *a, const void *b)
+{
+    return memcmp((*(receipt_pending * const *)a)->msgid, (*(receipt_pending * const *)b)->msgid,
+                  TOX_PUBLIC_KEY_SIZE);
+}
+
+// reads the __MSGID__ files of the receipt record base_name of sender_key_hex for master device: sent[entry]
+// is set for every entry that went out to it, confirmed[entry] for the ones it confirmed (both
+// RECEIPT_RECORD_MAX_RECEIPTS). *count is the number of entries the files tell (UINT32_MAX without any),
+// returns how many are confirmed.
+uint32_t receipt_record_scan(const char *sender_key_hex, const char *base_name, int device, bool *sent,
+                             bool *confirmed, uint32_t *count)
+{
+    char friendDir[strlen(msgsDir) + 1 + strlen(sender_key_hex) + 1];
+    snprintf(friendDir, sizeof(friendDir), "%s/%s", msgsDir, sender_key_hex);
+    DIR *dfd = opendir(friendDir);
+    uint32_t confirmed_count = 0;
+    memset(sent, 0, RECEIPT_RECORD_MAX_RECEIPTS * sizeof(bool));
+    memset(confirmed, 0, RECEIPT_RECORD_MAX_RECEIPTS * sizeof(bool));
+    *count = UINT32_MAX;
+
+    if (dfd == NULL) {
+        return 0;
+    }
+
+    const size_t base_len = strlen(base_name);
+    struct dirent *dp = NULL;
+
+    while ((dp = readdir(dfd)) != NULL) {
+        if (strncmp(dp->d_name, base_name, base_len) != 0 || strncmp(dp->d_name + base_len, "__", 2) != 0
+                || dp->d_name[base_len + 2] == '@') {
+            continue;
+        }
+
+        uint8_t sidecar[RECEIPT_RECORD_SIDECAR_SIZE];
+        int sfd = openat(dirfd(dfd), dp->d_name, O_RDONLY);
+
+        if (sfd < 0) {
+            continue;
+        }
+
+        const ssize_t got = read(sfd, sidecar, sizeof(sidecar));
+        close(sfd);
+        const uint16_t entry = get_u16_be(sidecar);
+
+        if (got < (ssize_t)sizeof(sidecar) - 1 || entry >= RECEIPT_RECORD_MAX_RECEIPTS
+                || ((got == (ssize_t)sizeof(sidecar)) ? sidecar[5] : 0) != device) {
+            continue;
+        }
+
+        *count = get_u16_be(sidecar + 2);
+        sent[entry] = true;
+
+        if (sidecar[4] != 0 && !confirmed[entry]) {
+            confirmed[entry] = true;
+            confirmed_count++;
+        }
+    }
+
+    closedir(dfd);
+    return confirmed_count;
+}
+
+// the master device of friend_number has the stored message base_name (the receipt came for its
+// __MSGID__ file sidecar_name): delete it, or only mark it while other devices still need it
+void receipt_synced_message_acked(Tox *tox, uint32_t friend_number, const char *sender_key_hex, int dir_fd,
+                                  const char *base_name, const char *sidecar_name)
+{
+    const int device = master_device_index_by_friend(tox, friend_number);
+
+    // a receipt record went out as one message per receipt, the device has it when each of them came back
+    if (name_has_suffix(base_name, RECEIPT_RECORD_SUFFIX)) {
+        const uint8_t confirmed = 1;
+        int fd = openat(dir_fd, sidecar_name, O_WRONLY);
+
+        if (fd >= 0) {
+            if (pwrite(fd, &confirmed, 1, 4) != 1) {
+                toxProxyLog(1, "receipts: could not mark %s/%s", sender_key_hex, sidecar_name);
+            }
+
+            close(fd);
+        }
+
+        bool entry_sent[RECEIPT_RECORD_MAX_RECEIPTS];
+        bool entry_confirmed[RECEIPT_RECORD_MAX_RECEIPTS];
+        uint32_t count = 0;
+        const uint32_t confirmed_count = receipt_record_scan(sender_key_hex, base_name, (device < 0) ? 0 : device,
+                                         entry_sent, entry_confirmed, &count);
+
+        if (confirmed_count < count) {
+            return;
+        }
+    }
+
+    if (device < 0 || master_device_got_message(spool_account_get(sender_key_hex), dir_fd, base_name, device)) {
+        spool_delete_message_files(sender_key_hex, base_name);
+        toxProxyLog(2, "receipts: deleted %s/%s*", sender_key_hex, base_name);
+    } else {
+        toxProxyLog(2, "receipts: kept %s/%s for the other master devices", sender_key_hex, base_name);
+    }
+}
+
+// one pass over the spool for all receipts (sorted by msg id): a receipt whose id is the one of a
+// __MSGID__ file is the confirmation of a message sent with the per message sync. returns how many matched.
+uint32_t receipts_match_synced(Tox *tox, receipt_pending **sorted, uint32_t count)
+{
+    uint32_t matched = 0;
+
+    mkdir(msgsDir, S_IRWXU);
+    DIR *dfd_m = opendir(msgsDir);
+
+    if (dfd_m == NULL) {
+        return 0;
+    }
+
+    struct dirent *dp_m = NULL;
+
+    while ((dp_m = readdir(dfd_m)) != NULL && matched < count) {
+        if (dp_m->d_name[0] == '.') {
+            continue;
+        }
+
+        char friendDir[strlen(msgsDir) + 1 + strlen(dp_m->d_name) + 1];
+        snprintf(friendDir, sizeof(friendDir), "%s/%s", msgsDir, dp_m->d_name);
+        DIR *dfd = opendir(friendDir);
+
+        if (dfd == NULL) {
+            continue;
+        }
+
+        struct dirent *dp = NULL;
+
+        while ((dp = readdir(dfd)) != NULL) {
+            const size_t len = strlen(dp->d_name);
+
+            if (len <= END_PART_GLOB_LEN || dp->d_name[len - 1] != '_') {
+                continue;
+            }
+
+            const char *end_part = dp->d_name + len - END_PART_GLOB_LEN;
+            receipt_pending key;
+
+            if (strncmp(end_part, "__", 2) != 0 || strcmp(end_part + END_PART_GLOB_LEN - 2, "__") != 0
+                    || hex_string_to_bin(end_part + 2, TOX_PUBLIC_KEY_SIZE * 2, (char *)key.msgid, TOX_PUBLIC_KEY_SIZE) != 0) {
+                continue;
+            }
+
+            receipt_pending *key_ptr = &key;
+            receipt_pending **hit = bsearch(&key_ptr, sorted, count, sizeof(receipt_pending *), receipt_cmp_msgid);
+
+            if (hit == NULL || (*hit)->matched) {
+                continue;
+            }
+
+            (*hit)->matched = true;
+            matched++;
+
+            char base_name[NAME_MAX + 1];
+            snprintf(base_name, sizeof(base_name), "%.*s", (int)(len - END_PART_GLOB_LEN), dp->d_name);
+            toxProxyLog(2, "receipts: found the receipt for %s/%s", dp_m->d_name, dp->d_name);
+            receipt_synced_message_acked(tox, (*hit)->friend_number, dp_m->d_name, dirfd(dfd), base_name, dp->d_name);
+        }
+
+        closedir(dfd);
+    }
+
+    closedir(dfd_m);
+    return matched;
+}
+
+// store the receipts of one friend that were not for synced messages, in records of up to
+// RECEIPT_RECORD_MAX_RECEIPTS. returns how many records were written.
+uint32_t receipt_batch_store(Tox *tox, uint32_t friend_number, receipt_batch *batch)
+{
+    uint8_t public_key_bin[TOX_PUBLIC_KEY_SIZE];
+
+    if (!tox_friend_get_public_key(tox, friend_number, public_key_bin, NULL)) {
+        toxProxyLog(1, "receipts: friend %u is gone, dropping %u receipts", friend_number, batch->count);
+        return 0;
+    }
+
+    char public_key_hex[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+    bin2upHex(public_key_bin, TOX_PUBLIC_KEY_SIZE, public_key_hex, sizeof(public_key_hex));
+
+    uint8_t record[RECEIPT_RECORD_HEADER_SIZE + RECEIPT_RECORD_MAX_RECEIPTS * RECEIPT_RECORD_ENTRY_SIZE];
+    uint32_t records = 0;
+    uint32_t i = 0;
+    bool dir_ready = false;
+
+    while (i < batch->count) {
+        uint8_t *p = record + RECEIPT_RECORD_HEADER_SIZE;
+        uint16_t n = 0;
+
+        for (; i < batch->count && n < RECEIPT_RECORD_MAX_RECEIPTS; i++) {
+            if (batch->receipts[i].matched) {
+                continue;
+            }
+
+            memcpy(p, batch->receipts[i].msgid, TOX_PUBLIC_KEY_SIZE);
+            p = put_u32_be(p + TOX_PUBLIC_KEY_SIZE, batch->receipts[i].ts_sec);
+            n++;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        memcpy(record, RECEIPT_RECORD_MAGIC, 4);
+        put_u16_be(record + 4, n);
+
+        if (!dir_ready) {
+            spool_prepare_sender_dir(public_key_hex);
+            dir_ready = true;
+        }
+
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+
+        if (writeSpoolFile(public_key_hex, &tv, RECEIPT_RECORD_SUFFIX, record, (size_t)(p - record))) {
+            records++;
+        }
+    }
+
+    return records;
+}
+
+// handle the receipts that are waiting, all of them with force, otherwise only once the first one waited
+// RECEIPT_COALESCE_SECS or RECEIPT_COALESCE_MAX are waiting
+void receipt_aggregator_flush(Tox *tox, bool force)
+{
+    if (receipt_pending_count == 0 || (!force && receipt_pending_count < RECEIPT_COALESCE_MAX
+                                       && receipt_first_pending_ts + RECEIPT_COALESCE_SECS > get_unix_time())) {
+        return;
+    }
+
+    receipt_pending **sorted = calloc(receipt_pending_count, sizeof(receipt_pending *));
+    uint32_t sorted_count = 0;
+
+    if (sorted != NULL) {
+        for (uint32_t f = 0; f < receipt_batches_size; f++) {
+            for (uint32_t i = 0; i < receipt_batches[f].count; i++) {
+                sorted[sorted_count++] = &receipt_batches[f].receipts[i];
+            }
+        }
+
+        qsort(sorted, sorted_count, sizeof(receipt_pending *), receipt_cmp_msgid);
+    }
+
+    const uint32_t matched = receipts_match_synced(tox, sorted, sorted_count);
+    free(sorted);
+
+    uint32_t records = 0;
+
+    for (uint32_t f = 0; f < receipt_batches_size; f++) {
+        if (receipt_batches[f].count > 0) {
+            records += receipt_batch_store(tox, f, &receipt_batches[f]);
+            receipt_batches[f].count = 0;
+        }
+    }
+
+    toxProxyLog(2, "receipts: %u handled, %u for synced messages, %u records stored", receipt_pending_count, matched,
+                records);
+    receipt_pending_count = 0;
+}
+
+void receipt_aggregator_add(Tox *tox, uint32_t friend_number, uint32_t ts_sec, const uint8_t *msgid)
+{
+    if (friend_number >= receipt_batches_size) {
+        const uint32_t new_size = friend_number + 1;
+        receipt_batch *b = realloc(receipt_batches, new_size * sizeof(receipt_batch));
+
+        if (b == NULL) {
+            return;
+        }
+
+        memset(b + receipt_batches_size, 0, (new_size - receipt_batches_size) * sizeof(receipt_batch));
+        receipt_batches = b;
+        receipt_batches_size = new_size;
+    }
+
+    receipt_batch *batch = &receipt_batches[friend_number];
+
+    for (uint32_t i = 0; i < batch->count; i++) {
+        if (memcmp(batch->receipts[i].msgid, msgid, TOX_PUBLIC_KEY_SIZE) == 0) {
+            return;
+        }
+    }
+
+    if (batch->count == batch->size) {
+        const uint32_t new_size = (batch->size == 0) ? 16 : (batch->size * 2);
+        receipt_pending *r = realloc(batch->receipts, new_size * sizeof(receipt_pending));
+
+        if (r == NULL) {
+            return;
+        }
+
+        batch->receipts = r;
+        batch->size = new_size;
+    }
+
+    receipt_pending *receipt = &batch->receipts[batch->count++];
+    CLEAR(*receipt);
+    memcpy(receipt->msgid, msgid, TOX_PUBLIC_KEY_SIZE);
+    receipt->ts_sec = ts_sec;
+    receipt->friend_number = friend_number;
+
+    if (receipt_pending_count == 0) {
+        receipt_first_pending_ts = get_unix_time();
+    }
+
+    receipt_pending_count++;
+
+    if (receipt_pending_count >= RECEIPT_COALESCE_MAX) {
+        receipt_aggregator_flush(tox, true);
+    }
+}
+// ----------- receipt aggregator -----------
+
+void friend_read_receipt_message_v2_cb(Tox *tox, uint32_t friend_number, uint32_t ts_sec, const uint8_t *msgid)
+{
+    toxProxyLog(9, "enter friend_read_receipt_message_v2_cb");
+
+    // a receipt for a message synced to a master device deletes that message, other receipts are stored
+    // for the master. both happen in batches, see receipt aggregator.
+    receipt_aggregator_add(tox, friend_number, ts_sec, msgid);
+}
+
+void friend_message_v2_cb(Tox *tox, uint32_t friend_number, const uint8_t *raw_message, size_t raw_message_len)
+{
+
+    toxProxyLog(9, "enter friend_message_v2_cb");
+
+#ifdef TOX_HAVE_TOXUTIL
+
+    if (!is_master_friendnumber(tox, friend_number)
+            && !ingress_friend_admit(tox, friend_number, raw_message, raw_message_len)) {
+        return;
+    }
+
+    // now get the real data from msgV2 buffer
+    uint8_t *message_text = calloc(1, raw_message_len);
+
+    if (message_text) {
+        // uint32_t ts_sec = tox_messagev2_get_ts_sec(raw_message);
+        // uint16_t ts_ms = tox_messagev2_get_ts_ms(raw_message);
+        uint32_t text_length = 0;
+        bool res = tox_messagev2_get_message_text(raw_message, (uint32_t) raw_message_len, (bool) false, (uint32_t) 0,
+                   message_text, &text_length);
+        toxProxyLog(9, "friend_message_v2_cb:fn=%d res=%d msg=%s", (int) friend_number, (int) res, (char *) message_text);
+
+        if (is_master_friendnumber(tox, friend_number)) {
+            if ((strlen((char *) message_text) == (strlen("fp:") + tox_public_key_size() * 2))
+                    &&
+                    (strncmp((char *) message_text, "fp:", strlen("fp:")) == 0)) {
+                char *pubKey = (char *)(message_text + 3);
+                uint8_t public_key_bin[tox_public_key_size()];
+
+                if (hex_string_to_bin(pubKey, tox_public_key_size() * 2, (char *) public_key_bin, tox_public_key_size()) != 0) {
+                    toxProxyLog(0, "fp: command with invalid public key");
+                } else {
+                    friend_provision_add_one(tox, friend_number, public_key_bin);
+                }
+            } else if (strlen((char *) message_text) == strlen("DELETE_EVERYTHING")
+                       && strncmp((char *) message_text, "DELETE_EVERYTHING", strlen("DELETE_EVERYTHING")) == 0) {
+                killSwitch();
+            } else {
+                // send_text_message_to_friend(tox, friend_number, "Sorry, but this command has not been understood, please check the implementation or contact the developer.");
+            }
+        } else {
+            toxProxyLog(9, "call writeMessageHelper()");
+            // nicht vom master, also wohl ein freund vom master.
+            writeMessageHelper(tox, friend_number, raw_message, raw_message_len, TOX_FILE_KIND_MESSAGEV2_SEND);
+            //TODO FIXME send acknowledgment here (message v2 ohne text mit wrapper = kompliziert laut tox, 3 bis 4 functions aufruf notwendig)
+            // send_text_message_to_friend(tox, friend_number, "thank you for using this proxy. The message will be relayed as soon as my master comes online.");
+        }
+
+        free(message_text);
+    }
+
+#endif
+}
+
+// ----------- friend provisioning -----------
+// CONTROL_PROXY_MESSAGE_TYPE_FRIEND_PUBKEYS_FOR_PROXY adds many friends of the master at once, the savedata
+// is written once for all of them instead of after every friend
+typedef struct friend_provision_state {
+    uint32_t batch_id;
+    uint32_t received;
+    uint32_t added;
+    uint32_t existing;
+    uint32_t failed;
+    // friends were added that are not in the savedata yet
+    bool dirty;
+    time_t last_packet_ts;
+    // the master device friend number to report to
+    uint32_t master;
+} friend_provision_state;
+
+friend_provision_state friend_provision;
+
+// the caches that are indexed by friend number or sender are grown once for all new friends,
+// not one by one when their first messages come in
+void friend_provision_prewarm(uint32_t max_friend_number, uint32_t new_friends)
+{
+    ingress_bucket_get(&ingress_friend_buckets, &ingress_friend_buckets_size, max_friend_number);
+    spool_accounts_reserve(spool_accounts_used + new_friends);
+}
+
+void friend_provision_commit(Tox *tox)
+{
+    if (!friend_provision.dirty) {
+        return;
+    }
+
+    const uint64_t start_usec = get_monotonic_usec();
+    updateToxSavedata(tox);
+    friend_provision.dirty = false;
+    toxProxyLog(2, "friend provisioning: batch %u saved (%u added, %u already friends, %u failed) in %llu ms",
+                friend_provision.batch_id, friend_provision.added, friend_provision.existing, friend_provision.failed,
+                (unsigned long long)((get_monotonic_usec() - start_usec) / 1000));
+    send_proxy_status(tox, friend_provision.master, PROXY_STATUS_TYPE_PROVISION);
+}
+
+void friend_provision_handle_packet(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length)
+{
+    if (length < 7 || length != 7 + (size_t)data[6] * TOX_PUBLIC_KEY_SIZE) {
+        toxProxyLog(0, "friend provisioning: packet with wrong size %u", (uint32_t)length);
+        return;
+    }
+
+    const uint32_t batch_id = get_u32_be(data + 1);
+    const uint8_t flags = data[5];
+    const uint8_t count = data[6];
+
+    if (batch_id != friend_provision.batch_id) {
+        // friends of an earlier batch that are not saved yet are saved with this one
+        const bool dirty = friend_provision.dirty;
+        CLEAR(friend_provision);
+        friend_provision.batch_id = batch_id;
+        friend_provision.dirty = dirty;
+    }
+
+    friend_provision.master = friend_number;
+    friend_provision.last_packet_ts = get_unix_time();
+    uint32_t max_friend_number = 0;
+    uint32_t added = 0;
+
+    for (uint8_t i = 0; i < count; i++) {
+        TOX_ERR_FRIEND_ADD error;
+        const uint32_t fn = tox_friend_add_norequest(tox, data + 7 + (size_t)i * TOX_PUBLIC_KEY_SIZE, &error);
+        friend_provision.received++;
+
+        if (fn != UINT32_MAX) {
+            added++;
+            max_friend_number = (fn > max_friend_number) ? fn : max_friend_number;
+        } else if (error == TOX_ERR_FRIEND_ADD_ALREADY_SENT) {
+            friend_provision.existing++;
+        } else {
+            friend_provision.failed++;
+        }
+    }
+
+    if (added > 0) {
+        friend_provision.added += added;
+        friend_provision.dirty = true;
+        friend_provision_prewarm(max_friend_number, friend_provision.added);
+    }
+
+    toxProxyLog(9, "friend provisioning: batch %u, %u of %u keys added", batch_id, added, count);
+
+    if ((flags & FRIEND_PROVISION_FLAG_LAST) && friend_provision.dirty) {
+        // the status goes out with the commit
+        friend_provision_commit(tox);
+        return;
+    }
+
+    send_proxy_status(tox, friend_number, PROXY_STATUS_TYPE_PROVISION);
+}
+
+// a friend from the "fp:<pubkey hex>" message of the master, it counts to the current batch and is saved
+// with it (or by friend_provision_maybe_commit()) like the friends of CONTROL_PROXY_MESSAGE_TYPE_FRIEND_PUBKEYS_FOR_PROXY
+void friend_provision_add_one(Tox *tox, uint32_t friend_number, const uint8_t *public_key)
+{
+    TOX_ERR_FRIEND_ADD error;
+    const uint32_t fn = tox_friend_add_norequest(tox, public_key, &error);
+    friend_provision.master = friend_number;
+    friend_provision.last_packet_ts = get_unix_time();
+    friend_provision.received++;
+
+    if (fn != UINT32_MAX) {
+        friend_provision.added++;
+        friend_provision.dirty = true;
+        friend_provision_prewarm(fn, 1);
+    } else if (error == TOX_ERR_FRIEND_ADD_ALREADY_SENT) {
+        friend_provision.existing++;
+    } else {
+        friend_provision.failed++;
+    }
+
+    toxProxyLog(9, "friend provisioning: fp: friend %s", (fn != UINT32_MAX) ? "added" : "not added");
+}
+
+// called from the main loop, saves friends of a batch whose last packet did not come
+void friend_provision_maybe_commit(Tox *tox)
+{
+    if (friend_provision.dirty && friend_provision.last_packet_ts + FRIEND_PROVISION_COMMIT_SECS <= get_unix_time()) {
+        friend_provision_commit(tox);
+    }
+}
+// ----------- friend provisioning -----------
+
+int spool_cmp_accounts_by_bytes(const void *a, const void *b)
+{
+    const spool_account *aa = *(const spool_account * const *)a;
+    const spool_account *bb = *(const spool_account * const *)b;
+    return (aa->bytes < bb->bytes) - (aa->bytes > bb->bytes);
+}
+
+// [180][1][policy:1][total bytes:8][total messages:4][global max bytes:8][global max messages:4]
+//         [sender max bytes:8][sender max messages:4][evicted:4][rejected:4][n:1]
+//         n * [sender pubkey:32][bytes:8][messages:4]  (the senders that store the most, biggest first)
+size_t build_quota_status(uint8_t *buf, size_t buf_size)
+{
+    uint8_t *p = buf;
+    *p++ = CONTROL_PROXY_MESSAGE_TYPE_PROXY_STATUS;
+    *p++ = PROXY_STATUS_TYPE_QUOTA;
+    *p++ = (uint8_t)SPOOL_QUOTA_POLICY_DEFAULT;
+    p = put_u64_be(p, spool_total_bytes);
+    p = put_u32_be(p, spool_total_messages);
+    p = put_u64_be(p, SPOOL_QUOTA_GLOBAL_MAX_BYTES);
+    p = put_u32_be(p, SPOOL_QUOTA_GLOBAL_MAX_MESSAGES);
+    p = put_u64_be(p, SPOOL_QUOTA_SENDER_MAX_BYTES);
+    p = put_u32_be(p, SPOOL_QUOTA_SENDER_MAX_MESSAGES);
+    p = put_u32_be(p, spool_total_evicted);
+    p = put_u32_be(p, spool_total_rejected);
+    uint8_t *count = p++;
+    *count = 0;
+
+    const size_t entry_size = TOX_PUBLIC_KEY_SIZE + 8 + 4;
+    const spool_account **top = calloc(spool_accounts_used + 1, sizeof(spool_account *));
+    uint32_t top_count = 0;
+
+    if (top == NULL) {
+        return (size_t)(p - buf);
+    }
+
+    for (uint32_t i = 0; i < spool_accounts_size; i++) {
+        if (spool_accounts[i].used && spool_accounts[i].messages > 0) {
+            top[top_count++] = &spool_accounts[i];
+        }
+    }
+
+    qsort(top, top_count, sizeof(spool_account *), spool_cmp_accounts_by_bytes);
+
+    for (uint32_t i = 0; i < top_count && (size_t)(p - buf) + entry_size <= buf_size && *count < UINT8_MAX; i++) {
+        if (hex_string_to_bin(top[i]->sender_key_hex, TOX_PUBLIC_KEY_SIZE * 2, (char *)p, TOX_PUBLIC_KEY_SIZE) != 0) {
+            continue;
+        }
+
+        p += TOX_PUBLIC_KEY_SIZE;
+        p = put_u64_be(p, top[i]->bytes);
+        p = put_u32_be(p, top[i]->messages);
+        (*count)++;
+    }
+
+    free(top);
+    return (size_t)(p - buf);
+}
+
+// [180][2][running:1][elapsed ms:4][dirs:4][files:4][zero byte:4][orphans:4][damaged:4][empty dirs:4]
+//         [unknown:4][stale dirs:4][encrypted:4][dirs from checkpoint:4][online ms:4][indexed ms:4]
+//         (what the startup recovery found, see spool_recovery_step(). online and indexed are the ms
+//         from the start of the process until tox was online and until the spool was fully indexed, 0 if not yet)
+size_t build_recovery_status(uint8_t *buf)
+{
+    const spool_recovery_report *r = &spool_recovery.report;
+    uint8_t *p = buf;
+    *p++ = CONTROL_PROXY_MESSAGE_TYPE_PROXY_STATUS;
+    *p++ = PROXY_STATUS_TYPE_RECOVERY;
+    *p++ = spool_recovery.running ? 1 : 0;
+    p = put_u32_be(p, spool_recovery.running ?
+                   (uint32_t)((get_monotonic_usec() - spool_recovery.start_usec) / 1000) : r->elapsed_ms);
+    p = put_u32_be(p, r->dirs);
+    p = put_u32_be(p, r->files);
+    p = put_u32_be(p, r->zero_byte);
+    p = put_u32_be(p, r->orphans);
+    p = put_u32_be(p, r->damaged);
+    p = put_u32_be(p, r->empty_dirs);
+    p = put_u32_be(p, r->unknown);
+    p = put_u32_be(p, r->stale_dirs);
+    p = put_u32_be(p, r->encrypted);
+    p = put_u32_be(p, r->from_checkpoint);
+    p = put_u32_be(p, startup_online_ms);
+    p = put_u32_be(p, spool_recovery.running ? 0 : startup_indexed_ms);
+    return (size_t)(p - buf);
+}
+
+// [180][3][friend messages accepted:4][friend messages rate limited:4][duplicates:4] (resends of stored
+//         messages, dropped by the ingress check + not stored again by writeMessage())
+//         [conference lines accepted:4][conference lines rate limited:4][n:1]
+//         n * [friend pubkey:32][accepted:4][rate limited:4]  (the friends that had messages dropped)
+//         (counted since the proxy started, see ingress limits)
+size_t build_ingress_status(Tox *tox, uint8_t *buf, size_t buf_size)
+{
+    uint8_t *p = buf;
+    *p++ = CONTROL_PROXY_MESSAGE_TYPE_PROXY_STATUS;
+    *p++ = PROXY_STATUS_TYPE_INGRESS;
+    p = put_u32_be(p, ingress_totals.friend_accepted);
+    p = put_u32_be(p, ingress_totals.friend_limited);
+    p = put_u32_be(p, ingress_totals.duplicates + msgid_index_duplicates);
+    p = put_u32_be(p, ingress_totals.conference_accepted);
+    p = put_u32_be(p, ingress_totals.conference_limited);
+    uint8_t *count = p++;
+    *count = 0;
+
+    const size_t entry_size = TOX_PUBLIC_KEY_SIZE + 4 + 4;
+
+    for (uint32_t i = 0; i < ingress_friend_buckets_size && (size_t)(p - buf) + entry_size <= buf_size
+            && *count < UINT8_MAX; i++) {
+        const ingress_bucket *b = &ingress_friend_buckets[i];
+
+        if (b->dropped == 0 || !tox_friend_get_public_key(tox, i, p, NULL)) {
+            continue;
+        }
+
+        p += TOX_PUBLIC_KEY_SIZE;
+        p = put_u32_be(p, b->accepted);
+        p = put_u32_be(p, b->dropped);
+        (*count)++;
+    }
+
+    return (size_t)(p - buf);
+}
+
+// [180][4][ttl direct secs:4][ttl conference secs:4][friend messages expired:4][conference messages expired:4]
+//         [bytes expired:8][senders with stored messages:4][n:1]
+//         n * [sender pubkey:32][expired:4]  (the senders that had messages expire, most first)
+//         (counted since the proxy started, see spool ttl)
+size_t build_expiry_status(uint8_t *buf, size_t buf_size)
+{
+    uint8_t *p = buf;
+    *p++ = CONTROL_PROXY_MESSAGE_TYPE_PROXY_STATUS;
+    *p++ = PROXY_STATUS_TYPE_EXPIRY;
+    p = put_u32_be(p, SPOOL_TTL_DIRECT_SECS);
+    p = put_u32_be(p, SPOOL_TTL_CONFERENCE_SECS);
+    p = put_u32_be(p, spool_ttl_expired_direct);
+    p = put_u32_be(p, spool_ttl_expired_conference);
+    p = put_u64_be(p, spool_ttl_expired_bytes);
+    uint8_t *senders = p;
+    p += 4;
+    uint8_t *count = p++;
+    *count = 0;
+
+    const size_t entry_size = TOX_PUBLIC_KEY_SIZE + 4;
+    const spool_account **top = calloc(spool_accounts_used + 1, sizeof(spool_account *));
+    uint32_t top_count = 0;
+    uint32_t with_messages = 0;
+
+    for (uint32_t i = 0; i < spool_accounts_size; i++) {
+        if (!spool_accounts[i].used) {
+            continue;
+        }
+
+        with_messages += (spool_accounts[i].messages > 0) ? 1 : 0;
+
+        if (top != NULL && spool_accounts[i].ttl_expired > 0) {
+            top[top_count++] = &spool_accounts[i];
+        }
+    }
+
+    put_u32_be(senders, with_messages);
+
+    if (top == NULL) {
+        return (size_t)(p - buf);
+    }
+
+    // few senders have messages expire, a simple sort is enough
+    for (uint32_t i = 1; i < top_count; i++) {
+        for (uint32_t j = i; j > 0 && top[j - 1]->ttl_expired < top[j]->ttl_expired; j--) {
+            const spool_account *tmp = top[j];
+            top[j] = top[j - 1];
+            top[j - 1] = tmp;
+        }
+    }
+
+    for (uint32_t i = 0; i < top_count && (size_t)(p - buf) + entry_size <= buf_size && *count < UINT8_MAX; i++) {
+        if (hex_string_to_bin(top[i]->sender_key_hex, TOX_PUBLIC_KEY_SIZE * 2, (char *)p, TOX_PUBLIC_KEY_SIZE) != 0) {
+            continue;
+        }
+
+        p += TOX_PUBLIC_KEY_SIZE;
+        p = put_u32_be(p, top[i]->ttl_expired);
+        (*count)++;
+    }
+
+    free(top);
+    return (size_t)(p - buf);
+}
+
+// [180][5][n:1] n * [hook:1][runs:4][failed:4][timed out:4][coalesced:4][last latency ms:4][max latency ms:4]
+//         [total latency ms:8]  (hook is HOOK, latency is from the event to the end of its script,
+//         counted since the proxy started, see hooks)
+size_t build_hooks_status(uint8_t *buf)
+{
+    uint8_t *p = buf;
+    *p++ = CONTROL_PROXY_MESSAGE_TYPE_PROXY_STATUS;
+    *p++ = PROXY_STATUS_TYPE_HOOKS;
+    *p++ = HOOKS;
+
+    for (int h = 0; h < HOOKS; h++) {
+        const hook_stats *st = &hook_totals[h];
+        *p++ = (uint8_t)h;
+        p = put_u32_be(p, st->runs);
+        p = put_u32_be(p, st->failed);
+        p = put_u32_be(p, st->timed_out);
+        p = put_u32_be(p, st->coalesced);
+        p = put_u32_be(p, st->last_latency_ms);
+        p = put_u32_be(p, st->max_latency_ms);
+        p = put_u64_be(p, st->total_latency_ms);
+    }
+
+    return (size_t)(p - buf);
+}
+
+// [180][6][batch_id:4][keys received:4][added:4][already friends:4][failed:4][saved:1]
+//         (of the last CONTROL_PROXY_MESSAGE_TYPE_FRIEND_PUBKEYS_FOR_PROXY batch, saved is 1 once the
+//         savedata has all added friends, see friend provisioning)
+size_t build_provision_status(uint8_t *buf)
+{
+    uint8_t *p = buf;
+    *p++ = CONTROL_PROXY_MESSAGE_TYPE_PROXY_STATUS;
+    *p++ = PROXY_STATUS_TYPE_PROVISION;
+    p = put_u32_be(p, friend_provision.batch_id);
+    p = put_u32_be(p, friend_provision.received);
+    p = put_u32_be(p, friend_provision.added);
+    p = put_u32_be(p, friend_provision.existing);
+    p = put_u32_be(p, friend_provision.failed);
+    *p++ = friend_provision.dirty ? 0 : 1;
+    return (size_t)(p - buf);
+}
+
+void send_proxy_status(Tox *tox, uint32_t friend_number, uint8_t status_type)
+{
+    uint8_t buf[TOX_MAX_CUSTOM_PACKET_SIZE];
+    size_t len = 0;
+
+    if (status_type == PROXY_STATUS_TYPE_QUOTA || status_type == PROXY_STATUS_TYPE_ALL) {
+        len = build_quota_status(buf, sizeof(buf));
+        TOX_ERR_FRIEND_CUSTOM_PACKET error;
+        bool res = tox_friend_send_lossless_packet(tox, friend_number, buf, len, &error);
+        toxProxyLog(9, "send_proxy_status: quota status len=%d res=%d", (int)len, (int)res);
+    }
+
+    if (status_type == PROXY_STATUS_TYPE_RECOVERY || status_type == PROXY_STATUS_TYPE_ALL) {
+        len = build_recovery_status(buf);
+        TOX_ERR_FRIEND_CUSTOM_PACKET error;
+        bool res = tox_friend_send_lossless_packet(tox, friend_number, buf, len, &error);
+        toxProxyLog(9, "send_proxy_status: recovery status len=%d res=%d", (int)len, (int)res);
+    }
+
+    if (status_type == PROXY_STATUS_TYPE_INGRESS || status_type == PROXY_STATUS_TYPE_ALL) {
+        len = build_ingress_status(tox, buf, sizeof(buf));
+        TOX_ERR_FRIEND_CUSTOM_PACKET error;
+        bool res = tox_friend_send_lossless_packet(tox, friend_number, buf, len, &error);
+        toxProxyLog(9, "send_proxy_status: ingress status len=%d res=%d", (int)len, (int)res);
+    }
+
+    if (status_type == PROXY_STATUS_TYPE_EXPIRY || status_type == PROXY_STATUS_TYPE_ALL) {
+        len = build_expiry_status(buf, sizeof(buf));
+        TOX_ERR_FRIEND_CUSTOM_PACKET error;
+        bool res = tox_friend_send_lossless_packet(tox, friend_number, buf, len, &error);
+        toxProxyLog(9, "send_proxy_status: expiry status len=%d res=%d", (int)len, (int)res);
+    }
+
+    if (status_type == PROXY_STATUS_TYPE_HOOKS || status_type == PROXY_STATUS_TYPE_ALL) {
+        len = build_hooks_status(buf);
+        TOX_ERR_FRIEND_CUSTOM_PACKET error;
+        bool res = tox_friend_send_lossless_packet(tox, friend_number, buf, len, &error);
+        toxProxyLog(9, "send_proxy_status: hooks status len=%d res=%d", (int)len, (int)res);
+    }
+
+    if (status_type == PROXY_STATUS_TYPE_PROVISION || status_type == PROXY_STATUS_TYPE_ALL) {
+        len = build_provision_status(buf);
+        TOX_ERR_FRIEND_CUSTOM_PACKET error;
+        bool res = tox_friend_send_lossless_packet(tox, friend_number, buf, len, &error);
+        toxProxyLog(9, "send_proxy_status: provision status len=%d res=%d", (int)len, (int)res);
+    }
+}
+
+// tell the master about evictions and rejections, but not more often than every SPOOL_QUOTA_STATUS_INTERVAL_SECS
+void send_quota_status_if_changed(Tox *tox)
+{
+    static time_t last_sent = 0;
+
+    if (!spool_quota_status_changed || last_sent + SPOOL_QUOTA_STATUS_INTERVAL_SECS > get_unix_time()) {
+        return;
+    }
+
+    const uint32_t master = get_master_friendnumber(tox);
+
+    if (master == UINT32_MAX) {
+        return;
+    }
+
+    send_proxy_status(tox, master, PROXY_STATUS_TYPE_QUOTA);
+    spool_quota_status_changed = false;
+    last_sent = get_unix_time();
+}
+
+// tell the master once what the startup recovery repaired
+void send_recovery_status_if_pending(Tox *tox)
+{
+    if (!spool_recovery.report_pending) {
+        return;
+    }
+
+    const uint32_t master = get_master_friendnumber(tox);
+
+    if (master == UINT32_MAX) {
+        return;
+    }
+
+    send_proxy_status(tox, master, PROXY_STATUS_TYPE_RECOVERY);
+    spool_recovery.report_pending = false;
+}
+
+// tell the master what expired, but not more often than every SPOOL_TTL_STATUS_INTERVAL_SECS
+void send_expiry_status_if_changed(Tox *tox)
+{
+    static time_t last_sent = 0;
+
+    if (!spool_ttl_status_changed || last_sent + SPOOL_TTL_STATUS_INTERVAL_SECS > get_unix_time()) {
+        return;
+    }
+
+    const uint32_t master = get_master_friendnumber(tox);
+
+    if (master == UINT32_MAX) {
+        return;
+    }
+
+    send_proxy_status(tox, master, PROXY_STATUS_TYPE_EXPIRY);
+    spool_ttl_status_changed = false;
+    last_sent = get_unix_time();
+}
+
+void friend_lossless_packet_cb(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length, void *user_data)
+{
+
+    if (length == 0) {
+        toxProxyLog(0, "received empty lossless package!");
+        return;
+    }
+
+    const int device = master_device_index_by_friend(tox, friend_number);
+
+    if (device < 0) {
+        if (length > 0)
+        {
+            toxProxyLog(0, "received lossless package from somebody who's not master! : id=%d", (int)data[0]);
+        }
+        else
+        {
+            toxProxyLog(0, "received lossless package from somebody who's not master!");
+        }
+        return;
+    }
+
+    if (data[0] == CONTROL_PROXY_MESSAGE_TYPE_PROXY_KILL_SWITCH) {
+        killSwitch();
+    } else if (data[0] == CONTROL_PROXY_MESSAGE_TYPE_PROXY_STATUS) {
+        send_proxy_status(tox, friend_number, (length > 1) ? data[1] : (uint8_t)PROXY_STATUS_TYPE_ALL);
+    } else if (data[0] == CONTROL_PROXY_MESSAGE_TYPE_BULK_SYNC_ACK) {
+        bulk_sync_handle_ack(device, data, length);
+    } else if (data[0] == CONTROL_PROXY_MESSAGE_TYPE_NOTIFICATION_TOKEN) {
+        if ((length > 10) && (length < 300))
+        {
+            toxProxyLog(0, "received CONTROL_PROXY_MESSAGE_TYPE_NOTIFICATION_TOKEN message");
+            push_tokens_handle_packet(data, length);
+        }
+        return;
+    } else if (data[0] == CONTROL_PROXY_MESSAGE_TYPE_NOTIFICATION_TOKENS) {
+        toxProxyLog(2, "received CONTROL_PROXY_MESSAGE_TYPE_NOTIFICATION_TOKENS message");
+        push_tokens_handle_packet(data, length);
+        return;
+    } else if (data[0] == CONTROL_PROXY_MESSAGE_TYPE_MASTER_DEVICES) {
+        master_devices_handle_packet(tox, device, data, length);
+    } else if (data[0] == CONTROL_PROXY_MESSAGE_TYPE_FRIEND_PUBKEYS_FOR_PROXY) {
+        friend_provision_handle_packet(tox, friend_number, data, length);
+    } else if (data[0] == CONTROL_PROXY_MESSAGE_TYPE_FRIEND_PUBKEY_FOR_PROXY) {
+        if (length != tox_public_key_size() + 1) {
+            toxProxyLog(0, "received ControlProxyMessageType_pubKey message with wrong size");
+            return;
+        }
+
+        const uint8_t *public_key = data + 1;
+        tox_friend_add_norequest(tox, public_key, NULL);
+        updateToxSavedata(tox);
+        char public_key_hex[tox_public_key_hex_size];
+        CLEAR(public_key_hex);
+        bin2upHex(public_key, tox_public_key_size(), public_key_hex, tox_public_key_hex_size);
+        toxProxyLog(0, "added friend of my master (norequest) with pubkey: %s", public_key_hex);
+    } else {
+        toxProxyLog(0, "received unexpected ControlProxyMessageType");
+    }
+}
+
+// ----------- master devices -----------
+// the master can use more than one device, every device is a tox friend of its own. the first one
+// (masterFile) is the friend that sent the first friend request, more are added by a master device with
+// CONTROL_PROXY_MESSAGE_TYPE_MASTER_DEVICES and kept in masterDevicesFile (one pubkey hex per line,
+// encrypted like the spool if that is on). friend numbers are looked up once and cached.
+//
+// all devices that are online get the stored messages at the same time, each with its own sync state
+// (bulk_sync[] has the same slots). a stored message is deleted once every device has it. until then
+// what a device has is its cursor per sender (spool_account.sync_cursor, it has every message up to that
+// sequence number, saved in sync_cursors_filename), a message it got out of order gets a marker file
+// "<message>__@<device pubkey hex>__" next to it until the cursor moves over it. either way it isn't sent
+// to that device again. with a single device all this is not needed, a message goes when it is acknowledged.
+typedef struct master_device {
+    bool used;
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    char public_key_hex[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+    // UINT32_MAX while it is not a friend (or not looked up yet)
+    uint32_t friend_number;
+    bool online;
+} master_device;
+
+master_device master_devices[MASTER_MAX_DEVICES];
+uint32_t master_devices_count = 0;
+bool sync_cursors_dirty = false;
+time_t sync_cursors_saved_ts = 0;
+
+int master_device_index(const uint8_t *public_key)
+{
+    for (int i = 0; i < MASTER_MAX_DEVICES; i++) {
+        if (master_devices[i].used && memcmp(master_devices[i].public_key, public_key, TOX_PUBLIC_KEY_SIZE) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+bool is_master(const char *public_key_hex)
+{
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+
+    if (hex_string_to_bin(public_key_hex, TOX_PUBLIC_KEY_SIZE * 2, (char *)public_key, sizeof(public_key)) != 0) {
+        return false;
+    }
+
+    return master_device_index(public_key) >= 0;
+}
+
+// slot of the master device that is friend_number, -1 if it is none
+int master_device_index_by_friend(Tox *tox, uint32_t friend_number)
+{
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+
+    if (!tox_friend_get_public_key(tox, friend_number, public_key, NULL)) {
+        return -1;
+    }
+
+    const int device = master_device_index(public_key);
+
+    if (device >= 0) {
+        master_devices[device].friend_number = friend_number;
+    }
+
+    return device;
+}
+
+bool is_master_friendnumber(Tox *tox, uint32_t friend_number)
+{
+    return master_device_index_by_friend(tox, friend_number) >= 0;
+}
+
+uint32_t master_device_friend_number(Tox *tox, int device)
+{
+    master_device *d = &master_devices[device];
+
+    if (d->friend_number == UINT32_MAX) {
+        TOX_ERR_FRIEND_BY_PUBLIC_KEY error;
+        d->friend_number = tox_friend_by_public_key(tox, d->public_key, &error);
+    }
+
+    return d->friend_number;
+}
+
+// friend number of a master device that is online (of the first master if none is),
+// UINT32_MAX if there is no master (yet)
+uint32_t get_master_friendnumber(Tox *tox)
+{
+    for (int i = 0; i < MASTER_MAX_DEVICES; i++) {
+        if (master_devices[i].used && master_devices[i].online) {
+            return master_device_friend_number(tox, i);
+        }
+    }
+
+    return master_devices[0].used ? master_device_friend_number(tox, 0) : UINT32_MAX;
+}
+
+// the first master always goes into slot 0. returns the slot, -1 if there is no room
+int master_device_add(const uint8_t *public_key, bool first)
+{
+    int device = master_device_index(public_key);
+
+    if (device >= 0) {
+        return device;
+    }
+
+    for (int i = first ? 0 : 1; i < MASTER_MAX_DEVICES; i++) {
+        if (!master_devices[i].used) {
+            device = i;
+            break;
+        }
+    }
+
+    if (device < 0 || (first && device != 0)) {
+        return -1;
+    }
+
+    master_device *d = &master_devices[device];
+    CLEAR(*d);
+    d->used = true;
+    memcpy(d->public_key, public_key, TOX_PUBLIC_KEY_SIZE);
+    bin2upHex(public_key, TOX_PUBLIC_KEY_SIZE, d->public_key_hex, sizeof(d->public_key_hex));
+    d->friend_number = UINT32_MAX;
+    master_devices_count++;
+    bulk_sync_reset_device(device);
+    return device;
+}
+
+void master_devices_update_online(void)
+{
+    masterIsOnline = false;
+
+    for (int i = 0; i < MASTER_MAX_DEVICES; i++) {
+        if (master_devices[i].used && master_devices[i].online) {
+            masterIsOnline = true;
+        }
+    }
+}
+
+void add_master(const char *public_key_hex)
+{
+
+    if (file_exists(masterFile) || master_devices[0].used) {
+        toxProxyLog(2, "I already have a *MASTER*");
+        return;
+    }
+
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+
+    if (hex_string_to_bin(public_key_hex, TOX_PUBLIC_KEY_SIZE * 2, (char *)public_key, sizeof(public_key)) != 0
+            || master_device_add(public_key, true) < 0) {
+        return;
+    }
+
+    toxProxyLog(2, "added master");
+    FILE *f = fopen(masterFile, "wb");
+
+    if (f) {
+        fwrite(public_key_hex, tox_public_key_hex_size, 1, f);
+        fclose(f);
+    }
+}
+
+// the devices after the first master
+bool master_devices_save(void)
+{
+    char buf[MASTER_MAX_DEVICES * (TOX_PUBLIC_KEY_SIZE * 2 + 1) + 1];
+    size_t length = 0;
+
+    for (int i = 1; i < MASTER_MAX_DEVICES; i++) {
+        if (master_devices[i].used) {
+            length += (size_t)snprintf(buf + length, sizeof(buf) - length, "%s\n", master_devices[i].public_key_hex);
+        }
+    }
+
+    if (length == 0) {
+        unlink(masterDevicesFile);
+        return true;
+    }
+
+    const bool res = spool_crypt_write_file(masterDevicesTmpFile, masterDevicesFile, (uint8_t *)buf, length);
+
+    if (!res) {
+        toxProxyLog(0, "master devices: can not write %s", masterDevicesFile);
+    }
+
+    return res;
+}
+
+void master_devices_load(void)
+{
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    char masterPubKeyHex[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+    CLEAR(masterPubKeyHex);
+
+    FILE *f = fopen(masterFile, "rb");
+
+    if (f) {
+        if (fread(masterPubKeyHex, TOX_PUBLIC_KEY_SIZE * 2, 1, f) == 1
+                && hex_string_to_bin(masterPubKeyHex, TOX_PUBLIC_KEY_SIZE * 2, (char *)public_key, sizeof(public_key)) == 0) {
+            master_device_add(public_key, true);
+        }
+
+        fclose(f);
+    }
+
+    size_t length = 0;
+    bool was_encrypted = false;
+    uint8_t *data = spool_crypt_read_file(masterDevicesFile, MASTER_MAX_DEVICES * (TOX_PUBLIC_KEY_SIZE * 2 + 1),
+                                          &length, &was_encrypted);
+
+    if (data == NULL) {
+        return;
+    }
+
+    for (size_t pos = 0; pos + TOX_PUBLIC_KEY_SIZE * 2 <= length; pos += TOX_PUBLIC_KEY_SIZE * 2 + 1) {
+        if (hex_string_to_bin((const char *)data + pos, TOX_PUBLIC_KEY_SIZE * 2, (char *)public_key, sizeof(public_key)) != 0
+                || master_device_add(public_key, false) < 0) {
+            toxProxyLog(0, "master devices: bad entry in %s", masterDevicesFile);
+        }
+    }
+
+    free(data);
+
+    if (spool_crypt_enabled && !was_encrypted) {
+        master_devices_save();
+    }
+
+    toxProxyLog(2, "master devices: %u", master_devices_count);
+}
+
+void master_device_marker_name(char *buf, size_t size, const char *name, int device)
+{
+    snprintf(buf, size, "%s__@%s__", name, master_devices[device].public_key_hex);
+}
+
+// sidecar is the marker of device for the message name
+bool master_device_is_marker(const char *sidecar, const char *name, int device)
+{
+    char marker[NAME_MAX + 1];
+    master_device_marker_name(marker, sizeof(marker), name, device);
+    return strcmp(sidecar, marker) == 0;
+}
+
+// device has the message name of the sender dir dir_fd (acc is the account of the sender) already
+bool master_device_has(spool_account *acc, int dir_fd, const char *name, int device)
+{
+    const uint64_t seq = spool_name_seq(name);
+
+    if (seq != 0 && acc != NULL && seq <= acc->sync_cursor[device]) {
+        return true;
+    }
+
+    char marker[NAME_MAX + 1];
+    struct stat st;
+    master_device_marker_name(marker, sizeof(marker), name, device);
+    return fstatat(dir_fd, marker, &st, 0) == 0;
+}
+
+// all master devices, but except (-1 for none), have the message name
+bool master_devices_all_have(spool_account *acc, int dir_fd, const char *name, int except)
+{
+    for (int i = 0; i < MASTER_MAX_DEVICES; i++) {
+        if (i != except && master_devices[i].used && !master_device_has(acc, dir_fd, name, i)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void master_device_mark(int dir_fd, const char *name, int device)
+{
+    char marker[NAME_MAX + 1];
+    master_device_marker_name(marker, sizeof(marker), name, device);
+    const int fd = openat(dir_fd, marker, O_WRONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// device has the message name now. returns true if it can be deleted because all devices have it,
+// if not device gets its marker.
+bool master_device_got_message(spool_account *acc, int dir_fd, const char *name, int device)
+{
+    if (master_devices_all_have(acc, dir_fd, name, device)) {
+        return true;
+    }
+
+    if (!master_device_has(acc, dir_fd, name, device)) {
+        master_device_mark(dir_fd, name, device);
+    }
+
+    return false;
+}
+
+void master_device_advance_cursor(spool_account *acc, int device, uint64_t seq)
+{
+    if (seq > acc->sync_cursor[device]) {
+        acc->sync_cursor[device] = seq;
+        sync_cursors_dirty = true;
+    }
+}
+
+// does device still need the message names[i] of the sorted names of a sender dir? the sidecars of the
+// message are right behind it, *has_sidecar says if there are others than the marker of device.
+// while *in_order (device had all messages with a sequence number before this one) the cursor of device
+// moves over the messages it has and their markers go, so the next time they are skipped by the number.
+bool master_device_needs(spool_account *acc, int dir_fd, char **names, size_t names_count, size_t i, int device,
+                         bool *in_order, bool *has_sidecar)
+{
+    const char *name = names[i];
+    const size_t name_len = strlen(name);
+    const uint64_t seq = spool_name_seq(name);
+    const char *marker = NULL;
+    *has_sidecar = false;
+
+    for (size_t j = i + 1; j < names_count && strncmp(names[j], name, name_len) == 0; j++) {
+        if (master_devices_count > 1 && master_device_is_marker(names[j], name, device)) {
+            marker = names[j];
+        } else {
+            *has_sidecar = true;
+        }
+    }
+
+    const bool by_cursor = (seq != 0 && acc != NULL && seq <= acc->sync_cursor[device]);
+
+    if (!by_cursor && marker == NULL) {
+        if (seq != 0) {
+            *in_order = false;
+        }
+
+        return true;
+    }
+
+    if (marker != NULL && seq != 0 && acc != NULL && (by_cursor || *in_order)) {
+        master_device_advance_cursor(acc, device, seq);
+        unlinkat(dir_fd, marker, 0);
+    }
+
+    return false;
+}
+
+// [SYNC_CURSORS_MAGIC] then per cursor [device pubkey 32][sender pubkey 32][seq u64]. only the cursors of
+// senders that have stored messages are kept, new messages get bigger numbers anyway.
+#define SYNC_CURSORS_MAGIC "TPr1"
+#define SYNC_CURSOR_RECORD_SIZE (TOX_PUBLIC_KEY_SIZE * 2 + 8)
+
+bool sync_cursors_save(void)
+{
+    uint32_t count = 0;
+
+    for (uint32_t a = 0; a < spool_accounts_size; a++) {
+        for (int d = 0; d < MASTER_MAX_DEVICES; d++) {
+            count += (spool_accounts[a].used && spool_accounts[a].sync_cursor[d] > 0) ? 1 : 0;
+        }
+    }
+
+    uint8_t *buf = calloc(1, 4 + (size_t)count * SYNC_CURSOR_RECORD_SIZE);
+
+    if (buf == NULL) {
+        return false;
+    }
+
+    uint8_t *p = buf;
+    memcpy(p, SYNC_CURSORS_MAGIC, 4);
+    p += 4;
+
+    for (uint32_t a = 0; a < spool_accounts_size; a++) {
+        const spool_account *acc = &spool_accounts[a];
+
+        if (!acc->used || (spool_quota_ready && acc->messages == 0)) {
+            continue;
+        }
+
+        for (int d = 0; d < MASTER_MAX_DEVICES; d++) {
+            if (!master_devices[d].used || acc->sync_cursor[d] == 0
+                    || hex_string_to_bin(acc->sender_key_hex, TOX_PUBLIC_KEY_SIZE * 2, (char *)p + TOX_PUBLIC_KEY_SIZE,
+                                         TOX_PUBLIC_KEY_SIZE) != 0) {
+                continue;
+            }
+
+            memcpy(p, master_devices[d].public_key, TOX_PUBLIC_KEY_SIZE);
+            p = put_u64_be(p + TOX_PUBLIC_KEY_SIZE * 2, acc->sync_cursor[d]);
+        }
+    }
+
+    const bool res = spool_crypt_write_file(sync_cursors_tmp_filename, sync_cursors_filename, buf, (size_t)(p - buf));
+    free(buf);
+
+    if (!res) {
+        toxProxyLog(0, "master devices: can not write %s", sync_cursors_filename);
+        return false;
+    }
+
+    sync_cursors_dirty = false;
+    sync_cursors_saved_ts = get_unix_time();
+    return true;
+}
+
+// after master_devices_load()
+void sync_cursors_load(void)
+{
+    size_t length = 0;
+    bool was_encrypted = false;
+    uint8_t *data = spool_crypt_read_file(sync_cursors_filename, 64 * 1024 * 1024, &length, &was_encrypted);
+
+    if (data == NULL) {
+        return;
+    }
+
+    if (length < 4 || memcmp(data, SYNC_CURSORS_MAGIC, 4) != 0 || ((length - 4) % SYNC_CURSOR_RECORD_SIZE) != 0) {
+        toxProxyLog(0, "master devices: %s is damaged, syncing everything again", sync_cursors_filename);
+        free(data);
+        return;
+    }
+
+    uint32_t count = 0;
+
+    for (const uint8_t *p = data + 4; p < data + length; p += SYNC_CURSOR_RECORD_SIZE) {
+        const int device = master_device_index(p);
+        char sender_key_hex[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+        bin2upHex(p + TOX_PUBLIC_KEY_SIZE, TOX_PUBLIC_KEY_SIZE, sender_key_hex, sizeof(sender_key_hex));
+        spool_account *acc = (device >= 0) ? spool_account_get(sender_key_hex) : NULL;
+
+        if (acc != NULL) {
+            acc->sync_cursor[device] = get_u64_be(p + TOX_PUBLIC_KEY_SIZE * 2);
+            count++;
+        }
+    }
+
+    free(data);
+    toxProxyLog(2, "master devices: %u sync cursors", count);
+}
+
+// called from the main loop
+void sync_cursors_maybe_save(void)
+{
+    if (sync_cursors_dirty && sync_cursors_saved_ts + SYNC_CURSORS_SAVE_SECS <= get_unix_time()) {
+        sync_cursors_save();
+    }
+}
+
+// after a device was removed: its markers go, and the messages that all remaining devices have are deleted
+void master_devices_sweep(const char *removed_key_hex)
+{
+    DIR *dfd_m = opendir(msgsDir);
+
+    if (dfd_m == NULL) {
+        return;
+    }
+
+    char removed_suffix[3 + TOX_PUBLIC_KEY_SIZE * 2 + 2 + 1];
+    snprintf(removed_suffix, sizeof(removed_suffix), "__@%s__", removed_key_hex);
+    uint32_t deleted = 0;
+    struct dirent *dp_m = NULL;
+
+    while ((dp_m = readdir(dfd_m)) != NULL) {
+        if (strlen(dp_m->d_name) != (TOX_PUBLIC_KEY_SIZE * 2) || dp_m->d_name[0] == '.') {
+            continue;
+        }
+
+        char friendDir[strlen(msgsDir) + 1 + strlen(dp_m->d_name) + 1];
+        snprintf(friendDir, sizeof(friendDir), "%s/%s", msgsDir, dp_m->d_name);
+        DIR *dfd = opendir(friendDir);
+
+        if (dfd == NULL) {
+            continue;
+        }
+
+        char **names = NULL;
+        const size_t names_count = spool_read_sorted_names(dfd, &names);
+        spool_account *acc = spool_account_get(dp_m->d_name);
+        const char *message = NULL;
+
+        // sorted names put the markers right behind their message
+        for (size_t i = 0; i <= names_count; i++) {
+            if (i == names_count || spool_is_message_file(names[i])) {
+                if (message && master_devices_all_have(acc, dirfd(dfd), message, -1)) {
+                    spool_delete_message_files(dp_m->d_name, message);
+                    acc = spool_account_get(dp_m->d_name);
+                    deleted++;
+                }
+
+                message = (i == names_count) ? NULL : names[i];
+            } else if (name_has_suffix(names[i], removed_suffix)) {
+                spool_unlink_file(acc, dirfd(dfd), names[i]);
+            }
+        }
+
+        spool_free_names(names, names_count);
+        closedir(dfd);
+    }
+
+    closedir(dfd_m);
+    toxProxyLog(2, "master devices: deleted %u messages all remaining devices have", deleted);
+}
+
+// [184][op][device pubkey 32] from a master device
+void master_devices_handle_packet(Tox *tox, int device, const uint8_t *data, size_t length)
+{
+    if (length != 2 + TOX_PUBLIC_KEY_SIZE) {
+        toxProxyLog(0, "master devices: packet with wrong size");
+        return;
+    }
+
+    const uint8_t *public_key = data + 2;
+    char public_key_hex[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+    bin2upHex(public_key, TOX_PUBLIC_KEY_SIZE, public_key_hex, sizeof(public_key_hex));
+
+    if (data[1] == MASTER_DEVICES_OP_ADD) {
+        if (master_device_index(public_key) >= 0) {
+            return;
+        }
+
+        const int added = master_device_add(public_key, false);
+
+        if (added < 0) {
+            toxProxyLog(0, "master devices: no room for %s", public_key_hex);
+            return;
+        }
+
+        master_devices_save();
+        tox_friend_add_norequest(tox, public_key, NULL);
+        updateToxSavedata(tox);
+        toxProxyLog(2, "master devices: device %d added %s as device %d", device, public_key_hex, added);
+    } else if (data[1] == MASTER_DEVICES_OP_REMOVE) {
+        const int removed = master_device_index(public_key);
+
+        if (removed <= 0) {
+            toxProxyLog(0, "master devices: can not remove %s", public_key_hex);
+            return;
+        }
+
+        const uint32_t friend_number = master_device_friend_number(tox, removed);
+        bulk_sync_reset_device(removed);
+        CLEAR(master_devices[removed]);
+
+        for (uint32_t a = 0; a < spool_accounts_size; a++) {
+            spool_accounts[a].sync_cursor[removed] = 0;
+        }
+
+        sync_cursors_dirty = true;
+        master_devices_count--;
+        master_devices_update_online();
+        master_devices_save();
+
+        if (friend_number != UINT32_MAX) {
+            tox_friend_delete(tox, friend_number, NULL);
+            updateToxSavedata(tox);
+        }
+
+        toxProxyLog(2, "master devices: device %d removed %s", device, public_key_hex);
+        master_devices_sweep(public_key_hex);
+    } else {
+        toxProxyLog(0, "master devices: unknown op %d", (int)data[1]);
+    }
+}
+
+void master_devices_connection_change(Tox *tox, uint32_t friend_number, TOX_CONNECTION connection_status)
+{
+    const int device = master_device_index_by_friend(tox, friend_number);
+
+    if (device < 0) {
+        return;
+    }
+
+    master_devices[device].online = (connection_status != TOX_CONNECTION_NONE);
+
+    if (master_devices[device].online) {
+        toxProxyLog(2, "master device %d is online, send it all cached unsent messages", device);
+    } else {
+        toxProxyLog(2, "master device %d went offline, don't send it any more messages.", device);
+    }
+
+    master_devices_update_online();
+    bulk_sync_reset_device(device);
+}
+// ----------- master devices -----------
+
+// a stored message whose sync wrapper tox does not take (too long, a master without
+// BULK_SYNC_FEATURE_FRAGMENT gets it that way) gets the marker "<message>__TOOLONG__" next to it.
+// the per message sync does not send it again, it stays stored for a master that takes it in parts.
+#define SYNC_MSG_TOO_LONG_MARKER "__TOOLONG__"
+
+// sync wrap one messageV2 of the stored message msgPath and send it to the master device with friend_number.
+// the msg id of the wrapper goes into a __MSGID__ file next to the stored message, the receipt of the master
+// for that id deletes it (see receipts_match_synced()). returns the error of the send.
+TOX_ERR_FRIEND_SEND_MESSAGE send_sync_msg_wrapped(Tox *tox, uint32_t friend_number, const uint8_t *pubKeyBin, const char *msgPath,
+                           uint32_t msg_type, const uint8_t *rawMsgData, size_t fsize, uint32_t ts_sec, uint16_t ts_ms,
+                           const uint8_t *sidecar, size_t sidecar_length)
+{
+    uint32_t rawMsgSize2 = tox_messagev2_size(fsize, TOX_FILE_KIND_MESSAGEV2_SYNC, 0);
+    uint8_t *raw_message2 = calloc(1, rawMsgSize2);
+    uint8_t *msgid2 = calloc(1, TOX_PUBLIC_KEY_SIZE);
+
+    if (raw_message2 == NULL || msgid2 == NULL) {
+        free(raw_message2);
+        free(msgid2);
+        return TOX_ERR_FRIEND_SEND_MESSAGE_SENDQ;
+    }
+
+    tox_messagev2_sync_wrap(fsize, pubKeyBin, msg_type, rawMsgData, ts_sec, ts_ms, raw_message2, msgid2);
+    toxProxyLog(9, "send_sync_msg_single: wrapped raw message = %p %s", raw_message2,
+                (msg_type == TOX_FILE_KIND_MESSAGEV2_ANSWER) ? "TOX_FILE_KIND_MESSAGEV2_ANSWER" : "TOX_FILE_KIND_MESSAGEV2_SEND");
+
+    // save new msgid ----------
+    char msgid2_str[tox_public_key_hex_size + 1];
+    CLEAR(msgid2_str);
+    bin2upHex(msgid2, tox_public_key_size(), msgid2_str, tox_public_key_hex_size);
+
+    char *msgPath_msg_id = calloc(1, 1000);
+    if (msgPath_msg_id)
+    {
+        sprintf(msgPath_msg_id, "%s__%s__", msgPath, msgid2_str);
+        toxProxyLog(9, "send_sync_msg_single: writing new msg_id to file: %s", msgPath_msg_id);
+        FILE *f_msg_id = fopen(msgPath_msg_id, "wb");
+        if (f_msg_id) {
+            if (sidecar != NULL) {
+                fwrite(sidecar, 1, sidecar_length, f_msg_id);
+            } else {
+                fwrite(msgid2_str, 1, 1, f_msg_id);
+            }
+            fclose(f_msg_id);
+        }
+    }
+    // save new msgid ----------
+
+    TOX_ERR_FRIEND_SEND_MESSAGE error = TOX_ERR_FRIEND_SEND_MESSAGE_OK;
+    bool res2 = tox_util_friend_send_sync_message_v2(tox, friend_number, raw_message2, rawMsgSize2, &error);
+    toxProxyLog(9, "send_sync_msg_single: send_sync_msg res=%d; error=%d", (int)res2, error);
+
+    if (!res2 && msgPath_msg_id != NULL) {
+        // no receipt will ever come for it, the next sync pass sends it again
+        unlink(msgPath_msg_id);
+    }
+
+    free(msgPath_msg_id);
+    free(raw_message2);
+    free(msgid2);
+    return res2 ? TOX_ERR_FRIEND_SEND_MESSAGE_OK : error;
+}
+
+// send one stored message to the master device with friend_number
+void send_sync_msg_single(Tox *tox, uint32_t friend_number, char *pubKeyHex, char *msgFileName)
+{
+    char *msgPath = calloc(1, strlen(msgsDir) + 1 + strlen(pubKeyHex) + 1 + strlen(msgFileName) + 1);
+
+    // last +1 is for terminating \0 I guess (without it, memory checker explodes..)
+    sprintf(msgPath, "%s/%s/%s", msgsDir, pubKeyHex, msgFileName);
+
+    char too_long_path[strlen(msgPath) + sizeof(SYNC_MSG_TOO_LONG_MARKER)];
+    snprintf(too_long_path, sizeof(too_long_path), "%s%s", msgPath, SYNC_MSG_TOO_LONG_MARKER);
+    struct stat st;
+
+    if (stat(too_long_path, &st) == 0) {
+        free(msgPath);
+        return;
+    }
+
+    size_t fsize = 0;
+    uint8_t *rawMsgData = spool_read_message(msgPath, &fsize);
+
+    if (rawMsgData && conference_record_check(msgFileName, rawMsgData, fsize)) {
+        size_t expanded_size = 0;
+        uint8_t *expanded = conference_record_expand(msgFileName, rawMsgData, fsize, &expanded_size);
+        free(rawMsgData);
+        rawMsgData = expanded;
+        fsize = expanded_size;
+    }
+
+    if (rawMsgData) {
+        uint8_t *pubKeyBin = hex_string_to_bin2(pubKeyHex);
+
+        if (pubKeyBin == NULL) {
+            toxProxyLog(0, "send_sync_msg_single: invalid sender directory %s", pubKeyHex);
+            free(rawMsgData);
+            free(msgPath);
+            return;
+        }
+
+        // the master gets them in the order they were stored in, with the time they came in
+        uint32_t ts_sec = 0;
+        uint16_t ts_ms = 0;
+        spool_receive_time(msgPath, msgFileName, &ts_sec, &ts_ms);
+
+        if (receipt_record_check(msgFileName, rawMsgData, fsize)) {
+            // one ANSWER per receipt, like they were stored before. the __MSGID__ file of each one tells
+            // which receipt of the record it is, see receipt_synced_message_acked(). the ones that went out
+            // already (confirmed or not) are not sent again
+            const uint16_t count = get_u16_be(rawMsgData + 4);
+            const uint32_t answer_size = tox_messagev2_size(0, TOX_FILE_KIND_MESSAGEV2_ANSWER, 0);
+            uint8_t *answer = calloc(1, answer_size);
+            const int device = master_device_index_by_friend(tox, friend_number);
+            bool sent[RECEIPT_RECORD_MAX_RECEIPTS];
+            bool confirmed[RECEIPT_RECORD_MAX_RECEIPTS];
+            uint32_t sent_count = 0;
+            receipt_record_scan(pubKeyHex, msgFileName, (device < 0) ? 0 : device, sent, confirmed, &sent_count);
+
+            for (uint16_t i = 0; answer != NULL && i < count && i < RECEIPT_RECORD_MAX_RECEIPTS; i++) {
+                if (sent[i]) {
+                    continue;
+                }
+
+                const uint8_t *entry = rawMsgData + RECEIPT_RECORD_HEADER_SIZE + (size_t)i * RECEIPT_RECORD_ENTRY_SIZE;
+                uint8_t sidecar[RECEIPT_RECORD_SIDECAR_SIZE];
+                put_u16_be(sidecar, i);
+                put_u16_be(sidecar + 2, count);
+                sidecar[4] = 0;
+                sidecar[5] = (uint8_t)((device < 0) ? 0 : device);
+                tox_messagev2_wrap(0, TOX_FILE_KIND_MESSAGEV2_ANSWER, 0, NULL, get_u32_be(entry + TOX_PUBLIC_KEY_SIZE), 0,
+                                   answer, (uint8_t *)entry);
+                send_sync_msg_wrapped(tox, friend_number, pubKeyBin, msgPath, TOX_FILE_KIND_MESSAGEV2_ANSWER, answer,
+                                      answer_size, ts_sec, ts_ms, sidecar, sizeof(sidecar));
+            }
+
+            free(answer);
+        } else {
+            const uint32_t msg_type = (msgFileName[strlen(msgFileName) - 1] == 'A') ? TOX_FILE_KIND_MESSAGEV2_ANSWER
+                                      : TOX_FILE_KIND_MESSAGEV2_SEND;
+
+            if (send_sync_msg_wrapped(tox, friend_number, pubKeyBin, msgPath, msg_type, rawMsgData, fsize, ts_sec, ts_ms,
+                                      NULL, 0) == TOX_ERR_FRIEND_SEND_MESSAGE_TOO_LONG) {
+                toxProxyLog(1, "send_sync_msg_single: %s/%s (%u bytes) is too long for a sync message, it is kept for "
+                            "a master that takes it in parts", pubKeyHex, msgFileName, (uint32_t)fsize);
+                FILE *f = fopen(too_long_path, "wb");
+
+                if (f) {
+                    fclose(f);
+                }
+            }
+        }
+
+        free(rawMsgData);
+        free(pubKeyBin);
+
+        // do not delete messages here!! // unlink(msgPath);
+    }
+
+    free(msgPath);
+}
+
+// ----------- sync priority -----------
+// stored messages are synced class by class: the direct messages of friends first, then receipts and
+// answers, the conference backlog last. within a class the senders take turns with up to
+// SYNC_ROUND_ROBIN_QUANTUM messages each, so a huge catch-up of one sender can't hold back the others.
+typedef enum SYNC_CLASS {
+    SYNC_CLASS_DIRECT = 0,
+    SYNC_CLASS_RECEIPT = 1,
+    SYNC_CLASS_CONFERENCE = 2,
+    SYNC_CLASSES = 3
+} SYNC_CLASS;
+
+SYNC_CLASS sync_class_of(const spool_account *acc, const char *name)
+{
+    if (acc != NULL && acc->is_conference) {
+        return SYNC_CLASS_CONFERENCE;
+    }
+
+    if (name[strlen(name) - 1] == 'A' || name_has_suffix(name, RECEIPT_RECORD_SUFFIX)) {
+        return SYNC_CLASS_RECEIPT;
+    }
+
+    return SYNC_CLASS_DIRECT;
+}
+
+// the order to sync runs_count runs of items in (run r is run_len[r] items in a row, one run per sender):
+// up to SYNC_ROUND_ROBIN_QUANTUM items of each run in turn. writes up to max item indexes to order,
+// returns how many.
+uint32_t sync_round_robin(const uint32_t *run_len, uint32_t runs_count, uint32_t *order, uint32_t max)
+{
+    uint32_t *run_start = calloc((size_t)runs_count * 2 + 1, sizeof(uint32_t));
+    uint32_t n = 0;
+
+    if (run_start == NULL) {
+        // keep them as they are
+        for (uint32_t r = 0; r < runs_count; r++) {
+            for (uint32_t i = 0; i < run_len[r] && n < max; i++) {
+                order[n] = n;
+                n++;
+            }
+        }
+
+        return n;
+    }
+
+    uint32_t *run_taken = run_start + runs_count;
+    uint32_t total = 0;
+
+    for (uint32_t r = 0; r < runs_count; r++) {
+        run_start[r] = total;
+        total += run_len[r];
+    }
+
+    bool more = true;
+
+    while (more && n < max) {
+        more = false;
+
+        for (uint32_t r = 0; r < runs_count && n < max; r++) {
+            for (uint32_t q = 0; q < SYNC_ROUND_ROBIN_QUANTUM && run_taken[r] < run_len[r] && n < max; q++) {
+                order[n++] = run_start[r] + run_taken[r]++;
+            }
+
+            more = more || (run_taken[r] < run_len[r]);
+        }
+    }
+
+    free(run_start);
+    return n;
+}
+
+// names[i] has a SYNC_MSG_TOO_LONG_MARKER, its files are sorted right behind it
+bool sync_msg_is_too_long(char **names, size_t names_count, size_t i)
+{
+    const size_t name_len = strlen(names[i]);
+
+    for (size_t j = i + 1; j < names_count && strncmp(names[j], names[i], name_len) == 0; j++) {
+        if (strcmp(names[j] + name_len, SYNC_MSG_TOO_LONG_MARKER) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// the names of the stored messages of one sender the master device does not have yet, sorted into their
+// classes, oldest first: names_out[c] gets count_out[c] names, free them with spool_free_names().
+// the dir is read once for all classes.
+void sync_msgs_of_sender(int device, const char *pubKeyHex, char **names_out[SYNC_CLASSES],
+                         size_t count_out[SYNC_CLASSES])
+{
+    for (int c = 0; c < SYNC_CLASSES; c++) {
+        names_out[c] = NULL;
+        count_out[c] = 0;
+    }
+
+    char *friendDir = calloc(1, strlen(msgsDir) + 1 + strlen(pubKeyHex) +
+                             1); // last +1 is for terminating \0 I guess (without it, memory checker explodes..)
+    sprintf(friendDir, "%s/%s", msgsDir, pubKeyHex);
+
+    DIR *dfd = opendir(friendDir);
+
+    if (dfd == NULL) {
+        // toxProxyLog(1, "Can't open msgsDir for sending messages to master (maybe no single message has been received yet?)");
+        free(friendDir);
+        return;
+    }
+
+    char **names = NULL;
+    const size_t names_count = spool_read_sorted_names(dfd, &names);
+    spool_account *acc = spool_account_get(pubKeyHex);
+    // the class of each name, SYNC_CLASSES for the ones the device does not need
+    uint8_t *name_class = (names_count > 0) ? calloc(names_count, 1) : NULL;
+    bool in_order = true;
+
+    // master_device_needs() sees all messages of the sender in order, its cursor only moves over what the
+    // device has
+    for (size_t i = 0; name_class != NULL && i < names_count; i++) {
+        bool has_sidecar = false;
+        name_class[i] = SYNC_CLASSES;
+
+        if (spool_is_message_file(names[i])
+                && master_device_needs(acc, dirfd(dfd), names, names_count, i, device, &in_order, &has_sidecar)
+                && !sync_msg_is_too_long(names, names_count, i)) {
+            name_class[i] = (uint8_t)sync_class_of(acc, names[i]);
+            count_out[name_class[i]]++;
+        }
+    }
+
+    for (int c = 0; name_class != NULL && c < SYNC_CLASSES; c++) {
+        if (count_out[c] > 0) {
+            names_out[c] = calloc(count_out[c], sizeof(char *));
+        }
+
+        size_t kept = 0;
+
+        for (size_t i = 0; names_out[c] != NULL && i < names_count; i++) {
+            if (name_class[i] == c) {
+                names_out[c][kept++] = names[i];
+                names[i] = NULL;
+            }
+        }
+
+        count_out[c] = kept;
+    }
+
+    spool_free_names(names, names_count);
+    free(name_class);
+    closedir(dfd);
+    free(friendDir);
+}
+
+// the per message sync: everything the master device does not have yet, class by class
+void send_sync_msgs(Tox *tox, int device, uint32_t friend_number)
+{
+    mkdir(msgsDir, S_IRWXU);
+
+    // loop over all directories = public-keys of friends we have received messages from
+    DIR *dfd = opendir(msgsDir);
+
+    if (dfd == NULL) {
+        // toxProxyLog(1, "Can't open msgsDir for sending messages to master (maybe no single message has been received yet?)");
+        return;
+    }
+
+    // one run per sender and class, every sender dir is read once
+    char **senders = NULL;
+    char ***names[SYNC_CLASSES] = {NULL};
+    uint32_t *run_len[SYNC_CLASSES] = {NULL};
+    uint32_t total[SYNC_CLASSES] = {0};
+    uint32_t runs_count = 0;
+    uint32_t runs_size = 0;
+    struct dirent *dp = NULL;
+
+    while ((dp = readdir(dfd)) != NULL) {
+        if (strncmp(dp->d_name, ".", 1) == 0 || strncmp(dp->d_name, "..", 2) == 0) {
+            continue;
+        }
+
+        if (runs_count == runs_size) {
+            const uint32_t new_size = (runs_size == 0) ? 16 : (runs_size * 2);
+            char **s2 = realloc(senders, new_size * sizeof(char *));
+            senders = (s2 != NULL) ? s2 : senders;
+            bool grown = (s2 != NULL);
+
+            for (int c = 0; c < SYNC_CLASSES; c++) {
+                char ***n2 = realloc(names[c], new_size * sizeof(char **));
+                names[c] = (n2 != NULL) ? n2 : names[c];
+                uint32_t *r2 = realloc(run_len[c], new_size * sizeof(uint32_t));
+                run_len[c] = (r2 != NULL) ? r2 : run_len[c];
+                grown = grown && (n2 != NULL) && (r2 != NULL);
+            }
+
+            if (!grown) {
+                break;
+            }
+
+            runs_size = new_size;
+        }
+
+        char **sender_names[SYNC_CLASSES];
+        size_t sender_counts[SYNC_CLASSES];
+        sync_msgs_of_sender(device, dp->d_name, sender_names, sender_counts);
+
+        if (sender_counts[SYNC_CLASS_DIRECT] + sender_counts[SYNC_CLASS_RECEIPT] + sender_counts[SYNC_CLASS_CONFERENCE] == 0) {
+            continue;
+        }
+
+        senders[runs_count] = strdup(dp->d_name);
+
+        for (int c = 0; c < SYNC_CLASSES; c++) {
+            if (senders[runs_count] == NULL) {
+                spool_free_names(sender_names[c], sender_counts[c]);
+                continue;
+            }
+
+            names[c][runs_count] = sender_names[c];
+            run_len[c][runs_count] = (uint32_t)sender_counts[c];
+            total[c] += (uint32_t)sender_counts[c];
+        }
+
+        if (senders[runs_count] != NULL) {
+            runs_count++;
+        }
+    }
+
+    closedir(dfd);
+
+    for (int c = 0; c < SYNC_CLASSES; c++) {
+        // order[] holds indexes into all names of the class, one run after the other
+        uint32_t *order = (total[c] > 0) ? calloc(total[c], sizeof(uint32_t)) : NULL;
+        uint32_t *item_run = (total[c] > 0) ? calloc(total[c], sizeof(uint32_t)) : NULL;
+        uint32_t *run_first = (runs_count > 0) ? calloc(runs_count, sizeof(uint32_t)) : NULL;
+
+        if (order != NULL && item_run != NULL && run_first != NULL) {
+            for (uint32_t r = 0, i = 0; r < runs_count; r++) {
+                run_first[r] = i;
+
+                for (uint32_t k = 0; k < run_len[c][r]; k++) {
+                    item_run[i++] = r;
+                }
+            }
+
+            const uint32_t n = sync_round_robin(run_len[c], runs_count, order, total[c]);
+
+            for (uint32_t i = 0; i < n; i++) {
+                const uint32_t r = item_run[order[i]];
+                char *name = names[c][r][order[i] - run_first[r]];
+                toxProxyLog(2, "found message by %s with filename %s", senders[r], name);
+                send_sync_msg_single(tox, friend_number, senders[r], name);
+            }
+        }
+
+        free(order);
+        free(item_run);
+        free(run_first);
+    }
+
+    for (uint32_t r = 0; r < runs_count; r++) {
+        for (int c = 0; c < SYNC_CLASSES; c++) {
+            spool_free_names(names[c][r], run_len[c][r]);
+        }
+
+        free(senders[r]);
+    }
+
+    for (int c = 0; c < SYNC_CLASSES; c++) {
+        free(names[c]);
+        free(run_len[c]);
+    }
+
+    free(senders);
+}
+// ----------- sync priority -----------
+
+// ----------- bulk sync -----------
+
+typedef enum BULK_SYNC_MODE {
+    // master (re)connected, not probed yet
+    BULK_SYNC_MODE_UNKNOWN = 0,
+    BULK_SYNC_MODE_PROBING = 1,
+    BULK_SYNC_MODE_SUPPORTED = 2,
+    // no answer to the probe, use send_sync_msgs()
+    BULK_SYNC_MODE_UNSUPPORTED = 3
+} BULK_SYNC_MODE;
+
+// 1 type + 1 version + 1 flags + 4 batch_id + 2 first_seq + 1 count
+#define BULK_SYNC_PACKET_HEADER_SIZE 10
+// seq u64 + receive time u32 + receive ms u16
+#define BULK_SYNC_RECORD_RECEIVE_TIME_SIZE (8 + 4 + 2)
+// 1 flags + sender pubkey + receive time + 2 length
+#define BULK_SYNC_RECORD_HEADER_MAX_SIZE (1 + TOX_PUBLIC_KEY_SIZE + BULK_SYNC_RECORD_RECEIVE_TIME_SIZE + 2)
+// total length u32 + offset u32 of a BULK_SYNC_RECORD_FRAGMENT record
+#define BULK_SYNC_RECORD_FRAGMENT_SIZE (4 + 4)
+// bigger messages can never be in a packet, they go in parts or (when the master can't put them together)
+// with the per message sync
+#define BULK_SYNC_MAX_RECORD_DATA (TOX_MAX_CUSTOM_PACKET_SIZE - BULK_SYNC_PACKET_HEADER_SIZE - BULK_SYNC_RECORD_HEADER_MAX_SIZE)
+
+typedef struct bulk_sync_entry {
+    // index into bulk_sync_state.senders
+    uint32_t sender;
+    // there are __MSGID__ files of an earlier per message sync next to the message
+    bool has_sidecar;
+    // sent without data, must not be deleted when the batch is acknowledged
+    bool skipped;
+    // SYNC_CLASS
+    uint8_t sync_class;
+    char name[64];
+} bulk_sync_entry;
+
+typedef struct bulk_sync_sender {
+    char *key_hex;
+    // a message of this sender was skipped, the cursor of the device can't move past it
+    bool skipped;
+    // its messages are in more than one class, they are not queued in the order of their sequence numbers
+    bool reordered;
+} bulk_sync_sender;
+
+// the messages of one class a spool scan found, the ones of a sender in a row (see bulk_sync_scan())
+typedef struct bulk_sync_class_queue {
+    bulk_sync_entry *entries;
+    uint32_t used;
+    uint32_t size;
+} bulk_sync_class_queue;
+
+typedef struct bulk_sync_state {
+    // the master_devices[] slot this is for, master is its friend number
+    int device;
+    BULK_SYNC_MODE mode;
+    uint32_t master;
+    // BULK_SYNC_FEATURE bits the master answered the probe with
+    uint8_t master_features;
+    time_t mode_ts;
+    uint32_t batch_id;
+    // messages found by the last spool scan, oldest first per sender. batches are consecutive slices of it.
+    bulk_sync_entry *entries;
+    uint32_t entries_used;
+    bulk_sync_sender *senders;
+    uint32_t senders_used;
+    uint32_t senders_size;
+    // the last scan stopped at BULK_SYNC_QUEUE_MAX_RECORDS, scan again right after this queue is done
+    bool queue_full;
+    time_t next_scan_ts;
+    // when the first direct message was stored that is not in the queue yet, 0 = none
+    time_t direct_waiting_ts;
+    // current batch is entries[batch_start ... batch_start + batch_count - 1]
+    uint32_t batch_start;
+    uint32_t batch_count;
+    // next record (counted from batch_start) to put into a packet, and the first one not acknowledged yet
+    uint32_t batch_next_send;
+    uint32_t batch_acked;
+    // bytes of record batch_next_send that went out in parts already
+    uint32_t batch_next_offset;
+    // when the end of the batch went out, 0 = still sending
+    time_t batch_sent_ts;
+} bulk_sync_state;
+
+// one per master_devices[] slot, the devices that are online are synced at the same time
+bulk_sync_state bulk_sync[MASTER_MAX_DEVICES];
+
+#ifdef HAVE_ZSTD
+const uint8_t bulk_sync_features = BULK_SYNC_FEATURE_ZSTD | BULK_SYNC_FEATURE_CONFERENCE_RECORD
+                                   | BULK_SYNC_FEATURE_RECEIVE_TIME | BULK_SYNC_FEATURE_RECEIPT_RECORD
+                                   | BULK_SYNC_FEATURE_FRAGMENT;
+ZSTD_CCtx *bulk_sync_zstd_cctx = NULL;
+uint8_t *bulk_sync_zstd_raw = NULL;
+size_t bulk_sync_zstd_raw_target = 0;
+#else
+const uint8_t bulk_sync_features = BULK_SYNC_FEATURE_CONFERENCE_RECORD | BULK_SYNC_FEATURE_RECEIVE_TIME
+                                   | BULK_SYNC_FEATURE_RECEIPT_RECORD | BULK_SYNC_FEATURE_FRAGMENT;
+#endif
+
+void bulk_sync_clear_queue(bulk_sync_state *bs)
+{
+    for (uint32_t i = 0; i < bs->senders_used; i++) {
+        free(bs->senders[i].key_hex);
+    }
+
+    bs->senders_used = 0;
+    bs->entries_used = 0;
+    bs->queue_full = false;
+    bs->batch_start = 0;
+    bs->batch_count = 0;
+    bs->batch_next_send = 0;
+    bs->batch_acked = 0;
+    bs->batch_next_offset = 0;
+    bs->batch_sent_ts = 0;
+}
+
+// forget everything about the master device, called when it comes online or goes offline.
+// messages that were in flight stay in the spool and are sent again.
+void bulk_sync_reset(bulk_sync_state *bs)
+{
+    bulk_sync_clear_queue(bs);
+    free(bs->entries);
+    free(bs->senders);
+
+    const int device = bs->device;
+    const uint32_t batch_id = bs->batch_id;
+    CLEAR(*bs);
+    bs->device = device;
+    // keep counting, so a late ack can never match a batch of the new session
+    bs->batch_id = batch_id + 1;
+}
+
+// put the stored messages of one sender dir into the queues of their classes, returns false once
+// the one of the direct messages is full
+bool bulk_sync_scan_sender(bulk_sync_state *bs, bulk_sync_class_queue *queues, const char *sender_key_hex)
+{
+    char friendDir[strlen(msgsDir) + 1 + strlen(sender_key_hex) + 1];
+    snprintf(friendDir, sizeof(friendDir), "%s/%s", msgsDir, sender_key_hex);
+
+    DIR *dfd = opendir(friendDir);
+
+    if (dfd == NULL) {
+        return true;
+    }
+
+    char **names = NULL;
+    const size_t names_count = spool_read_sorted_names(dfd, &names);
+    spool_account *acc = spool_account_get(sender_key_hex);
+
+    uint32_t sender = UINT32_MAX;
+    uint32_t classes_used = 0;
+    bool room = true;
+    bool in_order = true;
+
+    for (size_t i = 0; i < names_count; i++) {
+        bool has_sidecar = false;
+
+        if (!spool_is_message_file(names[i])
+                || !master_device_needs(acc, dirfd(dfd), names, names_count, i, bs->device, &in_order, &has_sidecar)) {
+            continue;
+        }
+
+        if (strlen(names[i]) >= sizeof(bs->entries[0].name)) {
+            continue;
+        }
+
+        const SYNC_CLASS sync_class = sync_class_of(acc, names[i]);
+        bulk_sync_class_queue *q = &queues[sync_class];
+        uint32_t before = 0;
+
+        for (int c = 0; c < sync_class; c++) {
+            before += queues[c].used;
+        }
+
+        // it would not get into the queue anyway
+        if (before + q->used >= BULK_SYNC_QUEUE_MAX_RECORDS) {
+            bs->queue_full = true;
+
+            if (sync_class == SYNC_CLASS_DIRECT) {
+                room = false;
+                break;
+            }
+
+            continue;
+        }
+
+        if (q->used == q->size) {
+            const uint32_t new_size = (q->size == 0) ? 256 : (q->size * 2);
+            bulk_sync_entry *e = realloc(q->entries, new_size * sizeof(bulk_sync_entry));
+
+            if (e == NULL) {
+                bs->queue_full = true;
+                continue;
+            }
+
+            q->entries = e;
+            q->size = new_size;
+        }
+
+        if (sender == UINT32_MAX) {
+            if (bs->senders_used == bs->senders_size) {
+                const uint32_t new_size = (bs->senders_size == 0) ? 16 : (bs->senders_size * 2);
+                bulk_sync_sender *s = realloc(bs->senders, new_size * sizeof(bulk_sync_sender));
+
+                if (s == NULL) {
+                    room = false;
+                    break;
+                }
+
+                bs->senders = s;
+                bs->senders_size = new_size;
+            }
+
+            CLEAR(bs->senders[bs->senders_used]);
+            bs->senders[bs->senders_used].key_hex = strdup(sender_key_hex);
+
+            if (bs->senders[bs->senders_used].key_hex == NULL) {
+                room = false;
+                break;
+            }
+
+            sender = bs->senders_used;
+            bs->senders_used++;
+        }
+
+        classes_used |= 1U << sync_class;
+
+        if ((classes_used & (classes_used - 1)) != 0) {
+            bs->senders[sender].reordered = true;
+        }
+
+        bulk_sync_entry *e = &q->entries[q->used];
+        q->used++;
+        CLEAR(*e);
+        e->sender = sender;
+        e->has_sidecar = has_sidecar;
+        e->sync_class = (uint8_t)sync_class;
+        snprintf(e->name, sizeof(e->name), "%s", names[i]);
+    }
+
+    spool_free_names(names, names_count);
+    closedir(dfd);
+    return room;
+}
+
+// one pass over the spool, fills the queue with up to BULK_SYNC_QUEUE_MAX_RECORDS messages:
+// class after class, the senders of a class in turn (see sync priority)
+void bulk_sync_scan(bulk_sync_state *bs)
+{
+    bulk_sync_clear_queue(bs);
+    bs->direct_waiting_ts = 0;
+
+    if (bs->entries == NULL) {
+        bs->entries = calloc(BULK_SYNC_QUEUE_MAX_RECORDS, sizeof(bulk_sync_entry));
+
+        if (bs->entries == NULL) {
+            return;
+        }
+    }
+
+    DIR *dfd_m = opendir(msgsDir);
+
+    if (dfd_m == NULL) {
+        return;
+    }
+
+    bulk_sync_class_queue queues[SYNC_CLASSES];
+    memset(queues, 0, sizeof(queues));
+    struct dirent *dp_m = NULL;
+
+    while ((dp_m = readdir(dfd_m)) != NULL) {
+        uint8_t sender_key_bin[TOX_PUBLIC_KEY_SIZE];
+
+        if (strlen(dp_m->d_name) != (TOX_PUBLIC_KEY_SIZE * 2)
+                || hex_string_to_bin(dp_m->d_name, TOX_PUBLIC_KEY_SIZE * 2, (char *)sender_key_bin, sizeof(sender_key_bin)) != 0) {
+            continue;
+        }
+
+        if (!bulk_sync_scan_sender(bs, queues, dp_m->d_name)) {
+            break;
+        }
+    }
+
+    closedir(dfd_m);
+
+    for (int c = 0; c < SYNC_CLASSES; c++) {
+        bulk_sync_class_queue *q = &queues[c];
+        const uint32_t room = BULK_SYNC_QUEUE_MAX_RECORDS - bs->entries_used;
+        uint32_t *run_len = calloc(q->used + 1, sizeof(uint32_t));
+        uint32_t *order = calloc(q->used + 1, sizeof(uint32_t));
+        uint32_t runs_count = 0;
+        uint32_t n = 0;
+
+        if (run_len != NULL && order != NULL) {
+            for (uint32_t i = 0; i < q->used; i++) {
+                if (i == 0 || q->entries[i].sender != q->entries[i - 1].sender) {
+                    runs_count++;
+                }
+
+                run_len[runs_count - 1]++;
+            }
+
+            n = sync_round_robin(run_len, runs_count, order, room);
+
+            for (uint32_t i = 0; i < n; i++) {
+                bs->entries[bs->entries_used++] = q->entries[order[i]];
+            }
+        } else {
+            for (n = 0; n < q->used && n < room; n++) {
+                bs->entries[bs->entries_used++] = q->entries[n];
+            }
+        }
+
+        if (n < q->used) {
+            bs->queue_full = true;
+        }
+
+        free(run_len);
+        free(order);
+        free(q->entries);
+    }
+
+    if (bs->entries_used > 0) {
+        toxProxyLog(2, "bulk sync: queued %u stored messages of %u senders%s", bs->entries_used,
+                    bs->senders_used, bs->queue_full ? " (queue full)" : "");
+    }
+}
+
+bool bulk_sync_send_probe(Tox *tox, bulk_sync_state *bs)
+{
+    uint8_t packet[BULK_SYNC_PACKET_HEADER_SIZE + 1];
+    uint8_t *p = packet;
+    *p++ = CONTROL_PROXY_MESSAGE_TYPE_BULK_SYNC;
+    *p++ = BULK_SYNC_VERSION;
+    *p++ = BULK_SYNC_FLAG_PROBE | BULK_SYNC_FLAG_END_OF_BATCH;
+    p = put_u32_be(p, bs->batch_id);
+    p = put_u16_be(p, 0);
+    *p++ = 0;
+    *p = bulk_sync_features;
+
+    TOX_ERR_FRIEND_CUSTOM_PACKET error;
+    return tox_friend_send_lossless_packet(tox, bs->master, packet, sizeof(packet), &error);
+}
+
+// put records of the current batch, starting at byte *offset of record *next, into buf until it is full or
+// there are max_records in it. returns the bytes used, *next, *offset and *count are moved on.
+size_t bulk_sync_pack_records(Tox *tox, bulk_sync_state *bs, uint8_t *buf, size_t buf_size, uint32_t max_records,
+                              uint32_t *next, uint32_t *offset, uint32_t *count)
+{
+    uint8_t *p = buf;
+    uint32_t prev_sender = UINT32_MAX;
+
+    while (*next < bs->batch_count && *count < max_records) {
+        bulk_sync_entry *e = &bs->entries[bs->batch_start + *next];
+        const char *sender_key_hex = bs->senders[e->sender].key_hex;
+        const size_t room = buf_size - (size_t)(p - buf);
+
+        char msgPath[strlen(msgsDir) + 1 + strlen(sender_key_hex) + 1 + sizeof(e->name)];
+        snprintf(msgPath, sizeof(msgPath), "%s/%s/%s", msgsDir, sender_key_hex, e->name);
+
+        size_t length = 0;
+        uint8_t *data = e->skipped ? NULL : spool_read_message(msgPath, &length);
+        uint8_t record_flags = 0;
+        bool send_alone = false;
+
+        if (data && receipt_record_check(e->name, data, length)) {
+            if (bs->master_features & BULK_SYNC_FEATURE_RECEIPT_RECORD) {
+                record_flags |= BULK_SYNC_RECORD_RECEIPTS;
+                length -= 4;
+                memmove(data, data + 4, length);
+            } else {
+                send_alone = true;
+            }
+        } else if (data && conference_record_check(e->name, data, length)) {
+            if (bs->master_features & BULK_SYNC_FEATURE_CONFERENCE_RECORD) {
+                // drop the magic, the master expands it itself
+                record_flags |= BULK_SYNC_RECORD_CONFERENCE;
+                length -= 4;
+                memmove(data, data + 4, length);
+            } else {
+                size_t expanded_length = 0;
+                uint8_t *expanded = conference_record_expand(e->name, data, length, &expanded_length);
+                free(data);
+                data = expanded;
+                length = expanded_length;
+            }
+        }
+
+        const bool fragment = (length > BULK_SYNC_MAX_RECORD_DATA)
+                              && (bs->master_features & BULK_SYNC_FEATURE_FRAGMENT);
+
+        if (data == NULL || send_alone || (length > BULK_SYNC_MAX_RECORD_DATA && !fragment)) {
+            if (room < 3) {
+                free(data);
+                break;
+            }
+
+            if (data) {
+                toxProxyLog(2, "bulk sync: %s/%s is too big for a packet or unknown to the master, sending it alone",
+                            sender_key_hex, e->name);
+                send_sync_msg_single(tox, bs->master, (char *)sender_key_hex, e->name);
+                free(data);
+            }
+
+            e->skipped = true;
+            bs->senders[e->sender].skipped = true;
+            *p++ = BULK_SYNC_RECORD_SKIPPED;
+            p = put_u16_be(p, 0);
+            (*count)++;
+            (*next)++;
+            continue;
+        }
+
+        const bool new_sender = (e->sender != prev_sender);
+        const bool receive_time = (bs->master_features & BULK_SYNC_FEATURE_RECEIVE_TIME);
+        const size_t header_size = 1 + (new_sender ? TOX_PUBLIC_KEY_SIZE : 0)
+                                   + (receive_time ? BULK_SYNC_RECORD_RECEIVE_TIME_SIZE : 0)
+                                   + (fragment ? BULK_SYNC_RECORD_FRAGMENT_SIZE : 0) + 2;
+        // the record (or what is left of it), a part of it fills the rest of buf
+        size_t part = (fragment && *offset < length) ? (length - *offset) : length;
+
+        if (fragment) {
+            const size_t min_part = (part < BULK_SYNC_FRAGMENT_MIN_BYTES) ? part : BULK_SYNC_FRAGMENT_MIN_BYTES;
+
+            if (header_size + min_part > room) {
+                free(data);
+                break;
+            }
+
+            if (header_size + part > room) {
+                part = room - header_size;
+            }
+        } else if (header_size + length > room) {
+            free(data);
+            break;
+        }
+
+        uint8_t *record = p;
+        *p++ = record_flags | (fragment ? BULK_SYNC_RECORD_FRAGMENT : 0);
+
+        if (e->name[strlen(e->name) - 1] == 'A' || name_has_suffix(e->name, RECEIPT_RECORD_SUFFIX)) {
+            *record |= BULK_SYNC_RECORD_ANSWER;
+        }
+
+        if (new_sender) {
+            // sender dirs were checked to be valid hex by bulk_sync_scan_sender()
+            *record |= BULK_SYNC_RECORD_NEW_SENDER;
+            hex_string_to_bin(sender_key_hex, TOX_PUBLIC_KEY_SIZE * 2, (char *)p, TOX_PUBLIC_KEY_SIZE);
+            p += TOX_PUBLIC_KEY_SIZE;
+            prev_sender = e->sender;
+        }
+
+        if (receive_time) {
+            uint32_t ts_sec = 0;
+            uint16_t ts_ms = 0;
+            spool_receive_time(msgPath, e->name, &ts_sec, &ts_ms);
+            p = put_u64_be(p, spool_name_seq(e->name));
+            p = put_u32_be(p, ts_sec);
+            p = put_u16_be(p, ts_ms);
+        }
+
+        const size_t part_offset = fragment ? *offset : 0;
+
+        if (fragment) {
+            p = put_u32_be(p, (uint32_t)length);
+            p = put_u32_be(p, (uint32_t)part_offset);
+        }
+
+        p = put_u16_be(p, (uint16_t)part);
+        memcpy(p, data + part_offset, part);
+        p += part;
+        free(data);
+        (*count)++;
+
+        if (part_offset + part < length) {
+            // buf is full, the next part starts the next one
+            *offset = (uint32_t)(part_offset + part);
+            break;
+        }
+
+        *offset = 0;
+        (*next)++;
+    }
+
+    return (size_t)(p - buf);
+}
+
+#ifdef HAVE_ZSTD
+// try to put more records into the packet by compressing them, the amount of raw data to try
+// follows what fitted last time. returns the packet size or 0 if compressing did not help.
+size_t bulk_sync_pack_compressed(Tox *tox, bulk_sync_state *bs, uint8_t *packet, uint32_t *next, uint32_t *offset,
+                                 uint32_t *count)
+{
+    const size_t room = TOX_MAX_CUSTOM_PACKET_SIZE - BULK_SYNC_PACKET_HEADER_SIZE;
+
+    if (bulk_sync_zstd_cctx == NULL) {
+        bulk_sync_zstd_cctx = ZSTD_createCCtx();
+        bulk_sync_zstd_raw = calloc(1, BULK_SYNC_ZSTD_MAX_RAW_BYTES);
+        bulk_sync_zstd_raw_target = room * 3;
+    }
+
+    if (bulk_sync_zstd_cctx == NULL || bulk_sync_zstd_raw == NULL) {
+        return 0;
+    }
+
+    for (int tries = 0; tries < 4; tries++) {
+        uint32_t n = *next;
+        uint32_t o = *offset;
+        uint32_t c = 0;
+        const size_t raw_size = bulk_sync_pack_records(tox, bs, bulk_sync_zstd_raw, bulk_sync_zstd_raw_target, UINT8_MAX,
+                                &n, &o, &c);
+
+        if (c == 0) {
+            return 0;
+        }
+
+        const size_t res = ZSTD_compressCCtx(bulk_sync_zstd_cctx, packet + BULK_SYNC_PACKET_HEADER_SIZE, room,
+                                             bulk_sync_zstd_raw, raw_size, BULK_SYNC_ZSTD_LEVEL);
+
+        if (!ZSTD_isError(res)) {
+            if (res >= raw_size) {
+                // nothing to gain, send them as they are
+                return 0;
+            }
+
+            if (c < UINT8_MAX && n < bs->batch_count && res < (room * 3 / 4)) {
+                bulk_sync_zstd_raw_target += bulk_sync_zstd_raw_target / 4;
+
+                if (bulk_sync_zstd_raw_target > BULK_SYNC_ZSTD_MAX_RAW_BYTES) {
+                    bulk_sync_zstd_raw_target = BULK_SYNC_ZSTD_MAX_RAW_BYTES;
+                }
+            }
+
+            *next = n;
+            *offset = o;
+            *count = c;
+            return BULK_SYNC_PACKET_HEADER_SIZE + res;
+        }
+
+        // did not fit into the packet, try with less
+        if (bulk_sync_zstd_raw_target <= room) {
+            return 0;
+        }
+
+        bulk_sync_zstd_raw_target -= bulk_sync_zstd_raw_target / 4;
+
+        if (bulk_sync_zstd_raw_target < room) {
+            bulk_sync_zstd_raw_target = room;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+// fill one packet with the next records of the current batch and send it.
+// returns false if the packet could not be sent (send queue full), it is built again next time.
+bool bulk_sync_send_packet(Tox *tox, bulk_sync_state *bs)
+{
+    uint8_t packet[TOX_MAX_CUSTOM_PACKET_SIZE];
+    uint8_t flags = 0;
+    uint32_t next = bs->batch_next_send;
+    uint32_t offset = bs->batch_next_offset;
+    uint32_t count = 0;
+    size_t packet_size = 0;
+
+#ifdef HAVE_ZSTD
+
+    if (bs->master_features & BULK_SYNC_FEATURE_ZSTD) {
+        packet_size = bulk_sync_pack_compressed(tox, bs, packet, &next, &offset, &count);
+
+        if (packet_size > 0) {
+            flags |= BULK_SYNC_FLAG_ZSTD;
+        }
+    }
+
+#endif
+
+    if (packet_size == 0) {
+        next = bs->batch_next_send;
+        offset = bs->batch_next_offset;
+        count = 0;
+        packet_size = BULK_SYNC_PACKET_HEADER_SIZE
+                      + bulk_sync_pack_records(tox, bs, packet + BULK_SYNC_PACKET_HEADER_SIZE,
+                                               sizeof(packet) - BULK_SYNC_PACKET_HEADER_SIZE, UINT8_MAX, &next, &offset,
+                                               &count);
+    }
+
+    uint32_t batch_end = bs->batch_count;
+
+    // a direct message is waiting and the rest of the batch is of a lower class: the batch ends with this
+    // packet, the next one starts with a new scan
+    if (bs->direct_waiting_ts != 0 && next > 0 && next < batch_end && offset == 0
+            && bs->entries[bs->batch_start + next].sync_class != SYNC_CLASS_DIRECT) {
+        batch_end = next;
+    }
+
+    if (next == batch_end) {
+        flags |= BULK_SYNC_FLAG_END_OF_BATCH;
+    }
+
+    uint8_t *p = packet;
+    *p++ = CONTROL_PROXY_MESSAGE_TYPE_BULK_SYNC;
+    *p++ = BULK_SYNC_VERSION;
+    *p++ = flags;
+    p = put_u32_be(p, bs->batch_id);
+    p = put_u16_be(p, (uint16_t)bs->batch_next_send);
+    *p = (uint8_t)count;
+
+    TOX_ERR_FRIEND_CUSTOM_PACKET error;
+
+    if (!tox_friend_send_lossless_packet(tox, bs->master, packet, packet_size, &error)) {
+        // records we skipped are marked already, they are skipped the same way next time
+        return false;
+    }
+
+    bs->batch_next_send = next;
+    bs->batch_next_offset = offset;
+
+    if (batch_end != bs->batch_count) {
+        toxProxyLog(2, "bulk sync: batch %u ended after %u of %u records for a new direct message", bs->batch_id,
+                    batch_end, bs->batch_count);
+        bs->batch_count = batch_end;
+    }
+
+    if (next == bs->batch_count) {
+        bs->batch_sent_ts = get_unix_time();
+    }
+
+    return true;
+}
+
+// delete the messages of the current batch the master device has acknowledged
+// (or only move its cursor over them, as long as other master devices don't have them yet)
+void bulk_sync_delete_acked(bulk_sync_state *bs, uint32_t from, uint32_t to)
+{
+    int dir_fd = -1;
+    uint32_t dir_sender = UINT32_MAX;
+    spool_account *acc = NULL;
+
+    for (uint32_t i = from; i < to; i++) {
+        bulk_sync_entry *e = &bs->entries[bs->batch_start + i];
+        const char *sender_key_hex = bs->senders[e->sender].key_hex;
+
+        if (e->skipped) {
+            continue;
+        }
+
+        if (e->sender != dir_sender) {
+            if (dir_fd >= 0) {
+                close(dir_fd);
+            }
+
+            char friendDir[strlen(msgsDir) + 1 + strlen(sender_key_hex) + 1];
+            snprintf(friendDir, sizeof(friendDir), "%s/%s", msgsDir, sender_key_hex);
+            dir_fd = open(friendDir, O_RDONLY | O_DIRECTORY);
+            dir_sender = e->sender;
+            acc = spool_account_get(sender_key_hex);
+        }
+
+        if (dir_fd < 0) {
+            continue;
+        }
+
+        if (!master_devices_all_have(acc, dir_fd, e->name, bs->device)) {
+            // the other devices still need it. the records come in the order of the sequence numbers,
+            // so the cursor can move up to it if nothing before it was skipped or is in another class
+            const uint64_t seq = spool_name_seq(e->name);
+
+            if (seq != 0 && !bs->senders[e->sender].skipped && !bs->senders[e->sender].reordered) {
+                master_device_advance_cursor(acc, bs->device, seq);
+            } else {
+                master_device_mark(dir_fd, e->name, bs->device);
+            }
+
+            continue;
+        }
+
+        if (e->has_sidecar || master_devices_count > 1) {
+            // the markers of the other devices go too
+            spool_delete_message_files(sender_key_hex, e->name);
+            // it looks the account up itself, don't keep a pointer across that
+            acc = spool_account_get(sender_key_hex);
+        } else {
+            spool_unlink_file(acc, dir_fd, e->name);
+        }
+    }
+
+    if (dir_fd >= 0) {
+        close(dir_fd);
+    }
+}
+
+// [182][batch_id u32][next_seq u16] from a master device
+void bulk_sync_handle_ack(int device, const uint8_t *data, size_t length)
+{
+    bulk_sync_state *bs = &bulk_sync[device];
+
+    if (length < 7) {
+        toxProxyLog(0, "bulk sync: ack with wrong size");
+        return;
+    }
+
+    const uint32_t batch_id = get_u32_be(data + 1);
+    const uint32_t next_seq = get_u16_be(data + 5);
+
+    if (batch_id != bs->batch_id) {
+        toxProxyLog(9, "bulk sync: ack for old batch %u", batch_id);
+        return;
+    }
+
+    if (bs->mode == BULK_SYNC_MODE_PROBING || bs->mode == BULK_SYNC_MODE_UNSUPPORTED) {
+        // answer to our probe (maybe a late one)
+        bs->master_features = (length > 7) ? (data[7] & bulk_sync_features) : 0;
+        toxProxyLog(2, "bulk sync: master supports bulk sync, features=%d", (int)bs->master_features);
+        bs->mode = BULK_SYNC_MODE_SUPPORTED;
+        bs->batch_id++;
+        return;
+    }
+
+    if (bs->mode != BULK_SYNC_MODE_SUPPORTED || bs->batch_count == 0) {
+        return;
+    }
+
+    if (next_seq > bs->batch_next_send) {
+        toxProxyLog(0, "bulk sync: master acknowledged records we did not send yet");
+        return;
+    }
+
+    if (next_seq > bs->batch_acked) {
+        bulk_sync_delete_acked(bs, bs->batch_acked, next_seq);
+        bs->batch_acked = next_seq;
+    }
+
+    if (bs->batch_acked == bs->batch_count) {
+        toxProxyLog(2, "bulk sync: batch %u with %u records done", bs->batch_id, bs->batch_count);
+        bs->batch_start += bs->batch_count;
+        bs->batch_count = 0;
+        bs->batch_id++;
+    } else if (bs->batch_sent_ts != 0) {
+        // the whole batch went out but the master only kept a part of it, send the rest again
+        toxProxyLog(1, "bulk sync: batch %u acked up to %u of %u, resending", bs->batch_id, next_seq,
+                    bs->batch_count);
+        bs->batch_next_send = bs->batch_acked;
+        bs->batch_next_offset = 0;
+        bs->batch_sent_ts = 0;
+    }
+}
+
+// called from the main loop while the master is online
+void bulk_sync_iterate(Tox *tox, bulk_sync_state *bs)
+{
+    const time_t now = get_unix_time();
+
+    switch (bs->mode) {
+        case BULK_SYNC_MODE_UNKNOWN:
+            bs->master = master_device_friend_number(tox, bs->device);
+
+            if (bs->master != UINT32_MAX && bulk_sync_send_probe(tox, bs)) {
+                bs->mode = BULK_SYNC_MODE_PROBING;
+                bs->mode_ts = now;
+            }
+
+            return;
+
+        case BULK_SYNC_MODE_PROBING:
+            if ((now - bs->mode_ts) >= BULK_SYNC_PROBE_TIMEOUT_SECS) {
+                toxProxyLog(2, "bulk sync: no answer from master, using the per message sync");
+                bs->mode = BULK_SYNC_MODE_UNSUPPORTED;
+            }
+
+            return;
+
+        case BULK_SYNC_MODE_UNSUPPORTED:
+            return;
+
+        case BULK_SYNC_MODE_SUPPORTED:
+            break;
+    }
+
+    if (bs->batch_count == 0) {
+        // a new direct message gets its turn right away when the queue has none (left), otherwise
+        // after BULK_SYNC_DIRECT_LATENCY_SECS
+        const bool direct_due = (bs->direct_waiting_ts != 0)
+                                && (bs->batch_start >= bs->entries_used
+                                    || bs->entries[bs->batch_start].sync_class != SYNC_CLASS_DIRECT
+                                    || (now - bs->direct_waiting_ts) >= BULK_SYNC_DIRECT_LATENCY_SECS);
+
+        if (bs->batch_start >= bs->entries_used || direct_due) {
+            if (!direct_due && !bs->queue_full && now < bs->next_scan_ts) {
+                return;
+            }
+
+            bulk_sync_scan(bs);
+            bs->next_scan_ts = now + BULK_SYNC_RESCAN_SECS;
+
+            if (bs->entries_used == 0) {
+                return;
+            }
+        }
+
+        bs->batch_count = bs->entries_used - bs->batch_start;
+
+        if (bs->batch_count > BULK_SYNC_BATCH_MAX_RECORDS) {
+            bs->batch_count = BULK_SYNC_BATCH_MAX_RECORDS;
+        }
+
+        bs->batch_next_send = 0;
+        bs->batch_acked = 0;
+        bs->batch_next_offset = 0;
+        bs->batch_sent_ts = 0;
+    }
+
+    if (bs->batch_sent_ts == 0) {
+        for (int packets = 0; packets < BULK_SYNC_PACKETS_PER_ITERATION; packets++) {
+            if (bs->batch_next_send >= bs->batch_count || !bulk_sync_send_packet(tox, bs)) {
+                break;
+            }
+        }
+    } else if ((now - bs->batch_sent_ts) >= BULK_SYNC_ACK_TIMEOUT_SECS) {
+        toxProxyLog(1, "bulk sync: no ack for batch %u, resending", bs->batch_id);
+        bs->batch_next_send = bs->batch_acked;
+        bs->batch_next_offset = 0;
+        bs->batch_sent_ts = 0;
+    }
+}
+
+void bulk_sync_direct_stored(void)
+{
+    const time_t now = get_unix_time();
+
+    for (int d = 0; d < MASTER_MAX_DEVICES; d++) {
+        if (bulk_sync[d].direct_waiting_ts == 0) {
+            bulk_sync[d].direct_waiting_ts = now;
+        }
+    }
+}
+
+bool bulk_sync_in_use(bulk_sync_state *bs)
+{
+    return bs->mode != BULK_SYNC_MODE_UNSUPPORTED;
+}
+
+void bulk_sync_reset_device(int device)
+{
+    bulk_sync[device].device = device;
+    bulk_sync_reset(&bulk_sync[device]);
+}
+
+// ----------- file transfers -----------
+// file transfers of friends (TOX_FILE_KIND_DATA) are stored and sent on to the master devices.
+// filesDir/<sender pubkey hex>/<file id hex>.data gets the chunks with positional writes, it is fallocate()d
+// to the file size when the transfer starts. <file id hex>.state next to it is
+// [FILE_STATE_MAGIC][size u64][received u64][receive time u32][devices done u8][name length u16][name]
+// where received is how far the data is complete. a friend that sends the same file again (same file id,
+// e.g. after it was offline) continues at received with tox_file_seek().
+// complete files go to every master device with tox_file_send() (same file id and name), after a
+// [185][file id 32][sender pubkey 32][receive time u32] packet that tells the device whose file it is.
+// each file_chunk_request of the device is answered with a pread() of just that chunk, a device that gets
+// the file again after it was offline can seek the same way. the file is deleted when all devices have it.
+// with spool encryption the state is written with spool_crypt_write_file() (an encrypted state means
+// encrypted data) and the data is [nonce 16] followed by blocks of FILE_CRYPT_BLOCK_SIZE, each one
+// encrypted on its own with xchacha20poly1305 and its block index in the nonce (the file id and size are
+// the additional data). the chunks are collected into blocks while they come in, so received only counts
+// whole blocks and a resumed transfer starts at a block. a chunk that is asked for is decrypted from the
+// blocks it is in. files that came in before the passphrase was set stay plain.
+#define FILE_STATE_MAGIC "TPf1"
+#define FILE_STATE_HEADER_SIZE (4 + 8 + 8 + 4 + 1 + 2)
+#define FILE_CRYPT_NONCE_SIZE 16
+#define FILE_CRYPT_BLOCK_SIZE (16 * 1024)
+#define FILE_SENDER_PACKET_SIZE (1 + TOX_FILE_ID_LENGTH + TOX_PUBLIC_KEY_SIZE + 4)
+
+typedef struct file_state {
+    uint64_t size;
+    uint64_t received;
+    uint32_t receive_ts;
+    // bit per master_devices[] slot
+    uint8_t devices_done;
+    uint16_t name_length;
+    uint8_t name[TOX_MAX_FILENAME_LENGTH];
+    // the state was stored encrypted, so is the data (not a part of the state file)
+    bool encrypted;
+} file_state;
+
+typedef struct file_transfer {
+    bool used;
+    // from a friend, otherwise to the master device in the device slot
+    bool incoming;
+    int device;
+    uint32_t friend_number;
+    uint32_t file_number;
+    int fd;
+    uint8_t file_id[TOX_FILE_ID_LENGTH];
+    char sender_key_hex[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+    file_state state;
+    // received when the state file was written last
+    uint64_t saved_received;
+    // for encrypted data: the nonce from the data file, the block that is collected (incoming) or was
+    // decrypted last (outgoing, block_index is UINT64_MAX before the first one)
+    uint8_t crypt_nonce[FILE_CRYPT_NONCE_SIZE];
+    uint8_t *crypt_block;
+    size_t block_fill;
+    uint64_t block_index;
+} file_transfer;
+
+file_transfer file_transfers[FILE_TRANSFERS_MAX];
+// sizes of all stored files, complete or not
+uint64_t file_spool_bytes = 0;
+uint32_t file_spool_files = 0;
+// look for complete files to send to the master devices at this time
+time_t file_forward_scan_ts = 0;
+// look for files that did not come in completely at this time
+time_t file_partial_check_ts = 0;
+
+// filesDir/<sender_key_hex>/<file id hex><suffix>
+void file_spool_path(const char *sender_key_hex, const uint8_t *file_id, const char *suffix, char *path,
+                     size_t path_size)
+{
+    char file_id_hex[TOX_FILE_ID_LENGTH * 2 + 1];
+    bin2upHex(file_id, TOX_FILE_ID_LENGTH, file_id_hex, sizeof(file_id_hex));
+    snprintf(path, path_size, "%s/%s/%s%s", filesDir, sender_key_hex, file_id_hex, suffix);
+}
+
+bool file_state_load(const char *path, file_state *state)
+{
+    size_t length = 0;
+    bool encrypted = false;
+    uint8_t *buf = spool_crypt_read_file(path, spool_crypt_size(FILE_STATE_HEADER_SIZE + TOX_MAX_FILENAME_LENGTH),
+                                         &length, &encrypted);
+
+    if (buf == NULL) {
+        return false;
+    }
+
+    if (length < FILE_STATE_HEADER_SIZE || length > FILE_STATE_HEADER_SIZE + TOX_MAX_FILENAME_LENGTH
+            || memcmp(buf, FILE_STATE_MAGIC, 4) != 0) {
+        free(buf);
+        return false;
+    }
+
+    CLEAR(*state);
+    state->encrypted = encrypted;
+    state->size = get_u64_be(buf + 4);
+    state->received = get_u64_be(buf + 12);
+    state->receive_ts = get_u32_be(buf + 20);
+    state->devices_done = buf[24];
+    state->name_length = get_u16_be(buf + 25);
+
+    if (state->name_length > TOX_MAX_FILENAME_LENGTH || length != FILE_STATE_HEADER_SIZE + state->name_length
+            || state->received > state->size) {
+        free(buf);
+        return false;
+    }
+
+    memcpy(state->name, buf + FILE_STATE_HEADER_SIZE, state->name_length);
+    free(buf);
+    return true;
+}
+
+bool file_state_save(const char *path, const file_state *state)
+{
+    uint8_t buf[FILE_STATE_HEADER_SIZE + TOX_MAX_FILENAME_LENGTH];
+    uint8_t *p = buf;
+    memcpy(p, FILE_STATE_MAGIC, 4);
+    p = put_u64_be(p + 4, state->size);
+    p = put_u64_be(p, state->received);
+    p = put_u32_be(p, state->receive_ts);
+    *p++ = state->devices_done;
+    p = put_u16_be(p, state->name_length);
+    memcpy(p, state->name, state->name_length);
+    p += state->name_length;
+
+    char tmp_path[strlen(path) + 5];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    if (state->encrypted) {
+        return spool_crypt_write_file(tmp_path, path, buf, (size_t)(p - buf));
+    }
+
+    FILE *f = fopen(tmp_path, "wb");
+
+    if (f == NULL) {
+        return false;
+    }
+
+    const bool ok = (fwrite(buf, (size_t)(p - buf), 1, f) == 1);
+
+    if (fclose(f) != 0 || !ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return false;
+    }
+
+    return true;
+}
+
+// size of the data file of an encrypted file of size bytes
+uint64_t file_crypt_data_size(uint64_t size)
+{
+    const uint64_t blocks = (size + FILE_CRYPT_BLOCK_SIZE - 1) / FILE_CRYPT_BLOCK_SIZE;
+    return FILE_CRYPT_NONCE_SIZE + size + blocks * crypto_aead_xchacha20poly1305_ietf_ABYTES;
+}
+
+// plain length of block index of a file of size bytes
+size_t file_crypt_block_length(uint64_t size, uint64_t index)
+{
+    const uint64_t start = index * FILE_CRYPT_BLOCK_SIZE;
+    return (size - start > FILE_CRYPT_BLOCK_SIZE) ? FILE_CRYPT_BLOCK_SIZE : (size_t)(size - start);
+}
+
+void file_crypt_block_nonce(const file_transfer *ft, uint64_t index, uint8_t *nonce, uint8_t *ad)
+{
+    memcpy(nonce, ft->crypt_nonce, FILE_CRYPT_NONCE_SIZE);
+    put_u64_be(nonce + FILE_CRYPT_NONCE_SIZE, index);
+    memcpy(ad, ft->file_id, TOX_FILE_ID_LENGTH);
+    put_u64_be(ad + TOX_FILE_ID_LENGTH, ft->state.size);
+}
+
+// the encrypted data of ft is open in ft->fd: take its nonce (a fresh file gets a new one) and the block buffer
+bool file_crypt_open(file_transfer *ft, bool fresh)
+{
+    ft->crypt_block = calloc(1, FILE_CRYPT_BLOCK_SIZE + crypto_aead_xchacha20poly1305_ietf_ABYTES);
+    ft->block_fill = 0;
+    ft->block_index = UINT64_MAX;
+
+    if (ft->crypt_block == NULL) {
+        return false;
+    }
+
+    if (fresh) {
+        randombytes_buf(ft->crypt_nonce, FILE_CRYPT_NONCE_SIZE);
+        return pwrite(ft->fd, ft->crypt_nonce, FILE_CRYPT_NONCE_SIZE, 0) == FILE_CRYPT_NONCE_SIZE;
+    }
+
+    return pread(ft->fd, ft->crypt_nonce, FILE_CRYPT_NONCE_SIZE, 0) == FILE_CRYPT_NONCE_SIZE;
+}
+
+// collect the chunks of an encrypted incoming file into blocks, a full block (or the last one) is
+// encrypted and written and counts as received. chunks come in order, one that does not fails.
+bool file_crypt_recv_chunk(file_transfer *ft, uint64_t position, const uint8_t *data, size_t length)
+{
+    if (position != ft->state.received + ft->block_fill || length > ft->state.size - position) {
+        return false;
+    }
+
+    while (length > 0) {
+        const uint64_t index = ft->state.received / FILE_CRYPT_BLOCK_SIZE;
+        const size_t block_length = file_crypt_block_length(ft->state.size, index);
+        const size_t take = (length > block_length - ft->block_fill) ? (block_length - ft->block_fill) : length;
+        memcpy(ft->crypt_block + ft->block_fill, data, take);
+        ft->block_fill += take;
+        data += take;
+        length -= take;
+
+        if (ft->block_fill == block_length) {
+            uint8_t nonce[crypto_aead_xchacha20poly1305_ietf_NPUBBYTES];
+            uint8_t ad[TOX_FILE_ID_LENGTH + 8];
+            uint8_t c[FILE_CRYPT_BLOCK_SIZE + crypto_aead_xchacha20poly1305_ietf_ABYTES];
+            unsigned long long clen = 0;
+            file_crypt_block_nonce(ft, index, nonce, ad);
+            crypto_aead_xchacha20poly1305_ietf_encrypt(c, &clen, ft->crypt_block, block_length, ad, sizeof(ad), NULL,
+                    nonce, spool_crypt_key);
+            const off_t offset = (off_t)(FILE_CRYPT_NONCE_SIZE
+                                         + index * (FILE_CRYPT_BLOCK_SIZE + crypto_aead_xchacha20poly1305_ietf_ABYTES));
+
+            if (pwrite(ft->fd, c, (size_t)clen, offset) != (ssize_t)clen) {
+                return false;
+            }
+
+            ft->state.received += block_length;
+            ft->block_fill = 0;
+        }
+    }
+
+    return true;
+}
+
+// decrypt length bytes at position of an encrypted stored file into out, the last block stays in ft
+bool file_crypt_read(file_transfer *ft, uint8_t *out, uint64_t position, size_t length)
+{
+    if (length > ft->state.size || position > ft->state.size - length) {
+        return false;
+    }
+
+    while (length > 0) {
+        const uint64_t index = position / FILE_CRYPT_BLOCK_SIZE;
+        const size_t block_length = file_crypt_block_length(ft->state.size, index);
+
+        if (ft->block_index != index) {
+            uint8_t nonce[crypto_aead_xchacha20poly1305_ietf_NPUBBYTES];
+            uint8_t ad[TOX_FILE_ID_LENGTH + 8];
+            uint8_t c[FILE_CRYPT_BLOCK_SIZE + crypto_aead_xchacha20poly1305_ietf_ABYTES];
+            const size_t clen = block_length + crypto_aead_xchacha20poly1305_ietf_ABYTES;
+            const off_t offset = (off_t)(FILE_CRYPT_NONCE_SIZE
+                                         + index * (FILE_CRYPT_BLOCK_SIZE + crypto_aead_xchacha20poly1305_ietf_ABYTES));
+            file_crypt_block_nonce(ft, index, nonce, ad);
+            ft->block_index = UINT64_MAX;
+
+            if (pread(ft->fd, c, clen, offset) != (ssize_t)clen
+                    || crypto_aead_xchacha20poly1305_ietf_decrypt(ft->crypt_block, NULL, NULL, c, clen, ad, sizeof(ad),
+                            nonce, spool_crypt_key) != 0) {
+                return false;
+            }
+
+            ft->block_index = index;
+        }
+
+        const size_t in_block = (size_t)(position - index * FILE_CRYPT_BLOCK_SIZE);
+        const size_t take = (length > block_length - in_block) ? (block_length - in_block) : length;
+        memcpy(out, ft->crypt_block + in_block, take);
+        out += take;
+        position += take;
+        length -= take;
+    }
+
+    return true;
+}
+
+// delete a stored file and its state
+void file_spool_remove(const char *sender_key_hex, const uint8_t *file_id, uint64_t size)
+{
+    char path[strlen(filesDir) + 1 + TOX_PUBLIC_KEY_SIZE * 2 + 1 + TOX_FILE_ID_LENGTH * 2 + 8];
+    file_spool_path(sender_key_hex, file_id, ".data", path, sizeof(path));
+    unlink(path);
+    file_spool_path(sender_key_hex, file_id, ".state", path, sizeof(path));
+    unlink(path);
+
+    file_spool_bytes = (file_spool_bytes > size) ? (file_spool_bytes - size) : 0;
+    file_spool_files = (file_spool_files > 0) ? (file_spool_files - 1) : 0;
+}
+
+file_transfer *file_transfer_find(uint32_t friend_number, uint32_t file_number)
+{
+    for (int i = 0; i < FILE_TRANSFERS_MAX; i++) {
+        if (file_transfers[i].used && file_transfers[i].friend_number == friend_number
+                && file_transfers[i].file_number == file_number) {
+            return &file_transfers[i];
+        }
+    }
+
+    return NULL;
+}
+
+// is sender_key_hex/file_id being received or sent right now?
+bool file_transfer_active(const char *sender_key_hex, const uint8_t *file_id, bool incoming)
+{
+    for (int i = 0; i < FILE_TRANSFERS_MAX; i++) {
+        const file_transfer *ft = &file_transfers[i];
+
+        if (ft->used && ft->incoming == incoming && memcmp(ft->file_id, file_id, TOX_FILE_ID_LENGTH) == 0
+                && strcmp(ft->sender_key_hex, sender_key_hex) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+file_transfer *file_transfer_new(void)
+{
+    for (int i = 0; i < FILE_TRANSFERS_MAX; i++) {
+        if (!file_transfers[i].used) {
+            CLEAR(file_transfers[i]);
+            file_transfers[i].used = true;
+            file_transfers[i].fd = -1;
+            return &file_transfers[i];
+        }
+    }
+
+    return NULL;
+}
+
+// an incoming transfer writes its state so it can go on later
+void file_transfer_close(file_transfer *ft)
+{
+    if (ft->incoming && ft->state.received != ft->saved_received && fdatasync(ft->fd) == 0) {
+        char path[strlen(filesDir) + 1 + TOX_PUBLIC_KEY_SIZE * 2 + 1 + TOX_FILE_ID_LENGTH * 2 + 8];
+        file_spool_path(ft->sender_key_hex, ft->file_id, ".state", path, sizeof(path));
+        file_state_save(path, &ft->state);
+    }
+
+    if (ft->fd >= 0) {
+        close(ft->fd);
+    }
+
+    if (ft->crypt_block != NULL) {
+        // a block that is not full yet is lost, the friend sends it again from received
+        sodium_memzero(ft->crypt_block, FILE_CRYPT_BLOCK_SIZE + crypto_aead_xchacha20poly1305_ietf_ABYTES);
+        free(ft->crypt_block);
+        ft->crypt_block = NULL;
+    }
+
+    ft->used = false;
+}
+
+void file_transfer_cancel(Tox *tox, uint32_t friend_number, uint32_t file_number)
+{
+    TOX_ERR_FILE_CONTROL error;
+    tox_file_control(tox, friend_number, file_number, TOX_FILE_CONTROL_CANCEL, &error);
+}
+
+void on_file_recv(Tox *tox, uint32_t friend_number, uint32_t file_number, uint32_t kind, uint64_t file_size,
+                  const uint8_t *filename, size_t filename_length, void *user_data)
+{
+    if (kind != TOX_FILE_KIND_DATA || master_device_index_by_friend(tox, friend_number) >= 0) {
+        // avatars are not stored, and the master has nothing to send to itself
+        file_transfer_cancel(tox, friend_number, file_number);
+        return;
+    }
+
+    if (file_size == UINT64_MAX || file_size > FILE_TRANSFER_MAX_BYTES) {
+        toxProxyLog(1, "file transfers: friend %u sends a file of %llu bytes, the limit is %llu", friend_number,
+                    (unsigned long long)file_size, (unsigned long long)FILE_TRANSFER_MAX_BYTES);
+        file_transfer_cancel(tox, friend_number, file_number);
+        return;
+    }
+
+    uint8_t public_key_bin[TOX_PUBLIC_KEY_SIZE];
+    TOX_ERR_FILE_GET error_get;
+    file_transfer *ft = file_transfer_new();
+
+    if (ft == NULL || !tox_friend_get_public_key(tox, friend_number, public_key_bin, NULL)) {
+        toxProxyLog(1, "file transfers: no room for the file of friend %u", friend_number);
+
+        if (ft != NULL) {
+            ft->used = false;
+        }
+
+        file_transfer_cancel(tox, friend_number, file_number);
+        return;
+    }
+
+    ft->incoming = true;
+    ft->friend_number = friend_number;
+    ft->file_number = file_number;
+    bin2upHex(public_key_bin, TOX_PUBLIC_KEY_SIZE, ft->sender_key_hex, sizeof(ft->sender_key_hex));
+
+    if (!tox_file_get_file_id(tox, friend_number, file_number, ft->file_id, &error_get)
+            || file_transfer_active(ft->sender_key_hex, ft->file_id, false)) {
+        // (it is being sent to a master device from the file we have)
+        ft->used = false;
+        file_transfer_cancel(tox, friend_number, file_number);
+        return;
+    }
+
+    char dir[strlen(filesDir) + 1 + sizeof(ft->sender_key_hex)];
+    snprintf(dir, sizeof(dir), "%s/%s", filesDir, ft->sender_key_hex);
+    mkdir(filesDir, S_IRWXU);
+    mkdir(dir, S_IRWXU);
+
+    char state_path[strlen(filesDir) + 1 + TOX_PUBLIC_KEY_SIZE * 2 + 1 + TOX_FILE_ID_LENGTH * 2 + 8];
+    char data_path[sizeof(state_path)];
+    file_spool_path(ft->sender_key_hex, ft->file_id, ".state", state_path, sizeof(state_path));
+    file_spool_path(ft->sender_key_hex, ft->file_id, ".data", data_path, sizeof(data_path));
+
+    file_state old;
+    const bool have_old = file_state_load(state_path, &old);
+
+    if (have_old && old.size == file_size && old.received == file_size) {
+        toxProxyLog(2, "file transfers: already have the file %s of friend %u", data_path, friend_number);
+        ft->used = false;
+        file_transfer_cancel(tox, friend_number, file_number);
+        return;
+    }
+
+    // a state for another size is gone with its data, the file starts over like a new one. so is a plain
+    // part of a file when the spool is encrypted now
+    const bool fresh = !(have_old && old.size == file_size && old.encrypted == spool_crypt_enabled);
+
+    if (!fresh) {
+        ft->state = old;
+    } else {
+        if (have_old) {
+            file_spool_remove(ft->sender_key_hex, ft->file_id, old.size);
+        }
+
+        if (file_spool_bytes + file_size > FILE_SPOOL_MAX_BYTES) {
+            toxProxyLog(1, "file transfers: no room for %llu more bytes (%llu of %llu stored)",
+                        (unsigned long long)file_size, (unsigned long long)file_spool_bytes,
+                        (unsigned long long)FILE_SPOOL_MAX_BYTES);
+            ft->used = false;
+            file_transfer_cancel(tox, friend_number, file_number);
+            return;
+        }
+
+        ft->state.size = file_size;
+        ft->state.encrypted = spool_crypt_enabled;
+        ft->state.receive_ts = (uint32_t)get_unix_time();
+        ft->state.name_length = (uint16_t)((filename_length > TOX_MAX_FILENAME_LENGTH) ? TOX_MAX_FILENAME_LENGTH :
+                                           filename_length);
+        memcpy(ft->state.name, filename, ft->state.name_length);
+    }
+
+    ft->fd = open(data_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    const uint64_t data_size = ft->state.encrypted ? file_crypt_data_size(file_size) : file_size;
+
+    if (ft->fd >= 0 && ft->state.encrypted && !file_crypt_open(ft, fresh)) {
+        toxProxyLog(0, "file transfers: can not set up the encryption of %s", data_path);
+        close(ft->fd);
+        ft->fd = -1;
+    }
+
+    if (ft->fd >= 0 && fresh) {
+        // the space is taken now, a full disk is noticed before any data came
+        if (data_size > 0 && fallocate(ft->fd, 0, 0, (off_t)data_size) != 0
+                && (errno != EOPNOTSUPP || posix_fallocate(ft->fd, 0, (off_t)data_size) != 0)) {
+            toxProxyLog(0, "file transfers: can not allocate %llu bytes for %s", (unsigned long long)data_size,
+                        data_path);
+            close(ft->fd);
+            ft->fd = -1;
+            unlink(data_path);
+        } else if (!file_state_save(state_path, &ft->state)) {
+            close(ft->fd);
+            ft->fd = -1;
+            unlink(data_path);
+        } else {
+            file_spool_bytes += file_size;
+            file_spool_files++;
+        }
+    }
+
+    if (ft->fd < 0) {
+        file_transfer_close(ft);
+        file_transfer_cancel(tox, friend_number, file_number);
+        return;
+    }
+
+    ft->saved_received = ft->state.received;
+
+    if (ft->state.received > 0) {
+        TOX_ERR_FILE_SEEK error_seek;
+
+        if (!tox_file_seek(tox, friend_number, file_number, ft->state.received, &error_seek)) {
+            ft->state.received = 0;
+        }
+
+        toxProxyLog(2, "file transfers: friend %u goes on with %s at %llu of %llu", friend_number, data_path,
+                    (unsigned long long)ft->state.received, (unsigned long long)file_size);
+    } else {
+        toxProxyLog(2, "file transfers: receiving %s (%llu bytes) from friend %u", data_path,
+                    (unsigned long long)file_size, friend_number);
+    }
+
+    TOX_ERR_FILE_CONTROL error_control;
+    tox_file_control(tox, friend_number, file_number, TOX_FILE_CONTROL_RESUME, &error_control);
+}
+
+void on_file_recv_chunk(Tox *tox, uint32_t friend_number, uint32_t file_number, uint64_t position,
+                        const uint8_t *data, size_t length, void *user_data)
+{
+    file_transfer *ft = file_transfer_find(friend_number, file_number);
+
+    if (ft == NULL || !ft->incoming) {
+        return;
+    }
+
+    if (length == 0) {
+        // all data is there
+        if (ft->state.received == ft->state.size) {
+            toxProxyLog(2, "file transfers: got %llu bytes from friend %u", (unsigned long long)ft->state.size,
+                        friend_number);
+            file_transfer_close(ft);
+            file_forward_scan_ts = 0;
+            ping_push_service();
+        } else {
+            toxProxyLog(1, "file transfers: friend %u ended at %llu of %llu", friend_number,
+                        (unsigned long long)ft->state.received, (unsigned long long)ft->state.size);
+            file_transfer_close(ft);
+        }
+
+        return;
+    }
+
+    if (ft->state.encrypted) {
+        if (!file_crypt_recv_chunk(ft, position, data, length)) {
+            toxProxyLog(0, "file transfers: can not store %u encrypted bytes at %llu from friend %u", (uint32_t)length,
+                        (unsigned long long)position, friend_number);
+            file_transfer_close(ft);
+            file_transfer_cancel(tox, friend_number, file_number);
+            return;
+        }
+    } else if (position + length > ft->state.size
+               || pwrite(ft->fd, data, length, (off_t)position) != (ssize_t)length) {
+        toxProxyLog(0, "file transfers: can not store %u bytes at %llu from friend %u", (uint32_t)length,
+                    (unsigned long long)position, friend_number);
+        file_transfer_close(ft);
+        file_transfer_cancel(tox, friend_number, file_number);
+        return;
+    } else if (position == ft->state.received) {
+        ft->state.received += length;
+    }
+
+    if (ft->state.received - ft->saved_received >= FILE_STATE_SAVE_BYTES) {
+        char path[strlen(filesDir) + 1 + TOX_PUBLIC_KEY_SIZE * 2 + 1 + TOX_FILE_ID_LENGTH * 2 + 8];
+        file_spool_path(ft->sender_key_hex, ft->file_id, ".state", path, sizeof(path));
+
+        // the data must be on disk before the state says it is
+        if (fdatasync(ft->fd) == 0 && file_state_save(path, &ft->state)) {
+            ft->saved_received = ft->state.received;
+        }
+    }
+}
+
+// the device has the file (or does not want it)
+void file_forward_done(file_transfer *ft)
+{
+    char path[strlen(filesDir) + 1 + TOX_PUBLIC_KEY_SIZE * 2 + 1 + TOX_FILE_ID_LENGTH * 2 + 8];
+    file_spool_path(ft->sender_key_hex, ft->file_id, ".state", path, sizeof(path));
+    file_state state;
+
+    if (file_state_load(path, &state)) {
+        state.devices_done |= (uint8_t)(1U << ft->device);
+        bool all = true;
+
+        for (int d = 0; d < MASTER_MAX_DEVICES; d++) {
+            all = all && (!master_devices[d].used || (state.devices_done & (1U << d)));
+        }
+
+        if (all) {
+            toxProxyLog(2, "file transfers: all master devices have %s, deleting it", path);
+            file_spool_remove(ft->sender_key_hex, ft->file_id, state.size);
+        } else {
+            file_state_save(path, &state);
+        }
+    }
+
+    file_transfer_close(ft);
+    file_forward_scan_ts = 0;
+}
+
+void on_file_chunk_request(Tox *tox, uint32_t friend_number, uint32_t file_number, uint64_t position,
+                           size_t length, void *user_data)
+{
+    file_transfer *ft = file_transfer_find(friend_number, file_number);
+
+    if (ft == NULL || ft->incoming) {
+        return;
+    }
+
+    if (length == 0) {
+        toxProxyLog(2, "file transfers: master device %d got %llu bytes", ft->device,
+                    (unsigned long long)ft->state.size);
+        file_forward_done(ft);
+        return;
+    }
+
+    static uint8_t chunk[FILE_CHUNK_MAX_BYTES];
+
+    if (length > sizeof(chunk)) {
+        return;
+    }
+
+    TOX_ERR_FILE_SEND_CHUNK error;
+
+    if (ft->state.encrypted ? !file_crypt_read(ft, chunk, position, length)
+            : (pread(ft->fd, chunk, length, (off_t)position) != (ssize_t)length)) {
+        toxProxyLog(0, "file transfers: can not read %u bytes at %llu", (uint32_t)length, (unsigned long long)position);
+        file_transfer_close(ft);
+        file_transfer_cancel(tox, friend_number, file_number);
+        return;
+    }
+
+    tox_file_send_chunk(tox, friend_number, file_number, position, chunk, length, &error);
+}
+
+void on_file_control(Tox *tox, uint32_t friend_number, uint32_t file_number, TOX_FILE_CONTROL control,
+                     void *user_data)
+{
+    file_transfer *ft = file_transfer_find(friend_number, file_number);
+
+    if (ft == NULL || control != TOX_FILE_CONTROL_CANCEL) {
+        return;
+    }
+
+    if (ft->incoming) {
+        // what came so far is kept, the friend can go on with it
+        toxProxyLog(2, "file transfers: friend %u stopped at %llu of %llu", friend_number,
+                    (unsigned long long)ft->state.received, (unsigned long long)ft->state.size);
+        file_transfer_close(ft);
+    } else {
+        toxProxyLog(1, "file transfers: master device %d does not want the file", ft->device);
+        file_forward_done(ft);
+    }
+}
+
+// the transfers of a friend that went offline are gone, a master device that came online gets the files
+void file_transfers_connection_change(uint32_t friend_number, TOX_CONNECTION connection_status)
+{
+    if (connection_status != TOX_CONNECTION_NONE) {
+        file_forward_scan_ts = 0;
+        return;
+    }
+
+    for (int i = 0; i < FILE_TRANSFERS_MAX; i++) {
+        if (file_transfers[i].used && file_transfers[i].friend_number == friend_number) {
+            file_transfer_close(&file_transfers[i]);
+        }
+    }
+}
+
+void file_transfers_close_all(void)
+{
+    for (int i = 0; i < FILE_TRANSFERS_MAX; i++) {
+        if (file_transfers[i].used) {
+            file_transfer_close(&file_transfers[i]);
+        }
+    }
+}
+
+// send a complete stored file to a master device
+bool file_forward_start(Tox *tox, int device, const char *sender_key_hex, const uint8_t *file_id,
+                        const file_state *state)
+{
+    const uint32_t master = master_device_friend_number(tox, device);
+    uint8_t packet[FILE_SENDER_PACKET_SIZE];
+    uint8_t *p = packet;
+    *p++ = CONTROL_PROXY_MESSAGE_TYPE_FILE_SENDER;
+    memcpy(p, file_id, TOX_FILE_ID_LENGTH);
+    p += TOX_FILE_ID_LENGTH;
+
+    if (master == UINT32_MAX
+            || hex_string_to_bin(sender_key_hex, TOX_PUBLIC_KEY_SIZE * 2, (char *)p, TOX_PUBLIC_KEY_SIZE) != 0) {
+        return false;
+    }
+
+    put_u32_be(p + TOX_PUBLIC_KEY_SIZE, state->receive_ts);
+
+    TOX_ERR_FRIEND_CUSTOM_PACKET error_packet;
+
+    if (!tox_friend_send_lossless_packet(tox, master, packet, sizeof(packet), &error_packet)) {
+        return false;
+    }
+
+    file_transfer *ft = file_transfer_new();
+
+    if (ft == NULL) {
+        return false;
+    }
+
+    char path[strlen(filesDir) + 1 + TOX_PUBLIC_KEY_SIZE * 2 + 1 + TOX_FILE_ID_LENGTH * 2 + 8];
+    file_spool_path(sender_key_hex, file_id, ".data", path, sizeof(path));
+    ft->fd = open(path, O_RDONLY);
+
+    if (ft->fd >= 0 && state->encrypted && !file_crypt_open(ft, false)) {
+        close(ft->fd);
+        ft->fd = -1;
+    }
+
+    TOX_ERR_FILE_SEND error_send;
+    const uint32_t file_number = (ft->fd < 0) ? UINT32_MAX
+                                 : tox_file_send(tox, master, TOX_FILE_KIND_DATA, state->size, file_id, state->name,
+                                         state->name_length, &error_send);
+
+    if (file_number == UINT32_MAX) {
+        file_transfer_close(ft);
+        return false;
+    }
+
+    ft->device = device;
+    ft->friend_number = master;
+    ft->file_number = file_number;
+    memcpy(ft->file_id, file_id, TOX_FILE_ID_LENGTH);
+    snprintf(ft->sender_key_hex, sizeof(ft->sender_key_hex), "%s", sender_key_hex);
+    ft->state = *state;
+    toxProxyLog(2, "file transfers: sending %s (%llu bytes) to master device %d", path,
+                (unsigned long long)state->size, device);
+    return true;
+}
+
+// called from the main loop: every online master device without a transfer gets the next complete file
+// it does not have yet
+void file_forward_iterate(Tox *tox)
+{
+    const time_t now = get_unix_time();
+
+    if (file_spool_files == 0 || now < file_forward_scan_ts) {
+        return;
+    }
+
+    file_forward_scan_ts = now + FILE_FORWARD_RESCAN_SECS;
+    uint8_t idle = 0;
+
+    for (int d = 0; d < MASTER_MAX_DEVICES; d++) {
+        bool busy = !master_devices[d].used || !master_devices[d].online;
+
+        for (int i = 0; !busy && i < FILE_TRANSFERS_MAX; i++) {
+            busy = file_transfers[i].used && !file_transfers[i].incoming && file_transfers[i].device == d;
+        }
+
+        idle |= busy ? 0 : (uint8_t)(1U << d);
+    }
+
+    DIR *dfd_f = (idle != 0) ? opendir(filesDir) : NULL;
+
+    if (dfd_f == NULL) {
+        return;
+    }
+
+    struct dirent *dp_f = NULL;
+
+    while (idle != 0 && (dp_f = readdir(dfd_f)) != NULL) {
+        if (strlen(dp_f->d_name) != TOX_PUBLIC_KEY_SIZE * 2) {
+            continue;
+        }
+
+        char dir[strlen(filesDir) + 1 + TOX_PUBLIC_KEY_SIZE * 2 + 1];
+        snprintf(dir, sizeof(dir), "%s/%s", filesDir, dp_f->d_name);
+        DIR *dfd = opendir(dir);
+        struct dirent *dp = NULL;
+
+        while (dfd != NULL && idle != 0 && (dp = readdir(dfd)) != NULL) {
+            const size_t len = strlen(dp->d_name);
+            uint8_t file_id[TOX_FILE_ID_LENGTH];
+            file_state state;
+
+            if (len != TOX_FILE_ID_LENGTH * 2 + 6 || strcmp(dp->d_name + TOX_FILE_ID_LENGTH * 2, ".state") != 0
+                    || hex_string_to_bin(dp->d_name, TOX_FILE_ID_LENGTH * 2, (char *)file_id, sizeof(file_id)) != 0) {
+                continue;
+            }
+
+            char path[sizeof(dir) + len + 1];
+            snprintf(path, sizeof(path), "%s/%s", dir, dp->d_name);
+
+            if (!file_state_load(path, &state) || state.received != state.size
+                    || file_transfer_active(dp_f->d_name, file_id, true)) {
+                continue;
+            }
+
+            for (int d = 0; d < MASTER_MAX_DEVICES; d++) {
+                if ((idle & (1U << d)) && !(state.devices_done & (1U << d))
+                        && file_forward_start(tox, d, dp_f->d_name, file_id, &state)) {
+                    idle &= (uint8_t)~(1U << d);
+                }
+            }
+        }
+
+        if (dfd != NULL) {
+            closedir(dfd);
+        }
+    }
+
+    closedir(dfd_f);
+}
+
+// called from the main loop: delete the files that did not come in completely within
+// FILE_PARTIAL_MAX_AGE_SECS and are not being received right now (file_spool_init() does it at startup)
+void file_spool_expire_partial(void)
+{
+    const time_t now = get_unix_time();
+
+    if (file_spool_files == 0 || now < file_partial_check_ts) {
+        return;
+    }
+
+    file_partial_check_ts = now + FILE_PARTIAL_CHECK_SECS;
+    DIR *dfd_f = opendir(filesDir);
+
+    if (dfd_f == NULL) {
+        return;
+    }
+
+    uint32_t removed = 0;
+    struct dirent *dp_f = NULL;
+
+    while ((dp_f = readdir(dfd_f)) != NULL) {
+        if (strlen(dp_f->d_name) != TOX_PUBLIC_KEY_SIZE * 2) {
+            continue;
+        }
+
+        char dir[strlen(filesDir) + 1 + TOX_PUBLIC_KEY_SIZE * 2 + 1];
+        snprintf(dir, sizeof(dir), "%s/%s", filesDir, dp_f->d_name);
+        DIR *dfd = opendir(dir);
+        struct dirent *dp = NULL;
+
+        while (dfd != NULL && (dp = readdir(dfd)) != NULL) {
+            const size_t len = strlen(dp->d_name);
+            uint8_t file_id[TOX_FILE_ID_LENGTH];
+            file_state state;
+            struct stat st;
+
+            if (len != TOX_FILE_ID_LENGTH * 2 + 6 || strcmp(dp->d_name + TOX_FILE_ID_LENGTH * 2, ".state") != 0
+                    || hex_string_to_bin(dp->d_name, TOX_FILE_ID_LENGTH * 2, (char *)file_id, sizeof(file_id)) != 0) {
+                continue;
+            }
+
+            char path[sizeof(dir) + len + 1];
+            snprintf(path, sizeof(path), "%s/%s", dir, dp->d_name);
+
+            if (file_state_load(path, &state) && state.received != state.size && stat(path, &st) == 0
+                    && st.st_mtime + FILE_PARTIAL_MAX_AGE_SECS <= now
+                    && !file_transfer_active(dp_f->d_name, file_id, true)) {
+                file_spool_remove(dp_f->d_name, file_id, state.size);
+                removed++;
+            }
+        }
+
+        if (dfd != NULL) {
+            closedir(dfd);
+        }
+    }
+
+    closedir(dfd_f);
+
+    if (removed > 0) {
+        toxProxyLog(1, "file transfers: removed %u files that did not come in completely", removed);
+    }
+}
+
+// count what is stored, remove the parts of files that are left without their state or data and files
+// that did not come in completely within FILE_PARTIAL_MAX_AGE_SECS
+void file_spool_init(void)
+{
+    mkdir(filesDir, S_IRWXU);
+    DIR *dfd_f = opendir(filesDir);
+
+    if (dfd_f == NULL) {
+        return;
+    }
+
+    const time_t now = get_unix_time();
+    uint32_t removed = 0;
+    struct dirent *dp_f = NULL;
+
+    while ((dp_f = readdir(dfd_f)) != NULL) {
+        if (strlen(dp_f->d_name) != TOX_PUBLIC_KEY_SIZE * 2) {
+            continue;
+        }
+
+        char dir[strlen(filesDir) + 1 + TOX_PUBLIC_KEY_SIZE * 2 + 1];
+        snprintf(dir, sizeof(dir), "%s/%s", filesDir, dp_f->d_name);
+        DIR *dfd = opendir(dir);
+
+        if (dfd == NULL) {
+            continue;
+        }
+
+        struct dirent *dp = NULL;
+
+        while ((dp = readdir(dfd)) != NULL) {
+            if (dp->d_name[0] == '.') {
+                continue;
+            }
+
+            const size_t len = strlen(dp->d_name);
+            const size_t id_len = TOX_FILE_ID_LENGTH * 2;
+            char path[sizeof(dir) + len + 8];
+            snprintf(path, sizeof(path), "%s/%s", dir, dp->d_name);
+            struct stat st;
+
+            if (len == id_len + 5 && strcmp(dp->d_name + id_len, ".data") == 0) {
+                // a file without a state is not counted anywhere
+                snprintf(path, sizeof(path), "%s/%.*s.state", dir, (int)id_len, dp->d_name);
+
+                if (stat(path, &st) != 0) {
+                    snprintf(path, sizeof(path), "%s/%s", dir, dp->d_name);
+                    unlink(path);
+                    removed++;
+                }
+
+                continue;
+            }
+
+            file_state state;
+            const bool is_state = (len == id_len + 6 && strcmp(dp->d_name + id_len, ".state") == 0);
+
+            if (is_state && file_state_load(path, &state) && stat(path, &st) == 0
+                    && (state.received == state.size || st.st_mtime + FILE_PARTIAL_MAX_AGE_SECS > now)) {
+                snprintf(path, sizeof(path), "%s/%.*s.data", dir, (int)id_len, dp->d_name);
+
+                if (stat(path, &st) == 0) {
+                    file_spool_bytes += state.size;
+                    file_spool_files++;
+                    continue;
+                }
+            }
+
+            // a damaged or old state (and its data), or a left over .tmp
+            unlink(path);
+            snprintf(path, sizeof(path), "%s/%s", dir, dp->d_name);
+            unlink(path);
+            removed++;
+        }
+
+        closedir(dfd);
+        rmdir(dir);
+    }
+
+    closedir(dfd_f);
+    toxProxyLog(2, "file transfers: %u stored files with %llu bytes, removed %u left over files", file_spool_files,
+                (unsigned long long)file_spool_bytes, removed);
+}
+// ----------- file transfers -----------
+
+// ----------- push -----------
+// wake-up pings for the devices of the master. every device registers a token for one of the push gateways
+// (CONTROL_PROXY_MESSAGE_TYPE_NOTIFICATION_TOKENS, or the older CONTROL_PROXY_MESSAGE_TYPE_NOTIFICATION_TOKEN
+// for gateway 0). the tokens are kept in push_token_filename (encrypted like the spool if that is on).
+//
+// the gateways come from PUSH_GATEWAYS_ENV ("[protocol:]host:port,...", in this order), without it there
+// is only PUSH__DST_HOST:PUSH__DST_PORT. a protocol (push_protocols[]) says what is sent for a token and
+// if the answer means it worked, "raw" is the one the push server speaks: the token, one per connection.
+//
+// ping_push_service() only marks the tokens, push_dispatch() (from the main loop too) sends the pings
+// without blocking over a small pool of connections per gateway. one connection per gateway is opened
+// ahead of time so a ping doesn't wait for DNS and the TCP handshake, the gateway hosts are looked up on
+// threads of their own (push_resolve()). a device gets at most one ping in
+// PUSH_MIN_INTERVAL_SECS, messages in between are covered by one more ping when the time is up.
+typedef struct push_protocol {
+    const char *name;
+    // the bytes to send to wake token, 0 if it doesn't fit in size
+    size_t (*build_request)(const char *token, uint8_t *buf, size_t size);
+    // reply is what the gateway answered before it closed the connection (length 0 if nothing)
+    bool (*reply_ok)(const uint8_t *reply, size_t length);
+} push_protocol;
+
+typedef enum PUSH_CONN_STATE {
+    PUSH_CONN_FREE = 0,
+    PUSH_CONN_CONNECTING = 1,
+    PUSH_CONN_READY = 2,
+    PUSH_CONN_WAIT_REPLY = 3
+} PUSH_CONN_STATE;
+
+typedef struct push_conn {
+    int fd;
+    PUSH_CONN_STATE state;
+    uint64_t deadline_usec;
+    // the token this connection wakes, empty for a warm connection that waits for one
+    char token[PUSH_TOKEN_MAX_LENGTH + 1];
+} push_conn;
+
+typedef struct push_gateway {
+    char host[256];
+    uint16_t port;
+    const push_protocol *protocol;
+    // addr is there once sin_family is set, addr_ts is when it was looked up (0 to look it up again)
+    struct sockaddr_in addr;
+    time_t addr_ts;
+    // a lookup thread is running, it sets the resolve_* fields under push_resolve_lock
+    bool resolving;
+    bool resolve_done;
+    bool resolve_ok;
+    struct in_addr resolve_addr;
+    // no new connections before this, after one failed
+    uint64_t retry_usec;
+    // no new warm connection before this, after the server closed the last one
+    uint64_t warm_usec;
+    push_conn pool[PUSH_POOL_SIZE];
+} push_gateway;
+
+typedef struct push_token {
+    // empty if the slot is free
+    char token[PUSH_TOKEN_MAX_LENGTH + 1];
+    uint8_t gateway;
+    bool pending;
+    uint64_t last_ping_usec;
+    uint64_t added;
+} push_token;
+
+size_t push_raw_build_request(const char *token, uint8_t *buf, size_t size)
+{
+    const size_t length = strlen(token);
+
+    if (length > size) {
+        return 0;
+    }
+
+    memcpy(buf, token, length);
+    return length;
+}
+
+bool push_raw_reply_ok(const uint8_t *reply, size_t length)
+{
+    // the push server answers, or just closes the connection, either way it has the token
+    return true;
+}
+
+const push_protocol push_protocols[] = {
+    {"raw", push_raw_build_request, push_raw_reply_ok},
+};
+
+push_gateway push_gateways[PUSH_MAX_GATEWAYS];
+uint32_t push_gateways_count = 0;
+// the lookup threads are not waited for, a lookup for gateways that were set up again or wiped since it
+// started (older generation) is dropped
+pthread_mutex_t push_resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+uint32_t push_resolve_generation = 0;
+push_token push_tokens[PUSH_MAX_TOKENS];
+uint64_t push_tokens_added = 0;
+
+struct {
+    uint64_t pings;
+    uint64_t coalesced;
+    uint64_t sent;
+    uint64_t failed;
+} push_stats;
+
+void push_conn_reset(push_conn *c)
+{
+    if (c->fd != -1) {
+        close(c->fd);
+    }
+
+    CLEAR(*c);
+    c->fd = -1;
+}
+
+// parse "[protocol:]host:port,..." into push_gateways
+void push_gateways_init(const char *spec)
+{
+    for (uint32_t g = 0; g < push_gateways_count; g++) {
+        for (int i = 0; i < PUSH_POOL_SIZE; i++) {
+            push_conn_reset(&push_gateways[g].pool[i]);
+        }
+    }
+
+    pthread_mutex_lock(&push_resolve_lock);
+    push_resolve_generation++;
+    CLEAR(push_gateways);
+    pthread_mutex_unlock(&push_resolve_lock);
+    push_gateways_count = 0;
+
+    for (uint32_t g = 0; g < PUSH_MAX_GATEWAYS; g++) {
+        for (int i = 0; i < PUSH_POOL_SIZE; i++) {
+            push_gateways[g].pool[i].fd = -1;
+        }
+    }
+
+    char *copy = strdup(spec);
+
+    if (copy == NULL) {
+        return;
+    }
+
+    char *save = NULL;
+
+    for (char *item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+        if (push_gateways_count >= PUSH_MAX_GATEWAYS) {
+            toxProxyLog(1, "push: more than %d gateways, ignoring \"%s\"", PUSH_MAX_GATEWAYS, item);
+            continue;
+        }
+
+        push_gateway *gw = &push_gateways[push_gateways_count];
+        gw->protocol = &push_protocols[0];
+        char *port = strrchr(item, ':');
+        char *host = item;
+        char *proto = strchr(item, ':');
+
+        if (port == NULL || port == item) {
+            toxProxyLog(0, "push: bad gateway \"%s\", want [protocol:]host:port", item);
+            continue;
+        }
+
+        *port++ = '\0';
+
+        if (proto != NULL && proto < port - 1) {
+            *proto = '\0';
+            host = proto + 1;
+            gw->protocol = NULL;
+
+            for (size_t p = 0; p < sizeof(push_protocols) / sizeof(push_protocols[0]); p++) {
+                if (strcmp(item, push_protocols[p].name) == 0) {
+                    gw->protocol = &push_protocols[p];
+                }
+            }
+
+            if (gw->protocol == NULL) {
+                toxProxyLog(0, "push: unknown gateway protocol \"%s\"", item);
+                continue;
+            }
+        }
+
+        const long port_num = strtol(port, NULL, 10);
+
+        if (port_num <= 0 || port_num > 65535 || *host == '\0' || strlen(host) >= sizeof(gw->host)) {
+            toxProxyLog(0, "push: bad gateway %s:%s", host, port);
+            continue;
+        }
+
+        snprintf(gw->host, sizeof(gw->host), "%s", host);
+        gw->port = (uint16_t)port_num;
+        toxProxyLog(2, "push: gateway %u is %s %s:%u", push_gateways_count, gw->protocol->name, gw->host,
+                    (unsigned)gw->port);
+        push_gateways_count++;
+    }
+
+    free(copy);
+}
+
+typedef struct push_resolve_job {
+    uint32_t gateway;
+    uint32_t generation;
+    char host[256];
+} push_resolve_job;
+
+void *push_resolve_thread(void *data)
+{
+    push_resolve_job *job = data;
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    CLEAR(hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    const bool ok = (getaddrinfo(job->host, NULL, &hints, &res) == 0 && res != NULL);
+
+    pthread_mutex_lock(&push_resolve_lock);
+
+    if (job->generation == push_resolve_generation) {
+        push_gateway *gw = &push_gateways[job->gateway];
+        gw->resolve_ok = ok;
+
+        if (ok) {
+            gw->resolve_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+        }
+
+        gw->resolve_done = true;
+    }
+
+    pthread_mutex_unlock(&push_resolve_lock);
+
+    if (res != NULL) {
+        freeaddrinfo(res);
+    }
+
+    free(job);
+    return NULL;
+}
+
+// the gateway host is looked up on a thread of its own when the address is old (or was never there), the
+// old one is used until the new one is there. false if there is no address yet (or the lookup failed).
+bool push_resolve(push_gateway *gw)
+{
+    const time_t now = get_unix_time();
+
+    if (gw->resolving) {
+        pthread_mutex_lock(&push_resolve_lock);
+        const bool done = gw->resolve_done;
+        const bool ok = gw->resolve_ok;
+        const struct in_addr addr = gw->resolve_addr;
+        pthread_mutex_unlock(&push_resolve_lock);
+
+        if (done) {
+            gw->resolving = false;
+
+            if (ok) {
+                CLEAR(gw->addr);
+                gw->addr.sin_family = AF_INET;
+                gw->addr.sin_port = htons(gw->port);
+                gw->addr.sin_addr = addr;
+                gw->addr_ts = now;
+            } else {
+                toxProxyLog(9, "push: can not resolve %s", gw->host);
+                // an old address is better than none, the lookup is tried again after PUSH_RETRY_SECS
+                gw->addr_ts = now - PUSH_RESOLVE_REFRESH_SECS + PUSH_RETRY_SECS;
+            }
+        }
+    }
+
+    if (!gw->resolving && (gw->addr_ts == 0 || gw->addr_ts + PUSH_RESOLVE_REFRESH_SECS <= now)) {
+        push_resolve_job *job = calloc(1, sizeof(push_resolve_job));
+        pthread_attr_t attr;
+        pthread_t tid;
+
+        if (job != NULL && pthread_attr_init(&attr) == 0) {
+            job->gateway = (uint32_t)(gw - push_gateways);
+            job->generation = push_resolve_generation;
+            snprintf(job->host, sizeof(job->host), "%s", gw->host);
+            gw->resolve_done = false;
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            gw->resolving = (pthread_create(&tid, &attr, push_resolve_thread, job) == 0);
+            pthread_attr_destroy(&attr);
+        }
+
+        if (!gw->resolving) {
+            free(job);
+        }
+    }
+
+    return gw->addr.sin_family == AF_INET;
+}
+
+void push_conn_failed(push_gateway *gw, push_conn *c, const char *what, uint64_t now)
+{
+    toxProxyLog(9, "push: %s %s:%u failed", what, gw->host, (unsigned)gw->port);
+
+    if (c->token[0] != '\0') {
+        push_stats.failed++;
 
-            if (res2 == false) {
-                toxProxyLog(0, "conference id unknown?");
-                return;
-            } else {
-                writeConferenceMessageHelper(tox, conference_id_buffer, message, length, public_key_hex);
+        // try again after the interval
+        for (int t = 0; t < PUSH_MAX_TOKENS; t++) {
+            if (strcmp(push_tokens[t].token, c->token) == 0) {
+                push_tokens[t].pending = true;
             }
         }
+
+        // maybe the host has moved, the old address is used until the lookup is done
+        gw->addr_ts = 0;
     }
-}
 
-void conference_peer_list_changed_cb(Tox *tox, uint32_t conference_number, void *user_data)
-{
-    updateToxSavedata(tox);
+    gw->retry_usec = now + (uint64_t)PUSH_RETRY_SECS * 1000000;
+    push_conn_reset(c);
 }
 
-void friend_sync_message_v2_cb(Tox *tox, uint32_t friend_number, const uint8_t *message, size_t length)
+void push_conn_send(push_gateway *gw, push_conn *c, uint64_t now)
 {
-    toxProxyLog(9, "enter friend_sync_message_v2_cb");
-}
+    uint8_t request[PUSH__MAXDATASIZE + PUSH_TOKEN_MAX_LENGTH];
+    const size_t length = gw->protocol->build_request(c->token, request, sizeof(request));
 
-bool is_answer_to_synced_message(Tox *tox, uint32_t friend_number, const uint8_t *message, size_t length)
-{
-    bool ret = false;
+    if (length == 0 || send(c->fd, request, length, MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)length) {
+        push_conn_failed(gw, c, "send to", now);
+        return;
+    }
 
-    uint8_t public_key_bin[tox_public_key_size()];
-    CLEAR(public_key_bin);
+    c->state = PUSH_CONN_WAIT_REPLY;
+    c->deadline_usec = now + (uint64_t)PUSH_RECV_TIMEOUT_SECS * 1000000;
+}
 
-    tox_friend_get_public_key(tox, friend_number, public_key_bin, NULL);
+// start a non blocking connect, token is NULL for a warm connection
+void push_conn_open(push_gateway *gw, push_conn *c, const char *token, uint64_t now)
+{
+    if (!push_resolve(gw)) {
+        // the first lookup is not done yet: try again from the next loop
+        if (!gw->resolving) {
+            gw->retry_usec = now + (uint64_t)PUSH_RETRY_SECS * 1000000;
+        }
 
-    char public_key_hex[tox_public_key_hex_size];
-    CLEAR(public_key_hex);
+        return;
+    }
 
-    bin2upHex(public_key_bin, tox_public_key_size(), public_key_hex, tox_public_key_hex_size);
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 
-    uint8_t *msg_id = calloc(1, tox_public_key_size());
-    if (msg_id)
-    {
-        tox_messagev2_get_message_id(message, msg_id);
+    if (fd == -1) {
+        return;
+    }
 
-        char msgid2_str[tox_public_key_hex_size + 1];
-        CLEAR(msgid2_str);
-        bin2upHex(msg_id, tox_public_key_size(), msgid2_str, tox_public_key_hex_size);
+    c->fd = fd;
+    snprintf(c->token, sizeof(c->token), "%s", token ? token : "");
 
-        toxProxyLog(2, "is_answer_to_synced_message: receipt from %s id __%s__", public_key_hex, msgid2_str);
+    if (connect(fd, (struct sockaddr *)&gw->addr, sizeof(gw->addr)) == 0) {
+        c->state = PUSH_CONN_READY;
+    } else if (errno == EINPROGRESS) {
+        c->state = PUSH_CONN_CONNECTING;
+        c->deadline_usec = now + (uint64_t)PUSH_CONNECT_TIMEOUT_MS * 1000;
+        return;
+    } else {
+        push_conn_failed(gw, c, "connect to", now);
+        return;
+    }
 
-        // find that message and delete the file for it ----------------
+    if (c->token[0] != '\0') {
+        push_conn_send(gw, c, now);
+    }
+}
 
-        mkdir(msgsDir, S_IRWXU);
-        DIR *dfd_m = opendir(msgsDir);
-        if (dfd_m == NULL)
-        {
-            free(msg_id);
-            return false;
-        }
+// move the connections on: connect done, answer there, timeouts
+void push_conn_progress(uint64_t now)
+{
+    struct pollfd pfds[PUSH_MAX_GATEWAYS * PUSH_POOL_SIZE];
+    push_conn *conns[PUSH_MAX_GATEWAYS * PUSH_POOL_SIZE];
+    push_gateway *gws[PUSH_MAX_GATEWAYS * PUSH_POOL_SIZE];
+    int n = 0;
 
-        struct dirent *dp_m = NULL;
+    for (uint32_t g = 0; g < push_gateways_count; g++) {
+        for (int i = 0; i < PUSH_POOL_SIZE; i++) {
+            push_conn *c = &push_gateways[g].pool[i];
 
-        while ((dp_m = readdir(dfd_m)) != NULL)
-        {
-            if (strlen(dp_m->d_name) > 2)
-            {
-                if (strncmp(dp_m->d_name, ".", 1) != 0 && strncmp(dp_m->d_name, "..", 2) != 0)
-                {
-                    // ****************************************
-
-                    char *friendDir = calloc(1, strlen(msgsDir) + 1 + strlen(dp_m->d_name) + 1);
-                    sprintf(friendDir, "%s/%s", msgsDir, dp_m->d_name);
-
-                    mkdir(msgsDir, S_IRWXU);
-                    DIR *dfd = opendir(friendDir);
-                    if (dfd == NULL)
-                    {
-                        free(friendDir);
-                        free(msg_id);
-                        return false;
-                    }
+            if (c->fd == -1) {
+                continue;
+            }
 
-                    struct dirent *dp = NULL;
+            pfds[n].fd = c->fd;
+            pfds[n].events = (c->state == PUSH_CONN_CONNECTING) ? POLLOUT : POLLIN;
+            pfds[n].revents = 0;
+            conns[n] = c;
+            gws[n] = &push_gateways[g];
+            n++;
+        }
+    }
 
-#define BASE_NAME_GLOB_LEN 31
-#define END_PART_GLOB_LEN 68
+    if (n == 0 || poll(pfds, n, 0) < 0) {
+        return;
+    }
 
-                    while ((dp = readdir(dfd)) != NULL)
-                    {
-                        if (strlen(dp->d_name) > 2)
-                        {
-                            if (strncmp(dp->d_name, ".", 1) != 0 && strncmp(dp->d_name, "..", 2) != 0)
-                            {
-                                int len = strlen(dp->d_name);
-                                const char *last_char = &dp->d_name[len - 1];
-                                if (strncmp(last_char, "_", 1) == 0)
-                                {
-                                    const char *last_char2 = &dp->d_name[len - END_PART_GLOB_LEN];
-                                    char *comp_str = calloc(1, (END_PART_GLOB_LEN + 2));
-                                    sprintf(comp_str, "__%s__", msgid2_str);
-
-                                    if (strncmp(last_char2, comp_str, END_PART_GLOB_LEN) == 0)
-                                    {
-                                        toxProxyLog(2, "is_answer_to_synced_message: found id %s in %s", comp_str, dp->d_name);
-                                        // now delete all files for that id
-                                        char *delete_file_glob = calloc(1, 1000);
-                                        snprintf(delete_file_glob, BASE_NAME_GLOB_LEN, "%s", dp->d_name);
-                                        char *run_cmd = calloc(1, 1000);
-                                        sprintf(run_cmd, "rm %s/%s*", friendDir, delete_file_glob);
-                                        toxProxyLog(2, "is_answer_to_synced_message: running cmd: %s", run_cmd);
-                                        int cmd_res = system(run_cmd);
-                                        cmd_res = 0;
-                                        toxProxyLog(2, "is_answer_to_synced_message: cmd DONE");
-                                        free(run_cmd);
-                                        free(delete_file_glob);
-
-                                        free(comp_str);
-
-                                        ret = true;
-                                    }
-                                }
-                            }
-                        }
+    for (int k = 0; k < n; k++) {
+        push_conn *c = conns[k];
+        push_gateway *gw = gws[k];
+        const short ev = pfds[k].revents;
+
+        if (c->state == PUSH_CONN_CONNECTING) {
+            int err = 0;
+            socklen_t err_len = sizeof(err);
+
+            if (ev & (POLLERR | POLLHUP)) {
+                push_conn_failed(gw, c, "connect to", now);
+            } else if (ev & POLLOUT) {
+                if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0 || err != 0) {
+                    push_conn_failed(gw, c, "connect to", now);
+                } else {
+                    c->state = PUSH_CONN_READY;
+
+                    if (c->token[0] != '\0') {
+                        push_conn_send(gw, c, now);
                     }
-
-                    // find that message and delete the file for it ----------------
-                    closedir(dfd);
-                    free(friendDir);
-
-                    // ****************************************
                 }
+            } else if (now > c->deadline_usec) {
+                push_conn_failed(gw, c, "connect to", now);
+            }
+        } else if (c->state == PUSH_CONN_READY) {
+            // the server doesn't send anything before it has a token, so this is the server closing it
+            if (ev != 0) {
+                push_conn_reset(c);
+                gw->warm_usec = now + (uint64_t)PUSH_WARM_REOPEN_SECS * 1000000;
+            }
+        } else if (c->state == PUSH_CONN_WAIT_REPLY) {
+            if (ev != 0) {
+                uint8_t reply[PUSH__MAXDATASIZE];
+                const ssize_t r = recv(c->fd, reply, sizeof(reply), MSG_DONTWAIT);
+
+                if (r >= 0 && gw->protocol->reply_ok(reply, (size_t)r)) {
+                    push_stats.sent++;
+                    toxProxyLog(9, "push: PING sent to %s:%u", gw->host, (unsigned)gw->port);
+                    push_conn_reset(c);
+                } else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    continue;
+                } else {
+                    push_conn_failed(gw, c, "answer from", now);
+                }
+            } else if (now > c->deadline_usec) {
+                push_conn_failed(gw, c, "answer from", now);
             }
         }
-
-        closedir(dfd_m);
-
-        free(msg_id);
-        return ret;
     }
-
-    return false;
 }
 
-void friend_read_receipt_message_v2_cb(Tox *tox, uint32_t friend_number, uint32_t ts_sec, const uint8_t *msgid)
+// send what is due and keep one connection per gateway ready. called from the main loop and on every ping
+void push_dispatch(void)
 {
-    toxProxyLog(9, "enter friend_read_receipt_message_v2_cb");
-
-	// check if the received msg is confirm conference msg received
-	// todo: when sending cached msgs to master: don't delete them instantly, instead only delete them here, if the receipt message's id is equal to one of the stored ones.
-	// also: make long enough pauses in sending messages to master to allow for receipt msgs to come in and get processed.
+    const uint64_t now = get_monotonic_usec();
+    bool gateway_used[PUSH_MAX_GATEWAYS] = {false};
 
-#ifdef TOX_HAVE_TOXUTIL
-    uint32_t raw_message_len = tox_messagev2_size(0, TOX_FILE_KIND_MESSAGEV2_ANSWER, 0);
-    uint8_t *raw_message_data = calloc(1, raw_message_len);
+    push_conn_progress(now);
 
-    bool res = tox_messagev2_wrap(0, TOX_FILE_KIND_MESSAGEV2_ANSWER,
-                                  0, NULL, ts_sec, 0,
-                                  raw_message_data, (uint8_t *)msgid);
-    res = true;
+    for (int t = 0; t < PUSH_MAX_TOKENS; t++) {
+        push_token *pt = &push_tokens[t];
 
-    // check if this is an answer for a message we synced -> then just delete this message and not send it again
-    // otherwise save the answer message
+        if (pt->token[0] == '\0' || pt->gateway >= push_gateways_count) {
+            continue;
+        }
 
-    if (is_answer_to_synced_message(tox, friend_number, raw_message_data, raw_message_len))
-    {
-    }
-    else
-    {
-        writeMessageHelper(tox, friend_number, raw_message_data, raw_message_len, TOX_FILE_KIND_MESSAGEV2_ANSWER);
-    }
+        push_gateway *gw = &push_gateways[pt->gateway];
+        gateway_used[pt->gateway] = true;
 
-#endif
+        if (!pt->pending
+                || (pt->last_ping_usec != 0 && now < pt->last_ping_usec + (uint64_t)PUSH_MIN_INTERVAL_SECS * 1000000)) {
+            continue;
+        }
 
-}
+        push_conn *warm = NULL;
+        push_conn *free_conn = NULL;
 
-void friend_message_v2_cb(Tox *tox, uint32_t friend_number, const uint8_t *raw_message, size_t raw_message_len)
-{
+        for (int i = 0; i < PUSH_POOL_SIZE; i++) {
+            push_conn *c = &gw->pool[i];
 
-    toxProxyLog(9, "enter friend_message_v2_cb");
+            if (c->state == PUSH_CONN_READY && c->token[0] == '\0') {
+                warm = c;
+            } else if (c->state == PUSH_CONN_CONNECTING && c->token[0] == '\0' && warm == NULL) {
+                // gets this token once it is connected
+                warm = c;
+            } else if (c->state == PUSH_CONN_FREE && free_conn == NULL) {
+                free_conn = c;
+            }
+        }
 
-#ifdef TOX_HAVE_TOXUTIL
-    // now get the real data from msgV2 buffer
-    uint8_t *message_text = calloc(1, raw_message_len);
+        if (warm != NULL) {
+            snprintf(warm->token, sizeof(warm->token), "%s", pt->token);
 
-    if (message_text) {
-        // uint32_t ts_sec = tox_messagev2_get_ts_sec(raw_message);
-        // uint16_t ts_ms = tox_messagev2_get_ts_ms(raw_message);
-        uint32_t text_length = 0;
-        bool res = tox_messagev2_get_message_text(raw_message, (uint32_t) raw_message_len, (bool) false, (uint32_t) 0,
-                   message_text, &text_length);
-        toxProxyLog(9, "friend_message_v2_cb:fn=%d res=%d msg=%s", (int) friend_number, (int) res, (char *) message_text);
+            if (warm->state == PUSH_CONN_READY) {
+                push_conn_send(gw, warm, now);
+            }
+        } else if (free_conn != NULL && now >= gw->retry_usec) {
+            push_conn_open(gw, free_conn, pt->token, now);
 
-        if (is_master_friendnumber(tox, friend_number)) {
-            if ((strlen((char *) message_text) == (strlen("fp:") + tox_public_key_hex_size))
-                    &&
-                    (strncmp((char *) message_text, "fp:", strlen("fp:")))) {
-                char *pubKey = (char *)(message_text + 3);
-                uint8_t public_key_bin[tox_public_key_size()];
-                hex_string_to_bin(pubKey, tox_public_key_size() * 2, (char *) public_key_bin, tox_public_key_size());
-                tox_friend_add_norequest(tox, public_key_bin, NULL);
-                updateToxSavedata(tox);
-            } else if (strlen((char *) message_text) == strlen("DELETE_EVERYTHING")
-                       && strncmp((char *) message_text, "DELETE_EVERYTHING", strlen("DELETE_EVERYTHING"))) {
-                killSwitch();
-            } else {
-                // send_text_message_to_friend(tox, friend_number, "Sorry, but this command has not been understood, please check the implementation or contact the developer.");
+            if (free_conn->state == PUSH_CONN_FREE) {
+                continue;
             }
         } else {
-            toxProxyLog(9, "call writeMessageHelper()");
-            // nicht vom master, also wohl ein freund vom master.
-            writeMessageHelper(tox, friend_number, raw_message, raw_message_len, TOX_FILE_KIND_MESSAGEV2_SEND);
-            //TODO FIXME send acknowledgment here (message v2 ohne text mit wrapper = kompliziert laut tox, 3 bis 4 functions aufruf notwendig)
-            // send_text_message_to_friend(tox, friend_number, "thank you for using this proxy. The message will be relayed as soon as my master comes online.");
+            // all connections busy, next time
+            continue;
         }
 
-        free(message_text);
+        pt->pending = false;
+        pt->last_ping_usec = now;
     }
 
-#endif
-}
+    for (uint32_t g = 0; g < push_gateways_count; g++) {
+        push_gateway *gw = &push_gateways[g];
+        push_conn *free_conn = NULL;
+        bool have_warm = false;
 
-void friend_lossless_packet_cb(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length, void *user_data)
-{
+        if (!gateway_used[g] || now < gw->retry_usec || now < gw->warm_usec) {
+            continue;
+        }
 
-    if (length == 0) {
-        toxProxyLog(0, "received empty lossless package!");
-        return;
-    }
+        for (int i = 0; i < PUSH_POOL_SIZE; i++) {
+            push_conn *c = &gw->pool[i];
 
-    if (!is_master_friendnumber(tox, friend_number)) {
-        if (length > 0)
-        {
-            toxProxyLog(0, "received lossless package from somebody who's not master! : id=%d", (int)data[0]);
+            if (c->state == PUSH_CONN_FREE) {
+                free_conn = free_conn ? free_conn : c;
+            } else if (c->token[0] == '\0') {
+                have_warm = true;
+            }
         }
-        else
-        {
-            toxProxyLog(0, "received lossless package from somebody who's not master!");
+
+        if (!have_warm && free_conn != NULL) {
+            push_conn_open(gw, free_conn, NULL, now);
         }
-        return;
     }
+}
 
-    if (data[0] == CONTROL_PROXY_MESSAGE_TYPE_PROXY_KILL_SWITCH) {
-        killSwitch();
-    } else if (data[0] == CONTROL_PROXY_MESSAGE_TYPE_NOTIFICATION_TOKEN) {
-        if ((length > 10) && (length < 300))
-        {
-            toxProxyLog(0, "received CONTROL_PROXY_MESSAGE_TYPE_NOTIFICATION_TOKEN message");
-            NOTIFICATION__device_token = calloc(1, (length + 1));
-            memcpy(NOTIFICATION__device_token, (data + 1), (length - 1));
-            toxProxyLog(0, "CONTROL_PROXY_MESSAGE_TYPE_NOTIFICATION_TOKEN: %s", NOTIFICATION__device_token);
-            // TODO: save notification token to file, and read from file when ToxProxy is restarted
-        }
-        return;
-    } else if (data[0] == CONTROL_PROXY_MESSAGE_TYPE_FRIEND_PUBKEY_FOR_PROXY) {
-        if (length != tox_public_key_size() + 1) {
-            toxProxyLog(0, "received ControlProxyMessageType_pubKey message with wrong size");
-            return;
+bool push_tokens_save(void)
+{
+    // "TPt1\n" then "<gateway> <token>\n" per token
+    char buf[5 + PUSH_MAX_TOKENS * (PUSH_TOKEN_MAX_LENGTH + 6)];
+    size_t length = (size_t)snprintf(buf, sizeof(buf), "TPt1\n");
+
+    for (int t = 0; t < PUSH_MAX_TOKENS; t++) {
+        if (push_tokens[t].token[0] != '\0') {
+            length += (size_t)snprintf(buf + length, sizeof(buf) - length, "%u %s\n",
+                                       (unsigned)push_tokens[t].gateway, push_tokens[t].token);
         }
+    }
 
-        const uint8_t *public_key = data + 1;
-        tox_friend_add_norequest(tox, public_key, NULL);
-        updateToxSavedata(tox);
-        char public_key_hex[tox_public_key_hex_size];
-        CLEAR(public_key_hex);
-        bin2upHex(public_key, tox_public_key_size(), public_key_hex, tox_public_key_hex_size);
-        toxProxyLog(0, "added friend of my master (norequest) with pubkey: %s", public_key_hex);
-    } else {
-        toxProxyLog(0, "received unexpected ControlProxyMessageType");
+    const bool res = spool_crypt_write_file(push_token_tmp_filename, push_token_filename, (uint8_t *)buf, length);
+    sodium_memzero(buf, sizeof(buf));
+
+    if (!res) {
+        toxProxyLog(0, "push: can not write %s", push_token_filename);
     }
+
+    return res;
 }
 
-void send_sync_msg_single(Tox *tox, char *pubKeyHex, char *msgFileName)
+// tokens are printable and without blanks
+bool push_token_valid(const uint8_t *token, size_t length)
 {
-    char *msgPath = calloc(1, strlen(msgsDir) + 1 + strlen(pubKeyHex) + 1 + strlen(msgFileName) + 1);
-
-    // last +1 is for terminating \0 I guess (without it, memory checker explodes..)
-    sprintf(msgPath, "%s/%s/%s", msgsDir, pubKeyHex, msgFileName);
-
-    FILE *f = fopen(msgPath, "rb");
-    if (f) {
-        fseek(f, 0, SEEK_END);
-        long fsize = ftell(f);
-        fseek(f, 0, SEEK_SET);
+    if (length == 0 || length > PUSH_TOKEN_MAX_LENGTH) {
+        return false;
+    }
 
-        if (fsize < 1) {
-            fclose(f);
-            free(msgPath);
-            return;
+    for (size_t i = 0; i < length; i++) {
+        if (token[i] <= ' ' || token[i] > '~') {
+            return false;
         }
+    }
 
-        uint8_t *rawMsgData = calloc(1, fsize);
-        size_t ret = fread(rawMsgData, fsize, 1, f);
+    return true;
+}
 
-        // TODO: handle ret return vlaue here!
-        if (ret) {
-            // ------
+int push_token_find(const uint8_t *token, size_t length)
+{
+    for (int t = 0; t < PUSH_MAX_TOKENS; t++) {
+        if (strlen(push_tokens[t].token) == length && memcmp(push_tokens[t].token, token, length) == 0) {
+            return t;
         }
+    }
 
-        fclose(f);
+    return -1;
+}
 
+bool push_token_put(uint8_t gateway, const uint8_t *token, size_t length)
+{
+    if (!push_token_valid(token, length)) {
+        toxProxyLog(1, "push: ignoring a bad token (%d bytes)", (int)length);
+        return false;
+    }
 
-        uint32_t rawMsgSize2 = tox_messagev2_size(fsize, TOX_FILE_KIND_MESSAGEV2_SYNC, 0);
-        uint8_t *raw_message2 = calloc(1, rawMsgSize2);
-        uint8_t *msgid2 = calloc(1, TOX_PUBLIC_KEY_SIZE);
-        uint8_t *pubKeyBin = hex_string_to_bin2(pubKeyHex);
+    int t = push_token_find(token, length);
 
-        if (msgFileName[strlen(msgFileName) - 1] == 'A') {
-            // TOX_FILE_KIND_MESSAGEV2_ANSWER
-            tox_messagev2_sync_wrap(fsize, pubKeyBin, TOX_FILE_KIND_MESSAGEV2_ANSWER,
-                                    rawMsgData, 665, 987, raw_message2, msgid2);
-            toxProxyLog(9, "send_sync_msg_single: wrapped raw message = %p TOX_FILE_KIND_MESSAGEV2_ANSWER", raw_message2);
-        } else { // TOX_FILE_KIND_MESSAGEV2_SEND
-            tox_messagev2_sync_wrap(fsize, pubKeyBin, TOX_FILE_KIND_MESSAGEV2_SEND,
-                                    rawMsgData, 987, 775, raw_message2, msgid2);
-            toxProxyLog(9, "send_sync_msg_single: wrapped raw message = %p TOX_FILE_KIND_MESSAGEV2_SEND", raw_message2);
-        }
+    if (t == -1) {
+        // a free slot, or the one registered the longest time ago
+        t = 0;
 
-        // save new msgid ----------
-        char msgid2_str[tox_public_key_hex_size + 1];
-        CLEAR(msgid2_str);
-        bin2upHex(msgid2, tox_public_key_size(), msgid2_str, tox_public_key_hex_size);
+        for (int i = 0; i < PUSH_MAX_TOKENS; i++) {
+            if (push_tokens[i].token[0] == '\0') {
+                t = i;
+                break;
+            }
 
-        char *msgPath_msg_id = calloc(1, 1000);
-        if (msgPath_msg_id)
-        {
-            sprintf(msgPath_msg_id, "%s__%s__", msgPath, msgid2_str);
-            toxProxyLog(9, "send_sync_msg_single: writing new msg_id to file: %s", msgPath_msg_id);
-            FILE *f_msg_id = fopen(msgPath_msg_id, "wb");
-            fwrite(msgid2_str, 1, 1, f_msg_id);
-            fclose(f_msg_id);
-            free(msgPath_msg_id);
+            if (push_tokens[i].added < push_tokens[t].added) {
+                t = i;
+            }
         }
-        // save new msgid ----------
 
-        TOX_ERR_FRIEND_SEND_MESSAGE error;
-        bool res2 = tox_util_friend_send_sync_message_v2(tox, 0, raw_message2, rawMsgSize2, &error);
-        toxProxyLog(9, "send_sync_msg_single: send_sync_msg res=%d; error=%d", (int)res2, error);
+        if (push_tokens[t].token[0] != '\0') {
+            toxProxyLog(1, "push: %d tokens registered, dropping the oldest one", PUSH_MAX_TOKENS);
+        }
 
-        free(rawMsgData);
-        free(raw_message2);
-        free(pubKeyBin);
-        free(msgid2);
+        CLEAR(push_tokens[t]);
+        memcpy(push_tokens[t].token, token, length);
+    }
 
-        // do not delete messages here!! // unlink(msgPath);
+    if (gateway >= push_gateways_count) {
+        toxProxyLog(1, "push: token for gateway %u, only %u configured", (unsigned)gateway, push_gateways_count);
     }
 
-    free(msgPath);
+    push_tokens[t].gateway = gateway;
+    push_tokens[t].added = ++push_tokens_added;
+    return true;
 }
 
-void send_sync_msgs_of_friend(Tox *tox, char *pubKeyHex)
+void push_tokens_load(void)
 {
-    //toxProxyLog(3, "sending messages of friend: %s to master", pubKeyHex);
-
-    char *friendDir = calloc(1, strlen(msgsDir) + 1 + strlen(pubKeyHex) +
-                             1); // last +1 is for terminating \0 I guess (without it, memory checker explodes..)
-    sprintf(friendDir, "%s/%s", msgsDir, pubKeyHex);
-
-    mkdir(msgsDir, S_IRWXU);
-
-    DIR *dfd = opendir(friendDir);
+    size_t length = 0;
+    uint8_t *data = spool_crypt_read_file(push_token_filename, 5 + PUSH_MAX_TOKENS * (PUSH_TOKEN_MAX_LENGTH + 6),
+                                          &length, NULL);
 
-    if (dfd == NULL) {
-        // toxProxyLog(1, "Can't open msgsDir for sending messages to master (maybe no single message has been received yet?)");
-        free(friendDir);
+    if (data == NULL) {
         return;
     }
 
-    struct dirent *dp = NULL;
+    if (length >= 5 && memcmp(data, "TPt1\n", 5) == 0) {
+        size_t pos = 5;
 
-    // char filename_qfd[260];
-    // char new_name_qfd[100];
+        while (pos < length) {
+            const uint8_t *line = data + pos;
+            const uint8_t *end = memchr(line, '\n', length - pos);
+            const size_t line_len = end ? (size_t)(end - line) : length - pos;
+            const uint8_t *blank = memchr(line, ' ', line_len);
 
-    while ((dp = readdir(dfd)) != NULL) {
-        if (strlen(dp->d_name) > 2)
-        {
-            if (strncmp(dp->d_name, ".", 1) != 0 && strncmp(dp->d_name, "..", 2) != 0)
-            {
-                int len = strlen(dp->d_name);
-                const char *last_char = &dp->d_name[len - 1];
-                if (strncmp(last_char, "_", 1) != 0)
-                {
-                    toxProxyLog(2, "found message by %s with filename %s", pubKeyHex, dp->d_name);
-                    send_sync_msg_single(tox, pubKeyHex, dp->d_name);
-                }
+            if (blank != NULL) {
+                push_token_put((uint8_t)strtoul((const char *)line, NULL, 10), blank + 1,
+                               line_len - (size_t)(blank + 1 - line));
             }
+
+            pos += line_len + 1;
         }
+    } else {
+        // a single token for gateway 0, written by older versions
+        push_token_put(0, data, length);
     }
 
-    closedir(dfd);
-    free(friendDir);
+    int count = 0;
+
+    for (int t = 0; t < PUSH_MAX_TOKENS; t++) {
+        count += (push_tokens[t].token[0] != '\0');
+    }
+
+    toxProxyLog(2, "push: %d saved device tokens", count);
+    sodium_memzero(data, length);
+    free(data);
 }
 
-void send_sync_msgs(Tox *tox)
+// CONTROL_PROXY_MESSAGE_TYPE_NOTIFICATION_TOKEN and CONTROL_PROXY_MESSAGE_TYPE_NOTIFICATION_TOKENS from the master
+void push_tokens_handle_packet(const uint8_t *data, size_t length)
 {
-    mkdir(msgsDir, S_IRWXU);
-
-    // loop over all directories = public-keys of friends we have received messages from
-    DIR *dfd = opendir(msgsDir);
+    bool changed = false;
+
+    if (data[0] == CONTROL_PROXY_MESSAGE_TYPE_NOTIFICATION_TOKEN) {
+        changed = push_token_put(0, data + 1, length - 1);
+    } else if (length >= 2 && data[1] == PUSH_TOKENS_OP_ADD && length > 3) {
+        changed = push_token_put(data[2], data + 3, length - 3);
+    } else if (length >= 2 && data[1] == PUSH_TOKENS_OP_REMOVE && length > 2) {
+        const int t = push_token_find(data + 2, length - 2);
+
+        if (t != -1) {
+            sodium_memzero(&push_tokens[t], sizeof(push_tokens[t]));
+            changed = true;
+        }
+    } else if (length >= 2 && data[1] == PUSH_TOKENS_OP_CLEAR) {
+        sodium_memzero(push_tokens, sizeof(push_tokens));
+        changed = true;
+    } else {
+        toxProxyLog(1, "push: unknown token packet (%d bytes)", (int)length);
+    }
 
-    if (dfd == NULL) {
-        // toxProxyLog(1, "Can't open msgsDir for sending messages to master (maybe no single message has been received yet?)");
-        return;
+    if (changed) {
+        push_tokens_save();
+        push_dispatch();
     }
+}
 
-    struct dirent *dp = NULL;
+// the kill switch: forget the tokens and drop the connections
+void push_tokens_wipe(void)
+{
+    sodium_memzero(push_tokens, sizeof(push_tokens));
 
-    while ((dp = readdir(dfd)) != NULL) {
-        if (strncmp(dp->d_name, ".", 1) != 0 && strncmp(dp->d_name, "..", 2) != 0) {
-            send_sync_msgs_of_friend(tox, dp->d_name);
+    for (uint32_t g = 0; g < push_gateways_count; g++) {
+        for (int i = 0; i < PUSH_POOL_SIZE; i++) {
+            push_conn_reset(&push_gateways[g].pool[i]);
         }
     }
 
-    closedir(dfd);
+    pthread_mutex_lock(&push_resolve_lock);
+    push_resolve_generation++;
+    sodium_memzero(push_gateways, sizeof(push_gateways));
+    pthread_mutex_unlock(&push_resolve_lock);
+    push_gateways_count = 0;
 }
 
-int ping_push_service()
+void push_init(void)
 {
-    toxProxyLog(9, "ping_push_service");
+    const char *spec = getenv(PUSH_GATEWAYS_ENV);
+    char default_spec[300];
 
-    if (!NOTIFICATION__device_token)
-    {
-        toxProxyLog(9, "ping_push_service: No NOTIFICATION__device_token");
-        return 1;
+    if (spec == NULL || *spec == '\0') {
+        snprintf(default_spec, sizeof(default_spec), "%s:%d", PUSH__DST_HOST, (int)PUSH__DST_PORT);
+        spec = default_spec;
     }
 
-    int sockfd = 0;
-    int numbytes = 0;
-    char buf[PUSH__MAXDATASIZE + 1];
-    struct hostent *he = NULL;
-    struct sockaddr_in their_addr;
-
-    memset(buf, 0, (PUSH__MAXDATASIZE + 1));
+    push_gateways_init(spec);
+    // the gateways are looked up and connected from the main loop, once tox is online
+    push_tokens_load();
+}
+// ----------- push -----------
 
-    if ((he = gethostbyname(PUSH__DST_HOST)) == NULL)
-    {
-        toxProxyLog(9, "gethostbyname");
-        return 1;
-    }
+// a new message is in the spool: wake the devices of the master (see push_dispatch)
+int ping_push_service()
+{
+    int count = 0;
 
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
-    {
-        toxProxyLog(9, "socket");
-        return 1;
-    }
+    push_stats.pings++;
 
-    their_addr.sin_family = AF_INET;
-    their_addr.sin_port = htons(PUSH__DST_PORT);
-    their_addr.sin_addr = *((struct in_addr *)he->h_addr);
-    bzero(&(their_addr.sin_zero), 8);
+    for (int t = 0; t < PUSH_MAX_TOKENS; t++) {
+        if (push_tokens[t].token[0] == '\0') {
+            continue;
+        }
 
-    if (connect(sockfd, (struct sockaddr *)&their_addr, sizeof(struct sockaddr)) == -1)
-    {
-        toxProxyLog(9, "connect");
-        close(sockfd);
-        return 1;
-    }
+        if (push_tokens[t].pending) {
+            push_stats.coalesced++;
+        }
 
-    if (send(sockfd, NOTIFICATION__device_token, strlen(NOTIFICATION__device_token), 0) == -1)
-    {
-        toxProxyLog(9, "send");
-        close(sockfd);
-        return 1;
+        push_tokens[t].pending = true;
+        count++;
     }
 
-    if ((numbytes = recv(sockfd, buf, PUSH__MAXDATASIZE, 0)) == -1)
-    {
-        toxProxyLog(9, "recv");
-        close(sockfd);
+    if (count == 0) {
+        toxProxyLog(9, "ping_push_service: No device token");
         return 1;
     }
 
-    close(sockfd);
-
-    toxProxyLog(9, "ping_push_service:PING sent");
-
+    push_dispatch();
     return 0;
 }
 
+// ToxProxy_bench.c includes this file and brings its own main()
+#ifndef TOXPROXY_NO_MAIN
 int main(int argc, char *argv[])
 {
+    startup_usec = get_monotonic_usec();
     openLogFile();
+    kill_switch_finish_interrupted();
 
     mkdir("db", S_IRWXU);
 
@@ -1638,8 +10182,20 @@ int main(int argc, char *argv[])
     // x[0] = 1;
     // ---- test ASAN ----
 
+    hooks_init();
     on_start();
 
+    if (!spool_crypt_init()) {
+        exit(1);
+    }
+
+    push_init();
+    master_devices_load();
+    spool_seq_init();
+    sync_cursors_load();
+    msgid_index_init();
+    file_spool_init();
+
     Tox *tox = openTox();
 
     tox_public_key_hex_size = tox_public_key_size() * 2 + 1;
@@ -1690,13 +10246,13 @@ int main(int argc, char *argv[])
     tox_callback_friend_connection_status(tox, tox_utils_friend_connection_status_cb);
     tox_utils_callback_friend_lossless_packet(tox, friend_lossless_packet_cb);
     tox_callback_friend_lossless_packet(tox, tox_utils_friend_lossless_packet_cb);
-    // tox_utils_callback_file_recv_control(tox, on_file_control);
+    tox_utils_callback_file_recv_control(tox, on_file_control);
     tox_callback_file_recv_control(tox, tox_utils_file_recv_control_cb);
-    // tox_utils_callback_file_chunk_request(tox, on_file_chunk_request);
+    tox_utils_callback_file_chunk_request(tox, on_file_chunk_request);
     tox_callback_file_chunk_request(tox, tox_utils_file_chunk_request_cb);
-    // tox_utils_callback_file_recv(tox, on_file_recv);
+    tox_utils_callback_file_recv(tox, on_file_recv);
     tox_callback_file_recv(tox, tox_utils_file_recv_cb);
-    // tox_utils_callback_file_recv_chunk(tox, on_file_recv_chunk);
+    tox_utils_callback_file_recv_chunk(tox, on_file_recv_chunk);
     tox_callback_file_recv_chunk(tox, tox_utils_file_recv_chunk_cb);
     tox_utils_callback_friend_message_v2(tox, friend_message_v2_cb);
     tox_utils_callback_friend_read_receipt_message_v2(tox, friend_read_receipt_message_v2_cb);
@@ -1708,10 +10264,17 @@ int main(int argc, char *argv[])
     toxProxyLog(9, "NOT using toxutil");
     tox_callback_self_connection_status(tox, self_connection_status_cb);
     tox_callback_friend_connection_status(tox, friendlist_onConnectionChange);
+    tox_callback_file_recv_control(tox, on_file_control);
+    tox_callback_file_chunk_request(tox, on_file_chunk_request);
+    tox_callback_file_recv(tox, on_file_recv);
+    tox_callback_file_recv_chunk(tox, on_file_recv_chunk);
 #endif
 
     updateToxSavedata(tox);
 
+    // the spool is checked on other threads while tox goes online
+    spool_index_load();
+    spool_recovery_start(tox, SPOOL_INDEX_THREADS);
 
     long long unsigned int cur_time = time(NULL);
     long long loop_counter = 0;
@@ -1723,6 +10286,8 @@ int main(int argc, char *argv[])
 
     while (1) {
         tox_iterate(tox, NULL);
+        spool_recovery_step(SPOOL_RECOVERY_SLICE_USEC);
+        hooks_poll();
         usleep_usec(tox_iteration_interval(tox) * 1000);
 
 
@@ -1769,8 +10334,36 @@ int main(int argc, char *argv[])
 // HINT: this is only an approximation
 #define RETRY_SYNC_EVERY_X_SECONDS 20
 
-        if ((masterIsOnline == true) && (i % (20 * RETRY_SYNC_EVERY_X_SECONDS) == 0)) {
-            send_sync_msgs(tox);
+        spool_recovery_step(SPOOL_RECOVERY_SLICE_USEC);
+        spool_index_maybe_save();
+        sync_cursors_maybe_save();
+        msgid_index_maybe_compact();
+        spool_ttl_tick();
+        hooks_poll();
+        friend_provision_maybe_commit(tox);
+        push_dispatch();
+        conference_ingest_flush();
+        receipt_aggregator_flush(tox, false);
+        spool_zstd_maybe_train();
+        file_forward_iterate(tox);
+        file_spool_expire_partial();
+
+        for (int d = 0; d < MASTER_MAX_DEVICES; d++) {
+            if (!master_devices[d].used || !master_devices[d].online) {
+                continue;
+            }
+
+            bulk_sync_iterate(tox, &bulk_sync[d]);
+
+            if ((!bulk_sync_in_use(&bulk_sync[d])) && (i % (20 * RETRY_SYNC_EVERY_X_SECONDS) == 0)) {
+                send_sync_msgs(tox, d, master_device_friend_number(tox, d));
+            }
+        }
+
+        if (masterIsOnline == true) {
+            send_quota_status_if_changed(tox);
+            send_recovery_status_if_pending(tox);
+            send_expiry_status_if_changed(tox);
         }
 
         // TODO: this is just to make sure stuff is saved
@@ -1812,6 +10405,16 @@ int main(int argc, char *argv[])
 
     }
 
+    conference_ingest_flush();
+    receipt_aggregator_flush(tox, true);
+    file_transfers_close_all();
+    friend_provision_commit(tox);
+    spool_index_save();
+
+    if (sync_cursors_dirty) {
+        sync_cursors_save();
+    }
+
 #ifdef TOX_HAVE_TOXUTIL
     tox_utils_kill(tox);
 #else
@@ -1826,4 +10429,4 @@ int main(int argc, char *argv[])
     // HINT: for gprof you need an "exit()" call
     exit(0);
 }
-
+#endif
@@ -0,0 +1,1318 @@
+/*
+ ============================================================================
+ Name        : ToxProxy_bench.c
+ Authors     : Thomas Käfer, Zoff
+ Version     : 0.1
+ Copyright   : 2019
+
+ Microbenchmarks for the primitives on the message path of ToxProxy
+ (hex codec, messagev2 wrapping, the ingress duplicate check, spool
+ encryption, spool writes and the receipt scan), the time the startup check needs to index the spool
+ (one thread, SPOOL_INDEX_THREADS threads, from the checkpoint), the time
+ the kill switch needs to wipe a spool, with one thread and with
+ KILL_SWITCH_WIPE_THREADS threads, and how fast push
+ pings reach two local mock gateways (warm and cold connections, also
+ with a slow resolver) and how many wake-ups a storm of messages turns into.
+ Built with -DHAVE_ZSTD it also prints speed and sizes of the spool and
+ bulk sync compression for several zstd levels, with and without a
+ dictionary, to pick SPOOL_ZSTD_LEVEL and BULK_SYNC_ZSTD_LEVEL for the
+ target (e.g. run it on the Pi).
+
+ This file includes ToxProxy.c, so build it exactly like ToxProxy.c but
+ with this file as the source (see circle_scripts/toxproxy.sh).
+
+ usage: ToxProxy_bench [-d workdir] [-m max_spool_size] [-r rounds]
+
+ every case is calibrated until one round takes at least 50ms, then run
+ for "rounds" rounds (the kill switch wipe runs once per spool size, it
+ destroys what it measures). the median ns/op and the average allocations/op
+ (malloc/calloc/realloc of the whole process) are printed.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+ ============================================================================
+ */
+
+#define TOXPROXY_NO_MAIN
+#include "ToxProxy.c"
+
+#include <dlfcn.h>
+#include <sys/utsname.h>
+
+// ----------- allocation counter -----------
+// glibc allows replacing malloc, the __libc_* symbols are the real allocator
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static uint64_t bench_alloc_count = 0;
+
+void *malloc(size_t size)
+{
+    __atomic_fetch_add(&bench_alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    __atomic_fetch_add(&bench_alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __atomic_fetch_add(&bench_alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    __atomic_fetch_add(&bench_alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *p = memalign(alignment, size);
+
+    if (p == NULL) {
+        return ENOMEM;
+    }
+
+    *memptr = p;
+    return 0;
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+// ----------- allocation counter -----------
+
+// ----------- slow resolver -----------
+// getaddrinfo() of the whole process waits this long first, like a slow or far away DNS server does
+static volatile uint64_t bench_resolve_delay_us = 0;
+
+int getaddrinfo(const char *node, const char *service, const struct addrinfo *hints, struct addrinfo **res)
+{
+    int (*real_getaddrinfo)(const char *, const char *, const struct addrinfo *, struct addrinfo **) =
+        (int (*)(const char *, const char *, const struct addrinfo *, struct addrinfo **))dlsym(RTLD_NEXT, "getaddrinfo");
+    const uint64_t delay = __atomic_load_n(&bench_resolve_delay_us, __ATOMIC_SEQ_CST);
+
+    if (delay > 0) {
+        usleep((useconds_t)delay);
+    }
+
+    return (real_getaddrinfo != NULL) ? real_getaddrinfo(node, service, hints, res) : EAI_FAIL;
+}
+// ----------- slow resolver -----------
+
+#define BENCH_MIN_ROUND_NS (50ULL * 1000ULL * 1000ULL)
+#define BENCH_MAX_ROUNDS 51
+#define BENCH_SENDERS 10
+
+typedef void (*bench_fn)(void *ctx, uint64_t iterations);
+
+static const uint32_t bench_spool_sizes[] = {10, 1000, 100000, 1000000};
+
+static int bench_rounds = 7;
+static uint32_t bench_max_spool_size = 1000000;
+static Tox *bench_tox = NULL;
+
+static char bench_sender_hex[BENCH_SENDERS][TOX_PUBLIC_KEY_SIZE * 2 + 1];
+static uint32_t bench_spool_populated = 0;
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int bench_cmp_double(const void *a, const void *b)
+{
+    const double da = *(const double *)a;
+    const double db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+// returns the median ns/op. cleanup (may be NULL) runs after every round, it is not timed or counted
+static double bench_run_cleanup(const char *name, uint32_t spool_size, bench_fn fn, void (*cleanup)(void), void *ctx)
+{
+    // calibrate: double the iterations until one round is long enough to be measured reliably
+    uint64_t iterations = 1;
+
+    while (1) {
+        const uint64_t start = bench_now_ns();
+        fn(ctx, iterations);
+        const uint64_t took = bench_now_ns() - start;
+
+        if (cleanup != NULL) {
+            cleanup();
+        }
+
+        if (took >= BENCH_MIN_ROUND_NS || iterations >= (1ULL << 30)) {
+            break;
+        }
+
+        iterations *= 2;
+    }
+
+    double ns_per_op[BENCH_MAX_ROUNDS];
+    uint64_t allocs = 0;
+
+    for (int r = 0; r < bench_rounds; r++) {
+        const uint64_t allocs_before = __atomic_load_n(&bench_alloc_count, __ATOMIC_RELAXED);
+        const uint64_t start = bench_now_ns();
+        fn(ctx, iterations);
+        ns_per_op[r] = (double)(bench_now_ns() - start) / (double)iterations;
+        allocs += __atomic_load_n(&bench_alloc_count, __ATOMIC_RELAXED) - allocs_before;
+
+        if (cleanup != NULL) {
+            cleanup();
+        }
+    }
+
+    qsort(ns_per_op, (size_t)bench_rounds, sizeof(double), bench_cmp_double);
+
+    printf("%-28s spool=%-8u iters=%-10llu ns/op=%14.1f (min %.1f max %.1f) allocs/op=%.2f\n",
+           name, spool_size, (unsigned long long)iterations, ns_per_op[bench_rounds / 2],
+           ns_per_op[0], ns_per_op[bench_rounds - 1],
+           (double)allocs / (double)(iterations * (uint64_t)bench_rounds));
+    fflush(stdout);
+    return ns_per_op[bench_rounds / 2];
+}
+
+static double bench_run(const char *name, uint32_t spool_size, bench_fn fn, void *ctx)
+{
+    return bench_run_cleanup(name, spool_size, fn, NULL, ctx);
+}
+
+// ----------- hex / wrap cases -----------
+
+static void bench_bin2upHex(void *ctx, uint64_t iterations)
+{
+    uint8_t bin[TOX_PUBLIC_KEY_SIZE];
+    char hex[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+
+    for (size_t i = 0; i < sizeof(bin); i++) {
+        bin[i] = (uint8_t)(i * 7);
+    }
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        bin[0] = (uint8_t)i;
+        bin2upHex(bin, sizeof(bin), hex, sizeof(hex));
+        __asm__ volatile("" : : "r"(hex) : "memory");
+    }
+}
+
+static void bench_hex_string_to_bin(void *ctx, uint64_t iterations)
+{
+    const char *hex = bench_sender_hex[1];
+    char bin[TOX_PUBLIC_KEY_SIZE];
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        hex_string_to_bin(hex, TOX_PUBLIC_KEY_SIZE * 2, bin, sizeof(bin));
+        __asm__ volatile("" : : "r"(bin) : "memory");
+    }
+}
+
+static void bench_hex_string_to_bin2(void *ctx, uint64_t iterations)
+{
+    const char *hex = bench_sender_hex[1];
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        uint8_t *bin = hex_string_to_bin2(hex);
+        __asm__ volatile("" : : "r"(bin) : "memory");
+        free(bin);
+    }
+}
+
+static void bench_sync_wrap(void *ctx, uint64_t iterations)
+{
+    const char *text = "hello, this is a typical short chat message that gets stored on the proxy";
+    const uint32_t text_len = (uint32_t)strlen(text);
+    uint8_t pubkey_bin[TOX_PUBLIC_KEY_SIZE];
+    memset(pubkey_bin, 0x42, sizeof(pubkey_bin));
+
+    uint8_t msgid[TOX_PUBLIC_KEY_SIZE];
+    CLEAR(msgid);
+    const uint32_t raw_len = tox_messagev2_size(text_len, TOX_FILE_KIND_MESSAGEV2_SEND, 0);
+    uint8_t *raw = calloc(1, raw_len);
+    tox_messagev2_wrap(text_len, TOX_FILE_KIND_MESSAGEV2_SEND, 0, (const uint8_t *)text, 1, 0, raw, msgid);
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        // same allocations as send_sync_msg_single()
+        const uint32_t sync_len = tox_messagev2_size(raw_len, TOX_FILE_KIND_MESSAGEV2_SYNC, 0);
+        uint8_t *sync_raw = calloc(1, sync_len);
+        uint8_t *msgid2 = calloc(1, TOX_PUBLIC_KEY_SIZE);
+        tox_messagev2_sync_wrap(raw_len, pubkey_bin, TOX_FILE_KIND_MESSAGEV2_SEND, raw, 987, 775, sync_raw, msgid2);
+        __asm__ volatile("" : : "r"(sync_raw) : "memory");
+        free(sync_raw);
+        free(msgid2);
+    }
+
+    free(raw);
+}
+
+static void bench_ingress_dedup(void *ctx, uint64_t iterations)
+{
+    static uint64_t n = 0;
+    uint8_t pubkey_bin[TOX_PUBLIC_KEY_SIZE];
+    memset(pubkey_bin, 0x42, sizeof(pubkey_bin));
+    uint8_t msgid[TOX_PUBLIC_KEY_SIZE];
+    CLEAR(msgid);
+    uint8_t id_hash[MSGID_INDEX_HASH_SIZE];
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        // always a new id, like the duplicate check in ingress_friend_admit() sees most of the time
+        put_u64_be(msgid, n++);
+        msgid_index_hash(pubkey_bin, msgid, id_hash);
+        bool seen = msgid_index_contains(id_hash);
+        __asm__ volatile("" : : "r"(seen) : "memory");
+    }
+}
+
+// ----------- encryption cases -----------
+
+typedef struct bench_crypt_ctx {
+    uint8_t *plain;
+    size_t plain_length;
+    uint8_t *encrypted;
+    size_t encrypted_length;
+} bench_crypt_ctx;
+
+static void bench_spool_encrypt(void *ctx, uint64_t iterations)
+{
+    const bench_crypt_ctx *c = (const bench_crypt_ctx *)ctx;
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        uint8_t *out = NULL;
+        spool_encrypt(c->plain, c->plain_length, &out);
+        __asm__ volatile("" : : "r"(out) : "memory");
+        free(out);
+    }
+}
+
+static void bench_spool_decrypt(void *ctx, uint64_t iterations)
+{
+    const bench_crypt_ctx *c = (const bench_crypt_ctx *)ctx;
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        size_t length = 0;
+        uint8_t *out = spool_decrypt(c->encrypted, c->encrypted_length, &length);
+        __asm__ volatile("" : : "r"(out) : "memory");
+        free(out);
+    }
+}
+
+// one block of a stored file (see file_crypt_recv_chunk()), and the same with aes256gcm for comparison
+// where the cpu has the instructions for it (libsodium has no aes256gcm without them)
+typedef struct bench_block_ctx {
+    bool aes;
+    uint8_t block[FILE_CRYPT_BLOCK_SIZE];
+    uint8_t out[FILE_CRYPT_BLOCK_SIZE + crypto_aead_xchacha20poly1305_ietf_ABYTES];
+} bench_block_ctx;
+
+static void bench_file_block_encrypt(void *ctx, uint64_t iterations)
+{
+    bench_block_ctx *c = (bench_block_ctx *)ctx;
+    uint8_t nonce[crypto_aead_xchacha20poly1305_ietf_NPUBBYTES];
+    CLEAR(nonce);
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        unsigned long long clen = 0;
+        put_u64_be(nonce, i);
+
+        if (c->aes) {
+            crypto_aead_aes256gcm_encrypt(c->out, &clen, c->block, sizeof(c->block), NULL, 0, NULL, nonce,
+                                          spool_crypt_key);
+        } else {
+            crypto_aead_xchacha20poly1305_ietf_encrypt(c->out, &clen, c->block, sizeof(c->block), NULL, 0, NULL, nonce,
+                    spool_crypt_key);
+        }
+
+        __asm__ volatile("" : : "r"(c->out) : "memory");
+    }
+}
+
+// a short chat line, a conference line, the biggest messageV2 and a big file (several chunks)
+static void bench_encryption(void)
+{
+    static const size_t sizes[] = {100, 1024, 4134, 65536};
+
+    if (sodium_init() < 0) {
+        return;
+    }
+
+    uint8_t salt[crypto_pwhash_SALTBYTES];
+    CLEAR(salt);
+    const uint64_t start = bench_now_ns();
+
+    if (crypto_pwhash(spool_crypt_key, sizeof(spool_crypt_key), "bench", 5, salt, crypto_pwhash_OPSLIMIT_INTERACTIVE,
+                      crypto_pwhash_MEMLIMIT_INTERACTIVE, crypto_pwhash_ALG_ARGON2ID13) != 0) {
+        printf("spool key derivation failed (not enough memory?)\n");
+        randombytes_buf(spool_crypt_key, sizeof(spool_crypt_key));
+    } else {
+        printf("%-28s ms=%.1f (once at startup)\n", "spool key derivation", (double)(bench_now_ns() - start) / 1000000.0);
+    }
+
+    spool_crypt_enabled = true;
+
+    for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+        bench_crypt_ctx c;
+        c.plain_length = sizes[k];
+        c.plain = calloc(1, c.plain_length);
+        randombytes_buf(c.plain, c.plain_length);
+        c.encrypted_length = spool_encrypt(c.plain, c.plain_length, &c.encrypted);
+
+        char name[64];
+        snprintf(name, sizeof(name), "spool_encrypt(%u)", (unsigned)c.plain_length);
+        double ns = bench_run(name, 0, bench_spool_encrypt, &c);
+        printf("%-28s MB/s=%.1f overhead bytes=%u\n", "", (double)c.plain_length * 1000.0 / ns,
+               (unsigned)(c.encrypted_length - c.plain_length));
+        snprintf(name, sizeof(name), "spool_decrypt(%u)", (unsigned)c.plain_length);
+        ns = bench_run(name, 0, bench_spool_decrypt, &c);
+        printf("%-28s MB/s=%.1f\n", "", (double)c.plain_length * 1000.0 / ns);
+
+        free(c.plain);
+        free(c.encrypted);
+    }
+
+    bench_block_ctx *b = calloc(1, sizeof(bench_block_ctx));
+
+    for (int aes = 0; b != NULL && aes < 2; aes++) {
+        const char *name = aes ? "file_block(aes256gcm)" : "file_block(xchacha20)";
+
+        if (aes && !crypto_aead_aes256gcm_is_available()) {
+            printf("%-28s not available on this cpu\n", name);
+            continue;
+        }
+
+        b->aes = aes;
+        randombytes_buf(b->block, sizeof(b->block));
+        const double ns = bench_run(name, 0, bench_file_block_encrypt, b);
+        printf("%-28s MB/s=%.1f\n", "", (double)sizeof(b->block) * 1000.0 / ns);
+    }
+
+    free(b);
+    spool_crypt_enabled = false;
+}
+
+// ----------- spool cases -----------
+
+// populated messages get seq n + 1, the ones writeMessage() writes during the cases start at
+// BENCH_WRITTEN_SEQ_BASE, so bench_spool_remove_written() can tell them apart by seq alone
+#define BENCH_WRITTEN_SEQ_BASE (1ULL << 40)
+
+static void bench_spool_file_name(char *out, size_t out_len, uint32_t n)
+{
+    // the same name writeMessage() gives a message, received one second apart from 2000-01-01 on
+    struct timeval received;
+    received.tv_sec = (time_t)(946684800 + n);
+    received.tv_usec = (suseconds_t)(n % 1000000);
+    char timestamp[SPOOL_TIME_NAME_LENGTH + SPOOL_TIME_OFFSET_LENGTH + 1];
+    spool_timestamp_name(&received, timestamp, sizeof(timestamp));
+    snprintf(out, out_len, "s%016llx_%s.txtS", (unsigned long long)n + 1, timestamp);
+}
+
+static void bench_spool_populate(uint32_t spool_size)
+{
+    mkdir(msgsDir, S_IRWXU);
+
+    for (int s = 0; s < BENCH_SENDERS; s++) {
+        char dir[1000];
+        snprintf(dir, sizeof(dir), "%s/%s", msgsDir, bench_sender_hex[s]);
+        mkdir(dir, S_IRWXU);
+    }
+
+    const uint32_t raw_len = tox_messagev2_size(64, TOX_FILE_KIND_MESSAGEV2_SEND, 0);
+    uint8_t *raw = calloc(1, raw_len);
+
+    // every second message already has a sync msgid sidecar file, like after a partial sync
+    for (uint32_t n = bench_spool_populated; n < spool_size; n++) {
+        char name[64];
+        char path[1100];
+        bench_spool_file_name(name, sizeof(name), n);
+        snprintf(path, sizeof(path), "%s/%s/%s", msgsDir, bench_sender_hex[n % BENCH_SENDERS], name);
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+        if (fd >= 0) {
+            if (write(fd, raw, raw_len) < 0) {}
+
+            close(fd);
+        }
+
+        if ((n % 2) == 1) {
+            char sidecar[1200];
+            snprintf(sidecar, sizeof(sidecar), "%s__%064X__", path, n);
+            fd = open(sidecar, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+            if (fd >= 0) {
+                if (write(fd, "A", 1) < 0) {}
+
+                close(fd);
+            }
+        }
+
+        if ((n % 100000) == 99999) {
+            printf("  ... populated %u messages\n", n + 1);
+            fflush(stdout);
+        }
+    }
+
+    free(raw);
+    bench_spool_populated = spool_size;
+}
+
+// remove the files writeMessage() created during a round, so the spool size stays constant
+static void bench_spool_remove_written(void)
+{
+    char dir[1000];
+    snprintf(dir, sizeof(dir), "%s/%s", msgsDir, bench_sender_hex[0]);
+    DIR *dfd = opendir(dir);
+
+    if (dfd == NULL) {
+        return;
+    }
+
+    struct dirent *dp = NULL;
+
+    while ((dp = readdir(dfd)) != NULL) {
+        if (dp->d_name[0] != '.' && spool_name_seq(dp->d_name) >= BENCH_WRITTEN_SEQ_BASE) {
+            unlinkat(dirfd(dfd), dp->d_name, 0);
+        }
+    }
+
+    closedir(dfd);
+}
+
+static void bench_write_message(void *ctx, uint64_t iterations)
+{
+    static uint64_t n = 0;
+    const uint32_t raw_len = tox_messagev2_size(64, TOX_FILE_KIND_MESSAGEV2_SEND, 0);
+    uint8_t raw[raw_len];
+    memcpy(raw, ctx, raw_len);
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        // a new message id every time (it is at the start), a resend would not be written
+        put_u64_be(raw, n++);
+        writeMessage(bench_sender_hex[0], raw, raw_len, TOX_FILE_KIND_MESSAGEV2_SEND);
+    }
+}
+
+// one spool pass for a batch of receipts that match nothing, ctx is the batch size
+static void bench_receipt_scan_miss(void *ctx, uint64_t iterations)
+{
+    const uint32_t count = (uint32_t)(uintptr_t)ctx;
+    receipt_pending receipts[RECEIPT_COALESCE_MAX];
+    receipt_pending *sorted[RECEIPT_COALESCE_MAX];
+
+    for (uint32_t i = 0; i < count; i++) {
+        CLEAR(receipts[i]);
+        memset(receipts[i].msgid, 0x5A, sizeof(receipts[i].msgid));
+        receipts[i].msgid[0] = (uint8_t)i;
+        sorted[i] = &receipts[i];
+    }
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        uint32_t found = receipts_match_synced(bench_tox, sorted, count);
+        __asm__ volatile("" : : "r"(found) : "memory");
+    }
+}
+
+// ----------- startup index -----------
+
+static void bench_spool_accounts_reset(void)
+{
+    for (uint32_t i = 0; i < spool_accounts_size; i++) {
+        spool_evict_free_names(&spool_accounts[i]);
+    }
+
+    free(spool_accounts);
+    spool_accounts = NULL;
+    spool_accounts_size = 0;
+    spool_accounts_used = 0;
+    spool_total_bytes = 0;
+    spool_total_messages = 0;
+    spool_quota_ready = false;
+}
+
+static double bench_spool_index_build(int threads, bool checkpoint)
+{
+    bench_spool_accounts_reset();
+
+    if (!checkpoint) {
+        // the last build has written one
+        unlink(spool_index_filename);
+    }
+
+    spool_index_load();
+
+    const uint64_t start = bench_now_ns();
+    spool_recovery_start(bench_tox, threads);
+
+    while (!spool_recovery_step(SPOOL_RECOVERY_SLICE_USEC)) {
+        // the main thread would run tox_iterate() here
+        usleep(1000);
+    }
+
+    return (double)(bench_now_ns() - start) / 1000000.0;
+}
+
+// how long the startup recovery needs until the quota accounts are complete: checking every dir with
+// one thread and with SPOOL_INDEX_THREADS threads, and with all dirs taken from the checkpoint.
+// the page cache is warm, on a Pi after a reboot the checks are slower.
+static void bench_startup_index(uint32_t spool_size)
+{
+    mkdir("db", S_IRWXU);
+
+    const double one_ms = bench_spool_index_build(1, false);
+    const double threads_ms = bench_spool_index_build(SPOOL_INDEX_THREADS, false);
+    const uint32_t messages = spool_total_messages;
+
+    // the checkpoint leaves out dirs that changed in the last seconds
+    struct timespec times[2];
+    clock_gettime(CLOCK_REALTIME, &times[0]);
+    times[0].tv_sec -= 60;
+    times[1] = times[0];
+
+    for (int s = 0; s < BENCH_SENDERS; s++) {
+        char dir[1000];
+        snprintf(dir, sizeof(dir), "%s/%s", msgsDir, bench_sender_hex[s]);
+        utimensat(AT_FDCWD, dir, times, 0);
+    }
+
+    spool_index_save();
+    const double checkpoint_ms = bench_spool_index_build(SPOOL_INDEX_THREADS, true);
+
+    printf("%-28s spool=%-8u messages=%-9u ms: threads=1 %.1f threads=%d %.1f checkpoint(%u dirs) %.1f\n",
+           "startup_index", spool_size, messages, one_ms, SPOOL_INDEX_THREADS, threads_ms,
+           spool_recovery.report.from_checkpoint, checkpoint_ms);
+    fflush(stdout);
+    unlink(spool_index_filename);
+}
+
+// ----------- kill switch -----------
+
+static void bench_kill_switch_wipe(uint32_t spool_size, int threads)
+{
+    bench_spool_populated = 0;
+    bench_spool_populate(spool_size);
+    kill_switch_sync();
+
+    const uint64_t start = bench_now_ns();
+    const uint64_t removed = kill_switch_wipe_dir(msgsDir, threads);
+    kill_switch_sync();
+    const double took_ms = (double)(bench_now_ns() - start) / 1000000.0;
+
+    printf("%-28s spool=%-8u threads=%-3d files=%-9llu ms=%10.1f files/s=%.0f\n", "kill_switch_wipe", spool_size,
+           threads, (unsigned long long)removed, took_ms, (took_ms > 0) ? ((double)removed * 1000.0 / took_ms) : 0.0);
+    fflush(stdout);
+}
+
+// ----------- push -----------
+// a local gateway that speaks the raw protocol: it reads one token per connection, answers and closes
+
+#define BENCH_PUSH_DEVICES PUSH_MAX_TOKENS
+#define BENCH_PUSH_STORM 10000
+// what the slow resolver waits in the -slow-dns cases
+#define BENCH_PUSH_SLOW_RESOLVE_US 200000
+
+// the connection the pings find: warm (open ahead of time), cold (gateways just set up), the same with a
+// slow resolver, and an address that is due to be looked up again with a slow resolver (the old one is used)
+static const char *const bench_push_cases[] = {"warm", "cold", "cold-slow-dns", "stale-slow-dns"};
+
+// longest push_dispatch() or ping_push_service() call in bench_push_wait(), the main loop is stuck that long
+static uint64_t bench_push_stall_ns = 0;
+
+typedef struct bench_push_gateway {
+    int listen_fd;
+    uint16_t port;
+    volatile uint32_t wakeups;
+    volatile uint64_t last_wakeup_ns;
+} bench_push_gateway;
+
+static void *bench_push_gateway_thread(void *arg)
+{
+    bench_push_gateway *gw = (bench_push_gateway *)arg;
+
+    while (1) {
+        const int fd = accept(gw->listen_fd, NULL, NULL);
+
+        if (fd == -1) {
+            break;
+        }
+
+        char token[PUSH_TOKEN_MAX_LENGTH + 1];
+
+        if (recv(fd, token, sizeof(token), 0) > 0) {
+            gw->last_wakeup_ns = bench_now_ns();
+            __atomic_add_fetch(&gw->wakeups, 1, __ATOMIC_SEQ_CST);
+
+            if (send(fd, "OK", 2, MSG_NOSIGNAL) < 0) {}
+        }
+
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static bool bench_push_gateway_start(bench_push_gateway *gw, pthread_t *thread)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    CLEAR(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    gw->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (gw->listen_fd == -1 || bind(gw->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+            || listen(gw->listen_fd, 64) != 0 || getsockname(gw->listen_fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+        return false;
+    }
+
+    gw->port = ntohs(addr.sin_port);
+    return (pthread_create(thread, NULL, bench_push_gateway_thread, gw) == 0);
+}
+
+// run push_dispatch() like the main loop does until the gateways have seen "wakeups" pings
+static bool bench_push_wait(bench_push_gateway *gws, uint32_t wakeups)
+{
+    const uint64_t give_up = bench_now_ns() + 3000000000ULL;
+
+    while (__atomic_load_n(&gws[0].wakeups, __ATOMIC_SEQ_CST) + __atomic_load_n(&gws[1].wakeups, __ATOMIC_SEQ_CST)
+            < wakeups) {
+        if (bench_now_ns() > give_up) {
+            return false;
+        }
+
+        const uint64_t start = bench_now_ns();
+        push_dispatch();
+        const uint64_t took = bench_now_ns() - start;
+        bench_push_stall_ns = (took > bench_push_stall_ns) ? took : bench_push_stall_ns;
+        usleep(50);
+    }
+
+    return true;
+}
+
+// run push_dispatch() until every gateway has its warm connection
+static void bench_push_warm_up(void)
+{
+    const uint64_t give_up = bench_now_ns() + 3000000000ULL;
+    bool ready = false;
+
+    while (!ready && bench_now_ns() < give_up) {
+        push_dispatch();
+        usleep(1000);
+        ready = true;
+
+        for (uint32_t g = 0; g < push_gateways_count; g++) {
+            bool warm = false;
+
+            for (int i = 0; i < PUSH_POOL_SIZE; i++) {
+                warm = warm || (push_gateways[g].pool[i].state == PUSH_CONN_READY
+                                && push_gateways[g].pool[i].token[0] == '\0');
+            }
+
+            ready = ready && warm;
+        }
+    }
+}
+
+// latency from a new message to the gateway having the ping for bench_push_cases (and the longest time
+// a single call held up the main loop meanwhile), and how many pings a storm of messages turns into
+static void bench_push(void)
+{
+    bench_push_gateway gws[2];
+    pthread_t threads[2];
+    memset(gws, 0, sizeof(gws));
+
+    if (!bench_push_gateway_start(&gws[0], &threads[0]) || !bench_push_gateway_start(&gws[1], &threads[1])) {
+        printf("push: can not start the local gateways\n");
+        return;
+    }
+
+    char spec[100];
+    snprintf(spec, sizeof(spec), "127.0.0.1:%u,raw:127.0.0.1:%u", (unsigned)gws[0].port, (unsigned)gws[1].port);
+    push_gateways_init(spec);
+
+    // straight into the registry, the bench has no ./db
+    for (int d = 0; d < BENCH_PUSH_DEVICES; d++) {
+        char token[64];
+        snprintf(token, sizeof(token), "bench-device-token-%02d-AAAAAAAAAAAAAAAAAAAAAAAAAAAAAA", d);
+        push_token_put((uint8_t)(d % 2), (const uint8_t *)token, strlen(token));
+    }
+
+    uint32_t expected = 0;
+
+    for (size_t c = 0; c < sizeof(bench_push_cases) / sizeof(bench_push_cases[0]); c++) {
+        if (c == 0) {
+            // let the warm connections finish their handshake
+            bench_push_warm_up();
+        } else if (c == 1 || c == 2) {
+            bench_resolve_delay_us = (c == 2) ? BENCH_PUSH_SLOW_RESOLVE_US : 0;
+            push_gateways_init(spec);
+        } else {
+            // no connections, the address is old
+            for (uint32_t g = 0; g < push_gateways_count; g++) {
+                for (int i = 0; i < PUSH_POOL_SIZE; i++) {
+                    push_conn_reset(&push_gateways[g].pool[i]);
+                }
+
+                push_gateways[g].addr_ts = 1;
+            }
+        }
+
+        for (int d = 0; d < BENCH_PUSH_DEVICES; d++) {
+            push_tokens[d].last_ping_usec = 0;
+        }
+
+        const uint64_t start = bench_now_ns();
+        ping_push_service();
+        bench_push_stall_ns = bench_now_ns() - start;
+        expected += BENCH_PUSH_DEVICES;
+
+        if (!bench_push_wait(gws, expected)) {
+            printf("push: the local gateways did not get all pings\n");
+            break;
+        }
+
+        const uint64_t last = (gws[0].last_wakeup_ns > gws[1].last_wakeup_ns) ? gws[0].last_wakeup_ns :
+                              gws[1].last_wakeup_ns;
+        printf("%-28s devices=%-3d connection=%-14s us=%10.1f stall_us=%.1f\n", "push_fan_out", BENCH_PUSH_DEVICES,
+               bench_push_cases[c], (double)(last - start) / 1000.0, (double)bench_push_stall_ns / 1000.0);
+    }
+
+    bench_resolve_delay_us = 0;
+
+    // a storm right after a quiet time: one wake-up per device, the rest waits for the interval
+    for (int d = 0; d < BENCH_PUSH_DEVICES; d++) {
+        push_tokens[d].last_ping_usec = 0;
+    }
+
+    const uint64_t pings_before = push_stats.pings;
+    const uint32_t wakeups_before = gws[0].wakeups + gws[1].wakeups;
+    const uint64_t start = bench_now_ns();
+
+    for (int i = 0; i < BENCH_PUSH_STORM; i++) {
+        ping_push_service();
+    }
+
+    const double storm_us = (double)(bench_now_ns() - start) / 1000.0;
+    bench_push_wait(gws, expected + BENCH_PUSH_DEVICES);
+    usleep(100000);
+    push_dispatch();
+
+    printf("%-28s devices=%-3d pings=%-7llu wake-ups=%-4u us/ping=%.3f\n", "push_storm", BENCH_PUSH_DEVICES,
+           (unsigned long long)(push_stats.pings - pings_before), gws[0].wakeups + gws[1].wakeups - wakeups_before,
+           storm_us / BENCH_PUSH_STORM);
+    fflush(stdout);
+
+    push_tokens_wipe();
+
+    for (int g = 0; g < 2; g++) {
+        shutdown(gws[g].listen_fd, SHUT_RDWR);
+        close(gws[g].listen_fd);
+        pthread_join(threads[g], NULL);
+    }
+}
+
+#ifdef HAVE_ZSTD
+// ----------- compression cases -----------
+
+#define BENCH_CORPUS_MESSAGES 4000
+
+typedef struct bench_corpus {
+    uint8_t *data[BENCH_CORPUS_MESSAGES];
+    size_t size[BENCH_CORPUS_MESSAGES];
+    // a conference record, not a messageV2
+    bool conference[BENCH_CORPUS_MESSAGES];
+    size_t raw_bytes;
+} bench_corpus;
+
+typedef struct bench_zstd_ctx {
+    bench_corpus *corpus;
+    int level;
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+    // compressed corpus for the decompression case
+    uint8_t *frames[BENCH_CORPUS_MESSAGES];
+    size_t frame_size[BENCH_CORPUS_MESSAGES];
+} bench_zstd_ctx;
+
+static const char *bench_words[] = {
+    "hello", "the", "you", "ok", "see", "tomorrow", "meeting", "at", "and", "is", "this", "what", "proxy",
+    "online", "later", "thanks", "yes", "no", "maybe", "send", "file", "picture", "lol", "home", "work",
+    "coffee", "now", "when", "are", "we", "going", "to", "have", "call", "me", "back", "please", "good",
+    "night", "morning", "how", "did", "it", "go", "weekend", "plans", "for", "the", "release", "build"
+};
+
+// chat lines like the ones that end up in the spool: 2/3 conference records built like
+// conference_ingest_flush_one() does ([CONFERENCE_RECORD_MAGIC][peer pubkey][messageV2 of the line]) and
+// 1/3 direct messages (messageV2)
+static void bench_corpus_build(bench_corpus *corpus)
+{
+    uint8_t peers[8][TOX_PUBLIC_KEY_SIZE];
+
+    for (int k = 0; k < 8; k++) {
+        for (size_t i = 0; i < sizeof(peers[k]); i++) {
+            peers[k][i] = (uint8_t)(rand() & 0xff);
+        }
+    }
+
+    CLEAR(*corpus);
+
+    for (uint32_t n = 0; n < BENCH_CORPUS_MESSAGES; n++) {
+        char text[TOX_MAX_MESSAGE_LENGTH];
+        size_t len = 0;
+        const int words = 2 + rand() % 20;
+
+        for (int w = 0; w < words && len < 900; w++) {
+            len += (size_t)snprintf(text + len, sizeof(text) - len, "%s%s", (w == 0) ? "" : " ",
+                                    bench_words[rand() % (int)(sizeof(bench_words) / sizeof(bench_words[0]))]);
+        }
+
+        uint8_t msgid[TOX_PUBLIC_KEY_SIZE];
+        CLEAR(msgid);
+        corpus->conference[n] = ((n % 3) != 0);
+        const size_t header = corpus->conference[n] ? CONFERENCE_RECORD_HEADER_SIZE : 0;
+        const uint32_t raw_len = tox_messagev2_size((uint32_t)len, TOX_FILE_KIND_MESSAGEV2_SEND, 0);
+        corpus->data[n] = calloc(1, header + raw_len);
+        corpus->size[n] = header + raw_len;
+
+        if (corpus->conference[n]) {
+            memcpy(corpus->data[n], CONFERENCE_RECORD_MAGIC, 4);
+            memcpy(corpus->data[n] + 4, peers[rand() % 8], TOX_PUBLIC_KEY_SIZE);
+        }
+
+        tox_messagev2_wrap((uint32_t)len, TOX_FILE_KIND_MESSAGEV2_SEND, 0, (const uint8_t *)text,
+                           1600000000U + n, (uint16_t)(n % 1000), corpus->data[n] + header, msgid);
+        corpus->raw_bytes += corpus->size[n];
+    }
+}
+
+static void bench_corpus_free(bench_corpus *corpus)
+{
+    for (uint32_t n = 0; n < BENCH_CORPUS_MESSAGES; n++) {
+        free(corpus->data[n]);
+    }
+}
+
+// the messageV2 that bulk sync sends for each entry, conference records expanded like the sync does
+static void bench_corpus_expand(const bench_corpus *corpus, bench_corpus *lines)
+{
+    CLEAR(*lines);
+
+    for (uint32_t n = 0; n < BENCH_CORPUS_MESSAGES; n++) {
+        if (corpus->conference[n]) {
+            lines->data[n] = conference_record_expand("bench" CONFERENCE_RECORD_SUFFIX, corpus->data[n], corpus->size[n],
+                             &lines->size[n]);
+        } else {
+            lines->data[n] = calloc(1, corpus->size[n]);
+            lines->size[n] = corpus->size[n];
+            memcpy(lines->data[n], corpus->data[n], corpus->size[n]);
+        }
+
+        lines->raw_bytes += lines->size[n];
+    }
+}
+
+static size_t bench_zstd_compress_one(bench_zstd_ctx *z, uint32_t n, uint8_t *out, size_t out_size)
+{
+    if (z->cdict) {
+        return ZSTD_compress_usingCDict(z->cctx, out, out_size, z->corpus->data[n], z->corpus->size[n], z->cdict);
+    }
+
+    return ZSTD_compressCCtx(z->cctx, out, out_size, z->corpus->data[n], z->corpus->size[n], z->level);
+}
+
+static void bench_zstd_compress(void *ctx, uint64_t iterations)
+{
+    bench_zstd_ctx *z = (bench_zstd_ctx *)ctx;
+    uint8_t out[2 * (TOX_MAX_MESSAGE_LENGTH + 256)];
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        size_t res = bench_zstd_compress_one(z, (uint32_t)(i % BENCH_CORPUS_MESSAGES), out, sizeof(out));
+        __asm__ volatile("" : : "r"(res) : "memory");
+    }
+}
+
+static void bench_zstd_decompress(void *ctx, uint64_t iterations)
+{
+    bench_zstd_ctx *z = (bench_zstd_ctx *)ctx;
+    uint8_t out[TOX_MAX_MESSAGE_LENGTH + 256];
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        const uint32_t n = (uint32_t)(i % BENCH_CORPUS_MESSAGES);
+        size_t res;
+
+        if (z->ddict) {
+            res = ZSTD_decompress_usingDDict(z->dctx, out, sizeof(out), z->frames[n], z->frame_size[n], z->ddict);
+        } else {
+            res = ZSTD_decompressDCtx(z->dctx, out, sizeof(out), z->frames[n], z->frame_size[n]);
+        }
+
+        __asm__ volatile("" : : "r"(res) : "memory");
+    }
+}
+
+// bytes on disk like writeSpoolFile() stores them: header + frame if that is smaller, raw otherwise
+static uint64_t bench_zstd_spool_bytes(bench_zstd_ctx *z)
+{
+    uint64_t bytes = 0;
+
+    for (uint32_t n = 0; n < BENCH_CORPUS_MESSAGES; n++) {
+        free(z->frames[n]);
+        z->frames[n] = calloc(1, ZSTD_compressBound(z->corpus->size[n]));
+        z->frame_size[n] = bench_zstd_compress_one(z, n, z->frames[n], ZSTD_compressBound(z->corpus->size[n]));
+
+        if (z->corpus->size[n] >= SPOOL_COMPRESS_MIN_BYTES
+                && (SPOOL_ZSTD_HEADER_SIZE + z->frame_size[n]) < z->corpus->size[n]) {
+            bytes += SPOOL_ZSTD_HEADER_SIZE + z->frame_size[n];
+        } else {
+            bytes += z->corpus->size[n];
+        }
+    }
+
+    return bytes;
+}
+
+// lossless packets needed to send the lines (see bench_corpus_expand()) with bulk sync, records packed like
+// bulk_sync_pack_records() (one sender) and optionally compressed per packet like bulk_sync_pack_compressed()
+static uint32_t bench_bulk_sync_packets(bench_corpus *corpus, int level, uint64_t *wire_bytes, uint64_t *compress_ns)
+{
+    const size_t room = TOX_MAX_CUSTOM_PACKET_SIZE - BULK_SYNC_PACKET_HEADER_SIZE;
+    uint8_t *raw = calloc(1, BULK_SYNC_ZSTD_MAX_RAW_BYTES);
+    uint8_t out[TOX_MAX_CUSTOM_PACKET_SIZE];
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    uint32_t packets = 0;
+    uint32_t n = 0;
+    *wire_bytes = 0;
+    *compress_ns = 0;
+
+    while (n < BENCH_CORPUS_MESSAGES) {
+        // with compression: the most records whose compressed size still fits
+        uint32_t count = 0;
+        size_t raw_size = 0;
+        size_t packet_size = 0;
+
+        while (n + count < BENCH_CORPUS_MESSAGES && count < UINT8_MAX) {
+            const size_t record = ((count == 0) ? (1 + TOX_PUBLIC_KEY_SIZE + 2) : 3) + corpus->size[n + count];
+            const size_t limit = (level > 0) ? BULK_SYNC_ZSTD_MAX_RAW_BYTES : room;
+
+            if (raw_size + record > limit) {
+                break;
+            }
+
+            memset(raw + raw_size, 0x42, 3);
+            memcpy(raw + raw_size + record - corpus->size[n + count], corpus->data[n + count], corpus->size[n + count]);
+
+            if (level > 0) {
+                const size_t res = ZSTD_compressCCtx(cctx, out, room, raw, raw_size + record, level);
+
+                if (ZSTD_isError(res)) {
+                    break;
+                }
+
+                packet_size = BULK_SYNC_PACKET_HEADER_SIZE + res;
+            } else {
+                packet_size = BULK_SYNC_PACKET_HEADER_SIZE + raw_size + record;
+            }
+
+            raw_size += record;
+            count++;
+        }
+
+        if (level > 0) {
+            // cost of compressing the packet once, what the proxy pays when its raw target is right
+            const uint64_t start = bench_now_ns();
+            const size_t res = ZSTD_compressCCtx(cctx, out, room, raw, raw_size, level);
+            *compress_ns += bench_now_ns() - start;
+            __asm__ volatile("" : : "r"(res) : "memory");
+        }
+
+        n += count;
+        packets++;
+        *wire_bytes += packet_size;
+    }
+
+    ZSTD_freeCCtx(cctx);
+    free(raw);
+    return packets;
+}
+
+static void bench_compression(void)
+{
+    bench_corpus *corpus = calloc(1, sizeof(bench_corpus));
+    bench_corpus_build(corpus);
+
+    // dictionary from a different sample of the same kind of data, like spool_zstd_maybe_train() does
+    bench_corpus *train = calloc(1, sizeof(bench_corpus));
+    bench_corpus_build(train);
+    uint8_t *samples = calloc(1, train->raw_bytes);
+    size_t offset = 0;
+
+    for (uint32_t n = 0; n < BENCH_CORPUS_MESSAGES; n++) {
+        memcpy(samples + offset, train->data[n], train->size[n]);
+        offset += train->size[n];
+    }
+
+    uint8_t *dict = calloc(1, SPOOL_ZSTD_DICT_SIZE);
+    const size_t dict_size = ZDICT_trainFromBuffer(dict, SPOOL_ZSTD_DICT_SIZE, samples, train->size, BENCH_CORPUS_MESSAGES);
+    free(samples);
+
+    printf("corpus: %u messages, %llu bytes raw, dictionary %d bytes\n", BENCH_CORPUS_MESSAGES,
+           (unsigned long long)corpus->raw_bytes, ZDICT_isError(dict_size) ? -1 : (int)dict_size);
+
+    static const int levels[] = {1, 3, 6, 9, 19};
+
+    for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+        for (int use_dict = 0; use_dict < 2; use_dict++) {
+            if (use_dict && ZDICT_isError(dict_size)) {
+                continue;
+            }
+
+            bench_zstd_ctx *z = calloc(1, sizeof(bench_zstd_ctx));
+            z->corpus = corpus;
+            z->level = levels[l];
+            z->cctx = ZSTD_createCCtx();
+            z->dctx = ZSTD_createDCtx();
+
+            if (use_dict) {
+                z->cdict = ZSTD_createCDict(dict, dict_size, levels[l]);
+                z->ddict = ZSTD_createDDict(dict, dict_size);
+            }
+
+            const uint64_t disk = bench_zstd_spool_bytes(z);
+            char name[64];
+            snprintf(name, sizeof(name), "zstd_compress(l%d%s)", levels[l], use_dict ? ",dict" : "");
+            bench_run(name, 0, bench_zstd_compress, z);
+            snprintf(name, sizeof(name), "zstd_decompress(l%d%s)", levels[l], use_dict ? ",dict" : "");
+            bench_run(name, 0, bench_zstd_decompress, z);
+            printf("  spool bytes on disk: %llu (%.1f%% of raw)\n", (unsigned long long)disk,
+                   100.0 * (double)disk / (double)corpus->raw_bytes);
+
+            for (uint32_t n = 0; n < BENCH_CORPUS_MESSAGES; n++) {
+                free(z->frames[n]);
+            }
+
+            ZSTD_freeCCtx(z->cctx);
+            ZSTD_freeDCtx(z->dctx);
+            ZSTD_freeCDict(z->cdict);
+            ZSTD_freeDDict(z->ddict);
+            free(z);
+        }
+    }
+
+    static const int wire_levels[] = {0, 1, 3, 6};
+    bench_corpus *lines = calloc(1, sizeof(bench_corpus));
+    bench_corpus_expand(corpus, lines);
+    printf("bulk sync: %llu bytes of messageV2 lines (conference records expanded)\n",
+           (unsigned long long)lines->raw_bytes);
+
+    for (size_t l = 0; l < sizeof(wire_levels) / sizeof(wire_levels[0]); l++) {
+        uint64_t wire_bytes = 0;
+        uint64_t compress_ns = 0;
+        const uint32_t packets = bench_bulk_sync_packets(lines, wire_levels[l], &wire_bytes, &compress_ns);
+        printf("bulk sync %-13s packets=%-6u bytes over the wire=%-9llu (%.1f%% of raw) records/packet=%.1f compress ns/record=%.1f\n",
+               (wire_levels[l] == 0) ? "uncompressed" : (wire_levels[l] == 1) ? "zstd l1" : (wire_levels[l] == 3) ? "zstd l3" : "zstd l6",
+               packets, (unsigned long long)wire_bytes, 100.0 * (double)wire_bytes / (double)lines->raw_bytes,
+               (double)BENCH_CORPUS_MESSAGES / (double)packets, (double)compress_ns / (double)BENCH_CORPUS_MESSAGES);
+    }
+
+    fflush(stdout);
+    bench_corpus_free(lines);
+    free(lines);
+    free(dict);
+    bench_corpus_free(train);
+    free(train);
+    bench_corpus_free(corpus);
+    free(corpus);
+}
+#endif
+
+static void bench_usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-d workdir] [-m max_spool_size] [-r rounds]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    char workdir_template[] = "/tmp/toxproxy_bench_XXXXXX";
+    const char *workdir = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:m:r:h")) != -1) {
+        switch (opt) {
+            case 'd':
+                workdir = optarg;
+                break;
+
+            case 'm':
+                bench_max_spool_size = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+
+            case 'r':
+                bench_rounds = atoi(optarg);
+
+                if (bench_rounds < 1 || bench_rounds > BENCH_MAX_ROUNDS) {
+                    bench_usage(argv[0]);
+                    return 1;
+                }
+
+                break;
+
+            default:
+                bench_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    bool remove_workdir = false;
+
+    if (workdir == NULL) {
+        workdir = mkdtemp(workdir_template);
+        remove_workdir = true;
+    } else {
+        mkdir(workdir, S_IRWXU);
+    }
+
+    if (workdir == NULL || chdir(workdir) != 0) {
+        fprintf(stderr, "can not use working directory\n");
+        return 1;
+    }
+
+    struct utsname machine;
+    CLEAR(machine);
+    uname(&machine);
+    printf("ToxProxy_bench: machine=%s workdir=%s rounds=%d max_spool_size=%u\n", machine.machine, workdir, bench_rounds,
+           bench_max_spool_size);
+
+    tox_public_key_hex_size = tox_public_key_size() * 2 + 1;
+    tox_address_hex_size = tox_address_size() * 2 + 1;
+
+    for (int s = 0; s < BENCH_SENDERS; s++) {
+        uint8_t key[TOX_PUBLIC_KEY_SIZE];
+
+        for (size_t i = 0; i < sizeof(key); i++) {
+            key[i] = (uint8_t)((s + 1) * 31 + i * 13);
+        }
+
+        bin2upHex(key, sizeof(key), bench_sender_hex[s], sizeof(bench_sender_hex[s]));
+    }
+
+    struct Tox_Options options;
+    tox_options_default(&options);
+    options.udp_enabled = false;
+    options.local_discovery_enabled = false;
+    options.tcp_port = 0;
+#ifdef TOX_HAVE_TOXUTIL
+    bench_tox = tox_utils_new(&options, NULL);
+#else
+    bench_tox = tox_new(&options, NULL);
+#endif
+
+    bench_run("bin2upHex(32)", 0, bench_bin2upHex, NULL);
+    bench_run("hex_string_to_bin(64)", 0, bench_hex_string_to_bin, NULL);
+    bench_run("hex_string_to_bin2(64)", 0, bench_hex_string_to_bin2, NULL);
+    bench_run("tox_messagev2_sync_wrap", 0, bench_sync_wrap, NULL);
+
+    bench_encryption();
+    bench_push();
+
+#ifdef HAVE_ZSTD
+    bench_compression();
+#endif
+
+    // writeMessage() checks and adds message ids like in the proxy
+    mkdir("db", S_IRWXU);
+    msgid_index_init();
+    spool_seq_next_value = BENCH_WRITTEN_SEQ_BASE;
+    bench_run("ingress duplicate check", 0, bench_ingress_dedup, NULL);
+
+    // a stored message, the receipt scan below looks for ids that are not in the spool
+    uint8_t msgid[TOX_PUBLIC_KEY_SIZE];
+    memset(msgid, 0xA5, sizeof(msgid));
+    const char *text = "0123456789012345678901234567890123456789012345678901234567890123";
+    const uint32_t raw_len = tox_messagev2_size(64, TOX_FILE_KIND_MESSAGEV2_SEND, 0);
+    uint8_t *raw = calloc(1, raw_len);
+    tox_messagev2_wrap(64, TOX_FILE_KIND_MESSAGEV2_SEND, 0, (const uint8_t *)text, 1, 0, raw, msgid);
+
+    for (size_t k = 0; k < sizeof(bench_spool_sizes) / sizeof(bench_spool_sizes[0]); k++) {
+        const uint32_t spool_size = bench_spool_sizes[k];
+
+        if (spool_size > bench_max_spool_size) {
+            break;
+        }
+
+        bench_spool_populate(spool_size);
+
+        bench_run_cleanup("writeMessage", spool_size, bench_write_message, bench_spool_remove_written, raw);
+        spool_crypt_enabled = true;
+        bench_run_cleanup("writeMessage(encrypted)", spool_size, bench_write_message, bench_spool_remove_written, raw);
+        spool_crypt_enabled = false;
+        bench_run("receipt_scan(miss)", spool_size, bench_receipt_scan_miss, (void *)(uintptr_t)1);
+        bench_run("receipt_scan(256 miss)", spool_size, bench_receipt_scan_miss, (void *)(uintptr_t)256);
+        bench_startup_index(spool_size);
+    }
+
+    free(raw);
+
+    // start from an empty spool, the loop above left the biggest one
+    kill_switch_wipe_dir(msgsDir, KILL_SWITCH_WIPE_THREADS);
+
+    for (size_t k = 0; k < sizeof(bench_spool_sizes) / sizeof(bench_spool_sizes[0]); k++) {
+        const uint32_t spool_size = bench_spool_sizes[k];
+
+        if (spool_size > bench_max_spool_size) {
+            break;
+        }
+
+        bench_kill_switch_wipe(spool_size, 1);
+        bench_kill_switch_wipe(spool_size, KILL_SWITCH_WIPE_THREADS);
+    }
+
+#ifdef TOX_HAVE_TOXUTIL
+    tox_utils_kill(bench_tox);
+#else
+    tox_kill(bench_tox);
+#endif
+
+    if (remove_workdir) {
+        if (chdir("/") != 0) {}
+
+        char *cmd = calloc(1, strlen(workdir) + 20);
+        sprintf(cmd, "rm -rf '%s'", workdir);
+
+        if (system(cmd)) {}
+
+        free(cmd);
+    }
+
+    return 0;
+}